@@ -0,0 +1,147 @@
+#include "kv_test.h"
+#include "kv_buffer.h"
+#include "kv_uring.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <atomic>
+#include <set>
+#include <thread>
+
+static std::shared_ptr<KVBufferPool> small_pool(size_t buffers) {
+    KVBufferPoolConfig config;
+    config.buffers = buffers;
+    return KVBufferPool::create(config);
+}
+
+TEST(BufferPoolTest, LeasesArePageAligned) {
+    std::shared_ptr<KVBufferPool> pool = small_pool(8);
+    ASSERT_TRUE(pool != NULL);
+    EXPECT_EQ(pool->buffer_size() % 4096, 0u);
+    EXPECT_GE(pool->buffer_size(), (size_t)BUFFER_SIZE);
+    KVBuffer buf = pool->lease();
+    ASSERT_TRUE(buf.valid());
+    EXPECT_EQ((uintptr_t)buf.data() % 4096, 0u);
+    EXPECT_EQ(buf.size(), pool->buffer_size());
+    EXPECT_EQ(pool->region_of(buf.data(), buf.size()), 0);
+    char kitty[] = "kitty";
+    EXPECT_EQ(pool->region_of(kitty, sizeof(kitty)), -1);
+}
+
+TEST(BufferPoolTest, ExhaustAndReturn) {
+    std::shared_ptr<KVBufferPool> pool = small_pool(40);
+    ASSERT_TRUE(pool != NULL);
+    std::vector<KVBuffer> leases;
+    std::set<void *> seen;
+    for (;;) {
+        KVBuffer buf = pool->lease();
+        if (!buf.valid()) {
+            break;
+        }
+        seen.insert(buf.data());
+        leases.push_back(std::move(buf));
+    }
+    EXPECT_EQ(leases.size(), 40u);
+    EXPECT_EQ(seen.size(), 40u);                //no buffer handed out twice
+    EXPECT_EQ(pool->available(), 0u);
+    leases.clear();
+    EXPECT_EQ(pool->available(), 40u);
+    EXPECT_TRUE(pool->lease().valid());
+}
+
+TEST(BufferPoolTest, LeaseMovesOwnership) {
+    std::shared_ptr<KVBufferPool> pool = small_pool(2);
+    ASSERT_TRUE(pool != NULL);
+    KVBuffer a = pool->lease();
+    void *p = a.data();
+    KVBuffer b(std::move(a));
+    EXPECT_FALSE(a.valid());
+    EXPECT_EQ(b.data(), p);
+    a = pool->lease();
+    EXPECT_EQ(pool->available(), 0u);
+    a = std::move(b);                           //gives the other one back
+    EXPECT_EQ(pool->available(), 1u);
+    a.release();
+    EXPECT_EQ(pool->available(), 2u);
+}
+
+TEST(BufferPoolTest, ConcurrentLeases) {
+    std::shared_ptr<KVBufferPool> pool = small_pool(64);
+    ASSERT_TRUE(pool != NULL);
+    std::atomic<int> errors(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&pool, &errors, t] {
+            for (int i = 0; i < 20000; i++) {
+                KVBuffer buf = pool->lease();
+                if (!buf.valid()) {
+                    continue;
+                }
+                // a buffer leased twice would see the other thread's mark
+                __u32 mark = (t << 24) | i;
+                memcpy(buf.data(), &mark, sizeof(mark));
+                std::this_thread::yield();
+                errors += memcmp(buf.data(), &mark, sizeof(mark)) != 0;
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    EXPECT_EQ(errors.load(), 0);
+    EXPECT_EQ(pool->available(), 64u);
+}
+
+class BufferTest : public KVTest {
+};
+
+TEST_F(BufferTest, StoreRetrieveLeased) {
+    std::shared_ptr<KVBufferPool> pool = KVBufferPool::shared();
+    ASSERT_TRUE(pool != NULL);
+    KVBuffer in = pool->lease();
+    KVBuffer out = pool->lease();
+    ASSERT_TRUE(in.valid() && out.valid());
+    memset(in.data(), 0x5a, 1024);
+    memset(out.data(), 0, 1024);
+    KVKey key = test_key(0xcccccc5a);
+    EXPECT_EQ(session->store(key, in.data(), 1024), 0);
+    EXPECT_EQ(session->retrieve(key, out.data(), 1024), 0);
+    EXPECT_EQ(memcmp(in.data(), out.data(), 1024), 0);
+    EXPECT_EQ(session->remove(key), 0);
+}
+
+TEST_F(BufferTest, FixedBuffersOverUring) {
+    if (session->device_fd() < 0) {
+        GTEST_SKIP() << "io_uring passthrough needs an NVMe char device";
+    }
+    std::unique_ptr<KVUringEngine> engine = KVUringEngine::create(session->device_fd());
+    ASSERT_TRUE(engine != NULL) << "Could NOT set up the io_uring";
+    std::shared_ptr<KVBufferPool> pool = small_pool(16);
+    ASSERT_TRUE(pool != NULL);
+    ASSERT_EQ(engine->register_buffers(pool), 0);
+    EXPECT_TRUE(engine->fixed_buffers());
+
+    KVBuffer in = pool->lease();
+    KVBuffer out = pool->lease();
+    memcpy(in.data(), "kitty", 5);
+    struct nvme_passthru_cmd my_cmd = {0,};
+    my_cmd.nsid = 1;
+    my_cmd.opcode = KV_OPC_STORE;
+    pack_key(&my_cmd, 0xcccccc5b);            //key value
+    my_cmd.cdw10 = 5;                           //value size
+    my_cmd.addr = (__u64)(uintptr_t)in.data();
+    my_cmd.data_len = 5;
+    EXPECT_EQ(engine->execute(&my_cmd, &result), 0);
+
+    my_cmd.opcode = KV_OPC_RETRIEVE;
+    my_cmd.addr = (__u64)(uintptr_t)out.data();
+    EXPECT_EQ(engine->execute(&my_cmd, &result), 0);
+    EXPECT_EQ(memcmp(out.data(), "kitty", 5), 0);
+    EXPECT_EQ(session->remove(test_key(0xcccccc5b)), 0);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,111 @@
+#include "kv_test.h"
+#include "kv_cache.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+class CacheTest : public KVTest {
+protected:
+    void SetUp() override {
+        KVTest::SetUp();
+        KVCacheConfig config;
+        config.capacity_bytes = 16 * 1024;
+        config.shards = 1;
+        cached = std::make_shared<KVCacheBackend>(session->backend(), session->nsid(), config);
+        kv = std::make_shared<KVSession>(cached, session->nsid());
+    }
+
+    std::shared_ptr<KVCacheBackend> cached;
+    std::shared_ptr<KVSession> kv;
+};
+
+TEST_F(CacheTest, RetrieveHitAfterStore) {
+    char kitty[] = "kitty";
+    ASSERT_EQ(kv->store(test_key(0xcccccccc), kitty, strlen(kitty)), 0);
+    char buf[8] = {0,};
+    __u32 size = 0;
+    EXPECT_EQ(kv->retrieve(test_key(0xcccccccc), buf, sizeof(buf), &size), 0);
+    EXPECT_EQ(size, 5u);
+    EXPECT_STREQ(buf, "kitty");
+    EXPECT_EQ(cached->hits(), 1u);
+    EXPECT_EQ(cached->misses(), 0u);
+}
+
+TEST_F(CacheTest, MissFillsCache) {
+    char buf[8];
+    EXPECT_EQ(kv->retrieve(test_key(0xcccccccc), buf, sizeof(buf)), 0);
+    EXPECT_EQ(kv->retrieve(test_key(0xcccccccc), buf, sizeof(buf)), 0);
+    EXPECT_EQ(cached->misses(), 1u);
+    EXPECT_EQ(cached->hits(), 1u);
+}
+
+TEST_F(CacheTest, ValueBiggerThanBuffer) {
+    char kitty[] = "kitty";
+    ASSERT_EQ(kv->store(test_key(0xcccccccc), kitty, strlen(kitty)), 0);
+    char buf[4] = {0,};
+    __u32 size = 0;
+    EXPECT_EQ(kv->retrieve(test_key(0xcccccccc), buf, 2, &size), 0);
+    EXPECT_EQ(size, 5u);
+    EXPECT_EQ(memcmp(buf, "ki\0", 3), 0);
+    EXPECT_EQ(cached->hits(), 1u);
+}
+
+TEST_F(CacheTest, BufferBiggerThanValue) {
+    char kitty[] = "kitty";
+    ASSERT_EQ(kv->store(test_key(0xcccccccc), kitty, strlen(kitty)), 0);
+    char buf[9];
+    memset(buf, 'x', sizeof(buf));
+    __u32 size = 0;
+    EXPECT_EQ(kv->retrieve(test_key(0xcccccccc), buf, sizeof(buf), &size), 0);
+    EXPECT_EQ(size, 5u);
+    EXPECT_EQ(memcmp(buf, "kittyxxxx", 9), 0);
+}
+
+TEST_F(CacheTest, BufferSizeTooShort) {
+    struct nvme_passthru_cmd my_cmd = {0,};
+    my_cmd.nsid = 1;
+    my_cmd.opcode = KV_OPC_RETRIEVE;
+    my_cmd.cdw10 = 0;
+    pack_key(&my_cmd, 0xcccccccc);            //key value
+    EXPECT_EQ(kv->submit(&my_cmd, &result), 137);
+}
+
+TEST_F(CacheTest, DeleteInvalidates) {
+    char kitty[] = "kitty";
+    KVKey key = test_key(0xcace0001);
+    ASSERT_EQ(kv->store(key, kitty, strlen(kitty)), 0);
+    ASSERT_EQ(kv->remove(key), 0);
+    char buf[8];
+    EXPECT_EQ(kv->retrieve(key, buf, sizeof(buf)), 135);
+    EXPECT_EQ(kv->exists(key), 135);
+    EXPECT_EQ(cached->hits(), 0u);
+}
+
+TEST_F(CacheTest, ScanDoesNotFlushHotKey) {
+    char value[512];
+    memset(value, 'h', sizeof(value));
+    KVKey hot = test_key(0xcace1000);
+    ASSERT_EQ(kv->store(hot, value, sizeof(value)), 0);
+    char buf[sizeof(value)];
+    for (int i = 0; i < 50; i++) {
+        ASSERT_EQ(kv->retrieve(hot, buf, sizeof(buf)), 0);
+    }
+    // many more cold keys than the cache can hold, each touched once
+    for (__u32 i = 0; i < 200; i++) {
+        KVKey cold = test_key(0xcace2000 + i);
+        ASSERT_EQ(kv->store(cold, value, sizeof(value)), 0);
+    }
+    __u64 hits = cached->hits();
+    EXPECT_EQ(kv->retrieve(hot, buf, sizeof(buf)), 0);
+    EXPECT_EQ(cached->hits(), hits + 1);
+    EXPECT_LE(cached->bytes(), 16u * 1024);
+    kv->remove(hot);
+    for (__u32 i = 0; i < 200; i++) {
+        kv->remove(test_key(0xcace2000 + i));
+    }
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
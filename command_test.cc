@@ -0,0 +1,101 @@
+#include "kv_test.h"
+#include "kv_command.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// all of this is folded by the compiler
+static_assert(kv_fixed_key(0xcccccccc).dword(0) == 0xcccccccc, "key packing");
+static_assert(kv_fixed_key<16>(0x11223344).dword(3) == 0, "zero padded key");
+static_assert(kv_fixed_key("abcdefgh").dword(1) == 0x68676665, "string key");
+static_assert(kv_exists_cmd(kv_fixed_key(0xcccccc89)).cdw11 == 4, "key size");
+static_assert(kv_exists_cmd(kv_fixed_key(0xcccccc89)).opcode == KV_OPC_EXISTS, "opcode");
+static_assert(kv_delete_cmd(kv_fixed_key<16>(1)).cdw11 == 16, "key size");
+
+class CommandTest : public KVTest {
+protected:
+    // test_key(value) for the builders, which take fixed size keys
+    KVFixedKey<KV_TEST_KEY_SIZE> fixed_key(__u32 value) const {
+        KVFixedKey<KV_TEST_KEY_SIZE> k;
+        memcpy(k.bytes, test_key(value).bytes, KV_TEST_KEY_SIZE);
+        return k;
+    }
+};
+
+TEST_F(CommandTest, MatchesHandPackedStore) {
+    char kitty[] = "kitty";
+    struct nvme_passthru_cmd my_cmd = {0,};
+    my_cmd.nsid = 1;
+    my_cmd.addr = (__u64)kitty;
+    my_cmd.opcode = KV_OPC_STORE;
+    my_cmd.data_len = strlen(kitty);
+    my_cmd.cdw11 = 260;                           //key size
+    my_cmd.cdw10 = strlen(kitty);
+    my_cmd.cdw2 = 0xcccccccc;                 //key value
+    my_cmd.timeout_ms = 1000;
+
+    struct nvme_passthru_cmd built = kv_store_cmd<KV_STORE_MUST_EXIST>(kv_fixed_key(0xcccccccc), kitty, strlen(kitty));
+    EXPECT_EQ(memcmp(&built, &my_cmd, sizeof(my_cmd)), 0);
+}
+
+TEST_F(CommandTest, StoreWholeArray) {
+    const char value[] = {'a', 'b', 'c'};
+    struct nvme_passthru_cmd built = kv_store_cmd(kv_fixed_key("k"), value);
+    EXPECT_EQ(built.cdw10, 3u);
+    EXPECT_EQ(built.data_len, 3u);
+    EXPECT_EQ(built.cdw11, 1u);
+    EXPECT_EQ(built.nsid, 1u);
+    EXPECT_EQ(built.addr, (__u64)value);
+}
+
+TEST_F(CommandTest, MatchesKVSessionPacking) {
+    const __u8 bytes[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+    KVFixedKey<16> key = {{1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16}};
+    struct nvme_passthru_cmd expected = {0,};
+    kv_pack_key(&expected, kv_key(bytes, sizeof(bytes)));
+    struct nvme_passthru_cmd built = kv_exists_cmd(key);
+    EXPECT_EQ(built.cdw2, expected.cdw2);
+    EXPECT_EQ(built.cdw3, expected.cdw3);
+    EXPECT_EQ(built.cdw14, expected.cdw14);
+    EXPECT_EQ(built.cdw15, expected.cdw15);
+    EXPECT_EQ(built.cdw11, expected.cdw11);
+    EXPECT_TRUE(kv_key_equal(key.key(), kv_key(bytes, sizeof(bytes))));
+}
+
+TEST_F(CommandTest, StoreRetrieveDelete) {
+    KVFixedKey<KV_TEST_KEY_SIZE> key = fixed_key(0xc0de0001);
+    char kitty[] = "kitty";
+    struct nvme_passthru_cmd store = kv_store_cmd<KV_STORE_MUST_NOT_EXIST>(key, kitty, strlen(kitty));
+    EXPECT_EQ(submit(&store), 0);
+    EXPECT_EQ(submit(&store), 137);
+
+    char buf[8] = {0,};
+    struct nvme_passthru_cmd retrieve = kv_retrieve_cmd(key, buf);
+    EXPECT_EQ(submit(&retrieve), 0);
+    EXPECT_EQ(result, 5u);
+    EXPECT_STREQ(buf, "kitty");
+
+    struct nvme_passthru_cmd exists = kv_exists_cmd(key);
+    EXPECT_EQ(submit(&exists), 0);
+    struct nvme_passthru_cmd del = kv_delete_cmd(key);
+    EXPECT_EQ(submit(&del), 0);
+    EXPECT_EQ(submit(&exists), 135);
+}
+
+TEST_F(CommandTest, ListIntoHeapBuffer) {
+    void *list_buffer = malloc(BUFFER_SIZE);
+    ASSERT_TRUE(list_buffer != NULL);
+    memset(list_buffer, 0, BUFFER_SIZE);
+    struct nvme_passthru_cmd list = kv_list_cmd<BUFFER_SIZE>(fixed_key(0xcccccc89), list_buffer);
+    EXPECT_EQ(submit(&list), 0);
+    std::vector<KVKey> keys;
+    EXPECT_GE(kv_list_parse(list_buffer, BUFFER_SIZE, &keys), 1);
+    ASSERT_FALSE(keys.empty());
+    EXPECT_TRUE(kv_key_equal(keys[0], test_key(0xcccccc89)));
+    free(list_buffer);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
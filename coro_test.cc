@@ -0,0 +1,245 @@
+#include "kv_test.h"
+#include "kv_coro.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+// Remembers how many commands came down together
+class BatchCounter : public KVBackend {
+public:
+    explicit BatchCounter(std::shared_ptr<KVBackend> inner) : inner(inner), largest(0) {}
+
+    int submit(struct nvme_passthru_cmd *cmd, __u32 *result) override {
+        return inner->submit(cmd, result);
+    }
+    void submit_batch(struct nvme_passthru_cmd *cmds, size_t n, int *status) override {
+        largest = std::max(largest, n);
+        inner->submit_batch(cmds, n, status);
+    }
+
+    std::shared_ptr<KVBackend> inner;
+    size_t largest;
+};
+
+// Stands in for a ring. The "kernel" runs what it took through a session
+// when reaped; submit() and reap() fail the way they are told to.
+class FakeEngine : public KVUringEngine {
+public:
+    FakeEngine(std::shared_ptr<KVSession> session, unsigned depth)
+        : KVUringEngine(-1, depth), session(session), submit_error(0), reap_error(0), refusals(0) {}
+
+    int queue(const struct nvme_passthru_cmd *cmd, kv_completion_fn fn, void *ctx) override {
+        if (inflight() == queue_depth()) {
+            return -EBUSY;
+        }
+        queued.push_back(command{*cmd, fn, ctx});
+        return 0;
+    }
+    int submit() override {
+        if (refusals > 0) {
+            refusals--;
+            return -EAGAIN;
+        }
+        if (submit_error) {
+            return submit_error;
+        }
+        int n = queued.size();
+        taken.insert(taken.end(), queued.begin(), queued.end());
+        queued.clear();
+        return n;
+    }
+    int reap(unsigned) override {
+        if (reap_error) {
+            return reap_error;
+        }
+        std::vector<command> done;
+        done.swap(taken);
+        for (command &c : done) {
+            __u32 result = 0;
+            int ret = session->submit(&c.cmd, &result);
+            c.fn(c.ctx, ret < 0 ? -errno : ret, result);
+        }
+        return done.size();
+    }
+    unsigned inflight() const override { return queued.size() + taken.size(); }
+    unsigned in_kernel() const override { return taken.size(); }
+
+    std::shared_ptr<KVSession> session;
+    int submit_error;
+    int reap_error;
+    int refusals;                               //-EAGAIN before taking any
+
+private:
+    struct command {
+        struct nvme_passthru_cmd cmd;
+        kv_completion_fn fn;
+        void *ctx;
+    };
+
+    std::vector<command> queued;
+    std::vector<command> taken;
+};
+
+class CoroTest : public KVTest {
+};
+
+static KVTask<> store_retrieve_remove(KVEventLoop *loop, KVKey key, int *errors) {
+    char value[16];
+    char buf[16] = {0,};
+    snprintf(value, sizeof(value), "v%02x%02x", key.bytes[key.size - 2], key.bytes[key.size - 1]);
+    *errors += co_await loop->store(key, value, sizeof(value)) != 0;
+    __u32 size = 0;
+    *errors += co_await loop->retrieve(key, buf, sizeof(buf), &size) != 0;
+    *errors += size != sizeof(value) || memcmp(buf, value, sizeof(value)) != 0;
+    *errors += co_await loop->remove(key) != 0;
+    *errors += co_await loop->exists(key) != 135;
+}
+
+TEST_F(CoroTest, StoreRetrieveRemove) {
+    KVEventLoop loop(session);
+    EXPECT_EQ(loop.uring(), session->device_fd() >= 0);
+    int errors = 0;
+    loop.spawn(store_retrieve_remove(&loop, test_key(0x20000001), &errors));
+    loop.run();
+    EXPECT_EQ(errors, 0);
+    EXPECT_EQ(loop.inflight(), 0u);
+}
+
+static KVTask<> status_codes(KVEventLoop *loop, KVKey missing, std::vector<int> *status) {
+    char buf[8];
+    status->push_back(co_await loop->exists(missing));
+    status->push_back(co_await loop->retrieve(missing, buf, sizeof(buf)));
+    struct nvme_passthru_cmd my_cmd = {0,};
+    my_cmd.nsid = 1;
+    my_cmd.opcode = KV_OPC_EXISTS;
+    my_cmd.cdw11 = 17;                          //key size
+    status->push_back(co_await loop->submit(my_cmd));
+}
+
+TEST_F(CoroTest, StatusCodes) {
+    KVEventLoop loop(session);
+    std::vector<int> status;
+    loop.spawn(status_codes(&loop, test_key(0x20000002), &status));
+    loop.run();
+    ASSERT_EQ(status.size(), 3u);
+    EXPECT_EQ(status[0], 135);
+    EXPECT_EQ(status[1], 135);
+    EXPECT_EQ(status[2], 134);
+}
+
+static KVTask<int> value_size(KVEventLoop *loop, KVKey key) {
+    char buf[2];
+    __u32 size = 0;
+    int ret = co_await loop->retrieve(key, buf, sizeof(buf), &size);
+    co_return ret == 0 ? (int)size : -ret;
+}
+
+static KVTask<> sum_sizes(KVEventLoop *loop, KVKey a, KVKey b, int *sum) {
+    *sum = co_await value_size(loop, a);
+    *sum += co_await value_size(loop, b);
+}
+
+TEST_F(CoroTest, NestedTasks) {
+    KVEventLoop loop(session);
+    int sum = 0;
+    loop.spawn(sum_sizes(&loop, test_key(0xcccccccc), test_key(0xcccccc89), &sum));
+    loop.run();
+    EXPECT_EQ(sum, 10);                         //"kitty" twice
+}
+
+TEST_F(CoroTest, OneThreadManyInFlight) {
+    const int TASKS = 256;
+    std::shared_ptr<BatchCounter> counter = std::make_shared<BatchCounter>(session->backend());
+    std::shared_ptr<KVSession> kv = std::make_shared<KVSession>(counter, session->nsid());
+    KVEventLoop loop(kv, TASKS);
+    int errors = 0;
+    for (int i = 0; i < TASKS; i++) {
+        loop.spawn(store_retrieve_remove(&loop, test_key(0x20010000 + i), &errors));
+    }
+    loop.run();
+    EXPECT_EQ(errors, 0);
+    // every task was waiting at once, so their commands went down together
+    EXPECT_EQ(counter->largest, (size_t)TASKS);
+}
+
+TEST_F(CoroTest, QueueDepthBoundsBatches) {
+    std::shared_ptr<BatchCounter> counter = std::make_shared<BatchCounter>(session->backend());
+    std::shared_ptr<KVSession> kv = std::make_shared<KVSession>(counter, session->nsid());
+    KVEventLoop loop(kv, 16);
+    int errors = 0;
+    for (int i = 0; i < 100; i++) {
+        loop.spawn(store_retrieve_remove(&loop, test_key(0x20020000 + i), &errors));
+    }
+    loop.run();
+    EXPECT_EQ(errors, 0);
+    EXPECT_EQ(counter->largest, 16u);
+}
+
+static KVTask<> store_one(KVEventLoop *loop, KVKey key, int *status) {
+    char kitty[] = "kitty";
+    *status = co_await loop->store(key, kitty, strlen(kitty));
+}
+
+TEST_F(CoroTest, BrokenRingFailsWhatItHeld) {
+    const int TASKS = 8;
+    FakeEngine *fake = new FakeEngine(session, 4);
+    fake->reap_error = -EIO;
+    KVEventLoop loop(session, std::unique_ptr<KVUringEngine>(fake));
+    ASSERT_TRUE(loop.uring());
+    std::vector<int> status(TASKS, 1);
+    for (int i = 0; i < TASKS; i++) {
+        loop.spawn(store_one(&loop, test_key(0x20030000 + i), &status[i]));
+    }
+    loop.run();
+    EXPECT_FALSE(loop.uring());
+    EXPECT_EQ(loop.inflight(), 0u);
+    // what the kernel never gave back fails, the rest goes down synchronously
+    for (int i = 0; i < TASKS; i++) {
+        EXPECT_EQ(status[i], i < 4 ? -EIO : 0) << i;
+        EXPECT_EQ(session->exists(test_key(0x20030000 + i)), i < 4 ? 135 : 0) << i;
+    }
+}
+
+TEST_F(CoroTest, BrokenRingRunsWhatItNeverTook) {
+    const int TASKS = 8;
+    FakeEngine *fake = new FakeEngine(session, 4);
+    fake->submit_error = -EIO;
+    KVEventLoop loop(session, std::unique_ptr<KVUringEngine>(fake));
+    std::vector<int> status(TASKS, 1);
+    for (int i = 0; i < TASKS; i++) {
+        loop.spawn(store_one(&loop, test_key(0x20040000 + i), &status[i]));
+    }
+    loop.run();
+    EXPECT_FALSE(loop.uring());
+    EXPECT_EQ(loop.inflight(), 0u);
+    for (int i = 0; i < TASKS; i++) {
+        EXPECT_EQ(status[i], 0) << i;
+        EXPECT_EQ(session->exists(test_key(0x20040000 + i)), 0) << i;
+    }
+}
+
+TEST_F(CoroTest, RingOutlivesRefusedSubmit) {
+    const int TASKS = 8;
+    FakeEngine *fake = new FakeEngine(session, 4);
+    fake->refusals = 3;
+    KVEventLoop loop(session, std::unique_ptr<KVUringEngine>(fake));
+    std::vector<int> status(TASKS, 1);
+    for (int i = 0; i < TASKS; i++) {
+        loop.spawn(store_one(&loop, test_key(0x20050000 + i), &status[i]));
+    }
+    loop.run();
+    EXPECT_TRUE(loop.uring());
+    EXPECT_EQ(fake->refusals, 0);
+    for (int i = 0; i < TASKS; i++) {
+        EXPECT_EQ(status[i], 0) << i;
+        EXPECT_EQ(session->remove(test_key(0x20050000 + i)), 0) << i;
+    }
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
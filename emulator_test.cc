@@ -0,0 +1,480 @@
+#include <gtest/gtest.h>
+#include "kv_emulator.h"
+#include "kv_cursor.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Every test gets a data log directory of its own
+class EmulatorTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        char dir[] = "/tmp/kv_emulator_XXXXXX";
+        ASSERT_TRUE(mkdtemp(dir) != NULL);
+        config.path = dir;
+        config.segment_size = 64 * 1024;
+    }
+
+    void TearDown() override {
+        stop();
+        DIR *d = opendir(config.path.c_str());
+        if (d) {
+            struct dirent *e;
+            while ((e = readdir(d)) != NULL) {
+                if (e->d_name[0] != '.') {
+                    unlink((config.path + "/" + e->d_name).c_str());
+                }
+            }
+            closedir(d);
+        }
+        rmdir(config.path.c_str());
+    }
+
+    // Shuts the emulator down cleanly, writing the index snapshot
+    void stop() {
+        kv.reset();
+        emu.reset();
+    }
+
+    // ... and starts it again on the same files
+    void restart() {
+        stop();
+        emu = std::make_shared<KVEmulator>(config);
+        ASSERT_TRUE(emu->ok());
+        kv = std::make_shared<KVSession>(emu, 1);
+    }
+
+    void start() {
+        restart();
+    }
+
+    std::string file(const char *name) {
+        return config.path + "/" + name;
+    }
+
+    KVEmulatorConfig config;
+    std::shared_ptr<KVEmulator> emu;
+    std::shared_ptr<KVSession> kv;
+};
+
+static std::string value_of(KVSession *kv, const KVKey &key) {
+    char buf[256] = {0,};
+    __u32 size = 0;
+    if (kv->retrieve(key, buf, sizeof(buf), &size) != 0) {
+        return "<none>";
+    }
+    return std::string(buf, size);
+}
+
+TEST_F(EmulatorTest, PersistsAcrossRestart) {
+    start();
+    char kitty[] = "kitty";
+    char puppy[] = "puppy";
+    ASSERT_EQ(kv->store(kv_key(0xcccccccc), kitty, strlen(kitty)), 0);
+    ASSERT_EQ(kv->store(kv_key(0xcccccc89), kitty, strlen(kitty)), 0);
+    ASSERT_EQ(kv->store(kv_key(0xcccccccc), puppy, strlen(puppy)), 0);
+    ASSERT_EQ(kv->remove(kv_key(0xcccccc89)), 0);
+    size_t used = emu->used_bytes();
+
+    restart();
+    EXPECT_EQ(value_of(kv.get(), kv_key(0xcccccccc)), "puppy");
+    EXPECT_EQ(kv->exists(kv_key(0xcccccc89)), 135);
+    EXPECT_EQ(emu->key_count(), 1u);
+    EXPECT_EQ(emu->used_bytes(), used);
+}
+
+TEST_F(EmulatorTest, ReplaysLogWithoutSnapshot) {
+    start();
+    char kitty[] = "kitty";
+    for (__u32 i = 0; i < 100; i++) {
+        ASSERT_EQ(kv->store(kv_key(0x21000000 + i), kitty, strlen(kitty)), 0);
+    }
+    for (__u32 i = 0; i < 100; i += 2) {
+        ASSERT_EQ(kv->remove(kv_key(0x21000000 + i)), 0);
+    }
+    stop();
+    ASSERT_EQ(unlink(file("index").c_str()), 0);
+
+    restart();
+    EXPECT_EQ(emu->key_count(), 50u);
+    EXPECT_EQ(kv->exists(kv_key(0x21000000)), 135);
+    EXPECT_EQ(value_of(kv.get(), kv_key(0x21000001)), "kitty");
+}
+
+TEST_F(EmulatorTest, ReplaysTailAfterSnapshot) {
+    start();
+    char kitty[] = "kitty";
+    ASSERT_EQ(kv->store(kv_key(0x21000100), kitty, strlen(kitty)), 0);
+    ASSERT_EQ(kv->store(kv_key(0x21000101), kitty, strlen(kitty)), 0);
+    ASSERT_EQ(emu->snapshot(), 0);
+    ASSERT_EQ(rename(file("index").c_str(), file("index.old").c_str()), 0);
+    // written after the snapshot: only the log has them
+    ASSERT_EQ(kv->remove(kv_key(0x21000100)), 0);
+    ASSERT_EQ(kv->store(kv_key(0x21000102), kitty, strlen(kitty)), 0);
+    stop();
+    ASSERT_EQ(rename(file("index.old").c_str(), file("index").c_str()), 0);
+
+    restart();
+    EXPECT_EQ(kv->exists(kv_key(0x21000100)), 135);
+    EXPECT_EQ(kv->exists(kv_key(0x21000101)), 0);
+    EXPECT_EQ(kv->exists(kv_key(0x21000102)), 0);
+    EXPECT_EQ(emu->key_count(), 2u);
+}
+
+TEST_F(EmulatorTest, TornRecordIsDropped) {
+    start();
+    char kitty[] = "kitty";
+    ASSERT_EQ(kv->store(kv_key(0x21000200), kitty, strlen(kitty)), 0);
+    ASSERT_EQ(kv->store(kv_key(0x21000201), kitty, strlen(kitty)), 0);
+    stop();
+    ASSERT_EQ(unlink(file("index").c_str()), 0);
+    // the second record's value never made it to the disk
+    int fd = open(file("00000001.seg").c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    size_t second = KVDataLog::record_size(4, 5);
+    ASSERT_EQ(pwrite(fd, "XX", 2, second + sizeof(KVLogRecord) + 4), 2);
+    close(fd);
+
+    restart();
+    EXPECT_EQ(value_of(kv.get(), kv_key(0x21000200)), "kitty");
+    EXPECT_EQ(kv->exists(kv_key(0x21000201)), 135);
+    // new records go where the torn one was
+    char puppy[] = "puppy";
+    ASSERT_EQ(kv->store(kv_key(0x21000202), puppy, strlen(puppy)), 0);
+    restart();
+    EXPECT_EQ(emu->key_count(), 2u);
+    EXPECT_EQ(value_of(kv.get(), kv_key(0x21000202)), "puppy");
+}
+
+TEST_F(EmulatorTest, RefusesOlderLogFormat) {
+    start();
+    char kitty[] = "kitty";
+    ASSERT_EQ(kv->store(kv_key(0x21000300), kitty, strlen(kitty)), 0);
+    stop();
+    int fd = open(file("00000001.seg").c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    __u32 magic = KV_LOG_RECORD_MAGIC_V1;
+    ASSERT_EQ(pwrite(fd, &magic, sizeof(magic), offsetof(KVLogRecord, magic)), (ssize_t)sizeof(magic));
+    close(fd);
+
+    // rather than come up empty and write over it
+    KVEmulator old(config);
+    EXPECT_FALSE(old.ok());
+}
+
+TEST_F(EmulatorTest, CompactionDropsDeadSegments) {
+    start();
+    char value[100];
+    for (int round = 0; round < 20; round++) {
+        for (__u32 i = 0; i < 200; i++) {
+            snprintf(value, sizeof(value), "round %d key %u", round, i);
+            ASSERT_EQ(kv->store(kv_key(0x21000300 + i), value, sizeof(value)), 0);
+        }
+    }
+    // 500 KiB were written, 25 KiB are live: the maintenance thread may
+    // have compacted some of it already
+    while (emu->compact() > 0) {
+    }
+    EXPECT_LE(emu->segments(), 3u);
+    EXPECT_EQ(emu->key_count(), 200u);
+    EXPECT_EQ(value_of(kv.get(), kv_key(0x21000300)).substr(0, 14), std::string("round 19 key 0"));
+
+    restart();
+    EXPECT_EQ(emu->key_count(), 200u);
+    char expected[100];
+    snprintf(expected, sizeof(expected), "round 19 key %u", 199);
+    EXPECT_EQ(value_of(kv.get(), kv_key(0x21000300 + 199)).substr(0, strlen(expected)), std::string(expected));
+}
+
+TEST_F(EmulatorTest, InMemoryCompaction) {
+    KVEmulatorConfig memory;
+    memory.segment_size = 64 * 1024;
+    KVEmulator e(memory);
+    KVSession s(std::shared_ptr<KVBackend>(&e, [](KVBackend *) {}), 1);
+    char value[100] = "v";
+    for (int round = 0; round < 20; round++) {
+        for (__u32 i = 0; i < 200; i++) {
+            ASSERT_EQ(s.store(kv_key(0x21000600 + i), value, sizeof(value)), 0);
+        }
+    }
+    while (e.compact() > 0) {
+    }
+    EXPECT_LE(e.segments(), 3u);
+    EXPECT_EQ(e.key_count(), 200u);
+    EXPECT_EQ(e.used_bytes(), 200u * (4 + sizeof(value)));
+}
+
+TEST_F(EmulatorTest, SpecOptions) {
+    KVEmulatorConfig c;
+    ASSERT_EQ(kv_parse_emulator_spec("emu,path=/tmp/kv data,segment_size=65536,sync=1", &c), 0);
+    EXPECT_EQ(c.path, "/tmp/kv data");
+    EXPECT_EQ(c.segment_size, 65536u);
+    EXPECT_TRUE(c.sync);
+    EXPECT_EQ(kv_parse_emulator_spec("emu,compact_live_percent=101", &c), -1);
+    EXPECT_TRUE(kv_open_backend("emu,path=/proc/no/such/dir") == NULL);
+}
+
+TEST_F(EmulatorTest, ConditionalStoresRaceOnePerKey) {
+    start();
+    const int THREADS = 8;
+    const __u32 KEYS = 500;
+    std::atomic<int> stored(0);
+    std::atomic<int> refused(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; t++) {
+        threads.emplace_back([&, t] {
+            char value[8];
+            snprintf(value, sizeof(value), "t%d", t);
+            for (__u32 i = 0; i < KEYS; i++) {
+                int ret = kv->store(kv_key(0x21000700 + i), value, sizeof(value), KV_STORE_MUST_NOT_EXIST);
+                if (ret == 0) {
+                    stored++;
+                } else if (ret == 137) {
+                    refused++;
+                }
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    // bit 9 lets exactly one store through per key
+    EXPECT_EQ(stored.load(), (int)KEYS);
+    EXPECT_EQ(refused.load(), (THREADS - 1) * (int)KEYS);
+    EXPECT_EQ(emu->key_count(), KEYS);
+}
+
+TEST_F(EmulatorTest, ReadsDuringOverwritesAndCompaction) {
+    start();
+    const __u32 KEYS = 300;
+    char value[120];
+    for (__u32 i = 0; i < KEYS; i++) {
+        snprintf(value, sizeof(value), "%u/0", i);
+        ASSERT_EQ(kv->store(kv_key(0x21000a00 + i), value, sizeof(value)), 0);
+    }
+    std::atomic<bool> done(false);
+    std::atomic<int> bad(0);
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 4; r++) {
+        readers.emplace_back([&, r] {
+            char buf[120];
+            char prefix[16];
+            for (__u32 i = r; !done; i = (i + 7) % KEYS) {
+                __u32 size = 0;
+                int ret = kv->retrieve(kv_key(0x21000a00 + i), buf, sizeof(buf), &size);
+                // every version of a key starts with its number
+                int n = snprintf(prefix, sizeof(prefix), "%u/", i);
+                if (ret != 0 || size != sizeof(buf) || memcmp(buf, prefix, n) != 0 ||
+                    kv->exists(kv_key(0x21000a00 + i)) != 0) {
+                    bad++;
+                }
+            }
+        });
+    }
+    // enough overwrites to fill and compact away many 64 KiB segments
+    std::thread writer([&] {
+        char v[120];
+        for (int round = 1; round < 40; round++) {
+            for (__u32 i = 0; i < KEYS; i++) {
+                snprintf(v, sizeof(v), "%u/%d", i, round);
+                if (kv->store(kv_key(0x21000a00 + i), v, sizeof(v)) != 0) {
+                    bad++;
+                }
+            }
+            emu->compact();
+        }
+    });
+    writer.join();
+    done = true;
+    for (auto &t : readers) {
+        t.join();
+    }
+    EXPECT_EQ(bad.load(), 0);
+    EXPECT_EQ(emu->key_count(), KEYS);
+    EXPECT_EQ(emu->used_bytes(), KEYS * (4 + sizeof(value)));
+    EXPECT_EQ(value_of(kv.get(), kv_key(0x21000a00 + 5)).substr(0, 4), std::string("5/39"));
+}
+
+TEST_F(EmulatorTest, IndexGrowsUnderConcurrentWriters) {
+    start();
+    const int THREADS = 4;
+    const __u32 PER_THREAD = 5000;
+    std::vector<std::thread> threads;
+    std::atomic<int> errors(0);
+    for (int t = 0; t < THREADS; t++) {
+        threads.emplace_back([&, t] {
+            for (__u32 i = 0; i < PER_THREAD; i++) {
+                KVKey key = kv_key(0x22000000 + t * PER_THREAD + i);
+                errors += kv->store(key, &i, sizeof(i)) != 0;
+                errors += kv->exists(key) != 0;
+                if (i % 3 == 0) {
+                    errors += kv->remove(key) != 0;
+                }
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    EXPECT_EQ(errors.load(), 0);
+    size_t kept = THREADS * (PER_THREAD - (PER_THREAD + 2) / 3);
+    EXPECT_EQ(emu->key_count(), kept);
+
+    restart();
+    EXPECT_EQ(emu->key_count(), kept);
+    EXPECT_EQ(kv->exists(kv_key(0x22000000)), 135);
+    EXPECT_EQ(kv->exists(kv_key(0x22000001)), 0);
+}
+
+static std::vector<std::string> tree_keys(const KVKeyTree &tree, const std::string &start) {
+    std::vector<std::string> out;
+    tree.scan(start.data(), start.size(), [&](const char *key, size_t size) {
+        out.push_back(std::string(key, size));
+        return true;
+    });
+    return out;
+}
+
+static std::vector<std::string> set_keys(const std::set<std::string> &set, const std::string &start) {
+    return std::vector<std::string>(set.lower_bound(start), set.end());
+}
+
+TEST(KeyTreeTest, MatchesOrderedSet) {
+    std::mt19937 rng(7);
+    KVKeyTree tree;
+    std::set<std::string> expected;
+    // few distinct keys, so inserts and erases hit each other often, with
+    // prefixes of each other among them
+    auto random_key = [&] {
+        std::string key(1 + rng() % 3, '\0');
+        for (char &c : key) {
+            c = "a\x80\xff"[rng() % 3];
+        }
+        key += std::to_string(rng() % 3000);
+        return key;
+    };
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 30000; i++) {
+            std::string key = random_key();
+            // grow in the first half of a round, shrink in the second
+            if ((int)(rng() % 100) < (i < 15000 ? 70 : 30)) {
+                EXPECT_EQ(tree.insert(key.data(), key.size()), expected.insert(key).second);
+            } else {
+                EXPECT_EQ(tree.erase(key.data(), key.size()), expected.erase(key) == 1);
+            }
+            if (i % 5000 == 0) {
+                std::string start = random_key();
+                ASSERT_EQ(tree_keys(tree, start), set_keys(expected, start));
+            }
+        }
+        ASSERT_EQ(tree.size(), expected.size());
+        ASSERT_EQ(tree_keys(tree, ""), set_keys(expected, ""));
+        // rebuilt from the sorted keys, the next round starts from a bulk load
+        std::vector<std::pair<const char *, size_t> > sorted;
+        for (const std::string &k : expected) {
+            sorted.push_back(std::make_pair(k.data(), k.size()));
+        }
+        tree.assign(sorted);
+        ASSERT_EQ(tree_keys(tree, ""), set_keys(expected, ""));
+    }
+    while (!expected.empty()) {
+        std::string key = *expected.begin();
+        ASSERT_TRUE(tree.erase(key.data(), key.size()));
+        expected.erase(expected.begin());
+    }
+    EXPECT_EQ(tree.size(), 0u);
+    EXPECT_TRUE(tree_keys(tree, "").empty());
+}
+
+static std::set<std::string> listed(std::shared_ptr<KVSession> kv) {
+    std::set<std::string> keys;
+    KVListCursor cursor(kv, 512);
+    KVKey key;
+    while (cursor.next(&key)) {
+        keys.insert(std::string((const char *)key.bytes, key.size));
+    }
+    return keys;
+}
+
+TEST_F(EmulatorTest, ListAfterRestart) {
+    start();
+    std::set<std::string> expected;
+    char value[] = "v";
+    for (__u32 i = 0; i < 3000; i++) {
+        KVKey key = kv_key(0x23000000 + i * 7919);
+        ASSERT_EQ(kv->store(key, value, 1), 0);
+        expected.insert(std::string((const char *)key.bytes, key.size));
+    }
+    for (__u32 i = 0; i < 3000; i += 3) {
+        KVKey key = kv_key(0x23000000 + i * 7919);
+        ASSERT_EQ(kv->remove(key), 0);
+        expected.erase(std::string((const char *)key.bytes, key.size));
+    }
+    EXPECT_EQ(listed(kv), expected);
+
+    // from the snapshot, then from the log alone
+    restart();
+    EXPECT_EQ(listed(kv), expected);
+    stop();
+    ASSERT_EQ(unlink(file("index").c_str()), 0);
+    restart();
+    EXPECT_EQ(listed(kv), expected);
+}
+
+TEST_F(EmulatorTest, ListKeepsUpWithWriters) {
+    start();
+    const int THREADS = 4;
+    const __u32 PER_THREAD = 50000;             //enough to fill the order queues
+    std::vector<std::thread> threads;
+    std::atomic<int> errors(0);
+    std::atomic<bool> writing(true);
+    char value[] = "v";
+    for (int t = 0; t < THREADS; t++) {
+        threads.emplace_back([&, t] {
+            for (__u32 i = 0; i < PER_THREAD; i++) {
+                KVKey key = kv_key(0x24000000 + t * PER_THREAD + i);
+                errors += kv->store(key, value, 1) != 0;
+                if (i % 3 == 0) {
+                    errors += kv->remove(key) != 0;
+                }
+            }
+        });
+    }
+    // Lists go on meanwhile, applying the queues as they go
+    std::thread lister([&] {
+        while (writing.load()) {
+            std::vector<__u8> buf(4096);
+            errors += kv->list(kv_key(0x24000000), buf.data(), buf.size()) < 0;
+        }
+    });
+    for (auto &t : threads) {
+        t.join();
+    }
+    writing.store(false);
+    lister.join();
+    EXPECT_EQ(errors.load(), 0);
+
+    std::set<std::string> expected;
+    for (__u32 i = 0; i < THREADS * PER_THREAD; i++) {
+        if (i % PER_THREAD % 3 != 0) {
+            KVKey key = kv_key(0x24000000 + i);
+            expected.insert(std::string((const char *)key.bytes, key.size));
+        }
+    }
+    EXPECT_EQ(listed(kv), expected);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,97 @@
+#include "kv_test.h"
+#include "kv_filter.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+class FilterTest : public KVTest {
+protected:
+    void SetUp() override {
+        KVTest::SetUp();
+        filtered = std::make_shared<KVFilterBackend>(session->backend(), session->nsid(), 1 << 16);
+        ASSERT_EQ(filtered->rebuild(), 0);
+        kv = std::make_shared<KVSession>(filtered, session->nsid());
+    }
+
+    std::shared_ptr<KVFilterBackend> filtered;
+    std::shared_ptr<KVSession> kv;
+};
+
+TEST_F(FilterTest, CuckooNoFalseNegatives) {
+    KVCuckooFilter f(4096);
+    for (__u32 i = 0; i < 3000; i++) {
+        ASSERT_TRUE(f.insert(kv_key(i)));
+    }
+    for (__u32 i = 0; i < 3000; i++) {
+        EXPECT_TRUE(f.contains(kv_key(i)));
+    }
+    for (__u32 i = 0; i < 3000; i += 2) {
+        EXPECT_TRUE(f.remove(kv_key(i)));
+    }
+    for (__u32 i = 1; i < 3000; i += 2) {
+        EXPECT_TRUE(f.contains(kv_key(i)));
+    }
+    int false_positives = 0;
+    for (__u32 i = 100000; i < 110000; i++) {
+        false_positives += f.contains(kv_key(i));
+    }
+    EXPECT_LT(false_positives, 20);
+}
+
+TEST_F(FilterTest, ExistingKey) {
+    EXPECT_EQ(kv->exists(test_key(0xcccccccc)), 0);
+    char buf[8];
+    EXPECT_EQ(kv->retrieve(test_key(0xcccccccc), buf, sizeof(buf)), 0);
+}
+
+TEST_F(FilterTest, NotExistingKeySkipsDevice) {
+    __u64 before = filtered->short_circuits();
+    EXPECT_EQ(kv->exists(test_key(0xeeeeeeee)), 135);
+    char buf[8];
+    EXPECT_EQ(kv->retrieve(test_key(0xc9cccccc), buf, sizeof(buf)), 135);
+    EXPECT_EQ(filtered->short_circuits(), before + 2);
+}
+
+TEST_F(FilterTest, StatusPrecedenceKept) {
+    struct nvme_passthru_cmd my_cmd = {0,};
+    my_cmd.nsid = 1;
+    my_cmd.opcode = KV_OPC_RETRIEVE;
+    my_cmd.cdw10 = 0;
+    pack_key(&my_cmd, 0xc9cccccc);            //key value
+    EXPECT_EQ(kv->submit(&my_cmd, &result), 137);
+    my_cmd.opcode = KV_OPC_EXISTS;
+    my_cmd.cdw11 = 0;
+    EXPECT_EQ(kv->submit(&my_cmd, &result), 134);
+}
+
+TEST_F(FilterTest, StoreAndDeleteKeepInSync) {
+    char kitty[] = "kitty";
+    KVKey key = test_key(0xf17e0001);
+    ASSERT_EQ(kv->store(key, kitty, strlen(kitty)), 0);
+    EXPECT_EQ(kv->exists(key), 0);
+    // overwrites must not pile up copies of the key
+    for (int i = 0; i < 20; i++) {
+        ASSERT_EQ(kv->store(key, kitty, strlen(kitty)), 0);
+    }
+    EXPECT_TRUE(filtered->ready());
+    ASSERT_EQ(kv->remove(key), 0);
+    __u64 before = filtered->short_circuits();
+    EXPECT_EQ(kv->exists(key), 135);
+    EXPECT_EQ(filtered->short_circuits(), before + 1);
+}
+
+TEST_F(FilterTest, StoreOptionBits) {
+    char kitty[] = "kitty";
+    KVKey key = test_key(0xf17e0002);
+    EXPECT_EQ(kv->store(key, kitty, strlen(kitty), KV_STORE_MUST_EXIST), 135);
+    EXPECT_EQ(kv->store(key, kitty, strlen(kitty), KV_STORE_MUST_NOT_EXIST), 0);
+    EXPECT_EQ(kv->store(key, kitty, strlen(kitty), KV_STORE_MUST_NOT_EXIST), 137);
+    EXPECT_EQ(kv->exists(key), 0);
+    EXPECT_EQ(kv->remove(key), 0);
+    EXPECT_EQ(kv->exists(key), 135);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
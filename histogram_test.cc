@@ -0,0 +1,99 @@
+#include "kv_test.h"
+#include "kv_histogram.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <atomic>
+#include <thread>
+
+class HistogramTest : public KVTest {
+};
+
+TEST_F(HistogramTest, BucketBounds) {
+    for (__u64 ns = 1; ns < (1ull << 35); ns = ns * 3 + 1) {
+        int b = KVHistogram::bucket_of(ns);
+        EXPECT_GE(KVHistogram::bucket_high(b), ns);
+        EXPECT_LE(KVHistogram::bucket_high(b) - ns, ns / 16);
+    }
+    EXPECT_EQ(KVHistogram::bucket_of(1ull << 40), KVHistogram::BUCKETS - 1);
+}
+
+TEST_F(HistogramTest, Percentiles) {
+    KVHistogram h;
+    for (__u64 i = 1; i <= 1000; i++) {
+        h.record(i * 1000);
+    }
+    EXPECT_EQ(h.count(), 1000u);
+    EXPECT_EQ(h.max(), 1000000u);
+    EXPECT_NEAR(h.percentile(0.50), 500000, 500000 / 16);
+    EXPECT_NEAR(h.percentile(0.99), 990000, 990000 / 16);
+    EXPECT_EQ(h.percentile(1.0), 1000000u);
+}
+
+TEST_F(HistogramTest, Merge) {
+    KVHistogram a, b;
+    a.record(100);
+    b.record(200);
+    b.record(300);
+    a.merge(b);
+    EXPECT_EQ(a.count(), 3u);
+    EXPECT_EQ(a.max(), 300u);
+    EXPECT_DOUBLE_EQ(a.mean(), 200);
+}
+
+TEST_F(HistogramTest, SubmitRecordsOpcodeAndStatus) {
+    __u64 misses = kv_latency_snapshot(KV_LAT_OP_RETRIEVE, KV_LAT_ST_135).count();
+    __u64 bad_keys = kv_latency_snapshot(KV_LAT_OP_EXISTS, KV_LAT_ST_134).count();
+    char buf[8];
+    EXPECT_EQ(session->retrieve(test_key(0xc9cccccc), buf, sizeof(buf)), 135);
+    EXPECT_EQ(session->exists(kv_key(0xcccccccc, 0)), 134);
+    EXPECT_EQ(kv_latency_snapshot(KV_LAT_OP_RETRIEVE, KV_LAT_ST_135).count(), misses + 1);
+    EXPECT_EQ(kv_latency_snapshot(KV_LAT_OP_EXISTS, KV_LAT_ST_134).count(), bad_keys + 1);
+}
+
+TEST_F(HistogramTest, MergesAcrossThreads) {
+    __u64 before = kv_latency_snapshot(KV_LAT_OP_EXISTS, KV_LAT_ST_SUCCESS).count();
+    std::thread workers[4];
+    for (auto &w : workers) {
+        w = std::thread([this] {
+            for (int i = 0; i < 100; i++) {
+                session->exists(test_key(0xcccccccc));
+            }
+        });
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+    EXPECT_EQ(kv_latency_snapshot(KV_LAT_OP_EXISTS, KV_LAT_ST_SUCCESS).count(), before + 400);
+}
+
+TEST_F(HistogramTest, ResetWhileRecording) {
+    std::atomic<bool> running(true);
+    std::thread workers[4];
+    for (auto &w : workers) {
+        w = std::thread([&running] {
+            while (running.load()) {
+                kv_latency_record(KV_OPC_STORE, 0, 1000);
+            }
+        });
+    }
+    for (int i = 0; i < 1000; i++) {
+        kv_latency_reset();
+    }
+    running.store(false);
+    for (auto &w : workers) {
+        w.join();
+    }
+    // nothing recorded before a reset survives it, idle threads' or not
+    kv_latency_reset();
+    EXPECT_EQ(kv_latency_snapshot().count(), 0u);
+    for (int i = 0; i < 10; i++) {
+        kv_latency_record(KV_OPC_STORE, 0, 1000);
+    }
+    EXPECT_EQ(kv_latency_snapshot(KV_LAT_OP_STORE, KV_LAT_ST_SUCCESS).count(), 10u);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
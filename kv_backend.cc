@@ -0,0 +1,153 @@
+#include "kv_backend.h"
+#include "kv_buffer.h"
+#include "kv_emulator.h"
+#include "kv_histogram.h"
+#include "kv_shard.h"
+#include "kv_shm.h"
+#include "kv_trace.h"
+#include "kv_uring.h"
+#include "libnvme.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <mutex>
+
+void KVBackend::submit_batch(struct nvme_passthru_cmd *cmds, size_t n, int *status) {
+    for (size_t i = 0; i < n; i++) {
+        __u64 start = kv_now_ns();
+        status[i] = submit(&cmds[i], &cmds[i].result);
+        kv_latency_record(cmds[i].opcode, status[i], kv_now_ns() - start);
+    }
+}
+
+std::shared_ptr<KVDeviceBackend> KVDeviceBackend::open(const char *path) {
+    int fd = ::open(path, O_RDWR);
+    if (fd < 0) {
+        perror("Error opening the NVMe device");
+        return NULL;
+    }
+    return std::shared_ptr<KVDeviceBackend>(new KVDeviceBackend(fd));
+}
+
+KVDeviceBackend::KVDeviceBackend(int fd) : fd(fd) {
+}
+
+KVDeviceBackend::~KVDeviceBackend() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+int KVDeviceBackend::submit(struct nvme_passthru_cmd *cmd, __u32 *result) {
+    return nvme_submit_io_passthru(fd, cmd, result);
+}
+
+struct batch_slot {
+    struct nvme_passthru_cmd *cmd;
+    int *status;
+    bool done;
+};
+
+static void complete_batch(void *ctx, int status, __u32 result) {
+    batch_slot *slot = (batch_slot *)ctx;
+    slot->done = true;
+    *slot->status = status;
+    slot->cmd->result = result;
+}
+
+void KVDeviceBackend::submit_batch(struct nvme_passthru_cmd *cmds, size_t n, int *status) {
+    std::unique_ptr<KVUringEngine> engine;
+    {
+        std::lock_guard<std::mutex> guard(engines_lock);
+        if (!engines.empty()) {
+            engine = std::move(engines.back());
+            engines.pop_back();
+        }
+    }
+    if (!engine) {
+        engine = KVUringEngine::create(fd);
+        std::shared_ptr<KVBufferPool> pool = KVBufferPool::shared();
+        if (engine && pool) {
+            // commands on leased buffers then go zero-copy
+            engine->register_buffers(pool);
+        }
+    }
+    if (!engine) {
+        KVBackend::submit_batch(cmds, n, status);
+        return;
+    }
+
+    std::vector<batch_slot> slots(n);
+    size_t queued = 0;
+    while (queued < n || engine->inflight() > 0) {
+        while (queued < n) {
+            slots[queued].cmd = &cmds[queued];
+            slots[queued].status = &status[queued];
+            slots[queued].done = false;
+            if (engine->queue(&cmds[queued], complete_batch, &slots[queued]) < 0) {
+                break;
+            }
+            queued++;
+        }
+        if (engine->submit() < 0 || engine->reap(1) < 0) {
+            // the ring is unusable. What the kernel took may still write to
+            // the caller's buffers, so it goes no further before that is
+            // done; what it never took runs the slow way.
+            while (engine->in_kernel() > 0 && engine->reap(engine->in_kernel()) >= 0) {
+            }
+            bool drained = engine->in_kernel() == 0;
+            for (size_t i = 0; i < n; i++) {
+                if (i >= queued || (!slots[i].done && drained)) {
+                    status[i] = submit(&cmds[i], &cmds[i].result);
+                } else if (!slots[i].done) {
+                    status[i] = -EIO;
+                }
+            }
+            return;
+        }
+    }
+    std::lock_guard<std::mutex> guard(engines_lock);
+    engines.push_back(std::move(engine));
+}
+
+bool kv_is_emulator_spec(const char *spec) {
+    return strncmp(spec, "emu", 3) == 0 && (spec[3] == '\0' || spec[3] == ',');
+}
+
+std::shared_ptr<KVBackend> kv_open_backend(const char *spec) {
+    static std::mutex lock;
+    static std::map<std::string, std::shared_ptr<KVBackend> > emulators;
+
+    if (kv_is_trace_spec(spec)) {
+        return kv_open_trace(spec);
+    }
+    if (kv_is_shard_spec(spec)) {
+        return kv_open_shards(spec);
+    }
+    if (kv_is_shm_spec(spec)) {
+        return kv_open_shm(spec);
+    }
+    if (!kv_is_emulator_spec(spec)) {
+        return KVDeviceBackend::open(spec);
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    std::shared_ptr<KVBackend> &emu = emulators[spec];
+    if (!emu) {
+        KVEmulatorConfig config;
+        if (kv_parse_emulator_spec(spec, &config) < 0) {
+            fprintf(stderr, "Invalid emulator spec: %s\n", spec);
+            emulators.erase(spec);
+            return NULL;
+        }
+        std::shared_ptr<KVEmulator> e = std::make_shared<KVEmulator>(config);
+        if (!e->ok()) {
+            emulators.erase(spec);
+            return NULL;
+        }
+        emu = e;
+    }
+    return emu;
+}
@@ -0,0 +1,60 @@
+#ifndef KV_BACKEND_H
+#define KV_BACKEND_H
+
+#include <linux/types.h>
+#include <linux/nvme_ioctl.h>
+#include <stddef.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class KVBufferPool;
+class KVUringEngine;
+
+// Anything that can execute a KV passthrough command: the real device or
+// a stand-in. submit() has the contract of nvme_submit_io_passthru: the
+// NVMe status (0, 129, 134, ...) or -1 with errno set, dw0 in *result.
+class KVBackend {
+public:
+    virtual ~KVBackend() {}
+    virtual int submit(struct nvme_passthru_cmd *cmd, __u32 *result) = 0;
+    // Issues n independent commands, as many at once as the backend can
+    // keep in flight. status[i] gets the NVMe status, or a negative value
+    // when the command never ran, and cmds[i].result the dw0. The default
+    // runs them one by one.
+    virtual void submit_batch(struct nvme_passthru_cmd *cmds, size_t n, int *status);
+    // fd of the NVMe char device, -1 when there is none
+    virtual int device_fd() const { return -1; }
+    // Pool whose buffers this backend moves data through best, NULL when
+    // any memory does as well
+    virtual std::shared_ptr<KVBufferPool> buffers() const { return NULL; }
+};
+
+class KVDeviceBackend : public KVBackend {
+public:
+    static std::shared_ptr<KVDeviceBackend> open(const char *path);
+    ~KVDeviceBackend();
+
+    int submit(struct nvme_passthru_cmd *cmd, __u32 *result) override;
+    // Pipelined through an io_uring borrowed from a small pool
+    void submit_batch(struct nvme_passthru_cmd *cmds, size_t n, int *status) override;
+    int device_fd() const override { return fd; }
+
+private:
+    explicit KVDeviceBackend(int fd);
+
+    int fd;
+    std::mutex engines_lock;
+    std::vector<std::unique_ptr<KVUringEngine> > engines;
+};
+
+// "emu[,option=value...]" selects the in-process emulator, shared by every
+// caller asking for the same spec, "shard:..." a sharded set of them (see
+// kv_open_shards()), "trace:<file>,<spec>" records what goes to <spec>
+// (see kv_open_trace()) and "shm:<socket>" talks to a kv_emud serving
+// other processes too (see kv_open_shm()). Anything else is a device path.
+std::shared_ptr<KVBackend> kv_open_backend(const char *spec);
+bool kv_is_emulator_spec(const char *spec);
+
+#endif
@@ -0,0 +1,341 @@
+#include <benchmark/benchmark.h>
+#include "kv_client.h"
+#include "kv_histogram.h"
+#include "kv_uring.h"
+#include "kv_writeback.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+// Throughput and latency of every KV opcode. Runs against KV_DEVICE
+// (default /dev/ng0n1, or "emu" for the emulator); use
+// --benchmark_format=json or --benchmark_out=<file> for machine output.
+
+const int KEYS_PER_THREAD = 1024;
+
+static const char *bench_device() {
+    const char *device = getenv("KV_DEVICE");
+    return device && *device ? device : KV_DEFAULT_DEVICE;
+}
+
+static std::shared_ptr<KVSession> bench_session(benchmark::State &state) {
+    std::shared_ptr<KVSession> session = KVSession::open(bench_device());
+    if (!session) {
+        state.SkipWithError("Could NOT open the KV device");
+    }
+    return session;
+}
+
+// Key i of a thread: the thread index in the first byte keeps threads apart,
+// the counter fills the rest (small keys wrap and share slots)
+static KVKey bench_key(int thread, int i, int size) {
+    __u8 bytes[KV_MAX_KEY_SIZE] = {0,};
+    bytes[0] = 0xb0 + thread;
+    for (int b = 1; b < size && b < 5; b++) {
+        bytes[b] = (i >> (8 * (b - 1))) & 0xff;
+    }
+    return kv_key(bytes, size);
+}
+
+static int keys_for_size(int key_size) {
+    return key_size == 1 ? 1 : KEYS_PER_THREAD;
+}
+
+// Latency samples of one benchmark thread. Percentiles of a multi-threaded
+// run are taken over the samples of all its threads: each one adds its own
+// to a shared pool, and the last to report computes them while the others
+// report 0, which the per-thread sum of the counters leaves alone.
+class LatencyRecorder {
+public:
+    explicit LatencyRecorder(size_t expected) { samples.reserve(std::min<size_t>(expected, 1 << 20)); }
+
+    void add(__u64 ns) { samples.push_back(ns); }
+
+    void report(benchmark::State &state, int errors) {
+        {
+            std::lock_guard<std::mutex> guard(pool_lock);
+            pool.insert(pool.end(), samples.begin(), samples.end());
+            double p50 = 0, p99 = 0, p999 = 0;
+            if (++reported == state.threads()) {
+                if (!pool.empty()) {
+                    std::sort(pool.begin(), pool.end());
+                    p50 = percentile(0.50);
+                    p99 = percentile(0.99);
+                    p999 = percentile(0.999);
+                }
+                pool.clear();
+                reported = 0;
+            }
+            state.counters["p50_us"] = p50;
+            state.counters["p99_us"] = p99;
+            state.counters["p999_us"] = p999;
+        }
+        state.counters["errors"] = benchmark::Counter(errors);
+        state.SetItemsProcessed(state.iterations());
+    }
+
+private:
+    static double percentile(double p) {
+        size_t i = (size_t)(p * (pool.size() - 1));
+        return pool[i] / 1000.0;
+    }
+
+    std::vector<__u64> samples;
+
+    static std::mutex pool_lock;
+    static std::vector<__u64> pool;
+    static int reported;
+};
+
+std::mutex LatencyRecorder::pool_lock;
+std::vector<__u64> LatencyRecorder::pool;
+int LatencyRecorder::reported = 0;
+
+static void fill_keys(KVSession *session, int thread, int key_size, const char *value, __u32 value_size) {
+    for (int i = 0; i < keys_for_size(key_size); i++) {
+        session->store(bench_key(thread, i, key_size), value, value_size);
+    }
+}
+
+// Args: key size, value size
+static void BM_Store(benchmark::State &state) {
+    std::shared_ptr<KVSession> session = bench_session(state);
+    if (!session) {
+        return;
+    }
+    int key_size = state.range(0);
+    std::vector<char> value(state.range(1), 'v');
+    LatencyRecorder lat(state.max_iterations);
+    int errors = 0;
+    int i = 0;
+    for (auto _ : state) {
+        KVKey key = bench_key(state.thread_index(), i++ % keys_for_size(key_size), key_size);
+        __u64 start = kv_now_ns();
+        int ret = session->store(key, value.data(), value.size());
+        lat.add(kv_now_ns() - start);
+        errors += ret != 0;
+    }
+    lat.report(state, errors);
+}
+
+// Stores acknowledged from the write-back buffer; the final flush() is
+// timed too, so the batching has to pay for itself.
+// Args: value size, max staleness in us
+static void BM_StoreWriteBack(benchmark::State &state) {
+    std::shared_ptr<KVSession> session = bench_session(state);
+    if (!session) {
+        return;
+    }
+    KVWriteBackConfig config;
+    config.max_staleness_us = state.range(1);
+    std::shared_ptr<KVWriteBackBackend> wb =
+        std::make_shared<KVWriteBackBackend>(session->backend(), session->nsid(), config);
+    KVSession kv(wb, session->nsid());
+    const int key_size = 8;
+    std::vector<char> value(state.range(0), 'v');
+    LatencyRecorder lat(state.max_iterations);
+    int errors = 0;
+    int i = 0;
+    for (auto _ : state) {
+        KVKey key = bench_key(state.thread_index(), i++ % KEYS_PER_THREAD, key_size);
+        __u64 start = kv_now_ns();
+        int ret = kv.store(key, value.data(), value.size());
+        lat.add(kv_now_ns() - start);
+        errors += ret != 0;
+    }
+    errors += wb->flush() != 0;
+    lat.report(state, errors);
+}
+
+static void BM_Retrieve(benchmark::State &state) {
+    std::shared_ptr<KVSession> session = bench_session(state);
+    if (!session) {
+        return;
+    }
+    int key_size = state.range(0);
+    std::vector<char> value(state.range(1), 'v');
+    fill_keys(session.get(), state.thread_index(), key_size, value.data(), value.size());
+    LatencyRecorder lat(state.max_iterations);
+    int errors = 0;
+    int i = 0;
+    for (auto _ : state) {
+        KVKey key = bench_key(state.thread_index(), i++ % keys_for_size(key_size), key_size);
+        __u64 start = kv_now_ns();
+        int ret = session->retrieve(key, value.data(), value.size());
+        lat.add(kv_now_ns() - start);
+        errors += ret != 0;
+    }
+    lat.report(state, errors);
+}
+
+static void BM_Exists(benchmark::State &state) {
+    std::shared_ptr<KVSession> session = bench_session(state);
+    if (!session) {
+        return;
+    }
+    int key_size = state.range(0);
+    char value[] = "kitty";
+    fill_keys(session.get(), state.thread_index(), key_size, value, strlen(value));
+    LatencyRecorder lat(state.max_iterations);
+    int errors = 0;
+    int i = 0;
+    for (auto _ : state) {
+        KVKey key = bench_key(state.thread_index(), i++ % keys_for_size(key_size), key_size);
+        __u64 start = kv_now_ns();
+        int ret = session->exists(key);
+        lat.add(kv_now_ns() - start);
+        errors += ret != 0;
+    }
+    lat.report(state, errors);
+}
+
+// Deletes need keys to delete: every KEYS_PER_THREAD iterations the keys
+// are stored again with the clock stopped
+static void BM_Delete(benchmark::State &state) {
+    std::shared_ptr<KVSession> session = bench_session(state);
+    if (!session) {
+        return;
+    }
+    int key_size = state.range(0);
+    char value[] = "kitty";
+    LatencyRecorder lat(state.max_iterations);
+    int errors = 0;
+    int i = 0;
+    for (auto _ : state) {
+        int n = i++ % keys_for_size(key_size);
+        if (n == 0) {
+            state.PauseTiming();
+            fill_keys(session.get(), state.thread_index(), key_size, value, strlen(value));
+            state.ResumeTiming();
+        }
+        KVKey key = bench_key(state.thread_index(), n, key_size);
+        __u64 start = kv_now_ns();
+        int ret = session->remove(key);
+        lat.add(kv_now_ns() - start);
+        errors += ret != 0;
+    }
+    lat.report(state, errors);
+}
+
+// Args: key size, list buffer size
+static void BM_List(benchmark::State &state) {
+    std::shared_ptr<KVSession> session = bench_session(state);
+    if (!session) {
+        return;
+    }
+    int key_size = state.range(0);
+    char value[] = "kitty";
+    fill_keys(session.get(), state.thread_index(), key_size, value, strlen(value));
+    std::vector<char> buf(state.range(1));
+    LatencyRecorder lat(state.max_iterations);
+    int errors = 0;
+    for (auto _ : state) {
+        __u64 start = kv_now_ns();
+        int ret = session->list(bench_key(state.thread_index(), 0, key_size), buf.data(), buf.size());
+        lat.add(kv_now_ns() - start);
+        errors += ret != 0;
+    }
+    state.SetBytesProcessed(state.iterations() * buf.size());
+    lat.report(state, errors);
+}
+
+struct qd_command {
+    struct nvme_passthru_cmd cmd;
+    __u64 start;
+    LatencyRecorder *lat;
+    int *errors;
+    std::vector<qd_command *> *idle;
+};
+
+static void on_qd_complete(void *ctx, int status, __u32 result) {
+    qd_command *c = (qd_command *)ctx;
+    c->lat->add(kv_now_ns() - c->start);
+    *c->errors += status != 0;
+    c->idle->push_back(c);
+}
+
+// Retrieve with queue_depth commands kept in flight through io_uring.
+// Args: value size, queue depth
+static void BM_RetrieveQueueDepth(benchmark::State &state) {
+    std::shared_ptr<KVSession> session = bench_session(state);
+    if (!session) {
+        return;
+    }
+    if (session->device_fd() < 0) {
+        state.SkipWithError("queue depth needs an NVMe char device");
+        return;
+    }
+    unsigned depth = state.range(1);
+    std::unique_ptr<KVUringEngine> engine = KVUringEngine::create(session->device_fd(), depth);
+    if (!engine) {
+        state.SkipWithError("Could NOT set up the io_uring");
+        return;
+    }
+    const int key_size = 8;
+    std::vector<char> value(state.range(0), 'v');
+    fill_keys(session.get(), state.thread_index(), key_size, value.data(), value.size());
+
+    std::vector<qd_command> cmds(depth);
+    std::vector<qd_command *> idle;
+    std::vector<std::vector<char> > bufs(depth, std::vector<char>(value.size()));
+    LatencyRecorder lat(state.max_iterations);
+    int errors = 0;
+    int i = 0;
+    for (unsigned d = 0; d < depth; d++) {
+        qd_command &c = cmds[d];
+        memset(&c.cmd, 0, sizeof(c.cmd));
+        c.cmd.opcode = KV_OPC_RETRIEVE;
+        c.cmd.nsid = session->nsid();
+        c.cmd.cdw10 = bufs[d].size();
+        c.cmd.addr = (__u64)(uintptr_t)bufs[d].data();
+        c.cmd.data_len = bufs[d].size();
+        c.cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+        c.lat = &lat;
+        c.errors = &errors;
+        c.idle = &idle;
+        idle.push_back(&c);
+    }
+    // every iteration is one command: keep the ring full, reap as they land
+    for (auto _ : state) {
+        while (idle.empty()) {
+            engine->submit();
+            engine->reap(1);
+        }
+        qd_command *c = idle.back();
+        idle.pop_back();
+        kv_pack_key(&c->cmd, bench_key(state.thread_index(), i++ % KEYS_PER_THREAD, key_size));
+        c->start = kv_now_ns();
+        engine->queue(&c->cmd, on_qd_complete, c);
+        if (idle.empty()) {
+            engine->submit();
+        }
+    }
+    engine->submit();
+    engine->reap(engine->inflight());
+    lat.report(state, errors);
+}
+
+BENCHMARK(BM_Store)->ArgsProduct({{1, 4, 8, 16}, {16, 512, KV_MAX_VALUE_SIZE}})
+    ->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_StoreWriteBack)->ArgsProduct({{16, 512}, {100, 1000, 10000}})
+    ->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_Retrieve)->ArgsProduct({{1, 4, 8, 16}, {16, 512, KV_MAX_VALUE_SIZE}})
+    ->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_Exists)->Arg(1)->Arg(4)->Arg(8)->Arg(16)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_Delete)->Arg(4)->Arg(8)->Arg(16)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_List)->ArgsProduct({{4, 16}, {64, BUFFER_SIZE}})->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_RetrieveQueueDepth)->ArgsProduct({{16, 512, KV_MAX_VALUE_SIZE}, {1, 4, 16, 64, 128}})
+    ->ThreadRange(1, 8)->UseRealTime();
+
+int main(int argc, char **argv) {
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::AddCustomContext("kv_device", bench_device());
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
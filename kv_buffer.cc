@@ -0,0 +1,200 @@
+#include "kv_buffer.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+const size_t PAGE = 4096;
+const size_t HUGE_PAGE = 2ul << 20;
+const size_t REGION_SIZE = 1ul << 30;     //largest io_uring fixed buffer
+const size_t BATCH = 16;                  //buffers moved between free lists at once
+
+// Each thread sticks to one of the local free lists
+static unsigned local_list_index() {
+    static std::atomic<unsigned> next(0);
+    static thread_local unsigned index = next.fetch_add(1);
+    return index;
+}
+
+KVBuffer &KVBuffer::operator=(KVBuffer &&other) {
+    if (this != &other) {
+        release();
+        pool = other.pool;
+        ptr = other.ptr;
+        other.ptr = NULL;
+    }
+    return *this;
+}
+
+size_t KVBuffer::size() const {
+    return ptr ? pool->buffer_size() : 0;
+}
+
+void KVBuffer::release() {
+    if (ptr) {
+        pool->give_back(ptr);
+        ptr = NULL;
+    }
+}
+
+// The free lists get a line each, which plain new does not promise before C++17
+std::shared_ptr<KVBufferPool> KVBufferPool::make() {
+    void *p;
+    int err = posix_memalign(&p, alignof(KVBufferPool), sizeof(KVBufferPool));
+    if (err != 0) {
+        errno = err;
+        return NULL;
+    }
+    return std::shared_ptr<KVBufferPool>(new (p) KVBufferPool(), [](KVBufferPool *pool) {
+        pool->~KVBufferPool();
+        free(pool);
+    });
+}
+
+std::shared_ptr<KVBufferPool> KVBufferPool::create(const KVBufferPoolConfig &config) {
+    std::shared_ptr<KVBufferPool> pool = make();
+    if (!pool || pool->setup(config) < 0) {
+        perror("Error allocating the buffer pool");
+        return NULL;
+    }
+    return pool;
+}
+
+std::shared_ptr<KVBufferPool> KVBufferPool::shared() {
+    static std::shared_ptr<KVBufferPool> pool = create();
+    return pool;
+}
+
+std::shared_ptr<KVBufferPool> KVBufferPool::wrap(void *arena, size_t buffer_size, size_t buffers,
+                                                std::shared_ptr<void> owner) {
+    std::shared_ptr<KVBufferPool> pool = make();
+    if (!pool) {
+        return NULL;
+    }
+    pool->arena = (__u8 *)arena;
+    pool->buf_size = buffer_size;
+    pool->count = buffers;
+    pool->arena_size = buffer_size * buffers;
+    pool->owner = owner;
+    std::vector<void *> &all = pool->global.buffers;
+    all.reserve(buffers);
+    for (size_t i = buffers; i > 0; i--) {
+        all.push_back(pool->arena + (i - 1) * buffer_size);
+    }
+    return pool;
+}
+
+int KVBufferPool::setup(const KVBufferPoolConfig &config) {
+    buf_size = (std::max<size_t>(config.buffer_size, 1) + PAGE - 1) & ~(PAGE - 1);
+    count = std::max<size_t>(config.buffers, 1);
+    arena_size = (buf_size * count + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+
+    void *p = MAP_FAILED;
+    if (config.hugepages) {
+        p = mmap(NULL, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        huge = p != MAP_FAILED;
+    }
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            return -1;
+        }
+        if (config.hugepages) {
+            madvise(p, arena_size, MADV_HUGEPAGE);
+        }
+    }
+    arena = (__u8 *)p;
+    pinned = config.lock && mlock(arena, arena_size) == 0;
+
+    std::vector<void *> &all = global.buffers;
+    all.reserve(count);
+    for (size_t i = count; i > 0; i--) {
+        all.push_back(arena + (i - 1) * buf_size);
+    }
+    return 0;
+}
+
+KVBufferPool::~KVBufferPool() {
+    if (arena && !owner) {
+        if (pinned) {
+            munlock(arena, arena_size);
+        }
+        munmap(arena, arena_size);
+    }
+}
+
+KVBuffer KVBufferPool::lease() {
+    free_list &local = locals[local_list_index() % LOCAL_LISTS];
+    std::lock_guard<std::mutex> guard(local.lock);
+    if (local.buffers.empty()) {
+        std::lock_guard<std::mutex> global_guard(global.lock);
+        size_t n = std::min(BATCH, global.buffers.size());
+        local.buffers.insert(local.buffers.end(), global.buffers.end() - n, global.buffers.end());
+        global.buffers.resize(global.buffers.size() - n);
+    }
+    if (local.buffers.empty()) {
+        // the rest may sit on other threads' lists
+        for (int i = 1; i < LOCAL_LISTS && local.buffers.empty(); i++) {
+            free_list &other = locals[(local_list_index() + i) % LOCAL_LISTS];
+            std::unique_lock<std::mutex> other_guard(other.lock, std::try_to_lock);
+            if (other_guard.owns_lock() && !other.buffers.empty()) {
+                local.buffers.push_back(other.buffers.back());
+                other.buffers.pop_back();
+            }
+        }
+    }
+    if (local.buffers.empty()) {
+        return KVBuffer();
+    }
+    void *p = local.buffers.back();
+    local.buffers.pop_back();
+    return KVBuffer(this, p);
+}
+
+void KVBufferPool::give_back(void *ptr) {
+    free_list &local = locals[local_list_index() % LOCAL_LISTS];
+    std::lock_guard<std::mutex> guard(local.lock);
+    local.buffers.push_back(ptr);
+    if (local.buffers.size() > 2 * BATCH) {
+        std::lock_guard<std::mutex> global_guard(global.lock);
+        global.buffers.insert(global.buffers.end(), local.buffers.end() - BATCH, local.buffers.end());
+        local.buffers.resize(local.buffers.size() - BATCH);
+    }
+}
+
+size_t KVBufferPool::available() {
+    size_t n = 0;
+    for (int i = 0; i < LOCAL_LISTS; i++) {
+        std::lock_guard<std::mutex> guard(locals[i].lock);
+        n += locals[i].buffers.size();
+    }
+    std::lock_guard<std::mutex> guard(global.lock);
+    return n + global.buffers.size();
+}
+
+std::vector<struct iovec> KVBufferPool::regions() const {
+    std::vector<struct iovec> out;
+    for (size_t off = 0; off < arena_size; off += REGION_SIZE) {
+        struct iovec v;
+        v.iov_base = arena + off;
+        v.iov_len = std::min(REGION_SIZE, arena_size - off);
+        out.push_back(v);
+    }
+    return out;
+}
+
+int KVBufferPool::region_of(const void *addr, size_t size) const {
+    uintptr_t p = (uintptr_t)addr;
+    uintptr_t base = (uintptr_t)arena;
+    if (!arena || p < base || p + size > base + arena_size) {
+        return -1;
+    }
+    size_t first = (p - base) / REGION_SIZE;
+    size_t last = (p - base + (size ? size - 1 : 0)) / REGION_SIZE;
+    return first == last ? (int)first : -1;
+}
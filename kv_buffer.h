@@ -0,0 +1,102 @@
+#ifndef KV_BUFFER_H
+#define KV_BUFFER_H
+
+#include "kv_client.h"
+#include <sys/uio.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct KVBufferPoolConfig {
+    size_t buffer_size = BUFFER_SIZE;   //rounded up to whole pages
+    size_t buffers = 4096;
+    bool hugepages = true;              //try MAP_HUGETLB, then transparent ones
+    bool lock = true;                   //mlock, if RLIMIT_MEMLOCK allows it
+};
+
+class KVBufferPool;
+
+// A leased pool buffer; it goes back to the pool with the lease. The pool
+// must outlive its leases.
+class KVBuffer {
+public:
+    KVBuffer() : pool(NULL), ptr(NULL) {}
+    KVBuffer(KVBuffer &&other) : pool(other.pool), ptr(other.ptr) { other.ptr = NULL; }
+    KVBuffer &operator=(KVBuffer &&other);
+    ~KVBuffer() { release(); }
+
+    KVBuffer(const KVBuffer &) = delete;
+    KVBuffer &operator=(const KVBuffer &) = delete;
+
+    void *data() const { return ptr; }
+    size_t size() const;
+    bool valid() const { return ptr != NULL; }
+    void release();
+
+private:
+    friend class KVBufferPool;
+    KVBuffer(KVBufferPool *pool, void *ptr) : pool(pool), ptr(ptr) {}
+
+    KVBufferPool *pool;
+    void *ptr;
+};
+
+// Page-aligned command buffers carved out of one arena, hugepage backed
+// when possible and locked in memory, so the kernel neither bounces nor
+// pins per command. Leases come from per-thread free lists that trade
+// batches with a global one. The arena can be registered with io_uring as
+// fixed buffers, see KVUringEngine::register_buffers().
+class KVBufferPool {
+public:
+    static std::shared_ptr<KVBufferPool> create(const KVBufferPoolConfig &config = KVBufferPoolConfig());
+    // Process-wide pool of BUFFER_SIZE buffers, made on first use
+    static std::shared_ptr<KVBufferPool> shared();
+    // Buffers of buffer_size (whole pages) out of memory mapped elsewhere,
+    // such as a shared segment; owner keeps it mapped while the pool lives
+    static std::shared_ptr<KVBufferPool> wrap(void *arena, size_t buffer_size, size_t buffers,
+                                              std::shared_ptr<void> owner);
+    ~KVBufferPool();
+
+    KVBufferPool(const KVBufferPool &) = delete;
+    KVBufferPool &operator=(const KVBufferPool &) = delete;
+
+    // An invalid lease when every buffer is out
+    KVBuffer lease();
+
+    size_t buffer_size() const { return buf_size; }
+    size_t capacity() const { return count; }
+    size_t available();
+    bool hugepages() const { return huge; }
+    bool locked() const { return pinned; }
+
+    // The arena as io_uring fixed-buffer regions (each at most 1 GiB), and
+    // the region holding [addr, addr + size), or -1 when it is not ours
+    std::vector<struct iovec> regions() const;
+    int region_of(const void *addr, size_t size) const;
+
+private:
+    friend class KVBuffer;
+    static const int LOCAL_LISTS = 64;
+
+    KVBufferPool() {}
+    static std::shared_ptr<KVBufferPool> make();
+    int setup(const KVBufferPoolConfig &config);
+    void give_back(void *ptr);
+
+    struct alignas(64) free_list {
+        std::mutex lock;
+        std::vector<void *> buffers;
+    };
+
+    __u8 *arena = NULL;
+    size_t arena_size = 0;
+    size_t buf_size = 0;
+    size_t count = 0;
+    bool huge = false;
+    bool pinned = false;
+    std::shared_ptr<void> owner;        //set when the arena is not ours
+    free_list locals[LOCAL_LISTS];
+    free_list global;
+};
+
+#endif
@@ -0,0 +1,221 @@
+#include "kv_cache.h"
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+const size_t ENTRY_OVERHEAD = 64;
+
+static __u64 hash_bytes(const std::string &key) {
+    __u64 h = 0xcbf29ce484222325ull;
+    for (unsigned char c : key) {
+        h = (h ^ c) * 0x100000001b3ull;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h;
+}
+
+KVFrequencySketch::KVFrequencySketch(size_t width) : additions(0) {
+    size_t w = 64;
+    while (w < width) {
+        w <<= 1;
+    }
+    counters.assign(w / 2, 0);
+    mask = w - 1;
+    sample_size = w * 10;
+}
+
+size_t KVFrequencySketch::index(__u64 hash, int row) const {
+    __u64 h = (hash + row * 0x9e3779b97f4a7c15ull) * 0xc4ceb9fe1a85ec53ull;
+    return (h >> 32) & mask;
+}
+
+int KVFrequencySketch::get(size_t i) const {
+    return (counters[i / 2] >> (4 * (i & 1))) & 0xf;
+}
+
+void KVFrequencySketch::increment(__u64 hash) {
+    bool added = false;
+    for (int row = 0; row < DEPTH; row++) {
+        size_t i = index(hash, row);
+        if (get(i) < 15) {
+            counters[i / 2] += 1 << (4 * (i & 1));
+            added = true;
+        }
+    }
+    if (added && ++additions >= sample_size) {
+        // age: halve every counter
+        for (__u8 &c : counters) {
+            c = (c >> 1) & 0x77;
+        }
+        additions /= 2;
+    }
+}
+
+int KVFrequencySketch::frequency(__u64 hash) const {
+    int f = 15;
+    for (int row = 0; row < DEPTH; row++) {
+        f = std::min(f, get(index(hash, row)));
+    }
+    return f;
+}
+
+KVCacheBackend::KVCacheBackend(std::shared_ptr<KVBackend> inner, __u32 nsid, const KVCacheConfig &config)
+    : inner(std::move(inner)), ns(nsid), hit_count(0), miss_count(0) {
+    int n = config.shards > 0 ? config.shards : 1;
+    size_t per_shard = config.capacity_bytes / n;
+    for (int i = 0; i < n; i++) {
+        shards.emplace_back(new shard(per_shard, per_shard / ENTRY_OVERHEAD));
+    }
+}
+
+int KVCacheBackend::submit(struct nvme_passthru_cmd *cmd, __u32 *result) {
+    __u32 key_size = cmd->cdw11 & 0xff;
+    if (cmd->nsid != ns || key_size == 0 || key_size > KV_MAX_KEY_SIZE) {
+        return inner->submit(cmd, result);
+    }
+    KVKey k = kv_unpack_key(cmd);
+    std::string key((const char *)k.bytes, k.size);
+    __u64 hash = hash_bytes(key);
+
+    switch (cmd->opcode) {
+    case KV_OPC_RETRIEVE:
+        return retrieve(cmd, result, key, hash);
+    case KV_OPC_STORE:
+    case KV_OPC_DELETE:
+        return write(cmd, result, key, hash);
+    case KV_OPC_EXISTS: {
+        shard &s = shard_of(hash);
+        std::lock_guard<std::mutex> guard(s.lock);
+        if (s.index.count(key)) {
+            cmd->result = 0;
+            if (result) {
+                *result = 0;
+            }
+            return KV_SUCCESS;
+        }
+        break;
+    }
+    }
+    return inner->submit(cmd, result);
+}
+
+int KVCacheBackend::retrieve(struct nvme_passthru_cmd *cmd, __u32 *result, const std::string &key, __u64 hash) {
+    // a zero-sized buffer is 137 on the device, let it say so
+    if (cmd->cdw10 == 0) {
+        return inner->submit(cmd, result);
+    }
+    shard &s = shard_of(hash);
+    __u64 version;
+    {
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.sketch.increment(hash);
+        auto it = s.index.find(key);
+        if (it != s.index.end()) {
+            s.lru.splice(s.lru.begin(), s.lru, it->second);
+            const std::string &value = it->second->value;
+            if (cmd->addr) {
+                size_t n = std::min<size_t>(std::min(cmd->cdw10, cmd->data_len), value.size());
+                memcpy((void *)(uintptr_t)cmd->addr, value.data(), n);
+            }
+            cmd->result = value.size();
+            if (result) {
+                *result = value.size();
+            }
+            hit_count.fetch_add(1, std::memory_order_relaxed);
+            return KV_SUCCESS;
+        }
+        version = s.version;
+    }
+    miss_count.fetch_add(1, std::memory_order_relaxed);
+
+    __u32 dw0 = 0;
+    int ret = inner->submit(cmd, &dw0);
+    if (result) {
+        *result = dw0;
+    }
+    // only a read that brought back the whole value can fill the cache
+    if (ret == 0 && cmd->addr && dw0 <= std::min(cmd->cdw10, cmd->data_len)) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        if (s.version == version && !s.writing.count(key)) {
+            admit(s, hash, key, (const char *)(uintptr_t)cmd->addr, dw0);
+        }
+    }
+    return ret;
+}
+
+int KVCacheBackend::write(struct nvme_passthru_cmd *cmd, __u32 *result, const std::string &key, __u64 hash) {
+    shard &s = shard_of(hash);
+    {
+        std::lock_guard<std::mutex> guard(s.lock);
+        drop(s, key);
+        s.version++;
+        pending_write &w = s.writing[key];
+        w.contended = w.count++ > 0;
+    }
+    int ret = inner->submit(cmd, result);
+
+    std::lock_guard<std::mutex> guard(s.lock);
+    auto it = s.writing.find(key);
+    bool install = --it->second.count == 0 && !it->second.contended;
+    if (it->second.count == 0) {
+        s.writing.erase(it);
+    }
+    // a store fills the cache only when the transfer covered the whole value
+    if (install && ret == 0 && cmd->opcode == KV_OPC_STORE &&
+        (cmd->cdw10 == 0 || (cmd->addr && cmd->data_len >= cmd->cdw10))) {
+        s.sketch.increment(hash);
+        admit(s, hash, key, (const char *)(uintptr_t)cmd->addr, cmd->cdw10);
+    }
+    return ret;
+}
+
+void KVCacheBackend::drop(shard &s, const std::string &key) {
+    auto it = s.index.find(key);
+    if (it != s.index.end()) {
+        s.bytes -= it->second->key.size() + it->second->value.size() + ENTRY_OVERHEAD;
+        s.lru.erase(it->second);
+        s.index.erase(it);
+    }
+}
+
+void KVCacheBackend::admit(shard &s, __u64 hash, const std::string &key, const char *value, size_t size) {
+    size_t need = key.size() + size + ENTRY_OVERHEAD;
+    if (need > s.capacity) {
+        return;
+    }
+    drop(s, key);
+    // TinyLFU: a newcomer only takes the place of less popular entries
+    int freq = s.sketch.frequency(hash);
+    while (s.bytes + need > s.capacity) {
+        entry &victim = s.lru.back();
+        if (s.sketch.frequency(hash_bytes(victim.key)) >= freq) {
+            return;
+        }
+        drop(s, std::string(victim.key));
+    }
+    s.lru.push_front(entry());
+    entry &e = s.lru.front();
+    e.key = key;
+    e.value.assign(size ? value : "", size);
+    s.index[key] = s.lru.begin();
+    s.bytes += need;
+}
+
+void KVCacheBackend::invalidate(const KVKey &key) {
+    std::string k((const char *)key.bytes, key.size);
+    shard &s = shard_of(hash_bytes(k));
+    std::lock_guard<std::mutex> guard(s.lock);
+    drop(s, k);
+    s.version++;
+}
+
+size_t KVCacheBackend::bytes() {
+    size_t total = 0;
+    for (auto &s : shards) {
+        std::lock_guard<std::mutex> guard(s->lock);
+        total += s->bytes;
+    }
+    return total;
+}
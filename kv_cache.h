@@ -0,0 +1,97 @@
+#ifndef KV_CACHE_H
+#define KV_CACHE_H
+
+#include "kv_backend.h"
+#include "kv_client.h"
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// TinyLFU frequency sketch: a count-min sketch of 4 bit counters that are
+// halved every sample_size increments, so old popularity fades
+class KVFrequencySketch {
+public:
+    explicit KVFrequencySketch(size_t width);
+
+    void increment(__u64 hash);
+    int frequency(__u64 hash) const;
+
+private:
+    static const int DEPTH = 4;
+
+    size_t index(__u64 hash, int row) const;
+    int get(size_t i) const;
+
+    std::vector<__u8> counters;      //two 4 bit counters per byte
+    size_t mask;
+    size_t additions;
+    size_t sample_size;
+};
+
+struct KVCacheConfig {
+    size_t capacity_bytes = 64ul << 20;
+    int shards = 16;
+};
+
+// Sharded write-through value cache in front of Retrieve. Stores fill it,
+// deletes invalidate it, and a retrieve hit is answered from host memory
+// with the device's partial-read semantics (dw0 is the full value size).
+// New keys only displace LRU victims that TinyLFU says are less popular,
+// so a scan of cold keys does not flush the hot set.
+class KVCacheBackend : public KVBackend {
+public:
+    KVCacheBackend(std::shared_ptr<KVBackend> inner, __u32 nsid = 1,
+                   const KVCacheConfig &config = KVCacheConfig());
+
+    int submit(struct nvme_passthru_cmd *cmd, __u32 *result) override;
+    int device_fd() const override { return inner->device_fd(); }
+
+    __u64 hits() const { return hit_count.load(std::memory_order_relaxed); }
+    __u64 misses() const { return miss_count.load(std::memory_order_relaxed); }
+    size_t bytes();
+    void invalidate(const KVKey &key);
+
+private:
+    struct entry {
+        std::string key;
+        std::string value;
+    };
+
+    // Writes in flight per key. A key written by two commands at once is
+    // left out of the cache: we cannot tell which one the device kept.
+    struct pending_write {
+        int count;
+        bool contended;
+    };
+
+    struct shard {
+        shard(size_t capacity, size_t sketch_width)
+            : bytes(0), capacity(capacity), version(0), sketch(sketch_width) {}
+
+        std::mutex lock;
+        std::list<entry> lru;               //front is most recent
+        std::unordered_map<std::string, std::list<entry>::iterator> index;
+        std::unordered_map<std::string, pending_write> writing;
+        size_t bytes;
+        size_t capacity;
+        __u64 version;                      //bumped when any write starts
+        KVFrequencySketch sketch;
+    };
+
+    shard &shard_of(__u64 hash) { return *shards[hash % shards.size()]; }
+    void drop(shard &s, const std::string &key);
+    void admit(shard &s, __u64 hash, const std::string &key, const char *value, size_t size);
+    int retrieve(struct nvme_passthru_cmd *cmd, __u32 *result, const std::string &key, __u64 hash);
+    int write(struct nvme_passthru_cmd *cmd, __u32 *result, const std::string &key, __u64 hash);
+
+    std::shared_ptr<KVBackend> inner;
+    __u32 ns;
+    std::vector<std::unique_ptr<shard> > shards;
+    std::atomic<__u64> hit_count;
+    std::atomic<__u64> miss_count;
+};
+
+#endif
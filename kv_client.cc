@@ -0,0 +1,316 @@
+#include "kv_client.h"
+#include "kv_buffer.h"
+#include "kv_histogram.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <utility>
+
+KVKey kv_key(__u32 value, __u8 size) {
+    KVKey key;
+    memset(&key, 0, sizeof(key));
+    for (int i = 0; i < 4; i++) {
+        key.bytes[i] = (value >> (8 * i)) & 0xff;
+    }
+    key.size = size;
+    return key;
+}
+
+KVKey kv_key(const void *bytes, size_t size) {
+    KVKey key;
+    memset(&key, 0, sizeof(key));
+    memcpy(key.bytes, bytes, size < KV_MAX_KEY_SIZE ? size : KV_MAX_KEY_SIZE);
+    key.size = size;
+    return key;
+}
+
+static __u32 key_dword(const KVKey &key, int i) {
+    return key.bytes[4 * i] | key.bytes[4 * i + 1] << 8 |
+           key.bytes[4 * i + 2] << 16 | (__u32)key.bytes[4 * i + 3] << 24;
+}
+
+void kv_pack_key(struct nvme_passthru_cmd *cmd, const KVKey &key) {
+    cmd->cdw2 = key_dword(key, 0);
+    cmd->cdw3 = key_dword(key, 1);
+    cmd->cdw14 = key_dword(key, 2);
+    cmd->cdw15 = key_dword(key, 3);
+    cmd->cdw11 = (cmd->cdw11 & ~0xffu) | key.size;
+}
+
+KVKey kv_unpack_key(const struct nvme_passthru_cmd *cmd) {
+    __u32 dw[4] = {cmd->cdw2, cmd->cdw3, cmd->cdw14, cmd->cdw15};
+    KVKey key;
+    for (size_t i = 0; i < KV_MAX_KEY_SIZE; i++) {
+        key.bytes[i] = (dw[i / 4] >> (8 * (i % 4))) & 0xff;
+    }
+    key.size = cmd->cdw11 & 0xff;
+    return key;
+}
+
+bool kv_key_equal(const KVKey &a, const KVKey &b) {
+    return a.size == b.size && memcmp(a.bytes, b.bytes, a.size < KV_MAX_KEY_SIZE ? a.size : KV_MAX_KEY_SIZE) == 0;
+}
+
+int kv_list_parse(const void *buf, size_t size, std::vector<KVKey> *keys) {
+    const __u8 *p = (const __u8 *)buf;
+    if (size < 4) {
+        return 0;
+    }
+    __u32 count = p[0] | p[1] << 8 | p[2] << 16 | (__u32)p[3] << 24;
+    size_t pos = 4;
+    for (__u32 i = 0; i < count; i++) {
+        if (pos + 2 > size) {
+            return -1;
+        }
+        size_t key_size = p[pos] | p[pos + 1] << 8;
+        if (key_size == 0 || key_size > KV_MAX_KEY_SIZE || pos + 2 + key_size > size) {
+            return -1;
+        }
+        keys->push_back(kv_key(p + pos + 2, key_size));
+        pos += (2 + key_size + 3) & ~(size_t)3;
+    }
+    return count;
+}
+
+__u32 kv_list_encode(const std::vector<KVKey> &keys, void *buf, size_t size) {
+    __u8 *p = (__u8 *)buf;
+    memset(p, 0, size);
+    size_t pos = 4;
+    __u32 count = 0;
+    for (const KVKey &key : keys) {
+        size_t entry = (2 + key.size + 3) & ~(size_t)3;
+        if (pos + entry > size) {
+            break;
+        }
+        p[pos] = key.size;
+        p[pos + 1] = 0;
+        memcpy(p + pos + 2, key.bytes, key.size);
+        pos += entry;
+        count++;
+    }
+    if (size >= 4) {
+        memcpy(p, &count, 4);
+    }
+    return count;
+}
+
+size_t kv_returned_bytes(const struct nvme_passthru_cmd *cmd, __u32 result) {
+    switch (cmd->opcode) {
+    case KV_OPC_RETRIEVE:
+        return std::min<size_t>(cmd->data_len, result);
+    case KV_OPC_LIST:
+        return std::min<size_t>(cmd->data_len, cmd->cdw10);
+    default:
+        return cmd->opcode & 2 ? cmd->data_len : 0;     //controller to host
+    }
+}
+
+__u32 kv_crc32(const void *data, size_t size, __u32 crc) {
+    // slicing-by-8: table[k] advances the crc over a byte and k zero bytes
+    static __u32 table[8][256];
+    static std::once_flag once;
+    std::call_once(once, [] {
+        for (__u32 i = 0; i < 256; i++) {
+            __u32 c = i;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            table[0][i] = c;
+        }
+        for (__u32 i = 0; i < 256; i++) {
+            for (int k = 1; k < 8; k++) {
+                table[k][i] = table[0][table[k - 1][i] & 0xff] ^ (table[k - 1][i] >> 8);
+            }
+        }
+    });
+    const __u8 *p = (const __u8 *)data;
+    crc = ~crc;
+    while (size >= 8) {
+        __u32 lo;
+        __u32 hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;                          //the host is little endian
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+              table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+              table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+        p += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+std::shared_ptr<KVSession> KVSession::open(const char *spec, __u32 nsid) {
+    static std::mutex lock;
+    static std::map<std::pair<std::string, __u32>, std::shared_ptr<KVSession> > sessions;
+
+    std::lock_guard<std::mutex> guard(lock);
+    std::pair<std::string, __u32> id(spec, nsid);
+    auto it = sessions.find(id);
+    if (it != sessions.end()) {
+        return it->second;
+    }
+    std::shared_ptr<KVBackend> backend = kv_open_backend(spec);
+    if (!backend) {
+        return NULL;
+    }
+    std::shared_ptr<KVSession> session = std::make_shared<KVSession>(backend, nsid, spec);
+    sessions[id] = session;
+    return session;
+}
+
+KVSession::KVSession(std::shared_ptr<KVBackend> backend, __u32 nsid, const char *spec)
+    : impl(std::move(backend)), dev_path(spec), ns(nsid) {
+}
+
+int KVSession::submit(struct nvme_passthru_cmd *cmd, __u32 *result) {
+    __u64 start = kv_now_ns();
+    int ret = impl->submit(cmd, result);
+    kv_latency_record(cmd->opcode, ret, kv_now_ns() - start);
+    return ret;
+}
+
+void KVSession::submit_batch(struct nvme_passthru_cmd *cmds, size_t n, int *status) {
+    impl->submit_batch(cmds, n, status);
+}
+
+KVBuffer KVSession::lease() {
+    std::shared_ptr<KVBufferPool> pool = impl->buffers();
+    return (pool ? pool : KVBufferPool::shared())->lease();
+}
+
+int KVSession::store(const KVKey &key, const void *value, __u32 size, __u32 options) {
+    struct nvme_passthru_cmd cmd = {0,};
+    __u32 result;
+    cmd.opcode = KV_OPC_STORE;
+    cmd.nsid = ns;
+    cmd.cdw11 = options;
+    kv_pack_key(&cmd, key);
+    cmd.cdw10 = size;                       //value size
+    cmd.addr = (__u64)(uintptr_t)value;
+    cmd.data_len = size;
+    cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+    return submit(&cmd, &result);
+}
+
+int KVSession::retrieve(const KVKey &key, void *buf, __u32 size, __u32 *value_size) {
+    struct nvme_passthru_cmd cmd = {0,};
+    __u32 result = 0;
+    cmd.opcode = KV_OPC_RETRIEVE;
+    cmd.nsid = ns;
+    kv_pack_key(&cmd, key);
+    cmd.cdw10 = size;                       //buffer size
+    cmd.addr = (__u64)(uintptr_t)buf;
+    cmd.data_len = size;
+    cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+    int ret = submit(&cmd, &result);
+    if (ret == 0 && value_size) {
+        *value_size = result;
+    }
+    return ret;
+}
+
+int KVSession::exists(const KVKey &key) {
+    struct nvme_passthru_cmd cmd = {0,};
+    __u32 result;
+    cmd.opcode = KV_OPC_EXISTS;
+    cmd.nsid = ns;
+    kv_pack_key(&cmd, key);
+    cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+    return submit(&cmd, &result);
+}
+
+int KVSession::remove(const KVKey &key) {
+    struct nvme_passthru_cmd cmd = {0,};
+    __u32 result;
+    cmd.opcode = KV_OPC_DELETE;
+    cmd.nsid = ns;
+    kv_pack_key(&cmd, key);
+    cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+    return submit(&cmd, &result);
+}
+
+int KVSession::list(const KVKey &start, void *buf, __u32 size) {
+    struct nvme_passthru_cmd cmd = {0,};
+    __u32 result;
+    cmd.opcode = KV_OPC_LIST;
+    cmd.nsid = ns;
+    kv_pack_key(&cmd, start);
+    cmd.cdw10 = size;                       //buffer size
+    cmd.addr = (__u64)(uintptr_t)buf;
+    cmd.data_len = size;
+    cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+    return submit(&cmd, &result);
+}
+
+int KVSession::insert_if_absent(const KVKey &key, const void *value, __u32 size) {
+    return store(key, value, size, KV_STORE_MUST_NOT_EXIST);
+}
+
+int KVSession::update_if_present(const KVKey &key, const void *value, __u32 size) {
+    return store(key, value, size, KV_STORE_MUST_EXIST);
+}
+
+// Randomized exponential backoff: up to 1 us << attempt, capped at 1 ms
+static void backoff(int attempt) {
+    static thread_local std::mt19937 rng(std::random_device{}());
+    __u32 limit = 1000u << std::min(attempt, 10);
+    std::this_thread::sleep_for(std::chrono::nanoseconds(std::uniform_int_distribution<__u32>(0, limit)(rng)));
+}
+
+int KVSession::get_or_create(const KVKey &key, const void *value, __u32 size, void *buf, __u32 buf_size,
+                             __u32 *value_size, bool *created) {
+    int ret = KV_ERR_KEY_NOT_EXIST;
+    for (int attempt = 0; attempt < KV_CONDITIONAL_RETRIES; attempt++) {
+        if (attempt > 0) {
+            backoff(attempt);
+        }
+        ret = retrieve(key, buf, buf_size, value_size);
+        if (ret != KV_ERR_KEY_NOT_EXIST) {
+            break;
+        }
+        ret = insert_if_absent(key, value, size);
+        if (ret == 0) {
+            memcpy(buf, value, std::min(size, buf_size));
+            if (value_size) {
+                *value_size = size;
+            }
+            if (created) {
+                *created = true;
+            }
+            return 0;
+        }
+        if (ret != KV_ERR_INVALID_REQUEST) {
+            return ret;
+        }
+        // another client created it first, or the device turned the
+        // request down: 137 says either. Read theirs, unless a delete took
+        // it away again, and try again then.
+        int found = exists(key);
+        if (found == KV_ERR_KEY_NOT_EXIST) {
+            ret = KV_ERR_INVALID_REQUEST;
+            continue;
+        }
+        if (found != 0) {
+            return found;
+        }
+        ret = retrieve(key, buf, buf_size, value_size);
+        if (ret != KV_ERR_KEY_NOT_EXIST) {
+            break;
+        }
+    }
+    if (ret == 0 && created) {
+        *created = false;
+    }
+    return ret;
+}
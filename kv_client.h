@@ -0,0 +1,125 @@
+#ifndef KV_CLIENT_H
+#define KV_CLIENT_H
+
+#include "kv_backend.h"
+#include <linux/types.h>
+#include <linux/nvme_ioctl.h>
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+class KVBuffer;
+
+typedef enum {
+    KV_OPC_STORE = 0x01,
+    KV_OPC_RETRIEVE = 0x02,
+    KV_OPC_LIST = 0x06,
+    KV_OPC_DELETE = 0x10,
+    KV_OPC_EXISTS = 0x14,
+} kv_opcode_e;
+
+// Store options, cdw11 bits 15:8
+typedef enum {
+    KV_STORE_MUST_EXIST = 1 << 8,
+    KV_STORE_MUST_NOT_EXIST = 1 << 9,
+} kv_store_option_e;
+
+// Status codes returned in place of the ioctl result
+typedef enum {
+    KV_SUCCESS = 0,
+    KV_ERR_CAPACITY_EXCEEDED = 129,
+    KV_ERR_INVALID_KEY_SIZE = 134,
+    KV_ERR_KEY_NOT_EXIST = 135,
+    KV_ERR_INVALID_REQUEST = 137,   // key exists under must-not-exist, or bad buffer
+} kv_status_e;
+
+const size_t BUFFER_SIZE = 4096;
+const size_t KV_MAX_KEY_SIZE = 16;
+const size_t KV_MAX_VALUE_SIZE = BUFFER_SIZE - 1;   //BUFFER_SIZE already fails with 129
+const char *const KV_DEFAULT_DEVICE = "/dev/ng0n1";
+const __u32 KV_DEFAULT_TIMEOUT_MS = 1000;
+const int KV_CONDITIONAL_RETRIES = 16;
+
+// Key bytes travel in cdw2, cdw3, cdw14 and cdw15, the size in cdw11 bits 7:0
+struct KVKey {
+    __u8 bytes[KV_MAX_KEY_SIZE];
+    __u8 size;
+};
+
+// Key packed the way the tests write it: value goes to cdw2, little endian
+KVKey kv_key(__u32 value, __u8 size = 4);
+KVKey kv_key(const void *bytes, size_t size);
+void kv_pack_key(struct nvme_passthru_cmd *cmd, const KVKey &key);
+KVKey kv_unpack_key(const struct nvme_passthru_cmd *cmd);
+bool kv_key_equal(const KVKey &a, const KVKey &b);
+
+// LIST buffer: a 32 bit key count, then per key a 16 bit key size and the
+// key bytes, each entry padded to 4 bytes. Appends the keys and returns how
+// many, or -1 when the buffer is malformed.
+int kv_list_parse(const void *buf, size_t size, std::vector<KVKey> *keys);
+// The other way round: writes as many keys as fit (the rest of the buffer
+// is zeroed) and returns how many
+__u32 kv_list_encode(const std::vector<KVKey> &keys, void *buf, size_t size);
+// Bytes a command that completed with status 0 and dw0 result wrote into
+// its data buffer: at most the value for Retrieve, the List buffer for
+// List. Whatever a bounce buffer holds past that is not the caller's.
+size_t kv_returned_bytes(const struct nvme_passthru_cmd *cmd, __u32 result);
+
+// CRC-32 (IEEE), chain calls by passing the previous result as crc
+__u32 kv_crc32(const void *data, size_t size, __u32 crc = 0);
+
+// One open device and namespace. Sessions are shared: open() hands back the
+// same session for the same spec and nsid, and it stays open until exit.
+// The spec is a device path or an emulator spec, see kv_open_backend().
+class KVSession {
+public:
+    static std::shared_ptr<KVSession> open(const char *spec = KV_DEFAULT_DEVICE, __u32 nsid = 1);
+    KVSession(std::shared_ptr<KVBackend> backend, __u32 nsid, const char *spec = "");
+
+    KVSession(const KVSession &) = delete;
+    KVSession &operator=(const KVSession &) = delete;
+
+    const std::string &path() const { return dev_path; }
+    __u32 nsid() const { return ns; }
+    int device_fd() const { return impl->device_fd(); }
+    const std::shared_ptr<KVBackend> &backend() const { return impl; }
+    // A command buffer from the backend's pool (see KVBackend::buffers()),
+    // else one of BUFFER_SIZE from KVBufferPool::shared(). It goes back to
+    // the pool with the lease, which must not outlive the backend; invalid
+    // when every buffer is out.
+    KVBuffer lease();
+
+    // Raw command, returns the NVMe status (or -1 with errno set)
+    int submit(struct nvme_passthru_cmd *cmd, __u32 *result);
+    // Independent raw commands issued together, see KVBackend::submit_batch
+    void submit_batch(struct nvme_passthru_cmd *cmds, size_t n, int *status);
+
+    int store(const KVKey &key, const void *value, __u32 size, __u32 options = 0);
+    // value_size receives the full size of the stored value, which may be
+    // bigger than the bytes copied into buf
+    int retrieve(const KVKey &key, void *buf, __u32 size, __u32 *value_size = NULL);
+    int exists(const KVKey &key);
+    int remove(const KVKey &key);
+    int list(const KVKey &start, void *buf, __u32 size);
+
+    // One conditional STORE each, checked by the device: 137 when the key
+    // is already there, 135 when it is not
+    int insert_if_absent(const KVKey &key, const void *value, __u32 size);
+    int update_if_present(const KVKey &key, const void *value, __u32 size);
+    // Retrieves the value into buf, or stores value when the key is missing
+    // and copies it to buf; *created tells which. A create that loses to
+    // another client reads the winner's value. When deletes keep racing
+    // with it, it retries with randomized exponential backoff, up to
+    // KV_CONDITIONAL_RETRIES times, then returns 135, or 137 when the last
+    // create was turned down and the key was still missing after it.
+    int get_or_create(const KVKey &key, const void *value, __u32 size, void *buf, __u32 buf_size,
+                      __u32 *value_size = NULL, bool *created = NULL);
+
+private:
+    std::shared_ptr<KVBackend> impl;
+    std::string dev_path;
+    __u32 ns;
+};
+
+#endif
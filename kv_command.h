@@ -0,0 +1,140 @@
+#ifndef KV_COMMAND_H
+#define KV_COMMAND_H
+
+#include "kv_client.h"
+#include <stdint.h>
+
+// Typed command builders. The key length, the store options and, where the
+// buffer is an array, its size are template parameters, so a command the
+// device would answer with 134 (key size) or 137 (empty buffer, or
+// must-exist together with must-not-exist) does not compile. Building a
+// command is a fixed sequence of stores, with no runtime checks.
+
+// Key of N bytes. Byte i travels in byte i % 4 of the i / 4th key dword
+// (cdw2, cdw3, cdw14, cdw15), the same packing as kv_pack_key().
+template <size_t N>
+struct KVFixedKey {
+    static_assert(N >= 1 && N <= KV_MAX_KEY_SIZE, "KV keys are 1 to 16 bytes");
+
+    __u8 bytes[N];
+
+    constexpr __u32 dword(size_t d) const {
+        __u32 w = 0;
+        for (size_t i = 4 * d; i < 4 * d + 4 && i < N; i++) {
+            w |= (__u32)bytes[i] << (8 * (i % 4));
+        }
+        return w;
+    }
+
+    KVKey key() const { return kv_key(bytes, N); }
+};
+
+// Same bytes as kv_key(value, N): the value little endian, then zeros
+template <size_t N = 4>
+constexpr KVFixedKey<N> kv_fixed_key(__u32 value) {
+    KVFixedKey<N> k = {};
+    for (size_t i = 0; i < N && i < 4; i++) {
+        k.bytes[i] = (value >> (8 * i)) & 0xff;
+    }
+    return k;
+}
+
+// The characters of a string literal, without the terminating NUL
+template <size_t M>
+constexpr KVFixedKey<M - 1> kv_fixed_key(const char (&s)[M]) {
+    KVFixedKey<M - 1> k = {};
+    for (size_t i = 0; i + 1 < M; i++) {
+        k.bytes[i] = (__u8)s[i];
+    }
+    return k;
+}
+
+template <__u32 Options>
+struct KVStoreOptions {
+    static_assert((Options & ~(__u32)(KV_STORE_MUST_EXIST | KV_STORE_MUST_NOT_EXIST)) == 0,
+                  "unknown store option");
+    static_assert(Options != (KV_STORE_MUST_EXIST | KV_STORE_MUST_NOT_EXIST),
+                  "must-exist and must-not-exist together can never succeed");
+    static const __u32 value = Options;
+};
+
+// opcode, nsid, key and timeout; no data
+template <size_t N>
+constexpr struct nvme_passthru_cmd kv_key_cmd(__u8 opcode, const KVFixedKey<N> &key, __u32 cdw11 = 0,
+                                              __u32 nsid = 1) {
+    struct nvme_passthru_cmd cmd = {};
+    cmd.opcode = opcode;
+    cmd.nsid = nsid;
+    cmd.cdw2 = key.dword(0);
+    cmd.cdw3 = key.dword(1);
+    cmd.cdw14 = key.dword(2);
+    cmd.cdw15 = key.dword(3);
+    cmd.cdw11 = cdw11 | N;                  //key size and options
+    cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+    return cmd;
+}
+
+inline void kv_cmd_data(struct nvme_passthru_cmd *cmd, const void *data, __u32 size) {
+    cmd->cdw10 = size;
+    cmd->addr = (__u64)(uintptr_t)data;
+    cmd->data_len = size;
+}
+
+template <__u32 Options = 0, size_t N>
+inline struct nvme_passthru_cmd kv_store_cmd(const KVFixedKey<N> &key, const void *value, __u32 size,
+                                             __u32 nsid = 1) {
+    struct nvme_passthru_cmd cmd = kv_key_cmd(KV_OPC_STORE, key, KVStoreOptions<Options>::value, nsid);
+    kv_cmd_data(&cmd, value, size);
+    return cmd;
+}
+
+// Stores the whole array, whose size is checked against the record limit.
+// No nsid argument: (key, array, n) must keep meaning a pointer and a size.
+template <__u32 Options = 0, size_t N, typename T, size_t M>
+inline struct nvme_passthru_cmd kv_store_cmd(const KVFixedKey<N> &key, const T (&value)[M]) {
+    static_assert(sizeof(value) <= KV_MAX_VALUE_SIZE, "value bigger than a KV record");
+    return kv_store_cmd<Options>(key, (const void *)value, sizeof(value));
+}
+
+template <size_t N, typename T, size_t M>
+inline struct nvme_passthru_cmd kv_retrieve_cmd(const KVFixedKey<N> &key, T (&buf)[M], __u32 nsid = 1) {
+    struct nvme_passthru_cmd cmd = kv_key_cmd(KV_OPC_RETRIEVE, key, 0, nsid);
+    kv_cmd_data(&cmd, buf, sizeof(buf));
+    return cmd;
+}
+
+// For heap buffers: the buffer size is a template argument instead
+template <__u32 Size, size_t N>
+inline struct nvme_passthru_cmd kv_retrieve_cmd(const KVFixedKey<N> &key, void *buf, __u32 nsid = 1) {
+    static_assert(Size > 0, "Retrieve needs a buffer");
+    struct nvme_passthru_cmd cmd = kv_key_cmd(KV_OPC_RETRIEVE, key, 0, nsid);
+    kv_cmd_data(&cmd, buf, Size);
+    return cmd;
+}
+
+template <size_t N, typename T, size_t M>
+inline struct nvme_passthru_cmd kv_list_cmd(const KVFixedKey<N> &start, T (&buf)[M], __u32 nsid = 1) {
+    struct nvme_passthru_cmd cmd = kv_key_cmd(KV_OPC_LIST, start, 0, nsid);
+    kv_cmd_data(&cmd, buf, sizeof(buf));
+    return cmd;
+}
+
+template <__u32 Size, size_t N>
+inline struct nvme_passthru_cmd kv_list_cmd(const KVFixedKey<N> &start, void *buf, __u32 nsid = 1) {
+    static_assert(Size > 0, "List needs a buffer");
+    struct nvme_passthru_cmd cmd = kv_key_cmd(KV_OPC_LIST, start, 0, nsid);
+    kv_cmd_data(&cmd, buf, Size);
+    return cmd;
+}
+
+template <size_t N>
+constexpr struct nvme_passthru_cmd kv_exists_cmd(const KVFixedKey<N> &key, __u32 nsid = 1) {
+    return kv_key_cmd(KV_OPC_EXISTS, key, 0, nsid);
+}
+
+template <size_t N>
+constexpr struct nvme_passthru_cmd kv_delete_cmd(const KVFixedKey<N> &key, __u32 nsid = 1) {
+    return kv_key_cmd(KV_OPC_DELETE, key, 0, nsid);
+}
+
+#endif
@@ -0,0 +1,186 @@
+#include "kv_coro.h"
+#include "kv_buffer.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+void KVOperation::await_suspend(std::coroutine_handle<> h) {
+    handle = h;
+    loop->queue(this);
+}
+
+KVEventLoop::KVEventLoop(std::shared_ptr<KVSession> session, unsigned queue_depth)
+    : kv(std::move(session)), depth(queue_depth ? queue_depth : 1), busy(0) {
+    if (kv->device_fd() >= 0) {
+        engine = KVUringEngine::create(kv->device_fd(), depth);
+        std::shared_ptr<KVBufferPool> pool = KVBufferPool::shared();
+        if (engine && pool) {
+            engine->register_buffers(pool);
+        }
+    }
+}
+
+KVEventLoop::KVEventLoop(std::shared_ptr<KVSession> session, std::unique_ptr<KVUringEngine> engine)
+    : kv(std::move(session)), engine(std::move(engine)), depth(1), busy(0) {
+    if (this->engine) {
+        depth = this->engine->queue_depth();
+    }
+}
+
+KVOperation KVEventLoop::store(const KVKey &key, const void *value, __u32 size, __u32 options) {
+    struct nvme_passthru_cmd cmd = {0,};
+    cmd.opcode = KV_OPC_STORE;
+    cmd.nsid = kv->nsid();
+    cmd.cdw11 = options;
+    kv_pack_key(&cmd, key);
+    cmd.cdw10 = size;                       //value size
+    cmd.addr = (__u64)(uintptr_t)value;
+    cmd.data_len = size;
+    cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+    return KVOperation(this, cmd);
+}
+
+KVOperation KVEventLoop::retrieve(const KVKey &key, void *buf, __u32 size, __u32 *value_size) {
+    struct nvme_passthru_cmd cmd = {0,};
+    cmd.opcode = KV_OPC_RETRIEVE;
+    cmd.nsid = kv->nsid();
+    kv_pack_key(&cmd, key);
+    cmd.cdw10 = size;                       //buffer size
+    cmd.addr = (__u64)(uintptr_t)buf;
+    cmd.data_len = size;
+    cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+    return KVOperation(this, cmd, value_size);
+}
+
+KVOperation KVEventLoop::exists(const KVKey &key) {
+    struct nvme_passthru_cmd cmd = {0,};
+    cmd.opcode = KV_OPC_EXISTS;
+    cmd.nsid = kv->nsid();
+    kv_pack_key(&cmd, key);
+    cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+    return KVOperation(this, cmd);
+}
+
+KVOperation KVEventLoop::remove(const KVKey &key) {
+    struct nvme_passthru_cmd cmd = {0,};
+    cmd.opcode = KV_OPC_DELETE;
+    cmd.nsid = kv->nsid();
+    kv_pack_key(&cmd, key);
+    cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+    return KVOperation(this, cmd);
+}
+
+KVOperation KVEventLoop::list(const KVKey &start, void *buf, __u32 size) {
+    struct nvme_passthru_cmd cmd = {0,};
+    cmd.opcode = KV_OPC_LIST;
+    cmd.nsid = kv->nsid();
+    kv_pack_key(&cmd, start);
+    cmd.cdw10 = size;                       //buffer size
+    cmd.addr = (__u64)(uintptr_t)buf;
+    cmd.data_len = size;
+    cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+    return KVOperation(this, cmd);
+}
+
+KVOperation KVEventLoop::submit(const struct nvme_passthru_cmd &cmd, __u32 *result) {
+    return KVOperation(this, cmd, result);
+}
+
+void KVEventLoop::spawn(KVTask<void> task) {
+    tasks.push_back(std::move(task));
+    tasks.back().start();
+    collect();
+}
+
+void KVEventLoop::queue(KVOperation *op) {
+    waiting.push_back(op);
+}
+
+void KVEventLoop::complete(void *ctx, int status, __u32 result) {
+    KVOperation *op = (KVOperation *)ctx;
+    op->status = status;
+    op->cmd.result = result;
+    op->loop->busy--;
+    op->loop->in_ring.erase(op);
+    op->loop->ready.push_back(op);
+}
+
+// Hands waiting commands to the device and waits for at least one of them
+void KVEventLoop::issue() {
+    if (!engine) {
+        // no ring: whatever is waiting goes down as one batch
+        size_t n = std::min<size_t>(waiting.size(), depth);
+        std::vector<struct nvme_passthru_cmd> cmds(n);
+        std::vector<int> status(n);
+        for (size_t i = 0; i < n; i++) {
+            cmds[i] = waiting[i]->cmd;
+        }
+        kv->submit_batch(cmds.data(), n, status.data());
+        for (size_t i = 0; i < n; i++) {
+            KVOperation *op = waiting.front();
+            waiting.pop_front();
+            op->status = status[i];
+            op->cmd.result = cmds[i].result;
+            ready.push_back(op);
+        }
+        return;
+    }
+    while (!waiting.empty() && engine->queue(&waiting.front()->cmd, complete, waiting.front()) == 0) {
+        in_ring.insert(waiting.front());
+        waiting.pop_front();
+        busy++;
+    }
+    int ret = engine->submit();
+    if (ret == -EAGAIN && engine->in_kernel() == 0) {
+        // nothing to wait for: the next issue() submits again
+        return;
+    }
+    if (ret >= 0 || ret == -EAGAIN) {
+        ret = engine->reap(1);
+    }
+    if (ret < 0) {
+        // the ring is unusable. What the kernel took may still write to
+        // the tasks' buffers, so none of them resumes before that is done;
+        // what it never took runs synchronously.
+        while (engine->in_kernel() > 0 && engine->reap(engine->in_kernel()) >= 0) {
+        }
+        bool drained = engine->in_kernel() == 0;
+        for (KVOperation *op : in_ring) {
+            if (drained) {
+                waiting.push_front(op);
+            } else {
+                op->status = -EIO;
+                ready.push_back(op);
+            }
+        }
+        in_ring.clear();
+        engine.reset();
+        busy = 0;
+    }
+}
+
+void KVEventLoop::resume_ready() {
+    // resuming a task may queue more commands, and complete it
+    std::vector<KVOperation *> batch;
+    batch.swap(ready);
+    for (KVOperation *op : batch) {
+        op->handle.resume();
+    }
+}
+
+void KVEventLoop::collect() {
+    for (auto it = tasks.begin(); it != tasks.end();) {
+        it = it->done() ? tasks.erase(it) : std::next(it);
+    }
+}
+
+void KVEventLoop::run() {
+    while (!waiting.empty() || !ready.empty() || busy > 0) {
+        if (ready.empty()) {
+            issue();
+        }
+        resume_ready();
+        collect();
+    }
+}
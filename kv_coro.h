@@ -0,0 +1,190 @@
+#ifndef KV_CORO_H
+#define KV_CORO_H
+
+// C++20: only the kv_coro library and what links it are built with it
+
+#include "kv_client.h"
+#include "kv_uring.h"
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <list>
+#include <memory>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+template <typename T> class KVTask;
+
+struct KVTaskPromiseBase {
+    // resumes whoever co_awaited the task, if anyone did
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            std::coroutine_handle<> next = h.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { std::terminate(); }
+
+    std::coroutine_handle<> continuation;
+};
+
+template <typename T>
+struct KVTaskPromise : KVTaskPromiseBase {
+    KVTask<T> get_return_object() noexcept;
+    void return_value(T v) { value = std::move(v); }
+
+    T value;
+};
+
+template <>
+struct KVTaskPromise<void> : KVTaskPromiseBase {
+    KVTask<void> get_return_object() noexcept;
+    void return_void() noexcept {}
+};
+
+// Lazily started coroutine: nothing runs until it is co_awaited or handed
+// to KVEventLoop::spawn(). The task owns the coroutine frame.
+//
+// Write tasks as functions that take their arguments by value or pointer.
+// A lambda coroutine with captures reads them from the lambda object, which
+// is usually gone by the time the task runs.
+template <typename T = void>
+class KVTask {
+public:
+    typedef KVTaskPromise<T> promise_type;
+
+    explicit KVTask(std::coroutine_handle<promise_type> h) : handle(h) {}
+    KVTask(KVTask &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    KVTask &operator=(KVTask &&other) noexcept {
+        if (this != &other) {
+            if (handle) {
+                handle.destroy();
+            }
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+    ~KVTask() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    KVTask(const KVTask &) = delete;
+    KVTask &operator=(const KVTask &) = delete;
+
+    bool done() const { return !handle || handle.done(); }
+    void start() { handle.resume(); }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume() {
+        if constexpr (!std::is_void<T>::value) {
+            return std::move(handle.promise().value);
+        }
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <typename T>
+KVTask<T> KVTaskPromise<T>::get_return_object() noexcept {
+    return KVTask<T>(std::coroutine_handle<KVTaskPromise<T> >::from_promise(*this));
+}
+
+inline KVTask<void> KVTaskPromise<void>::get_return_object() noexcept {
+    return KVTask<void>(std::coroutine_handle<KVTaskPromise<void> >::from_promise(*this));
+}
+
+class KVEventLoop;
+
+// One KV command: co_await suspends the task until the command completes
+// and gives the NVMe status (or a negative value when it never ran)
+class KVOperation {
+public:
+    KVOperation(KVEventLoop *loop, const struct nvme_passthru_cmd &cmd, __u32 *result = NULL)
+        : loop(loop), cmd(cmd), result(result), status(-1) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h);
+    int await_resume() const noexcept {
+        if (result && status == 0) {
+            *result = cmd.result;
+        }
+        return status;
+    }
+
+private:
+    friend class KVEventLoop;
+
+    KVEventLoop *loop;
+    struct nvme_passthru_cmd cmd;
+    __u32 *result;
+    int status;
+    std::coroutine_handle<> handle;
+};
+
+// Single-threaded event loop for KV coroutines. On an NVMe char device the
+// commands of every waiting task go through one io_uring, up to
+// queue_depth in flight; on anything else (the emulator, decorated
+// backends) they are handed to the session's submit_batch() together.
+// Nothing in here is locked: spawn, await and run() from one thread.
+class KVEventLoop {
+public:
+    explicit KVEventLoop(std::shared_ptr<KVSession> session, unsigned queue_depth = KV_URING_DEFAULT_DEPTH);
+    // Commands go through the engine given instead of one of its own
+    KVEventLoop(std::shared_ptr<KVSession> session, std::unique_ptr<KVUringEngine> engine);
+
+    KVEventLoop(const KVEventLoop &) = delete;
+    KVEventLoop &operator=(const KVEventLoop &) = delete;
+
+    const std::shared_ptr<KVSession> &session() const { return kv; }
+    bool uring() const { return engine != NULL; }
+    unsigned queue_depth() const { return depth; }
+    unsigned inflight() const { return busy; }
+
+    // The buffers passed in must live until the operation completes
+    KVOperation store(const KVKey &key, const void *value, __u32 size, __u32 options = 0);
+    KVOperation retrieve(const KVKey &key, void *buf, __u32 size, __u32 *value_size = NULL);
+    KVOperation exists(const KVKey &key);
+    KVOperation remove(const KVKey &key);
+    KVOperation list(const KVKey &start, void *buf, __u32 size);
+    KVOperation submit(const struct nvme_passthru_cmd &cmd, __u32 *result = NULL);
+
+    // Starts the task; the loop keeps it until it returns
+    void spawn(KVTask<void> task);
+    // Completes commands and resumes their tasks until none is waiting
+    void run();
+
+private:
+    friend class KVOperation;
+
+    static void complete(void *ctx, int status, __u32 result);
+    void queue(KVOperation *op);
+    void issue();
+    void resume_ready();
+    void collect();
+
+    std::shared_ptr<KVSession> kv;
+    std::unique_ptr<KVUringEngine> engine;
+    unsigned depth;
+    unsigned busy;
+    std::unordered_set<KVOperation *> in_ring;  //queued to the engine, not completed yet
+    std::deque<KVOperation *> waiting;      //not handed to the device yet
+    std::vector<KVOperation *> ready;       //completed, task not resumed yet
+    std::list<KVTask<void> > tasks;
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include "kv_cursor.h"
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+// room for a 4 byte count and two maximum-size keys, or a page holding
+// nothing but the resume key would end the walk early
+const size_t MIN_PAGE_SIZE = 4 + 2 * 20;
+
+static KVKey first_key() {
+    __u8 zero = 0;
+    return kv_key(&zero, 1);
+}
+
+KVListCursor::KVListCursor(std::shared_ptr<KVSession> session, size_t page_size, bool prefetch)
+    : KVListCursor(std::move(session), first_key(), page_size, prefetch) {
+}
+
+KVListCursor::KVListCursor(std::shared_ptr<KVSession> session, const KVKey &start,
+                           size_t page_size, bool prefetch)
+    : session(std::move(session)), pos(0), resume(start), resumed(false), done(false),
+      error(0), fetched(0), requested(false), ready(false), stopping(false) {
+    front.buf.resize(std::max(page_size, MIN_PAGE_SIZE));
+    back.buf.resize(std::max(page_size, MIN_PAGE_SIZE));
+    front.status = back.status = 0;
+    if (prefetch) {
+        thread = std::thread(&KVListCursor::worker, this);
+    }
+    request(start);
+}
+
+KVListCursor::~KVListCursor() {
+    if (thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        cond.notify_all();
+        thread.join();
+    }
+}
+
+void KVListCursor::fetch(page *p, const KVKey &from) {
+    struct nvme_passthru_cmd cmd = {0,};
+    __u32 result;
+    cmd.opcode = KV_OPC_LIST;
+    cmd.nsid = session->nsid();
+    kv_pack_key(&cmd, from);
+    cmd.cdw10 = p->buf.size();              //buffer size
+    cmd.addr = (__u64)(uintptr_t)p->buf.data();
+    cmd.data_len = p->buf.size();
+    cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+    p->keys.clear();
+    p->status = session->submit(&cmd, &result);
+    if (p->status == 0 && kv_list_parse(p->buf.data(), p->buf.size(), &p->keys) < 0) {
+        p->status = -1;
+    }
+}
+
+// Starts filling the back page from the given key
+void KVListCursor::request(const KVKey &from) {
+    if (!thread.joinable()) {
+        fetch(&back, from);
+        ready = true;
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        wanted = from;
+        requested = true;
+    }
+    cond.notify_all();
+}
+
+void KVListCursor::worker() {
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+        cond.wait(guard, [this] { return requested || stopping; });
+        if (stopping) {
+            return;
+        }
+        requested = false;
+        KVKey from = wanted;
+        guard.unlock();
+        fetch(&back, from);
+        guard.lock();
+        ready = true;
+        cond.notify_all();
+    }
+}
+
+bool KVListCursor::next(KVKey *key) {
+    while (pos >= front.keys.size()) {
+        if (done) {
+            return false;
+        }
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            cond.wait(guard, [this] { return ready; });
+            ready = false;
+        }
+        std::swap(front, back);
+        pos = 0;
+        fetched++;
+        if (front.status != 0) {
+            error = front.status;
+            done = true;
+            return false;
+        }
+        // the page starts at the key we resume from
+        if (resumed && !front.keys.empty() && kv_key_equal(front.keys[0], resume)) {
+            pos = 1;
+        }
+        if (pos >= front.keys.size()) {
+            done = true;
+            return false;
+        }
+        resume = front.keys.back();
+        resumed = true;
+        request(resume);
+    }
+    *key = front.keys[pos++];
+    return true;
+}
@@ -0,0 +1,64 @@
+#ifndef KV_CURSOR_H
+#define KV_CURSOR_H
+
+#include "kv_client.h"
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Walks the namespace in LIST order, one page of keys per KV_OPC_LIST. Each
+// page resumes from the last key of the previous one (LIST is inclusive, so
+// that key is dropped again). With prefetch on, a worker thread fetches the
+// next page into a second buffer while the caller consumes the current one.
+class KVListCursor {
+public:
+    // The default start, the one byte key 0x00, is the first possible key
+    explicit KVListCursor(std::shared_ptr<KVSession> session, size_t page_size = BUFFER_SIZE,
+                          bool prefetch = true);
+    KVListCursor(std::shared_ptr<KVSession> session, const KVKey &start,
+                 size_t page_size = BUFFER_SIZE, bool prefetch = true);
+    ~KVListCursor();
+
+    KVListCursor(const KVListCursor &) = delete;
+    KVListCursor &operator=(const KVListCursor &) = delete;
+
+    // false at the end of the namespace or when a LIST failed, see status()
+    bool next(KVKey *key);
+    // 0, the NVMe status of the failed LIST, or -1 for a malformed page
+    int status() const { return error; }
+    __u64 pages() const { return fetched; }
+
+private:
+    struct page {
+        std::vector<__u8> buf;
+        std::vector<KVKey> keys;
+        int status;
+    };
+
+    void fetch(page *p, const KVKey &from);
+    void request(const KVKey &from);
+    void worker();
+
+    std::shared_ptr<KVSession> session;
+    page front;
+    page back;
+    size_t pos;
+    KVKey resume;
+    bool resumed;
+    bool done;
+    int error;
+    __u64 fetched;
+
+    // prefetch state, guarded by lock
+    std::mutex lock;
+    std::condition_variable cond;
+    KVKey wanted;
+    bool requested;
+    bool ready;
+    bool stopping;
+    std::thread thread;
+};
+
+#endif
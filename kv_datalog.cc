@@ -0,0 +1,473 @@
+#include "kv_datalog.h"
+#include "kv_client.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+
+const size_t PAGE_SIZE = 4096;
+
+// crc of a record: the key and the value, then the header after the crc
+// field. The first part is taken before an append locks the log.
+static __u32 header_crc(const KVLogRecord *rec, __u32 payload_crc) {
+    return kv_crc32(&rec->magic, sizeof(*rec) - sizeof(rec->crc), payload_crc);
+}
+
+static __u32 record_crc(const KVLogRecord *rec) {
+    return header_crc(rec, kv_crc32(rec->key(), rec->key_size + rec->value_size));
+}
+
+static int write_all(int fd, const void *data, size_t size) {
+    const char *p = (const char *)data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static void sync_dir(const std::string &dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+std::unique_ptr<KVDataLog> KVDataLog::open(const std::string &path, size_t segment_size, bool sync) {
+    std::unique_ptr<KVDataLog> log(new KVDataLog(path, segment_size, sync));
+    if (!path.empty() && mkdir(path.c_str(), 0755) < 0 && errno != EEXIST) {
+        perror("Error creating the data log directory");
+        return NULL;
+    }
+    if (log->load() < 0) {
+        return NULL;
+    }
+    return log;
+}
+
+KVDataLog::KVDataLog(const std::string &path, size_t segment_size, bool sync)
+    : dir(path), sync_writes(sync), active(0), seq(0), table(nullptr) {
+    seg_size = (std::max<size_t>(segment_size, PAGE_SIZE) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+KVDataLog::~KVDataLog() {
+    flush();
+    for (auto &s : segs) {
+        munmap(s.second.base, s.second.size);
+    }
+    delete table.load();
+}
+
+void KVDataLog::free_table(void *p) {
+    delete (segment_table *)p;
+}
+
+// Swaps in a table of what is in segs now. With the lock held, or before
+// there are readers.
+void KVDataLog::publish() {
+    segment_table *t = new segment_table;
+    t->first = segs.empty() ? 0 : segs.begin()->first;
+    for (auto &s : segs) {
+        t->segs.resize(s.first - t->first + 1, NULL);
+        t->segs[s.first - t->first] = &s.second;
+    }
+    segment_table *old = table.exchange(t);
+    if (old) {
+        retired.retire(old, free_table);
+        retired.reclaim();
+    }
+}
+
+KVDataLog::segment *KVDataLog::find(__u32 id) const {
+    const segment_table *t = table.load(std::memory_order_acquire);
+    return id >= t->first && id - t->first < t->segs.size() ? t->segs[id - t->first] : NULL;
+}
+
+std::string KVDataLog::segment_path(__u32 id) const {
+    char name[32];
+    snprintf(name, sizeof(name), "/%08u.seg", id);
+    return dir + name;
+}
+
+// Maps the segments already in the directory; the newest one stays active
+int KVDataLog::load() {
+    if (persistent()) {
+        DIR *d = opendir(dir.c_str());
+        if (!d) {
+            perror("Error opening the data log directory");
+            return -1;
+        }
+        struct dirent *e;
+        while ((e = readdir(d)) != NULL) {
+            unsigned id;
+            char rest;
+            if (sscanf(e->d_name, "%u.se%c", &id, &rest) != 2 || rest != 'g') {
+                continue;
+            }
+            std::string file = segment_path(id);
+            int fd = ::open(file.c_str(), O_RDWR);
+            struct stat st;
+            if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+                continue;
+            }
+            void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (base == MAP_FAILED) {
+                perror("Error mapping a data log segment");
+                closedir(d);
+                return -1;
+            }
+            // its crcs would all fail, and recovery would drop every record
+            if ((size_t)st.st_size >= sizeof(KVLogRecord) &&
+                ((const KVLogRecord *)base)->magic == KV_LOG_RECORD_MAGIC_V1) {
+                fprintf(stderr, "Data log segment %s is in an older format\n", file.c_str());
+                munmap(base, st.st_size);
+                closedir(d);
+                return -1;
+            }
+            // nothing is appended to it until recover() found its end
+            segment &s = segs[id];
+            s.base = (char *)base;
+            s.size = st.st_size;
+            s.tail = st.st_size;
+            s.live.store(0);
+            s.sealed = true;
+            s.dropped = false;
+        }
+        closedir(d);
+    }
+    if (segs.empty()) {
+        return create(1);
+    }
+    active = segs.rbegin()->first;
+    segs[active].sealed = false;
+    publish();
+    return 0;
+}
+
+int KVDataLog::create(__u32 id) {
+    void *base;
+    if (persistent()) {
+        std::string file = segment_path(id);
+        int fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, seg_size) < 0) {
+            int err = -errno;
+            perror("Error creating a data log segment");
+            if (fd >= 0) {
+                close(fd);
+            }
+            return err;
+        }
+        base = mmap(NULL, seg_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        sync_dir(dir);
+    } else {
+        base = mmap(NULL, seg_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (base == MAP_FAILED) {
+        return -errno;
+    }
+    segment &s = segs[id];
+    s.base = (char *)base;
+    s.size = seg_size;
+    s.tail = 0;
+    s.live.store(0);
+    s.sealed = false;
+    s.dropped = false;
+    active = id;
+    publish();
+    return 0;
+}
+
+size_t KVDataLog::record_size(__u8 key_size, __u32 value_size) {
+    return (sizeof(KVLogRecord) + key_size + value_size + 7) & ~(size_t)7;
+}
+
+size_t KVDataLog::segments() {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t n = 0;
+    for (auto &s : segs) {
+        n += !s.second.dropped;
+    }
+    return n;
+}
+
+KVLogLocation KVDataLog::end(__u64 *last_seq) {
+    std::lock_guard<std::mutex> guard(lock);
+    KVLogLocation location;
+    location.segment = active;
+    location.offset = segs.at(active).tail;
+    if (last_seq) {
+        *last_seq = seq;
+    }
+    return location;
+}
+
+bool KVDataLog::valid(const segment &s, size_t offset, const KVLogRecord **rec, bool check_crc) const {
+    if (offset + sizeof(KVLogRecord) > s.size) {
+        return false;
+    }
+    const KVLogRecord *r = (const KVLogRecord *)(s.base + offset);
+    if (r->magic != KV_LOG_RECORD_MAGIC || (r->type != KV_LOG_PUT && r->type != KV_LOG_DELETE) ||
+        r->key_size == 0 || r->key_size > KV_MAX_KEY_SIZE ||
+        r->value_size > s.size || offset + record_size(r->key_size, r->value_size) > s.size) {
+        return false;
+    }
+    if (check_crc && r->crc != record_crc(r)) {
+        return false;
+    }
+    *rec = r;
+    return true;
+}
+
+void KVDataLog::recover(KVLogLocation from, __u64 from_seq,
+                        const std::function<void(const KVLogRecord *, KVLogLocation)> &fn) {
+    seq = from_seq;
+    for (auto it = segs.lower_bound(from.segment); it != segs.end(); ++it) {
+        segment &s = it->second;
+        size_t offset = it->first == from.segment ? from.offset : 0;
+        const KVLogRecord *rec;
+        while (valid(s, offset, &rec, true)) {
+            KVLogLocation location;
+            location.segment = it->first;
+            location.offset = offset;
+            fn(rec, location);
+            seq = std::max(seq, rec->seq);
+            offset += record_size(rec->key_size, rec->value_size);
+        }
+        s.tail = offset;
+    }
+    // a torn write may have left more behind it: appends must not run into
+    // bytes that could pass for records
+    segment &a = segs.at(active);
+    const KVLogRecord *junk;
+    if (a.tail < a.size && (valid(a, a.tail, &junk, false) || a.base[a.tail] != 0)) {
+        memset(a.base + a.tail, 0, a.size - a.tail);
+    }
+}
+
+int KVDataLog::append(__u8 type, const char *key, __u8 key_size, const void *value, __u32 value_size,
+                      KVLogLocation *location) {
+    size_t need = record_size(key_size, value_size);
+    if (need > seg_size) {
+        return -EFBIG;
+    }
+    __u32 crc = kv_crc32(key, key_size);
+    if (value_size) {
+        crc = kv_crc32(value, value_size, crc);
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    segment *s = &segs.at(active);
+    if (s->tail + need > s->size) {
+        s->sealed = true;
+        int ret = create(active + 1);
+        if (ret < 0) {
+            s->sealed = false;
+            return ret;
+        }
+        s = &segs.at(active);
+    }
+    KVLogRecord *rec = (KVLogRecord *)(s->base + s->tail);
+    rec->magic = KV_LOG_RECORD_MAGIC;
+    rec->seq = ++seq;
+    rec->value_size = value_size;
+    rec->type = type;
+    rec->key_size = key_size;
+    rec->reserved = 0;
+    memcpy((char *)rec->key(), key, key_size);
+    if (value_size) {
+        memcpy((char *)rec->value(), value, value_size);
+    }
+    rec->crc = header_crc(rec, crc);
+
+    location->segment = active;
+    location->offset = s->tail;
+    if (sync_writes && persistent()) {
+        uintptr_t start = (uintptr_t)rec & ~(PAGE_SIZE - 1);
+        msync((void *)start, (uintptr_t)rec + need - start, MS_SYNC);
+    }
+    s->tail += need;
+    return 0;
+}
+
+bool KVDataLog::contains(KVLogLocation location, __u8 key_size, __u32 value_size) const {
+    auto it = segs.find(location.segment);
+    return it != segs.end() && location.offset + record_size(key_size, value_size) <= it->second.tail;
+}
+
+const KVLogRecord *KVDataLog::record(KVLogLocation location) const {
+    return (const KVLogRecord *)(find(location.segment)->base + location.offset);
+}
+
+void KVDataLog::retain(KVLogLocation location, __u8 key_size, __u32 value_size) {
+    find(location.segment)->live.fetch_add(record_size(key_size, value_size), std::memory_order_relaxed);
+}
+
+void KVDataLog::release(KVLogLocation location, __u8 key_size, __u32 value_size) {
+    find(location.segment)->live.fetch_sub(record_size(key_size, value_size), std::memory_order_relaxed);
+}
+
+std::vector<__u32> KVDataLog::garbage(unsigned live_percent) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<__u32> ids;
+    for (auto &s : segs) {
+        if (s.second.sealed && !s.second.dropped && s.second.live * 100 < live_percent * s.second.size) {
+            ids.push_back(s.first);
+        }
+    }
+    return ids;
+}
+
+size_t KVDataLog::scan(__u32 segment, size_t offset, size_t max_bytes,
+                       const std::function<void(const KVLogRecord *, KVLogLocation)> &fn) {
+    // a sealed segment does not change, and only drop() removes it
+    std::unique_lock<std::mutex> guard(lock);
+    const struct segment &s = segs.at(segment);
+    guard.unlock();
+    size_t stop = std::min(s.tail, offset + max_bytes);
+    const KVLogRecord *rec;
+    // our own records, already checked when they were written or recovered
+    while (offset < stop && valid(s, offset, &rec, false)) {
+        KVLogLocation location;
+        location.segment = segment;
+        location.offset = offset;
+        fn(rec, location);
+        offset += record_size(rec->key_size, rec->value_size);
+    }
+    return offset < s.tail && valid(s, offset, &rec, false) ? offset : 0;
+}
+
+void KVDataLog::drop(__u32 segment) {
+    std::unique_lock<std::mutex> guard(lock);
+    auto it = segs.find(segment);
+    if (it == segs.end() || it->second.dropped || segment == active) {
+        return;
+    }
+    it->second.dropped = true;
+    guard.unlock();
+    // readers that looked a key up before it was moved out may still go
+    // through the table to the segment; the ones after cannot
+    kv_epoch_synchronize();
+    guard.lock();
+    char *base = it->second.base;
+    size_t size = it->second.size;
+    segs.erase(it);
+    publish();
+    guard.unlock();
+    munmap(base, size);
+    if (persistent()) {
+        unlink(segment_path(segment).c_str());
+    }
+}
+
+void KVDataLog::flush() {
+    if (!persistent()) {
+        return;
+    }
+    std::vector<std::pair<char *, size_t> > maps;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto &s : segs) {
+            maps.push_back(std::make_pair(s.second.base, s.second.size));
+        }
+    }
+    // a segment dropped meanwhile just makes msync() fail
+    for (auto &m : maps) {
+        msync(m.first, m.second, MS_SYNC);
+    }
+}
+
+int KVDataLog::write_index(const std::vector<KVLogIndexEntry> &entries, KVLogLocation covered, __u64 snapshot_seq) {
+    if (!persistent()) {
+        return 0;
+    }
+    flush();
+    KVLogIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = KV_LOG_INDEX_MAGIC;
+    header.version = KV_LOG_INDEX_VERSION;
+    header.count = entries.size();
+    header.seq = snapshot_seq;
+    header.covered = covered;
+    header.crc = kv_crc32(entries.data(), entries.size() * sizeof(KVLogIndexEntry));
+    header.header_crc = kv_crc32(&header, offsetof(KVLogIndexHeader, header_crc));
+
+    std::string tmp = dir + "/index.tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+    int ret = write_all(fd, &header, sizeof(header));
+    if (ret == 0) {
+        ret = write_all(fd, entries.data(), entries.size() * sizeof(KVLogIndexEntry));
+    }
+    if (ret == 0 && fsync(fd) < 0) {
+        ret = -errno;
+    }
+    close(fd);
+    if (ret == 0 && rename(tmp.c_str(), (dir + "/index").c_str()) < 0) {
+        ret = -errno;
+    }
+    if (ret < 0) {
+        unlink(tmp.c_str());
+        return ret;
+    }
+    sync_dir(dir);
+    return 0;
+}
+
+int KVDataLog::read_index(std::vector<KVLogIndexEntry> *entries, KVLogLocation *covered, __u64 *snapshot_seq) const {
+    if (!persistent()) {
+        return -1;
+    }
+    int fd = ::open((dir + "/index").c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    KVLogIndexHeader header;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && read(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+              header.magic == KV_LOG_INDEX_MAGIC && header.version == KV_LOG_INDEX_VERSION &&
+              header.header_crc == kv_crc32(&header, offsetof(KVLogIndexHeader, header_crc)) &&
+              (size_t)st.st_size == sizeof(header) + header.count * sizeof(KVLogIndexEntry);
+    if (ok) {
+        entries->resize(header.count);
+        size_t size = header.count * sizeof(KVLogIndexEntry);
+        char *p = (char *)entries->data();
+        while (size > 0) {
+            ssize_t n = read(fd, p, size);
+            if (n <= 0) {
+                ok = false;
+                break;
+            }
+            p += n;
+            size -= n;
+        }
+    }
+    close(fd);
+    if (!ok || header.crc != kv_crc32(entries->data(), entries->size() * sizeof(KVLogIndexEntry))) {
+        entries->clear();
+        return -1;
+    }
+    *covered = header.covered;
+    *snapshot_seq = header.seq;
+    return 0;
+}
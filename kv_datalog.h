@@ -0,0 +1,167 @@
+#ifndef KV_DATALOG_H
+#define KV_DATALOG_H
+
+#include "kv_epoch.h"
+#include <linux/types.h>
+#include <stddef.h>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+const __u32 KV_LOG_RECORD_MAGIC = 0x3252564b;     //"KVR2"
+const __u32 KV_LOG_RECORD_MAGIC_V1 = 0x4352564b;  //"KVRC": crc over the header first, not read any more
+const __u32 KV_LOG_INDEX_MAGIC = 0x5849564b;      //"KVIX"
+const __u32 KV_LOG_INDEX_VERSION = 1;
+
+typedef enum {
+    KV_LOG_PUT = 1,
+    KV_LOG_DELETE = 2,
+} kv_log_record_e;
+
+// One record in a segment, 8 byte aligned: this header, the key, the value.
+// crc covers the key and the value, then the rest of this header, so a torn
+// write never passes for data.
+struct KVLogRecord {
+    __u32 crc;
+    __u32 magic;
+    __u64 seq;
+    __u32 value_size;
+    __u8 type;
+    __u8 key_size;
+    __u16 reserved;
+
+    const char *key() const { return (const char *)(this + 1); }
+    const char *value() const { return key() + key_size; }
+};
+
+static_assert(sizeof(KVLogRecord) == 24, "record header layout");
+
+struct KVLogLocation {
+    __u32 segment;
+    __u32 offset;
+};
+
+inline bool operator==(const KVLogLocation &a, const KVLogLocation &b) {
+    return a.segment == b.segment && a.offset == b.offset;
+}
+
+// A key of the index snapshot, 32 bytes in the file
+struct KVLogIndexEntry {
+    __u8 key[16];
+    __u8 key_size;
+    __u8 reserved[3];
+    KVLogLocation location;
+    __u32 value_size;
+};
+
+static_assert(sizeof(KVLogIndexEntry) == 32, "index entry layout");
+
+struct KVLogIndexHeader {
+    __u32 magic;
+    __u32 version;
+    __u64 count;
+    __u64 seq;                              //last record the snapshot has seen
+    KVLogLocation covered;                  //replay starts here
+    __u32 crc;                              //of the entries
+    __u32 header_crc;                       //of everything above
+};
+
+// Log-structured value store: records are appended to fixed-size segments
+// that are mmapped in full. With a directory every segment is a file there
+// ("<id>.seg") next to the index snapshot ("index"); without one they are
+// anonymous memory. Appends are serialized by a lock of the log, held while
+// the record is copied in. record(), retain() and release() take no lock;
+// callers hold a KVEpochGuard so a segment is not unmapped under them.
+// recover() runs before anything else, and drop(), flush() and
+// write_index() only from one thread at a time.
+class KVDataLog {
+public:
+    static std::unique_ptr<KVDataLog> open(const std::string &path, size_t segment_size, bool sync);
+    ~KVDataLog();
+
+    KVDataLog(const KVDataLog &) = delete;
+    KVDataLog &operator=(const KVDataLog &) = delete;
+
+    bool persistent() const { return !dir.empty(); }
+    size_t segment_size() const { return seg_size; }
+    size_t segments();
+    // Where the next record goes and the seq of the last one
+    KVLogLocation end(__u64 *last_seq = NULL);
+
+    // Replays the valid records from `from` to the end of the log, in
+    // order, and appends after the last one. Call once, after open().
+    void recover(KVLogLocation from, __u64 from_seq,
+                 const std::function<void(const KVLogRecord *, KVLogLocation)> &fn);
+
+    // Appends a record, starting a new segment when the active one is full.
+    // Returns 0 or -errno.
+    int append(__u8 type, const char *key, __u8 key_size, const void *value, __u32 value_size,
+               KVLogLocation *location);
+    const KVLogRecord *record(KVLogLocation location) const;
+    // Whether a record of that size can be at location, for loaded snapshots
+    bool contains(KVLogLocation location, __u8 key_size, __u32 value_size) const;
+    static size_t record_size(__u8 key_size, __u32 value_size);
+
+    // Live bytes per segment, kept by the owner: a record is retained while
+    // the index points at it and released when it is overwritten or deleted
+    void retain(KVLogLocation location, __u8 key_size, __u32 value_size);
+    void release(KVLogLocation location, __u8 key_size, __u32 value_size);
+    // Sealed segments where less than live_percent of the bytes are live
+    std::vector<__u32> garbage(unsigned live_percent);
+    // The valid records of a sealed segment from offset on, up to about
+    // max_bytes of them. Returns where to carry on, 0 at the end.
+    size_t scan(__u32 segment, size_t offset, size_t max_bytes,
+                const std::function<void(const KVLogRecord *, KVLogLocation)> &fn);
+    // Unmaps a sealed segment, once no reader is left, and deletes its file.
+    // Not with a KVEpochGuard held.
+    void drop(__u32 segment);
+
+    // Writes the snapshot atomically: temp file, fsync, rename. flush()
+    // first, so the records it points at are durable. Returns 0 or -errno.
+    int write_index(const std::vector<KVLogIndexEntry> &entries, KVLogLocation covered, __u64 snapshot_seq);
+    // 0, or -1 when there is no valid snapshot
+    int read_index(std::vector<KVLogIndexEntry> *entries, KVLogLocation *covered, __u64 *snapshot_seq) const;
+    // msync() of every segment
+    void flush();
+
+private:
+    struct segment {
+        char *base;
+        size_t size;
+        size_t tail;                        //bytes written
+        std::atomic<size_t> live;
+        bool sealed;
+        bool dropped;                       //readable until its readers are gone
+    };
+
+    // The segments by id for the lookups without the lock, replaced whole
+    struct segment_table {
+        __u32 first;
+        std::vector<segment *> segs;        //NULL where one was dropped
+    };
+
+    KVDataLog(const std::string &path, size_t segment_size, bool sync);
+    int load();
+    int create(__u32 id);
+    std::string segment_path(__u32 id) const;
+    bool valid(const segment &s, size_t offset, const KVLogRecord **rec, bool check_crc) const;
+    segment *find(__u32 id) const;
+    void publish();
+    static void free_table(void *p);
+
+    std::string dir;
+    size_t seg_size;
+    bool sync_writes;
+    std::mutex lock;                        //everything below
+    std::map<__u32, segment> segs;
+    __u32 active;
+    __u64 seq;
+    std::atomic<segment_table *> table;
+    KVRetireList retired;
+};
+
+#endif
@@ -0,0 +1,71 @@
+#include "kv_client.h"
+#include "kv_shm.h"
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Serves one backend, the emulator by default, to every process that opens
+// "shm:<socket>": the test binaries and a service can then share one
+// stand-in device. Runs until SIGINT or SIGTERM; stopping it snapshots a
+// persistent emulator the way a clean exit of any process would.
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-s socket] [spec]\n"
+            "  -s    socket to listen on (default %s)\n"
+            "  spec  backend to serve: an emulator spec (default emu) or a device path\n",
+            prog, KV_SHM_DEFAULT_SOCKET);
+}
+
+int main(int argc, char **argv) {
+    const char *socket_path = KV_SHM_DEFAULT_SOCKET;
+    const char *spec = "emu";
+    int opt;
+    while ((opt = getopt(argc, argv, "s:h")) != -1) {
+        switch (opt) {
+        case 's': socket_path = optarg; break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind < argc - 1) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (optind == argc - 1) {
+        spec = argv[optind];
+    }
+    if (kv_is_shm_spec(spec)) {
+        fprintf(stderr, "Serving another server's connection is not supported: %s\n", spec);
+        return 2;
+    }
+
+    // blocked before any thread starts, so only sigwait() takes them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    std::shared_ptr<KVBackend> backend = kv_open_backend(spec);
+    if (!backend) {
+        fprintf(stderr, "Could NOT open the KV device %s\n", spec);
+        return 2;
+    }
+    std::unique_ptr<KVShmServer> server = KVShmServer::start(socket_path, backend);
+    if (!server) {
+        return 2;
+    }
+    printf("Serving %s on %s\n", spec, socket_path);
+    fflush(stdout);
+
+    int sig;
+    sigwait(&signals, &sig);
+    __u64 executed = server->executed();
+    server.reset();
+    printf("Stopped by %s after %llu commands\n", strsignal(sig), (unsigned long long)executed);
+    return 0;
+}
@@ -0,0 +1,608 @@
+#include "kv_emulator.h"
+#include "kv_histogram.h"
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+int kv_parse_emulator_spec(const char *spec, KVEmulatorConfig *config) {
+    const char *p = strchr(spec, ',');
+    while (p) {
+        p++;
+        const char *end = strchr(p, ',');
+        std::string option(p, end ? end - p : strlen(p));
+        size_t eq = option.find('=');
+        if (eq == std::string::npos) {
+            return -1;
+        }
+        std::string name = option.substr(0, eq);
+        const char *value = option.c_str() + eq + 1;
+        if (name == "path") {
+            config->path = value;
+            p = end;
+            continue;
+        }
+        if (name == "timing") {
+            config->timing = value;
+            p = end;
+            continue;
+        }
+        char *last;
+        unsigned long long n = strtoull(value, &last, 0);
+        if (name == "capacity" && *last == '\0') {
+            config->capacity = n;
+        } else if (name == "max_value_size" && *last == '\0') {
+            config->max_value_size = n;
+        } else if (name == "segment_size" && *last == '\0') {
+            config->segment_size = n;
+        } else if (name == "sync" && *last == '\0') {
+            config->sync = n != 0;
+        } else if (name == "compact_live_percent" && *last == '\0' && n <= 100) {
+            config->compact_live_percent = n;
+        } else {
+            return -1;
+        }
+        p = end;
+    }
+    return 0;
+}
+
+static std::string unpack_key(const struct nvme_passthru_cmd *cmd) {
+    __u32 dw[4] = {cmd->cdw2, cmd->cdw3, cmd->cdw14, cmd->cdw15};
+    char bytes[KV_MAX_KEY_SIZE];
+    for (int i = 0; i < 16; i++) {
+        bytes[i] = (dw[i / 4] >> (8 * (i % 4))) & 0xff;
+    }
+    return std::string(bytes, cmd->cdw11 & 0xff);
+}
+
+// List order: byte by byte, a prefix before the longer keys
+static bool key_order(const KVLogIndexEntry &a, const KVLogIndexEntry &b) {
+    int r = memcmp(a.key, b.key, std::min(a.key_size, b.key_size));
+    return r != 0 ? r < 0 : a.key_size < b.key_size;
+}
+
+// Puts snapshot entries in List order. Sorting on the first 8 key bytes as
+// a number is much quicker than comparing whole entries; only ties need
+// key_order().
+static void sort_entries(std::vector<KVLogIndexEntry> *entries) {
+    std::vector<std::pair<__u64, __u32> > order(entries->size());
+    for (size_t i = 0; i < entries->size(); i++) {
+        __u64 prefix;
+        memcpy(&prefix, (*entries)[i].key, sizeof(prefix));
+        order[i] = std::make_pair(be64toh(prefix), (__u32)i);
+    }
+    std::sort(order.begin(), order.end());
+    std::vector<KVLogIndexEntry> sorted(entries->size());
+    for (size_t i = 0; i < order.size(); i++) {
+        sorted[i] = (*entries)[order[i].second];
+    }
+    for (size_t i = 0; i < order.size();) {
+        size_t j = i + 1;
+        while (j < order.size() && order[j].first == order[i].first) {
+            j++;
+        }
+        if (j - i > 1) {
+            std::sort(sorted.begin() + i, sorted.begin() + j, key_order);
+        }
+        i = j;
+    }
+    entries->swap(sorted);
+}
+
+KVEmulator::KVEmulator(const KVEmulatorConfig &config)
+    : config(config), used(0), sealed(false), order_due(false), stopping(false) {
+    if (!config.timing.empty()) {
+        KVTimingProfile profile;
+        if (kv_load_timing_profile(config.timing.c_str(), &profile) < 0) {
+            fprintf(stderr, "Could NOT load the emulator timing profile %s\n", config.timing.c_str());
+            return;
+        }
+        timing.reset(new KVTimingModel(profile));
+    }
+    // the biggest record has to fit in a segment
+    __u32 max_value = std::min<size_t>(config.max_value_size, 1u << 30);
+    size_t segment_size = std::max(config.segment_size, KVDataLog::record_size(KV_MAX_KEY_SIZE, max_value));
+    log = KVDataLog::open(config.path, segment_size, config.sync);
+    if (!log) {
+        fprintf(stderr, "Could NOT open the emulator data log %s\n", config.path.c_str());
+        return;
+    }
+    recover();
+    thread = std::thread(&KVEmulator::maintain, this);
+}
+
+KVEmulator::~KVEmulator() {
+    {
+        std::lock_guard<std::mutex> guard(wake_lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    if (thread.joinable()) {
+        thread.join();
+    }
+    // the next start loads this instead of replaying the log
+    if (log) {
+        snapshot();
+    }
+}
+
+// The index snapshot, if there is one, then every record written after it
+void KVEmulator::recover() {
+    std::vector<KVLogIndexEntry> entries;
+    KVLogLocation from = {0, 0};
+    __u64 seq = 0;
+    if (log->read_index(&entries, &from, &seq) == 0) {
+        for (const KVLogIndexEntry &e : entries) {
+            if (!log->contains(e.location, e.key_size, e.value_size)) {
+                // points at a segment that is gone: trust the log alone
+                entries.clear();
+                from.segment = 0;
+                from.offset = 0;
+                seq = 0;
+                break;
+            }
+        }
+    }
+    // snapshots are written in key order, which makes the tree a bulk load
+    auto less = [](const KVLogIndexEntry *a, const KVLogIndexEntry *b) { return key_order(*a, *b); };
+    std::vector<const KVLogIndexEntry *> sorted(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        sorted[i] = &entries[i];
+    }
+    if (!std::is_sorted(sorted.begin(), sorted.end(), less)) {
+        std::sort(sorted.begin(), sorted.end(), less);
+    }
+    std::vector<std::pair<const char *, size_t> > ordered(sorted.size());
+    for (size_t i = 0; i < sorted.size(); i++) {
+        ordered[i] = std::make_pair((const char *)sorted[i]->key, (size_t)sorted[i]->key_size);
+    }
+    order.assign(ordered);
+
+    keys.reserve(entries.size());
+    for (const KVLogIndexEntry &e : entries) {
+        KVIndexValue v;
+        v.location = e.location;
+        v.value_size = e.value_size;
+        keys.lock((const char *)e.key, e.key_size).set(v);
+        log->retain(e.location, e.key_size, e.value_size);
+        used += e.key_size + e.value_size;
+    }
+    log->recover(from, seq, [this](const KVLogRecord *rec, KVLogLocation location) {
+        KVHashIndex::Locked k = keys.lock(rec->key(), rec->key_size);
+        if (k.get()) {
+            log->release(k.get()->location, rec->key_size, k.get()->value_size);
+            used -= rec->key_size + k.get()->value_size;
+            k.erase();
+            if (rec->type == KV_LOG_DELETE) {
+                order.erase(rec->key(), rec->key_size);
+            }
+        } else if (rec->type == KV_LOG_PUT) {
+            order.insert(rec->key(), rec->key_size);
+        }
+        if (rec->type == KV_LOG_PUT) {
+            KVIndexValue v;
+            v.location = location;
+            v.value_size = rec->value_size;
+            k.set(v);
+            log->retain(location, rec->key_size, rec->value_size);
+            used += rec->key_size + rec->value_size;
+        }
+    });
+}
+
+int KVEmulator::submit(struct nvme_passthru_cmd *cmd, __u32 *result) {
+    if (!log) {
+        errno = EIO;
+        return -1;
+    }
+    __u64 arrival = timing ? kv_now_ns() : 0;
+    int ret = execute(cmd);
+    if (result) {
+        *result = cmd->result;
+    }
+    if (timing) {
+        KVTimingModel::wait_until(completion(cmd, ret, arrival));
+    }
+    return ret;
+}
+
+// The commands of a batch reach the modeled device together, the way a
+// queue of them reaches a real one: the dies work through them side by
+// side and the batch returns with the last of them
+void KVEmulator::submit_batch(struct nvme_passthru_cmd *cmds, size_t n, int *status) {
+    if (!timing || !log) {
+        KVBackend::submit_batch(cmds, n, status);
+        return;
+    }
+    __u64 arrival = kv_now_ns();
+    __u64 last = arrival;
+    std::vector<__u64> done(n);
+    for (size_t i = 0; i < n; i++) {
+        status[i] = execute(&cmds[i]);
+        done[i] = completion(&cmds[i], status[i], arrival);
+        last = std::max(last, done[i]);
+    }
+    KVTimingModel::wait_until(last);
+    for (size_t i = 0; i < n; i++) {
+        kv_latency_record(cmds[i].opcode, status[i], done[i] - arrival);
+    }
+}
+
+// Runs the command at once; cmd->result gets dw0
+int KVEmulator::execute(struct nvme_passthru_cmd *cmd) {
+    __u32 dw0 = 0;
+    int ret;
+    __u32 key_size = cmd->cdw11 & 0xff;
+
+    if (cmd->nsid != 1) {
+        ret = KV_ERR_INVALID_NAMESPACE;
+    } else if (cmd->opcode != KV_OPC_STORE && cmd->opcode != KV_OPC_RETRIEVE &&
+               cmd->opcode != KV_OPC_LIST && cmd->opcode != KV_OPC_DELETE &&
+               cmd->opcode != KV_OPC_EXISTS) {
+        ret = KV_ERR_INVALID_OPCODE;
+    } else if (key_size == 0 || key_size > KV_MAX_KEY_SIZE) {
+        ret = KV_ERR_INVALID_KEY_SIZE;
+    } else {
+        // the index nodes and log segments we look at stay until we are done
+        KVEpochGuard pin;
+        std::string key = unpack_key(cmd);
+        switch (cmd->opcode) {
+        case KV_OPC_STORE:
+            ret = store(key, cmd);
+            break;
+        case KV_OPC_RETRIEVE:
+            ret = retrieve(key, cmd, &dw0);
+            break;
+        case KV_OPC_LIST:
+            ret = list(key, cmd, &dw0);
+            break;
+        case KV_OPC_DELETE:
+            ret = remove(key);
+            break;
+        default:
+            ret = exists(key);
+            break;
+        }
+    }
+    cmd->result = dw0;
+    return ret;
+}
+
+// When the modeled device completes a command that arrived at arrival
+__u64 KVEmulator::completion(const struct nvme_passthru_cmd *cmd, int ret, __u64 arrival) {
+    // what crossed the link: the value sent, or the part of it returned
+    size_t bytes = 0;
+    if (cmd->opcode == KV_OPC_STORE) {
+        bytes = cmd->data_len;
+    } else if (ret == 0 && cmd->opcode == KV_OPC_RETRIEVE) {
+        bytes = std::min<size_t>(cmd->data_len, cmd->result);
+    } else if (ret == 0 && cmd->opcode == KV_OPC_LIST) {
+        bytes = cmd->data_len;
+    }
+    __u32 key_size = cmd->cdw11 & 0xff;
+    std::string key = key_size <= KV_MAX_KEY_SIZE ? unpack_key(cmd) : std::string();
+    return timing->schedule(cmd->opcode, key.data(), key.size(), bytes, arrival);
+}
+
+int KVEmulator::store(const std::string &key, const struct nvme_passthru_cmd *cmd) {
+    __u32 size = cmd->cdw10;
+    if (size > config.max_value_size) {
+        return KV_ERR_CAPACITY_EXCEEDED;
+    }
+    // the value is cdw10 bytes; whatever the transfer does not cover is zero
+    const char *value = (const char *)(uintptr_t)cmd->addr;
+    std::string padded;
+    if (!cmd->addr || cmd->data_len < size) {
+        padded.assign(size, '\0');
+        if (cmd->addr) {
+            memcpy(&padded[0], value, cmd->data_len);
+        }
+        value = padded.data();
+    }
+
+    // the checks and the change are one step for this key
+    KVHashIndex::Locked k = keys.lock(key.data(), key.size());
+    const KVIndexValue *old = k.get();
+    if ((cmd->cdw11 & KV_STORE_MUST_NOT_EXIST) && old) {
+        return KV_ERR_INVALID_REQUEST;
+    }
+    if ((cmd->cdw11 & KV_STORE_MUST_EXIST) && !old) {
+        return KV_ERR_KEY_NOT_EXIST;
+    }
+    size_t old_size = old ? key.size() + old->value_size : 0;
+    if (!charge(old_size, key.size() + size)) {
+        return KV_ERR_CAPACITY_EXCEEDED;
+    }
+    KVIndexValue v;
+    v.value_size = size;
+    if (log->append(KV_LOG_PUT, key.data(), key.size(), value, size, &v.location) < 0) {
+        used.fetch_add(old_size - (key.size() + size));
+        return KV_ERR_CAPACITY_EXCEEDED;
+    }
+    log->retain(v.location, key.size(), size);
+    if (old) {
+        log->release(old->location, key.size(), old->value_size);
+    }
+    k.set(v);
+    if (!old) {
+        queue_order(key, true);
+    }
+    if (v.location.offset == 0) {
+        // a new segment: the one before is sealed
+        std::lock_guard<std::mutex> w(wake_lock);
+        sealed = true;
+        wake.notify_one();
+    }
+    return KV_SUCCESS;
+}
+
+// Accounts for a key going from old_size to new_size bytes, unless that
+// overflows the namespace
+bool KVEmulator::charge(size_t old_size, size_t new_size) {
+    size_t u = used.load();
+    do {
+        if (u - old_size + new_size > config.capacity) {
+            return false;
+        }
+    } while (!used.compare_exchange_weak(u, u - old_size + new_size));
+    return true;
+}
+
+int KVEmulator::retrieve(const std::string &key, const struct nvme_passthru_cmd *cmd, __u32 *result) {
+    if (cmd->cdw10 == 0) {
+        return KV_ERR_INVALID_REQUEST;
+    }
+    // no lock: a record is never changed once written, so this reads the
+    // value the key had when it was looked up
+    KVIndexValue v;
+    if (!keys.find(key.data(), key.size(), &v)) {
+        return KV_ERR_KEY_NOT_EXIST;
+    }
+    // partial reads are fine, dw0 always carries the full value size
+    if (cmd->addr) {
+        size_t n = std::min<size_t>(std::min(cmd->cdw10, cmd->data_len), v.value_size);
+        memcpy((void *)(uintptr_t)cmd->addr, log->record(v.location)->value(), n);
+    }
+    *result = v.value_size;
+    return KV_SUCCESS;
+}
+
+int KVEmulator::exists(const std::string &key) {
+    KVIndexValue v;
+    return keys.find(key.data(), key.size(), &v) ? KV_SUCCESS : KV_ERR_KEY_NOT_EXIST;
+}
+
+int KVEmulator::remove(const std::string &key) {
+    KVHashIndex::Locked k = keys.lock(key.data(), key.size());
+    const KVIndexValue *old = k.get();
+    if (!old) {
+        return KV_ERR_KEY_NOT_EXIST;
+    }
+    // only a replay needs to know, and only the persistent log is replayed
+    KVLogLocation tombstone;
+    if (log->persistent() && log->append(KV_LOG_DELETE, key.data(), key.size(), NULL, 0, &tombstone) < 0) {
+        return KV_ERR_CAPACITY_EXCEEDED;
+    }
+    log->release(old->location, key.size(), old->value_size);
+    used -= key.size() + old->value_size;
+    k.erase();
+    queue_order(key, false);
+    return KV_SUCCESS;
+}
+
+// Called with the key's stripe locked, so its changes queue up in the order
+// they were made. A full queue goes to the maintenance thread, unless that
+// one falls far behind.
+void KVEmulator::queue_order(const std::string &key, bool insert) {
+    __u32 h = 2166136261u;
+    for (char c : key) {
+        h = (h ^ (__u8)c) * 16777619u;
+    }
+    order_queue &q = order_queues[h % ORDER_QUEUES];
+    order_change c;
+    c.insert = insert;
+    c.size = key.size();
+    memcpy(c.key, key.data(), key.size());
+    size_t queued;
+    {
+        std::lock_guard<std::mutex> guard(q.lock);
+        q.changes.push_back(c);
+        queued = q.changes.size();
+    }
+    if (queued == ORDER_QUEUE_LIMIT) {
+        std::lock_guard<std::mutex> w(wake_lock);
+        order_due = true;
+        wake.notify_one();
+    } else if (queued >= ORDER_QUEUE_MAX) {
+        std::lock_guard<std::shared_timed_mutex> guard(order_lock);
+        apply_order(q);
+    }
+}
+
+// With order_lock held exclusively: a queue is taken over whole, so two
+// batches of it can not reach the tree out of order
+void KVEmulator::apply_order(order_queue &q) {
+    std::vector<order_change> changes;
+    {
+        std::lock_guard<std::mutex> guard(q.lock);
+        changes.swap(q.changes);
+    }
+    for (const order_change &c : changes) {
+        if (c.insert) {
+            order.insert(c.key, c.size);
+        } else {
+            order.erase(c.key, c.size);
+        }
+    }
+}
+
+// List buffer: a 32 bit key count followed by one entry per key, a 16 bit
+// key size and the key bytes, each entry padded to 4 bytes
+int KVEmulator::list(const std::string &start, const struct nvme_passthru_cmd *cmd, __u32 *result) {
+    if (cmd->cdw10 == 0) {
+        return KV_ERR_INVALID_REQUEST;
+    }
+    std::vector<__u8> out(cmd->cdw10, 0);
+    size_t pos = 4;
+    __u32 count = 0;
+    // whatever was stored or removed before this List is in the tree
+    apply_all_order();
+    {
+        std::shared_lock<std::shared_timed_mutex> guard(order_lock);
+        order.scan(start.data(), start.size(), [&](const char *key, size_t size) {
+            size_t entry = (2 + size + 3) & ~(size_t)3;
+            if (pos + entry > out.size()) {
+                return false;
+            }
+            out[pos] = size & 0xff;
+            out[pos + 1] = size >> 8;
+            memcpy(&out[pos + 2], key, size);
+            pos += entry;
+            count++;
+            return true;
+        });
+    }
+    if (out.size() >= 4) {
+        memcpy(&out[0], &count, 4);
+    }
+    if (cmd->addr) {
+        memcpy((void *)(uintptr_t)cmd->addr, out.data(), std::min<size_t>(out.size(), cmd->data_len));
+    }
+    *result = count;
+    return KV_SUCCESS;
+}
+
+void KVEmulator::apply_all_order() {
+    std::lock_guard<std::shared_timed_mutex> guard(order_lock);
+    for (order_queue &q : order_queues) {
+        apply_order(q);
+    }
+}
+
+size_t KVEmulator::key_count() {
+    return keys.size();
+}
+
+size_t KVEmulator::used_bytes() {
+    return used.load();
+}
+
+size_t KVEmulator::segments() {
+    return log ? log->segments() : 0;
+}
+
+int KVEmulator::snapshot() {
+    std::lock_guard<std::mutex> serial(maintenance);
+    return write_snapshot();
+}
+
+int KVEmulator::write_snapshot() {
+    if (!log->persistent()) {
+        return 0;
+    }
+    // A record before covered was appended with its key's stripe locked, so
+    // the walk sees what it did; the ones after are replayed on top
+    __u64 seq;
+    KVLogLocation covered = log->end(&seq);
+    std::vector<KVLogIndexEntry> entries;
+    entries.reserve(keys.size());
+    keys.for_each([&](const char *key, size_t size, const KVIndexValue &v) {
+        KVLogIndexEntry e;
+        memset(&e, 0, sizeof(e));
+        memcpy(e.key, key, size);
+        e.key_size = size;
+        e.location = v.location;
+        e.value_size = v.value_size;
+        entries.push_back(e);
+    });
+    // in key order, so loading it builds the List tree in one pass
+    sort_entries(&entries);
+    return log->write_index(entries, covered, seq);
+}
+
+// Moves the live records of a sealed segment to the end of the log, locking
+// one key at a time
+bool KVEmulator::relocate(__u32 segment) {
+    bool moved_all = true;
+    size_t offset = 0;
+    do {
+        KVEpochGuard pin;
+        offset = log->scan(segment, offset, 1 << 20, [&](const KVLogRecord *rec, KVLogLocation location) {
+            if (rec->type != KV_LOG_PUT) {
+                return;
+            }
+            KVHashIndex::Locked k = keys.lock(rec->key(), rec->key_size);
+            if (!k.get() || !(k.get()->location == location)) {
+                return;                     //overwritten or deleted since
+            }
+            KVIndexValue v = *k.get();
+            if (log->append(KV_LOG_PUT, rec->key(), rec->key_size, rec->value(), rec->value_size, &v.location) < 0) {
+                moved_all = false;
+                return;
+            }
+            log->retain(v.location, rec->key_size, rec->value_size);
+            log->release(location, rec->key_size, rec->value_size);
+            k.set(v);
+        });
+    } while (offset != 0);
+    return moved_all;
+}
+
+int KVEmulator::compact() {
+    if (!log) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> serial(maintenance);
+    std::vector<__u32> victims = log->garbage(config.compact_live_percent);
+    std::vector<__u32> emptied;
+    for (__u32 id : victims) {
+        if (relocate(id)) {
+            emptied.push_back(id);
+        }
+    }
+    if (emptied.empty()) {
+        return 0;
+    }
+    // a segment goes once the index on disk no longer points into it; the
+    // deletes it holds are covered by the snapshot too
+    if (write_snapshot() < 0) {
+        return -1;
+    }
+    for (__u32 id : emptied) {
+        log->drop(id);
+    }
+    return emptied.size();
+}
+
+void KVEmulator::maintain() {
+    std::unique_lock<std::mutex> guard(wake_lock);
+    while (!stopping) {
+        wake.wait_for(guard, std::chrono::seconds(1), [this] { return stopping || sealed || order_due; });
+        if (stopping) {
+            break;
+        }
+        bool snap = sealed;
+        bool order_full = order_due;
+        sealed = false;
+        order_due = false;
+        guard.unlock();
+        if (order_full) {
+            apply_all_order();
+        }
+        // a full order queue alone is no reason to look for dead segments;
+        // a compaction that dropped something has written a snapshot already
+        if (snap || !order_full) {
+            if (compact() <= 0 && snap) {
+                snapshot();
+            }
+            keys.reclaim();
+        }
+        guard.lock();
+    }
+}
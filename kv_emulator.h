@@ -0,0 +1,120 @@
+#ifndef KV_EMULATOR_H
+#define KV_EMULATOR_H
+
+#include "kv_backend.h"
+#include "kv_client.h"
+#include "kv_datalog.h"
+#include "kv_index.h"
+#include "kv_timing.h"
+#include <stddef.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+
+// NVMe generic status for an opcode the emulator does not know
+const int KV_ERR_INVALID_OPCODE = 0x01;
+const int KV_ERR_INVALID_NAMESPACE = 0x0b;
+
+struct KVEmulatorConfig {
+    size_t capacity = 1ul << 30;            //bytes of keys and values
+    size_t max_value_size = KV_MAX_VALUE_SIZE;
+    std::string path;                       //data log directory, empty keeps it in memory
+    size_t segment_size = 64ul << 20;
+    bool sync = false;                      //msync every record before completing
+    unsigned compact_live_percent = 50;     //segments less live than this are compacted
+    std::string timing;                     //timing profile, see kv_load_timing_profile(); empty for none
+};
+
+// "emu,capacity=<bytes>,max_value_size=<bytes>,path=<dir>,segment_size=<bytes>,
+// sync=<0|1>,compact_live_percent=<n>,timing=<file>"
+int kv_parse_emulator_spec(const char *spec, KVEmulatorConfig *config);
+
+// Software KV namespace (nsid 1) with the status semantics the test suites
+// check on the real device. Values live in a KVDataLog, their locations in a
+// KVHashIndex: Retrieve and Exists take no lock, and commands that change a
+// key lock only its stripe, so threads driving different keys do not wait
+// for each other beyond the log append. A KVKeyTree keeps the keys in order,
+// so a List page is a seek and a walk instead of a sort; writers do not
+// touch it, they queue the keys they add or remove, and the maintenance
+// thread applies the queues as they fill up, List before it walks. With a
+// path the namespace survives restarts: the index snapshot is loaded and
+// only the log written after it is replayed. A maintenance thread snapshots
+// the index whenever a segment fills up and compacts segments that are
+// mostly dead. With a timing profile a command returns when the modeled
+// device would have completed it, see KVTimingModel; without one, at once.
+class KVEmulator : public KVBackend {
+public:
+    explicit KVEmulator(const KVEmulatorConfig &config = KVEmulatorConfig());
+    ~KVEmulator();
+
+    int submit(struct nvme_passthru_cmd *cmd, __u32 *result) override;
+    // With a timing profile the batch arrives at once and overlaps on the
+    // modeled dies; without one, the commands run one by one
+    void submit_batch(struct nvme_passthru_cmd *cmds, size_t n, int *status) override;
+
+    // false when the data log could not be opened; every command then fails
+    bool ok() const { return log != NULL; }
+    size_t key_count();
+    size_t used_bytes();
+    size_t segments();
+    // Copies the live records out of mostly dead segments and drops them.
+    // Returns how many were dropped, or -1.
+    int compact();
+    // Writes the index snapshot. Returns 0 or -errno.
+    int snapshot();
+
+private:
+    int execute(struct nvme_passthru_cmd *cmd);
+    __u64 completion(const struct nvme_passthru_cmd *cmd, int ret, __u64 arrival);
+    int store(const std::string &key, const struct nvme_passthru_cmd *cmd);
+    int retrieve(const std::string &key, const struct nvme_passthru_cmd *cmd, __u32 *result);
+    int exists(const std::string &key);
+    int remove(const std::string &key);
+    int list(const std::string &start, const struct nvme_passthru_cmd *cmd, __u32 *result);
+
+    // A key added to or removed from the List order, not in the tree yet.
+    // A key's changes queue up in one queue, in the order they were made.
+    struct order_change {
+        bool insert;
+        __u8 size;
+        char key[KV_MAX_KEY_SIZE];
+    };
+    struct order_queue {
+        std::mutex lock;
+        std::vector<order_change> changes;
+    };
+    static const size_t ORDER_QUEUES = 64;
+    static const size_t ORDER_QUEUE_LIMIT = 4096;   //changes that wake the maintenance thread
+    static const size_t ORDER_QUEUE_MAX = 4 * ORDER_QUEUE_LIMIT;    //a writer applies them itself
+
+    bool charge(size_t old_size, size_t new_size);
+    void queue_order(const std::string &key, bool insert);
+    void apply_order(order_queue &q);
+    void apply_all_order();
+    void recover();
+    int write_snapshot();
+    bool relocate(__u32 segment);
+    void maintain();
+
+    KVEmulatorConfig config;
+    KVHashIndex keys;
+    std::shared_timed_mutex order_lock;     //the tree: exclusive to apply changes, shared to walk it
+    KVKeyTree order;
+    order_queue order_queues[ORDER_QUEUES];
+    std::unique_ptr<KVDataLog> log;
+    std::unique_ptr<KVTimingModel> timing;
+    std::atomic<size_t> used;
+
+    std::mutex maintenance;                 //one snapshot or compaction at a time
+    std::mutex wake_lock;
+    std::condition_variable wake;
+    bool sealed;                            //a segment filled up since the last snapshot
+    bool order_due;                         //an order queue filled up
+    bool stopping;
+    std::thread thread;
+};
+
+#endif
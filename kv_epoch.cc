@@ -0,0 +1,125 @@
+#include "kv_epoch.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include <thread>
+
+namespace {
+
+// One per thread that ever pinned, reused after the thread exits
+struct alignas(64) epoch_slot {
+    std::atomic<__u64> epoch;               //pinned at, 0 when not pinned
+    std::atomic<bool> taken;
+    epoch_slot *next;
+};
+
+std::atomic<__u64> global_epoch(1);
+std::atomic<epoch_slot *> slots(nullptr);
+
+struct thread_slot {
+    epoch_slot *slot = nullptr;
+    unsigned depth = 0;
+
+    ~thread_slot() {
+        if (slot) {
+            slot->taken.store(false, std::memory_order_release);
+        }
+    }
+};
+
+thread_local thread_slot self;
+
+epoch_slot *take_slot() {
+    for (epoch_slot *s = slots.load(std::memory_order_acquire); s; s = s->next) {
+        bool expected = false;
+        if (!s->taken.load(std::memory_order_relaxed) && s->taken.compare_exchange_strong(expected, true)) {
+            return s;
+        }
+    }
+    // slots are never freed, there are only ever as many as threads at once;
+    // a line of their own, which plain new does not promise before C++17
+    void *p;
+    if (posix_memalign(&p, sizeof(epoch_slot), sizeof(epoch_slot)) != 0) {
+        abort();
+    }
+    epoch_slot *s = new (p) epoch_slot;
+    s->epoch.store(0, std::memory_order_relaxed);
+    s->taken.store(true, std::memory_order_relaxed);
+    s->next = slots.load(std::memory_order_relaxed);
+    while (!slots.compare_exchange_weak(s->next, s)) {
+    }
+    return s;
+}
+
+// Moves the epoch on and returns the oldest one a reader still has pinned.
+// Memory retired before that is unreachable for everyone.
+__u64 oldest_epoch() {
+    __u64 oldest = global_epoch.fetch_add(1) + 1;
+    for (epoch_slot *s = slots.load(std::memory_order_acquire); s; s = s->next) {
+        __u64 e = s->epoch.load();
+        if (e != 0 && e < oldest) {
+            oldest = e;
+        }
+    }
+    return oldest;
+}
+
+}
+
+KVEpochGuard::KVEpochGuard() {
+    if (self.depth++ == 0) {
+        if (!self.slot) {
+            self.slot = take_slot();
+        }
+        // seq_cst: the writer that scans the slots next either sees the pin
+        // or unlinked its memory before any load of ours
+        self.slot->epoch.store(global_epoch.load());
+    }
+}
+
+KVEpochGuard::~KVEpochGuard() {
+    if (--self.depth == 0) {
+        self.slot->epoch.store(0, std::memory_order_release);
+    }
+}
+
+KVRetireList::~KVRetireList() {
+    for (const item &i : items) {
+        i.free(i.p);
+    }
+}
+
+void KVRetireList::retire(void *p, void (*free)(void *)) {
+    item i;
+    // a reader that pins after this load cannot find p any more
+    i.epoch = global_epoch.load();
+    i.p = p;
+    i.free = free;
+    items.push_back(i);
+}
+
+void KVRetireList::reclaim() {
+    if (items.empty()) {
+        return;
+    }
+    __u64 oldest = oldest_epoch();
+    size_t kept = 0;
+    for (size_t i = 0; i < items.size(); i++) {
+        if (items[i].epoch < oldest) {
+            items[i].free(items[i].p);
+        } else {
+            items[kept++] = items[i];
+        }
+    }
+    items.resize(kept);
+}
+
+void kv_epoch_synchronize() {
+    assert(self.depth == 0);
+    __u64 now = global_epoch.load();
+    while (oldest_epoch() <= now) {
+        std::this_thread::yield();
+    }
+}
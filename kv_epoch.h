@@ -0,0 +1,53 @@
+#ifndef KV_EPOCH_H
+#define KV_EPOCH_H
+
+#include <linux/types.h>
+#include <stddef.h>
+#include <vector>
+
+// Epoch based reclamation for lock-free readers. A reader pins the epoch
+// while it looks at shared memory; a writer that unlinks memory retires it
+// instead of freeing it, and it is freed once every reader that might
+// still see it has unpinned. Pins nest and cost two stores to a slot of
+// the calling thread.
+class KVEpochGuard {
+public:
+    KVEpochGuard();
+    ~KVEpochGuard();
+
+    KVEpochGuard(const KVEpochGuard &) = delete;
+    KVEpochGuard &operator=(const KVEpochGuard &) = delete;
+};
+
+// Memory unlinked from a shared structure, waiting for its readers. The
+// owner serializes the calls.
+class KVRetireList {
+public:
+    KVRetireList() {}
+    // Frees everything: nobody may be reading any more
+    ~KVRetireList();
+
+    KVRetireList(const KVRetireList &) = delete;
+    KVRetireList &operator=(const KVRetireList &) = delete;
+
+    // Call after p can no longer be reached; free(p) runs later
+    void retire(void *p, void (*free)(void *));
+    // Frees what no reader can see any more
+    void reclaim();
+    size_t size() const { return items.size(); }
+
+private:
+    struct item {
+        __u64 epoch;
+        void *p;
+        void (*free)(void *);
+    };
+
+    std::vector<item> items;
+};
+
+// Waits until every reader pinned now has unpinned. Must not be called
+// with a pin held.
+void kv_epoch_synchronize();
+
+#endif
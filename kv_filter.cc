@@ -0,0 +1,230 @@
+#include "kv_filter.h"
+#include "kv_cursor.h"
+#include <string.h>
+
+static __u64 mix64(__u64 h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+static __u64 hash_key(const KVKey &key) {
+    __u64 h = 0xcbf29ce484222325ull ^ key.size;
+    for (int i = 0; i < key.size && i < (int)KV_MAX_KEY_SIZE; i++) {
+        h = (h ^ key.bytes[i]) * 0x100000001b3ull;
+    }
+    return mix64(h);
+}
+
+KVCuckooFilter::KVCuckooFilter(size_t capacity) : items(0), victim_seed(1) {
+    size_t buckets = 1;
+    while (buckets * SLOTS * 95 / 100 < capacity) {
+        buckets <<= 1;
+    }
+    table.assign(buckets * SLOTS, 0);
+    mask = buckets - 1;
+}
+
+void KVCuckooFilter::locate(const KVKey &key, size_t *i1, size_t *i2, __u16 *fp) const {
+    __u64 h = hash_key(key);
+    *fp = h >> 48;
+    if (*fp == 0) {
+        *fp = 1;                //0 marks an empty slot
+    }
+    *i1 = h & mask;
+    *i2 = alt_index(*i1, *fp);
+}
+
+size_t KVCuckooFilter::alt_index(size_t i, __u16 fp) const {
+    return (i ^ mix64(fp)) & mask;
+}
+
+size_t KVCuckooFilter::pair_of(const KVKey &key) const {
+    size_t i1, i2;
+    __u16 fp;
+    locate(key, &i1, &i2, &fp);
+    return i1 < i2 ? i1 : i2;
+}
+
+bool KVCuckooFilter::put(size_t i, __u16 fp) {
+    for (int s = 0; s < SLOTS; s++) {
+        if (table[i * SLOTS + s] == 0) {
+            table[i * SLOTS + s] = fp;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool KVCuckooFilter::contains(const KVKey &key) const {
+    size_t i1, i2;
+    __u16 fp;
+    locate(key, &i1, &i2, &fp);
+    for (int s = 0; s < SLOTS; s++) {
+        if (table[i1 * SLOTS + s] == fp || table[i2 * SLOTS + s] == fp) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool KVCuckooFilter::insert(const KVKey &key) {
+    size_t i1, i2;
+    __u16 fp;
+    locate(key, &i1, &i2, &fp);
+    items++;
+    if (put(i1, fp) || put(i2, fp)) {
+        return true;
+    }
+    size_t i = (victim_seed & 1) ? i1 : i2;
+    for (int kick = 0; kick < MAX_KICKS; kick++) {
+        victim_seed = victim_seed * 1103515245 + 12345;
+        __u16 &slot = table[i * SLOTS + (victim_seed >> 16) % SLOTS];
+        __u16 evicted = slot;
+        slot = fp;
+        fp = evicted;
+        i = alt_index(i, fp);
+        if (put(i, fp)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool KVCuckooFilter::remove(const KVKey &key) {
+    size_t i1, i2;
+    __u16 fp;
+    locate(key, &i1, &i2, &fp);
+    for (size_t i : {i1, i2}) {
+        for (int s = 0; s < SLOTS; s++) {
+            if (table[i * SLOTS + s] == fp) {
+                table[i * SLOTS + s] = 0;
+                items--;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void KVCuckooFilter::clear() {
+    memset(table.data(), 0, table.size() * sizeof(table[0]));
+    items = 0;
+}
+
+KVFilterBackend::KVFilterBackend(std::shared_ptr<KVBackend> inner, __u32 nsid, size_t capacity)
+    : inner(std::move(inner)), ns(nsid), filter(capacity), usable(false), skipped(0) {
+}
+
+bool KVFilterBackend::definitely_absent(const KVKey &key) {
+    std::shared_lock<std::shared_timed_mutex> guard(table_lock);
+    return !filter.contains(key);
+}
+
+int KVFilterBackend::submit(struct nvme_passthru_cmd *cmd, __u32 *result) {
+    __u32 key_size = cmd->cdw11 & 0xff;
+    if (cmd->nsid != ns || key_size == 0 || key_size > KV_MAX_KEY_SIZE) {
+        return inner->submit(cmd, result);
+    }
+    KVKey key = kv_unpack_key(cmd);
+    switch (cmd->opcode) {
+    case KV_OPC_STORE:
+        return store(cmd, result, key);
+    case KV_OPC_DELETE:
+        return remove(cmd, result, key);
+    case KV_OPC_RETRIEVE:
+        // a zero-sized buffer is 137 on the device, whether the key exists or not
+        if (cmd->cdw10 == 0) {
+            break;
+        }
+        // fall through
+    case KV_OPC_EXISTS:
+        if (usable.load() && definitely_absent(key)) {
+            skipped.fetch_add(1, std::memory_order_relaxed);
+            cmd->result = 0;
+            if (result) {
+                *result = 0;
+            }
+            return KV_ERR_KEY_NOT_EXIST;
+        }
+        break;
+    }
+    return inner->submit(cmd, result);
+}
+
+// The filter holds one fingerprint per store of a key that did not exist,
+// minus one per successful delete, so a live key is never missing from it.
+// A plain store of a key the filter may hold is first tried as must-exist
+// to learn whether it creates the key.
+int KVFilterBackend::store(struct nvme_passthru_cmd *cmd, __u32 *result, const KVKey &key) {
+    std::lock_guard<std::mutex> guard(stripes[filter.pair_of(key) % STRIPES]);
+    if (!usable.load()) {
+        return inner->submit(cmd, result);
+    }
+    __u32 options = cmd->cdw11 & (KV_STORE_MUST_EXIST | KV_STORE_MUST_NOT_EXIST);
+    bool created = options == KV_STORE_MUST_NOT_EXIST;
+    if (options == 0) {
+        if (definitely_absent(key)) {
+            created = true;
+        } else {
+            cmd->cdw11 |= KV_STORE_MUST_EXIST;
+            int ret = inner->submit(cmd, result);
+            cmd->cdw11 &= ~(__u32)KV_STORE_MUST_EXIST;
+            if (ret != KV_ERR_KEY_NOT_EXIST) {
+                return ret;
+            }
+            created = true;
+        }
+    }
+    int ret = inner->submit(cmd, result);
+    if (ret == 0 && created) {
+        std::lock_guard<std::shared_timed_mutex> table_guard(table_lock);
+        if (!filter.insert(key)) {
+            usable.store(false);
+        }
+    }
+    return ret;
+}
+
+int KVFilterBackend::remove(struct nvme_passthru_cmd *cmd, __u32 *result, const KVKey &key) {
+    std::lock_guard<std::mutex> guard(stripes[filter.pair_of(key) % STRIPES]);
+    int ret = inner->submit(cmd, result);
+    if (ret == 0 && usable.load()) {
+        std::lock_guard<std::shared_timed_mutex> table_guard(table_lock);
+        if (!filter.remove(key)) {
+            usable.store(false);
+        }
+    }
+    return ret;
+}
+
+int KVFilterBackend::rebuild() {
+    for (int i = 0; i < STRIPES; i++) {
+        stripes[i].lock();
+    }
+    usable.store(false);
+    {
+        std::lock_guard<std::shared_timed_mutex> table_guard(table_lock);
+        filter.clear();
+    }
+
+    // a private session: the scan goes to the device, not through us
+    KVListCursor cursor(std::make_shared<KVSession>(inner, ns));
+    bool full = false;
+    KVKey key;
+    while (cursor.next(&key)) {
+        std::lock_guard<std::shared_timed_mutex> table_guard(table_lock);
+        full |= !filter.insert(key);
+    }
+    int ret = cursor.status();
+    if (ret == 0 && !full) {
+        usable.store(true);
+    }
+    for (int i = STRIPES; i > 0; i--) {
+        stripes[i - 1].unlock();
+    }
+    return ret == 0 && full ? KV_ERR_CAPACITY_EXCEEDED : ret;
+}
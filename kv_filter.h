@@ -0,0 +1,76 @@
+#ifndef KV_FILTER_H
+#define KV_FILTER_H
+
+#include "kv_backend.h"
+#include "kv_client.h"
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+
+// Cuckoo filter over KV keys: 16 bit fingerprints, 4 per bucket, and
+// deletion that does not degrade the filter. Not locked.
+class KVCuckooFilter {
+public:
+    explicit KVCuckooFilter(size_t capacity);
+
+    bool contains(const KVKey &key) const;
+    // false when the table is too full; a fingerprint may have been dropped
+    bool insert(const KVKey &key);
+    // Removes one copy; only call it for a key that was inserted
+    bool remove(const KVKey &key);
+    void clear();
+
+    size_t size() const { return items; }
+    // Both buckets a key may live in hash to the same pair
+    size_t pair_of(const KVKey &key) const;
+
+private:
+    static const int SLOTS = 4;
+    static const int MAX_KICKS = 500;
+
+    void locate(const KVKey &key, size_t *i1, size_t *i2, __u16 *fp) const;
+    size_t alt_index(size_t i, __u16 fp) const;
+    bool put(size_t i, __u16 fp);
+
+    std::vector<__u16> table;
+    size_t mask;
+    size_t items;
+    unsigned victim_seed;
+};
+
+// Backend that answers a definite "absent" Exists or Retrieve with 135
+// without touching the device. Store and Delete keep the filter in sync,
+// and rebuild() loads it from a LIST scan. Until the first rebuild, and
+// after the filter overflowed, every command goes to the device.
+class KVFilterBackend : public KVBackend {
+public:
+    KVFilterBackend(std::shared_ptr<KVBackend> inner, __u32 nsid = 1, size_t capacity = 1 << 20);
+
+    int submit(struct nvme_passthru_cmd *cmd, __u32 *result) override;
+    int device_fd() const override { return inner->device_fd(); }
+
+    // Scans the namespace with KV_OPC_LIST; writers wait for it to finish
+    int rebuild();
+    bool ready() const { return usable.load(); }
+    __u64 short_circuits() const { return skipped.load(std::memory_order_relaxed); }
+
+private:
+    static const int STRIPES = 64;
+
+    bool definitely_absent(const KVKey &key);
+    int store(struct nvme_passthru_cmd *cmd, __u32 *result, const KVKey &key);
+    int remove(struct nvme_passthru_cmd *cmd, __u32 *result, const KVKey &key);
+
+    std::shared_ptr<KVBackend> inner;
+    __u32 ns;
+    KVCuckooFilter filter;
+    std::shared_timed_mutex table_lock;
+    // Store and Delete hold the stripe of the key's bucket pair from the
+    // device command until the filter is updated
+    std::mutex stripes[STRIPES];
+    std::atomic<bool> usable;
+    std::atomic<__u64> skipped;
+};
+
+#endif
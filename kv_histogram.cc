@@ -0,0 +1,268 @@
+#include "kv_histogram.h"
+#include "kv_client.h"
+#include <time.h>
+#include <mutex>
+#include <vector>
+
+__u64 kv_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+KVHistogram::KVHistogram() {
+    reset();
+}
+
+KVHistogram::KVHistogram(const KVHistogram &other) {
+    reset();
+    merge(other);
+}
+
+KVHistogram &KVHistogram::operator=(const KVHistogram &other) {
+    if (this != &other) {
+        reset();
+        merge(other);
+    }
+    return *this;
+}
+
+int KVHistogram::bucket_of(__u64 ns) {
+    if (ns < (1u << SUB_BITS)) {
+        return ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    if (msb >= MAX_BITS) {
+        return BUCKETS - 1;
+    }
+    int shift = msb - SUB_BITS;
+    return ((shift + 1) << SUB_BITS) + (int)(ns >> shift) - (1 << SUB_BITS);
+}
+
+__u64 KVHistogram::bucket_high(int bucket) {
+    if (bucket < (1 << SUB_BITS)) {
+        return bucket;
+    }
+    int shift = (bucket >> SUB_BITS) - 1;
+    __u64 sub = (bucket & ((1 << SUB_BITS) - 1)) + (1 << SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+void KVHistogram::record(__u64 ns) {
+    bump(buckets[bucket_of(ns)], 1);
+    bump(total, 1);
+    bump(sum, ns);
+    if (ns > largest.load(std::memory_order_relaxed)) {
+        largest.store(ns, std::memory_order_relaxed);
+    }
+}
+
+void KVHistogram::merge(const KVHistogram &other) {
+    for (int i = 0; i < BUCKETS; i++) {
+        __u64 n = other.buckets[i].load(std::memory_order_relaxed);
+        if (n) {
+            buckets[i].fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+    total.fetch_add(other.total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    sum.fetch_add(other.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    __u64 m = other.largest.load(std::memory_order_relaxed);
+    if (m > largest.load(std::memory_order_relaxed)) {
+        largest.store(m, std::memory_order_relaxed);
+    }
+}
+
+void KVHistogram::reset() {
+    for (int i = 0; i < BUCKETS; i++) {
+        buckets[i].store(0, std::memory_order_relaxed);
+    }
+    total.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    largest.store(0, std::memory_order_relaxed);
+}
+
+double KVHistogram::mean() const {
+    __u64 n = count();
+    return n ? (double)sum.load(std::memory_order_relaxed) / n : 0;
+}
+
+__u64 KVHistogram::percentile(double p) const {
+    // the bucket counts may move while we read them: walk to the rank
+    // computed from their own sum so the answer stays in range
+    __u64 n = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        n += buckets[i].load(std::memory_order_relaxed);
+    }
+    if (n == 0) {
+        return 0;
+    }
+    __u64 rank = (__u64)(p * n);
+    if (rank >= n) {
+        rank = n - 1;
+    }
+    __u64 seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen > rank) {
+            __u64 high = bucket_high(i);
+            __u64 m = max();
+            return m && high > m ? m : high;
+        }
+    }
+    return max();
+}
+
+int kv_latency_op_index(__u8 opcode) {
+    switch (opcode) {
+    case KV_OPC_STORE:
+        return KV_LAT_OP_STORE;
+    case KV_OPC_RETRIEVE:
+        return KV_LAT_OP_RETRIEVE;
+    case KV_OPC_LIST:
+        return KV_LAT_OP_LIST;
+    case KV_OPC_DELETE:
+        return KV_LAT_OP_DELETE;
+    case KV_OPC_EXISTS:
+        return KV_LAT_OP_EXISTS;
+    default:
+        return KV_LAT_OP_OTHER;
+    }
+}
+
+int kv_latency_status_index(int status) {
+    switch (status) {
+    case KV_SUCCESS:
+        return KV_LAT_ST_SUCCESS;
+    case KV_ERR_CAPACITY_EXCEEDED:
+        return KV_LAT_ST_129;
+    case KV_ERR_INVALID_KEY_SIZE:
+        return KV_LAT_ST_134;
+    case KV_ERR_KEY_NOT_EXIST:
+        return KV_LAT_ST_135;
+    case KV_ERR_INVALID_REQUEST:
+        return KV_LAT_ST_137;
+    default:
+        return status < 0 ? KV_LAT_ST_ERRNO : KV_LAT_ST_OTHER;
+    }
+}
+
+// One per recording thread. Histograms are allocated on first use by the
+// owner and published with a release store, so readers never lock them.
+// Blocks outlive their threads and are handed to the next new thread.
+// Only the owner writes a block, clearing it too: a reset just moves the
+// generation on, and a block of an older one counts as empty until its
+// owner records again and finds it stale.
+struct latency_block {
+    std::atomic<KVHistogram *> hist[KV_LAT_OPS][KV_LAT_STATUSES];
+    std::atomic<__u64> generation;
+    std::atomic<bool> owned;
+};
+
+static std::atomic<__u64> latency_generation(0);
+
+static std::mutex registry_lock;
+static std::vector<latency_block *> &registry() {
+    static std::vector<latency_block *> *blocks = new std::vector<latency_block *>;
+    return *blocks;
+}
+
+static latency_block *adopt_block() {
+    std::lock_guard<std::mutex> guard(registry_lock);
+    for (latency_block *b : registry()) {
+        bool expected = false;
+        if (b->owned.compare_exchange_strong(expected, true)) {
+            return b;
+        }
+    }
+    latency_block *b = new latency_block;
+    for (int op = 0; op < KV_LAT_OPS; op++) {
+        for (int st = 0; st < KV_LAT_STATUSES; st++) {
+            b->hist[op][st].store(NULL, std::memory_order_relaxed);
+        }
+    }
+    b->generation.store(latency_generation.load(), std::memory_order_relaxed);
+    b->owned.store(true);
+    registry().push_back(b);
+    return b;
+}
+
+struct latency_owner {
+    latency_block *block;
+    latency_owner() : block(adopt_block()) {}
+    ~latency_owner() { block->owned.store(false); }
+};
+
+void kv_latency_record(__u8 opcode, int status, __u64 ns) {
+    static thread_local latency_owner owner;
+    latency_block *b = owner.block;
+    __u64 generation = latency_generation.load(std::memory_order_acquire);
+    if (b->generation.load(std::memory_order_relaxed) != generation) {
+        for (int op = 0; op < KV_LAT_OPS; op++) {
+            for (int st = 0; st < KV_LAT_STATUSES; st++) {
+                KVHistogram *h = b->hist[op][st].load(std::memory_order_relaxed);
+                if (h) {
+                    h->reset();
+                }
+            }
+        }
+        // readers skip the block until it is clear
+        b->generation.store(generation, std::memory_order_release);
+    }
+    std::atomic<KVHistogram *> &slot = b->hist[kv_latency_op_index(opcode)][kv_latency_status_index(status)];
+    KVHistogram *h = slot.load(std::memory_order_relaxed);
+    if (!h) {
+        h = new KVHistogram;
+        slot.store(h, std::memory_order_release);
+    }
+    h->record(ns);
+}
+
+KVHistogram kv_latency_snapshot(int op, int status) {
+    KVHistogram merged;
+    std::lock_guard<std::mutex> guard(registry_lock);
+    __u64 generation = latency_generation.load(std::memory_order_acquire);
+    for (latency_block *b : registry()) {
+        if (b->generation.load(std::memory_order_acquire) != generation) {
+            continue;                       //reset since its owner last recorded
+        }
+        for (int o = 0; o < KV_LAT_OPS; o++) {
+            if (op >= 0 && o != op) {
+                continue;
+            }
+            for (int st = 0; st < KV_LAT_STATUSES; st++) {
+                if (status >= 0 && st != status) {
+                    continue;
+                }
+                KVHistogram *h = b->hist[o][st].load(std::memory_order_acquire);
+                if (h) {
+                    merged.merge(*h);
+                }
+            }
+        }
+    }
+    return merged;
+}
+
+void kv_latency_dump(FILE *out) {
+    static const char *ops[KV_LAT_OPS] = {"store", "retrieve", "list", "delete", "exists", "other"};
+    static const char *statuses[KV_LAT_STATUSES] = {"0", "129", "134", "135", "137", "other", "errno"};
+
+    fprintf(out, "%-9s %-6s %12s %10s %10s %10s %10s %10s\n",
+            "opcode", "status", "count", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+    for (int op = 0; op < KV_LAT_OPS; op++) {
+        for (int st = 0; st < KV_LAT_STATUSES; st++) {
+            KVHistogram h = kv_latency_snapshot(op, st);
+            if (h.count() == 0) {
+                continue;
+            }
+            fprintf(out, "%-9s %-6s %12llu %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+                    ops[op], statuses[st], (unsigned long long)h.count(), h.mean() / 1000,
+                    h.percentile(0.50) / 1000.0, h.percentile(0.99) / 1000.0,
+                    h.percentile(0.999) / 1000.0, h.max() / 1000.0);
+        }
+    }
+}
+
+void kv_latency_reset() {
+    latency_generation.fetch_add(1, std::memory_order_acq_rel);
+}
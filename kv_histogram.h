@@ -0,0 +1,82 @@
+#ifndef KV_HISTOGRAM_H
+#define KV_HISTOGRAM_H
+
+#include <linux/types.h>
+#include <stdio.h>
+#include <atomic>
+
+// HDR-style log-linear latency histogram in nanoseconds: exact below 32 ns,
+// then 32 sub-buckets per power of two (about 3% relative error), up to
+// 2^36 ns. record() is meant for a single writer thread and never locks;
+// other threads may read or merge it at any time.
+class KVHistogram {
+public:
+    static const int SUB_BITS = 5;
+    static const int MAX_BITS = 36;
+    static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) << SUB_BITS;
+
+    KVHistogram();
+    KVHistogram(const KVHistogram &other);
+    KVHistogram &operator=(const KVHistogram &other);
+
+    void record(__u64 ns);
+    void merge(const KVHistogram &other);
+    void reset();
+
+    __u64 count() const { return total.load(std::memory_order_relaxed); }
+    __u64 max() const { return largest.load(std::memory_order_relaxed); }
+    double mean() const;
+    // Upper bound of the bucket holding the p-th fraction, 0 when empty
+    __u64 percentile(double p) const;
+
+    static int bucket_of(__u64 ns);
+    static __u64 bucket_high(int bucket);
+
+private:
+    static void bump(std::atomic<__u64> &counter, __u64 n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::atomic<__u64> buckets[BUCKETS];
+    std::atomic<__u64> total;
+    std::atomic<__u64> sum;
+    std::atomic<__u64> largest;
+};
+
+// Always-on latency of every command that goes through KVSession::submit or
+// KVUringEngine, one histogram set per thread, keyed by opcode and status.
+enum {
+    KV_LAT_OP_STORE,
+    KV_LAT_OP_RETRIEVE,
+    KV_LAT_OP_LIST,
+    KV_LAT_OP_DELETE,
+    KV_LAT_OP_EXISTS,
+    KV_LAT_OP_OTHER,
+    KV_LAT_OPS
+};
+
+enum {
+    KV_LAT_ST_SUCCESS,
+    KV_LAT_ST_129,
+    KV_LAT_ST_134,
+    KV_LAT_ST_135,
+    KV_LAT_ST_137,
+    KV_LAT_ST_OTHER,        //any other NVMe status
+    KV_LAT_ST_ERRNO,        //the command never completed on the device
+    KV_LAT_STATUSES
+};
+
+int kv_latency_op_index(__u8 opcode);
+int kv_latency_status_index(int status);
+
+void kv_latency_record(__u8 opcode, int status, __u64 ns);
+// Merged view of every thread for one KV_LAT_OP_* / KV_LAT_ST_* pair,
+// -1 merges across all of them
+KVHistogram kv_latency_snapshot(int op = -1, int status = -1);
+void kv_latency_dump(FILE *out);
+// Clears every thread's histograms, also while they record
+void kv_latency_reset();
+
+__u64 kv_now_ns();
+
+#endif
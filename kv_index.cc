@@ -0,0 +1,524 @@
+#include "kv_index.h"
+#include <string.h>
+#include <algorithm>
+
+// A stripe retires this many nodes before it looks for ones to free
+const size_t RECLAIM_BATCH = 64;
+
+static __u64 mix(__u64 h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+__u64 KVHashIndex::hash_key(const char *key, size_t size) {
+    __u64 a = 0;
+    __u64 b = 0;
+    memcpy(&a, key, std::min<size_t>(size, 8));
+    if (size > 8) {
+        memcpy(&b, key + 8, size - 8);
+    }
+    return mix(a ^ mix(b + size));
+}
+
+void KVHashIndex::free_node(void *p) {
+    delete (node *)p;
+}
+
+// A table replaced by a bigger one, with the nodes only it still links
+void KVHashIndex::free_table(void *p) {
+    table *t = (table *)p;
+    for (size_t b = 0; b < t->size; b++) {
+        node *n = t->buckets[b].load(std::memory_order_relaxed);
+        while (n) {
+            node *next = n->next.load(std::memory_order_relaxed);
+            delete n;
+            n = next;
+        }
+    }
+    delete[] t->buckets;
+    delete t;
+}
+
+KVHashIndex::table *KVHashIndex::new_table(size_t buckets) {
+    table *t = new table;
+    t->shift = 64;
+    for (size_t n = buckets; n > 1; n /= 2) {
+        t->shift--;
+    }
+    t->size = buckets;
+    t->buckets = new std::atomic<node *>[buckets]();
+    return t;
+}
+
+KVHashIndex::KVHashIndex() : current(new_table(STRIPES)) {
+    for (stripe &s : stripes) {
+        s.count.store(0, std::memory_order_relaxed);
+    }
+}
+
+KVHashIndex::~KVHashIndex() {
+    free_table(current.load());
+}
+
+KVHashIndex::Locked::Locked(KVHashIndex *index, const char *key, size_t size)
+    : index(index), hash(hash_key(key, size)), key(key), size(size), locked(true) {
+    stripe = hash >> (64 - STRIPE_BITS);
+    index->stripes[stripe].lock.lock();
+    // stable while any stripe is locked
+    table *t = index->current.load(std::memory_order_acquire);
+    link = &t->bucket(hash);
+    n = link->load(std::memory_order_relaxed);
+    while (n && !(n->hash == hash && n->key_size == size && memcmp(n->key, key, size) == 0)) {
+        link = &n->next;
+        n = link->load(std::memory_order_relaxed);
+    }
+}
+
+KVHashIndex::Locked::Locked(Locked &&other)
+    : index(other.index), stripe(other.stripe), hash(other.hash), key(other.key), size(other.size),
+      link(other.link), n(other.n), locked(other.locked) {
+    other.locked = false;
+}
+
+KVHashIndex::Locked::~Locked() {
+    if (!locked) {
+        return;
+    }
+    KVHashIndex::stripe &s = index->stripes[stripe];
+    size_t buckets = index->current.load(std::memory_order_relaxed)->size;
+    bool full = s.count.load(std::memory_order_relaxed) > 2 * buckets / STRIPES;
+    s.lock.unlock();
+    if (full) {
+        index->grow(2 * buckets);
+    }
+}
+
+void KVHashIndex::Locked::set(const KVIndexValue &value) {
+    node *m = new node;
+    m->hash = hash;
+    m->value = value;
+    m->key_size = size;
+    memcpy(m->key, key, size);
+    KVHashIndex::stripe &s = index->stripes[stripe];
+    if (n) {
+        m->next.store(n->next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        // readers see the old node or the new one, both whole
+        link->store(m, std::memory_order_release);
+        s.retired.retire(n, free_node);
+        if (s.retired.size() >= RECLAIM_BATCH) {
+            s.retired.reclaim();
+        }
+    } else {
+        m->next.store(link->load(std::memory_order_relaxed), std::memory_order_relaxed);
+        link->store(m, std::memory_order_release);
+        s.count.fetch_add(1, std::memory_order_relaxed);
+    }
+    n = m;
+}
+
+void KVHashIndex::Locked::erase() {
+    if (!n) {
+        return;
+    }
+    KVHashIndex::stripe &s = index->stripes[stripe];
+    // a reader on n still finds the rest of the chain behind it
+    link->store(n->next.load(std::memory_order_relaxed), std::memory_order_release);
+    s.retired.retire(n, free_node);
+    if (s.retired.size() >= RECLAIM_BATCH) {
+        s.retired.reclaim();
+    }
+    s.count.fetch_sub(1, std::memory_order_relaxed);
+    n = NULL;
+}
+
+bool KVHashIndex::find(const char *key, size_t size, KVIndexValue *value) const {
+    __u64 hash = hash_key(key, size);
+    const table *t = current.load(std::memory_order_acquire);
+    const node *n = t->bucket(hash).load(std::memory_order_acquire);
+    while (n) {
+        if (n->hash == hash && n->key_size == size && memcmp(n->key, key, size) == 0) {
+            *value = n->value;
+            return true;
+        }
+        n = n->next.load(std::memory_order_acquire);
+    }
+    return false;
+}
+
+void KVHashIndex::for_each(const std::function<void(const char *, size_t, const KVIndexValue &)> &fn) {
+    for (size_t i = 0; i < STRIPES; i++) {
+        std::lock_guard<std::mutex> guard(stripes[i].lock);
+        table *t = current.load(std::memory_order_acquire);
+        size_t run = t->size / STRIPES;
+        for (size_t b = i * run; b < (i + 1) * run; b++) {
+            for (node *n = t->buckets[b].load(std::memory_order_relaxed); n;
+                 n = n->next.load(std::memory_order_relaxed)) {
+                fn(n->key, n->key_size, n->value);
+            }
+        }
+    }
+}
+
+size_t KVHashIndex::size() const {
+    size_t n = 0;
+    for (const stripe &s : stripes) {
+        n += s.count.load(std::memory_order_relaxed);
+    }
+    return n;
+}
+
+void KVHashIndex::reserve(size_t n) {
+    size_t buckets = STRIPES;
+    while (buckets < n) {
+        buckets *= 2;
+    }
+    grow(buckets);
+}
+
+// Copies every node into a table of the given size. Readers keep using the
+// old table until it is swapped, so it has to stay intact: nodes cannot be
+// moved over.
+void KVHashIndex::grow(size_t buckets) {
+    for (stripe &s : stripes) {
+        s.lock.lock();
+    }
+    table *old = current.load(std::memory_order_relaxed);
+    if (buckets > old->size) {
+        table *t = new_table(buckets);
+        for (size_t b = 0; b < old->size; b++) {
+            for (node *n = old->buckets[b].load(std::memory_order_relaxed); n;
+                 n = n->next.load(std::memory_order_relaxed)) {
+                node *m = new node;
+                m->hash = n->hash;
+                m->value = n->value;
+                m->key_size = n->key_size;
+                memcpy(m->key, n->key, n->key_size);
+                std::atomic<node *> &head = t->bucket(m->hash);
+                m->next.store(head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                head.store(m, std::memory_order_relaxed);
+            }
+        }
+        current.store(t, std::memory_order_release);
+        std::lock_guard<std::mutex> guard(tables_lock);
+        retired_tables.retire(old, free_table);
+    }
+    for (stripe &s : stripes) {
+        s.lock.unlock();
+    }
+}
+
+void KVHashIndex::reclaim() {
+    for (stripe &s : stripes) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.retired.reclaim();
+    }
+    std::lock_guard<std::mutex> guard(tables_lock);
+    retired_tables.reclaim();
+}
+
+KVKeyTree::KVKeyTree() : count(0) {
+    leaf *l = new leaf;
+    l->is_leaf = true;
+    l->count = 0;
+    l->next = NULL;
+    root = l;
+}
+
+KVKeyTree::~KVKeyTree() {
+    free_node(root);
+}
+
+void KVKeyTree::free_node(node *n) {
+    if (n->is_leaf) {
+        delete (leaf *)n;
+        return;
+    }
+    inner *in = (inner *)n;
+    for (int i = 0; i < in->count; i++) {
+        free_node(in->children[i]);
+    }
+    delete in;
+}
+
+int KVKeyTree::compare(const key &a, const char *bytes, size_t size) {
+    int r = memcmp(a.bytes, bytes, std::min<size_t>(a.size, size));
+    return r != 0 ? r : (int)a.size - (int)size;
+}
+
+// The first key of a leaf that is not less than the one given
+int KVKeyTree::lower_bound(const node *n, const char *bytes, size_t size) {
+    int lo = 0;
+    int hi = n->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (compare(n->keys[mid], bytes, size) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// The child of an inner node the key belongs under
+int KVKeyTree::child_of(const node *n, const char *bytes, size_t size) {
+    int lo = 0;
+    int hi = n->count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (compare(n->keys[mid], bytes, size) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+KVKeyTree::leaf *KVKeyTree::leaf_for(const char *bytes, size_t size, std::vector<step> *path) const {
+    node *n = root;
+    while (!n->is_leaf) {
+        step s;
+        s.n = (inner *)n;
+        s.child = child_of(n, bytes, size);
+        if (path) {
+            path->push_back(s);
+        }
+        n = s.n->children[s.child];
+    }
+    return (leaf *)n;
+}
+
+bool KVKeyTree::insert(const char *bytes, size_t size) {
+    std::vector<step> path;
+    leaf *l = leaf_for(bytes, size, &path);
+    int i = lower_bound(l, bytes, size);
+    if (i < l->count && compare(l->keys[i], bytes, size) == 0) {
+        return false;
+    }
+    key k;
+    k.size = size;
+    memcpy(k.bytes, bytes, size);
+    count++;
+    leaf *target = l;
+    if (l->count == FANOUT) {
+        // the upper half moves to a new leaf right of this one
+        leaf *r = new leaf;
+        r->is_leaf = true;
+        r->count = FANOUT - FANOUT / 2;
+        memcpy(r->keys, l->keys + FANOUT / 2, r->count * sizeof(key));
+        l->count = FANOUT / 2;
+        r->next = l->next;
+        l->next = r;
+        if (i > l->count) {
+            target = r;
+            i -= l->count;
+        }
+        add_child(path, r->keys[0], r);
+    }
+    memmove(target->keys + i + 1, target->keys + i, (target->count - i) * sizeof(key));
+    target->keys[i] = k;
+    target->count++;
+    return true;
+}
+
+// Hangs right into the tree next to the node the path ends at, splitting
+// the inner nodes that are full on the way up
+void KVKeyTree::add_child(std::vector<step> &path, key first, node *right) {
+    while (!path.empty()) {
+        inner *p = path.back().n;
+        int c = path.back().child;
+        path.pop_back();
+        if (p->count < FANOUT) {
+            memmove(p->children + c + 2, p->children + c + 1, (p->count - c - 1) * sizeof(node *));
+            memmove(p->keys + c + 1, p->keys + c, (p->count - c - 1) * sizeof(key));
+            p->children[c + 1] = right;
+            p->keys[c] = first;
+            p->count++;
+            return;
+        }
+        node *children[FANOUT + 1];
+        key keys[FANOUT];
+        memcpy(children, p->children, (c + 1) * sizeof(node *));
+        children[c + 1] = right;
+        memcpy(children + c + 2, p->children + c + 1, (FANOUT - c - 1) * sizeof(node *));
+        memcpy(keys, p->keys, c * sizeof(key));
+        keys[c] = first;
+        memcpy(keys + c + 1, p->keys + c, (FANOUT - 1 - c) * sizeof(key));
+
+        // the key between the halves moves up
+        int left = (FANOUT + 1) / 2;
+        inner *r = new inner;
+        r->is_leaf = false;
+        r->count = FANOUT + 1 - left;
+        memcpy(r->children, children + left, r->count * sizeof(node *));
+        memcpy(r->keys, keys + left, (r->count - 1) * sizeof(key));
+        p->count = left;
+        memcpy(p->children, children, left * sizeof(node *));
+        memcpy(p->keys, keys, (left - 1) * sizeof(key));
+        first = keys[left - 1];
+        right = r;
+    }
+    inner *top = new inner;
+    top->is_leaf = false;
+    top->count = 2;
+    top->children[0] = root;
+    top->children[1] = right;
+    top->keys[0] = first;
+    root = top;
+}
+
+bool KVKeyTree::erase(const char *bytes, size_t size) {
+    std::vector<step> path;
+    leaf *l = leaf_for(bytes, size, &path);
+    int i = lower_bound(l, bytes, size);
+    if (i == l->count || compare(l->keys[i], bytes, size) != 0) {
+        return false;
+    }
+    memmove(l->keys + i, l->keys + i + 1, (l->count - i - 1) * sizeof(key));
+    l->count--;
+    count--;
+    // the keys above stay valid bounds: nothing under them got smaller
+    if (!path.empty() && l->count < FANOUT / 4) {
+        merge(path);
+    }
+    return true;
+}
+
+// The node the path ends at is under a quarter full: it takes in a
+// neighbour if both fit in one node, or else they split what they hold
+// evenly. A merge can leave the parent short in turn.
+void KVKeyTree::merge(std::vector<step> &path) {
+    while (!path.empty()) {
+        inner *p = path.back().n;
+        int c = path.back().child;
+        path.pop_back();
+        int li = c > 0 ? c - 1 : 0;
+        node *a = p->children[li];
+        node *b = p->children[li + 1];
+
+        // both nodes in a row; for inner nodes the key that separates them
+        // in the parent goes in between
+        key keys[2 * FANOUT];
+        node *children[2 * FANOUT];
+        int n = a->count + b->count;
+        int nkeys;
+        if (a->is_leaf) {
+            memcpy(keys, a->keys, a->count * sizeof(key));
+            memcpy(keys + a->count, b->keys, b->count * sizeof(key));
+            nkeys = n;
+        } else {
+            memcpy(keys, a->keys, (a->count - 1) * sizeof(key));
+            keys[a->count - 1] = p->keys[li];
+            memcpy(keys + a->count, b->keys, (b->count - 1) * sizeof(key));
+            memcpy(children, ((inner *)a)->children, a->count * sizeof(node *));
+            memcpy(children + a->count, ((inner *)b)->children, b->count * sizeof(node *));
+            nkeys = n - 1;
+        }
+
+        if (n > FANOUT) {
+            int half = n / 2;
+            a->count = half;
+            b->count = n - half;
+            if (a->is_leaf) {
+                memcpy(a->keys, keys, half * sizeof(key));
+                memcpy(b->keys, keys + half, (n - half) * sizeof(key));
+                p->keys[li] = b->keys[0];
+            } else {
+                memcpy(a->keys, keys, (half - 1) * sizeof(key));
+                p->keys[li] = keys[half - 1];
+                memcpy(b->keys, keys + half, (n - half - 1) * sizeof(key));
+                memcpy(((inner *)a)->children, children, half * sizeof(node *));
+                memcpy(((inner *)b)->children, children + half, (n - half) * sizeof(node *));
+            }
+            return;
+        }
+
+        memcpy(a->keys, keys, nkeys * sizeof(key));
+        a->count = n;
+        if (a->is_leaf) {
+            ((leaf *)a)->next = ((leaf *)b)->next;
+            delete (leaf *)b;
+        } else {
+            memcpy(((inner *)a)->children, children, n * sizeof(node *));
+            delete (inner *)b;
+        }
+        memmove(p->keys + li, p->keys + li + 1, (p->count - li - 2) * sizeof(key));
+        memmove(p->children + li + 1, p->children + li + 2, (p->count - li - 2) * sizeof(node *));
+        p->count--;
+        if (p == root) {
+            if (p->count == 1) {
+                root = p->children[0];
+                delete p;
+            }
+            return;
+        }
+        if (p->count >= FANOUT / 4) {
+            return;
+        }
+    }
+}
+
+void KVKeyTree::assign(const std::vector<std::pair<const char *, size_t> > &keys) {
+    free_node(root);
+    count = keys.size();
+    // nodes three quarters full, so the inserts that follow do not split
+    // all of them at once
+    const size_t FILL = FANOUT * 3 / 4;
+    std::vector<node *> level;
+    std::vector<key> firsts;
+    size_t leaves = std::max<size_t>(1, (keys.size() + FILL - 1) / FILL);
+    leaf *prev = NULL;
+    for (size_t i = 0, k = 0; i < leaves; i++) {
+        leaf *l = new leaf;
+        l->is_leaf = true;
+        l->count = keys.size() / leaves + (i < keys.size() % leaves);
+        l->next = NULL;
+        for (int j = 0; j < l->count; j++, k++) {
+            l->keys[j].size = keys[k].second;
+            memcpy(l->keys[j].bytes, keys[k].first, keys[k].second);
+        }
+        if (prev) {
+            prev->next = l;
+        }
+        prev = l;
+        level.push_back(l);
+        firsts.push_back(l->keys[0]);
+    }
+    while (level.size() > 1) {
+        std::vector<node *> up;
+        std::vector<key> up_firsts;
+        size_t nodes = (level.size() + FILL - 1) / FILL;
+        for (size_t i = 0, k = 0; i < nodes; i++) {
+            inner *in = new inner;
+            in->is_leaf = false;
+            in->count = level.size() / nodes + (i < level.size() % nodes);
+            up_firsts.push_back(firsts[k]);
+            for (int j = 0; j < in->count; j++, k++) {
+                in->children[j] = level[k];
+                if (j > 0) {
+                    in->keys[j - 1] = firsts[k];
+                }
+            }
+            up.push_back(in);
+        }
+        level.swap(up);
+        firsts.swap(up_firsts);
+    }
+    root = level[0];
+}
+
+void KVKeyTree::scan(const char *start, size_t size, const std::function<bool(const char *, size_t)> &fn) const {
+    const leaf *l = leaf_for(start, size, NULL);
+    for (int i = lower_bound(l, start, size); l; l = l->next, i = 0) {
+        for (; i < l->count; i++) {
+            if (!fn(l->keys[i].bytes, l->keys[i].size)) {
+                return;
+            }
+        }
+    }
+}
@@ -0,0 +1,175 @@
+#ifndef KV_INDEX_H
+#define KV_INDEX_H
+
+#include "kv_client.h"
+#include "kv_datalog.h"
+#include "kv_epoch.h"
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// What the emulator's index holds for a key
+struct KVIndexValue {
+    KVLogLocation location;
+    __u32 value_size;
+};
+
+// Concurrent hash index of keys up to 16 bytes. Buckets are chains of
+// immutable nodes: a writer links in a new node and retires the one it
+// replaces, so find() takes no lock and never sees half an update. Writers
+// lock the stripe a key hashes to, which makes a check and the change that
+// depends on it atomic for that key. The table doubles once a stripe has
+// twice as many keys as buckets, copying the nodes with every stripe locked.
+class KVHashIndex {
+    struct node;
+
+public:
+    static const unsigned STRIPE_BITS = 8;
+    static const size_t STRIPES = 1 << STRIPE_BITS;
+
+    KVHashIndex();
+    ~KVHashIndex();
+
+    KVHashIndex(const KVHashIndex &) = delete;
+    KVHashIndex &operator=(const KVHashIndex &) = delete;
+
+    // A key with its stripe locked
+    class Locked {
+    public:
+        Locked(Locked &&other);
+        ~Locked();
+
+        // NULL when the key is not there; good until the next set()/erase()
+        const KVIndexValue *get() const { return n ? &n->value : NULL; }
+        void set(const KVIndexValue &value);
+        void erase();
+
+    private:
+        friend class KVHashIndex;
+        Locked(KVHashIndex *index, const char *key, size_t size);
+
+        KVHashIndex *index;
+        size_t stripe;
+        __u64 hash;
+        const char *key;
+        size_t size;
+        std::atomic<KVHashIndex::node *> *link;     //what points at n, or the bucket head
+        KVHashIndex::node *n;
+        bool locked;
+    };
+
+    // The lookups take no lock: callers hold a KVEpochGuard around them
+    // and around any use of what they return
+    bool find(const char *key, size_t size, KVIndexValue *value) const;
+    Locked lock(const char *key, size_t size) { return Locked(this, key, size); }
+    // Every key, one stripe locked at a time: a key changed meanwhile is
+    // seen either before or after the change
+    void for_each(const std::function<void(const char *, size_t, const KVIndexValue &)> &fn);
+
+    size_t size() const;
+    // Sizes the table for n keys up front
+    void reserve(size_t n);
+    // Frees the retired nodes no reader can see any more
+    void reclaim();
+
+private:
+    struct node {
+        std::atomic<node *> next;
+        __u64 hash;
+        KVIndexValue value;
+        __u8 key_size;
+        char key[KV_MAX_KEY_SIZE];
+    };
+
+    // Buckets are picked by the top bits of the hash, the stripe by the
+    // top STRIPE_BITS: every stripe owns a run of neighbouring buckets
+    struct table {
+        unsigned shift;                     //64 - log2(buckets)
+        size_t size;
+        std::atomic<node *> *buckets;
+
+        std::atomic<node *> &bucket(__u64 hash) const { return buckets[hash >> shift]; }
+    };
+
+    struct alignas(64) stripe {
+        std::mutex lock;
+        std::atomic<size_t> count;
+        KVRetireList retired;
+    };
+
+    static __u64 hash_key(const char *key, size_t size);
+    static void free_node(void *p);
+    static void free_table(void *p);
+    static table *new_table(size_t buckets);
+    void grow(size_t buckets);
+
+    stripe stripes[STRIPES];
+    std::atomic<table *> current;
+    std::mutex tables_lock;
+    KVRetireList retired_tables;
+};
+
+// Keys up to 16 bytes in order, for List: a B+tree with wide nodes whose
+// leaves are chained, so a page of keys is a seek and a walk along the
+// leaves. Keys compare like std::string, byte by byte and a prefix first.
+// The owner serializes the calls.
+class KVKeyTree {
+public:
+    KVKeyTree();
+    ~KVKeyTree();
+
+    KVKeyTree(const KVKeyTree &) = delete;
+    KVKeyTree &operator=(const KVKeyTree &) = delete;
+
+    // false when the key is there already
+    bool insert(const char *key, size_t size);
+    // false when the key is not there
+    bool erase(const char *key, size_t size);
+    // Replaces the contents with keys that are sorted and unique
+    void assign(const std::vector<std::pair<const char *, size_t> > &keys);
+    // The keys from start on, in order, until fn returns false
+    void scan(const char *start, size_t size, const std::function<bool(const char *, size_t)> &fn) const;
+    size_t size() const { return count; }
+
+private:
+    static const int FANOUT = 64;
+
+    struct key {
+        __u8 size;
+        char bytes[KV_MAX_KEY_SIZE];
+    };
+
+    struct node {
+        bool is_leaf;
+        int count;                          //keys of a leaf, children of an inner node
+        key keys[FANOUT];                   //inner: keys[i] is the least key under children[i + 1]
+    };
+
+    struct leaf : node {
+        leaf *next;
+    };
+
+    struct inner : node {
+        node *children[FANOUT];
+    };
+
+    // A node and which of its children the way down took
+    struct step {
+        inner *n;
+        int child;
+    };
+
+    static int compare(const key &a, const char *bytes, size_t size);
+    static int lower_bound(const node *n, const char *bytes, size_t size);
+    static int child_of(const node *n, const char *bytes, size_t size);
+    static void free_node(node *n);
+    leaf *leaf_for(const char *bytes, size_t size, std::vector<step> *path) const;
+    void add_child(std::vector<step> &path, key first, node *right);
+    void merge(std::vector<step> &path);
+
+    node *root;
+    size_t count;
+};
+
+#endif
@@ -0,0 +1,204 @@
+#include "kv_large.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+const __u32 MANIFEST_MAGIC = 0x4f4c564b;    //"KVLO"
+const __u8 CHUNK_KEY_TAG = 0xfe;
+const int GET_RETRIES = 8;
+
+static __u32 next_generation(__u32 old) {
+    static thread_local std::mt19937 rng(std::random_device{}());
+    __u32 gen;
+    do {
+        gen = rng();
+    } while (gen == old);
+    return gen;
+}
+
+KVObjectStore::KVObjectStore(std::shared_ptr<KVSession> session, __u32 chunk_size)
+    : session(std::move(session)),
+      chunk(std::max<__u32>(1, std::min<__u32>(chunk_size, KV_MAX_VALUE_SIZE))) {
+}
+
+// hash of the user key, generation, chunk index (24 bits) and a tag byte
+KVKey KVObjectStore::chunk_key(const KVKey &key, __u32 generation, __u32 index) const {
+    __u64 h = 0xcbf29ce484222325ull ^ key.size;
+    for (int i = 0; i < key.size; i++) {
+        h = (h ^ key.bytes[i]) * 0x100000001b3ull;
+    }
+    __u8 bytes[KV_MAX_KEY_SIZE];
+    memcpy(bytes, &h, 8);
+    memcpy(bytes + 8, &generation, 4);
+    bytes[12] = index & 0xff;
+    bytes[13] = (index >> 8) & 0xff;
+    bytes[14] = (index >> 16) & 0xff;
+    bytes[15] = CHUNK_KEY_TAG;
+    return kv_key(bytes, sizeof(bytes));
+}
+
+int KVObjectStore::read_manifest(const KVKey &key, manifest *m) {
+    __u32 size = 0;
+    int ret = session->retrieve(key, m, sizeof(*m), &size);
+    if (ret != 0) {
+        return ret;
+    }
+    if (size != sizeof(*m) || m->magic != MANIFEST_MAGIC ||
+        m->crc != kv_crc32(m, offsetof(manifest, crc)) ||
+        m->chunk_size == 0 || m->chunks > MAX_CHUNKS ||
+        m->size > (__u64)m->chunk_size * m->chunks) {
+        return KV_ERR_INVALID_REQUEST;      //a plain value, not an object
+    }
+    return KV_SUCCESS;
+}
+
+void KVObjectStore::remove_chunks(const KVKey &key, __u32 generation, __u32 count) {
+    std::vector<struct nvme_passthru_cmd> cmds(count);
+    std::vector<int> status(count);
+    for (__u32 i = 0; i < count; i++) {
+        struct nvme_passthru_cmd &cmd = cmds[i];
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = KV_OPC_DELETE;
+        cmd.nsid = session->nsid();
+        kv_pack_key(&cmd, chunk_key(key, generation, i));
+        cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+    }
+    session->submit_batch(cmds.data(), count, status.data());
+}
+
+int KVObjectStore::put(const KVKey &key, const void *value, size_t size) {
+    __u64 chunks = (size + chunk - 1) / chunk;
+    if (chunks > MAX_CHUNKS) {
+        return KV_ERR_CAPACITY_EXCEEDED;
+    }
+    manifest old;
+    bool replacing = read_manifest(key, &old) == KV_SUCCESS;
+
+    manifest m;
+    memset(&m, 0, sizeof(m));
+    m.magic = MANIFEST_MAGIC;
+    m.chunk_size = chunk;
+    m.size = size;
+    m.generation = next_generation(replacing ? old.generation : 0);
+    m.chunks = chunks;
+    m.crc = kv_crc32(&m, offsetof(manifest, crc));
+
+    std::vector<struct nvme_passthru_cmd> cmds(chunks);
+    std::vector<int> status(chunks);
+    for (__u32 i = 0; i < chunks; i++) {
+        __u32 len = std::min<size_t>(chunk, size - (size_t)i * chunk);
+        struct nvme_passthru_cmd &cmd = cmds[i];
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = KV_OPC_STORE;
+        cmd.nsid = session->nsid();
+        kv_pack_key(&cmd, chunk_key(key, m.generation, i));
+        cmd.cdw10 = len;                    //value size
+        cmd.addr = (__u64)(uintptr_t)((const char *)value + (size_t)i * chunk);
+        cmd.data_len = len;
+        cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+    }
+    session->submit_batch(cmds.data(), chunks, status.data());
+    for (__u32 i = 0; i < chunks; i++) {
+        if (status[i] != 0) {
+            remove_chunks(key, m.generation, chunks);
+            return status[i];
+        }
+    }
+
+    // the manifest is the commit point. What it replaces is read again
+    // right before: a concurrent put may have swapped it in the meantime,
+    // and its chunks would be nobody's once ours is stored over it.
+    replacing = read_manifest(key, &old) == KV_SUCCESS;
+    int ret = session->store(key, &m, sizeof(m));
+    if (ret != 0) {
+        remove_chunks(key, m.generation, chunks);
+        return ret;
+    }
+    if (replacing && old.generation != m.generation) {
+        remove_chunks(key, old.generation, old.chunks);
+    }
+    // and one stored over ours since leaves ours to us
+    manifest now;
+    if (read_manifest(key, &now) == KV_SUCCESS && now.generation != m.generation) {
+        remove_chunks(key, m.generation, chunks);
+    }
+    return KV_SUCCESS;
+}
+
+int KVObjectStore::get(const KVKey &key, void *buf, size_t size, size_t *object_size) {
+    for (int attempt = 0; attempt < GET_RETRIES; attempt++) {
+        manifest m;
+        int ret = read_manifest(key, &m);
+        if (ret != 0) {
+            return ret;
+        }
+        size_t want = std::min<__u64>(size, m.size);
+        __u32 n = (want + m.chunk_size - 1) / m.chunk_size;
+        std::vector<struct nvme_passthru_cmd> cmds(n);
+        std::vector<int> status(n);
+        for (__u32 i = 0; i < n; i++) {
+            // a short last buffer is a partial read of that chunk
+            __u32 len = std::min<size_t>(m.chunk_size, want - (size_t)i * m.chunk_size);
+            struct nvme_passthru_cmd &cmd = cmds[i];
+            memset(&cmd, 0, sizeof(cmd));
+            cmd.opcode = KV_OPC_RETRIEVE;
+            cmd.nsid = session->nsid();
+            kv_pack_key(&cmd, chunk_key(key, m.generation, i));
+            cmd.cdw10 = len;                //buffer size
+            cmd.addr = (__u64)(uintptr_t)((char *)buf + (size_t)i * m.chunk_size);
+            cmd.data_len = len;
+            cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+        }
+        session->submit_batch(cmds.data(), n, status.data());
+
+        bool replaced = false;
+        ret = KV_SUCCESS;
+        for (__u32 i = 0; i < n && ret == 0; i++) {
+            if (status[i] == KV_ERR_KEY_NOT_EXIST) {
+                replaced = true;
+            } else if (status[i] != 0) {
+                ret = status[i];
+            }
+        }
+        if (ret != 0) {
+            return ret;
+        }
+        // a missing chunk means a concurrent put or remove swapped the
+        // generation under us: start over from the manifest
+        if (replaced) {
+            continue;
+        }
+        if (object_size) {
+            *object_size = m.size;
+        }
+        return KV_SUCCESS;
+    }
+    return KV_ERR_KEY_NOT_EXIST;
+}
+
+int KVObjectStore::stat(const KVKey &key, size_t *object_size) {
+    manifest m;
+    int ret = read_manifest(key, &m);
+    if (ret == 0 && object_size) {
+        *object_size = m.size;
+    }
+    return ret;
+}
+
+int KVObjectStore::remove(const KVKey &key) {
+    manifest m;
+    int ret = read_manifest(key, &m);
+    if (ret != 0) {
+        return ret;
+    }
+    // the object disappears with its manifest, the chunks are just garbage
+    ret = session->remove(key);
+    if (ret != 0) {
+        return ret;
+    }
+    remove_chunks(key, m.generation, m.chunks);
+    return KV_SUCCESS;
+}
@@ -0,0 +1,56 @@
+#ifndef KV_LARGE_H
+#define KV_LARGE_H
+
+#include "kv_client.h"
+#include <memory>
+
+// Values bigger than one device record. An object is cut into chunks of at
+// most chunk_size bytes stored under derived 16 byte keys, and a small
+// manifest (size, chunk size, generation) is stored under the user's key.
+//
+// Every put writes its chunks under a fresh generation and only then the
+// manifest, so a reader sees either the old object or the new one, never a
+// half-written mix. Chunks of the replaced generation are deleted after the
+// manifest flips; a crash in between leaves them behind as garbage.
+// Concurrent puts of one key: the last manifest stored wins, and each put
+// re-reads the manifest just before and after storing its own, to delete
+// the chunks of a put it overwrote or of one that overwrote it. What slips
+// through is a put overwritten, after its second read, by one that did its
+// first read before: those chunks stay behind like after a crash.
+//
+// Chunk commands go out through KVSession::submit_batch() and chunk reads
+// land directly in the caller's buffer.
+class KVObjectStore {
+public:
+    explicit KVObjectStore(std::shared_ptr<KVSession> session, __u32 chunk_size = KV_MAX_VALUE_SIZE);
+
+    int put(const KVKey &key, const void *value, size_t size);
+    // Copies up to size bytes; object_size receives the full object size
+    int get(const KVKey &key, void *buf, size_t size, size_t *object_size = NULL);
+    int stat(const KVKey &key, size_t *object_size);
+    int remove(const KVKey &key);
+
+    __u32 chunk_size() const { return chunk; }
+
+    static const __u32 MAX_CHUNKS = 1 << 24;
+
+private:
+    struct manifest {
+        __u32 magic;
+        __u32 chunk_size;
+        __u64 size;
+        __u32 generation;
+        __u32 chunks;
+        __u32 reserved;
+        __u32 crc;
+    };
+
+    int read_manifest(const KVKey &key, manifest *m);
+    KVKey chunk_key(const KVKey &key, __u32 generation, __u32 index) const;
+    void remove_chunks(const KVKey &key, __u32 generation, __u32 count);
+
+    std::shared_ptr<KVSession> session;
+    __u32 chunk;
+};
+
+#endif
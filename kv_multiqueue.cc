@@ -0,0 +1,400 @@
+#include "kv_multiqueue.h"
+#include "kv_buffer.h"
+#include "kv_client.h"
+#include "kv_histogram.h"
+#include "kv_uring.h"
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <new>
+
+// polls before sleeping; on a single CPU a spinning thread only delays
+// the one it waits for
+const int SPIN = 2000;
+
+enum { REQ_PENDING, REQ_WAITING, REQ_DONE };
+
+struct KVMultiQueueBackend::request {
+    struct nvme_passthru_cmd *cmd;
+    int status;
+    int err;
+    __u32 result;
+    __u64 end;                          //kv_now_ns() at completion
+    std::atomic<int> state;
+};
+
+struct KVMultiQueueBackend::queue {
+    explicit queue(size_t ring_size)
+        : ring(ring_size), doorbell(0), sleeping(0), done(0), steals(0), cpu(-1) {}
+
+    KVBoundedQueue<request *> ring;
+    alignas(64) std::atomic<int> doorbell;
+    std::atomic<int> sleeping;
+    std::atomic<__u64> done;
+    std::atomic<__u64> steals;
+    int cpu;
+    std::thread thread;
+};
+
+void KVMultiQueueBackend::queue_free::operator()(queue *q) const {
+    q->~queue();
+    free(q);
+}
+
+// A command in the worker's io_uring and the bounce buffer it owns
+struct KVMultiQueueBackend::slot {
+    request *r;
+    KVBuffer buffer;
+    __u8 *bounce;
+    bool copy_out;
+    std::vector<slot *> *free_list;
+};
+
+static void futex_wait(std::atomic<int> *addr, int value) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void futex_wake(std::atomic<int> *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+KVMultiQueueBackend::KVMultiQueueBackend(std::shared_ptr<KVBackend> inner, const KVMultiQueueConfig &config)
+    : inner(std::move(inner)), config(config),
+      spin(std::thread::hardware_concurrency() > 1 ? SPIN : 0), stopping(false) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    std::vector<int> cpus;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &allowed)) {
+                cpus.push_back(c);
+            }
+        }
+    }
+    if (cpus.empty()) {
+        cpus.push_back(0);
+    }
+    int n = config.queues > 0 ? config.queues : cpus.size();
+    queue_of_cpu.assign(CPU_SETSIZE, 0);
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        queue_of_cpu[c] = c % n;
+    }
+    for (int q = 0; q < n; q++) {
+        // the doorbell gets a line of its own, which plain new does not
+        // promise before C++17
+        void *p;
+        if (posix_memalign(&p, alignof(queue), sizeof(queue)) != 0) {
+            throw std::bad_alloc();
+        }
+        queue_list.emplace_back(new (p) queue(config.ring_size));
+        queue_list[q]->cpu = cpus[q % cpus.size()];
+        if (q < (int)cpus.size()) {
+            queue_of_cpu[cpus[q]] = q;
+        }
+    }
+    for (int q = 0; q < n; q++) {
+        queue_list[q]->thread = std::thread(&KVMultiQueueBackend::worker, this, q);
+    }
+}
+
+KVMultiQueueBackend::~KVMultiQueueBackend() {
+    stopping.store(true);
+    for (auto &q : queue_list) {
+        ring(q.get());
+    }
+    for (auto &q : queue_list) {
+        q->thread.join();
+    }
+}
+
+__u64 KVMultiQueueBackend::executed(int queue) const {
+    return queue_list[queue]->done.load(std::memory_order_relaxed);
+}
+
+__u64 KVMultiQueueBackend::stolen(int queue) const {
+    return queue_list[queue]->steals.load(std::memory_order_relaxed);
+}
+
+void KVMultiQueueBackend::enqueue(request *r) {
+    int cpu = sched_getcpu();
+    int home = cpu >= 0 && cpu < CPU_SETSIZE ? queue_of_cpu[cpu] : 0;
+    int n = queue_list.size();
+    int q = home;
+    // a full ring spills over to the next ones
+    for (int i = 0; !queue_list[q]->ring.push(r); i++) {
+        q = (home + i + 1) % n;
+        if (i >= n) {
+            std::this_thread::yield();
+        }
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    queue &target = *queue_list[q];
+    if (target.sleeping.load()) {
+        ring(&target);
+    }
+    if (target.ring.size_approx() > 1) {
+        // work is piling up: get an idle worker to steal some
+        for (int i = 1; i < n; i++) {
+            queue &other = *queue_list[(q + i) % n];
+            if (other.sleeping.load()) {
+                ring(&other);
+                break;
+            }
+        }
+    }
+}
+
+void KVMultiQueueBackend::ring(queue *q) {
+    q->doorbell.fetch_add(1);
+    futex_wake(&q->doorbell);
+}
+
+void KVMultiQueueBackend::wait(request *r) {
+    for (int i = 0; i < spin && r->state.load(std::memory_order_acquire) != REQ_DONE; i++) {
+        cpu_relax();
+    }
+    for (;;) {
+        int state = REQ_PENDING;
+        if (r->state.compare_exchange_strong(state, REQ_WAITING) || state == REQ_WAITING) {
+            futex_wait(&r->state, REQ_WAITING);
+        } else {
+            break;                              //done
+        }
+    }
+}
+
+// After the exchange the request may be gone: only its address is used
+void KVMultiQueueBackend::complete(request *r, int status, __u32 result) {
+    if (status < 0) {
+        r->err = -status;
+        status = -1;
+    }
+    r->status = status;
+    r->result = result;
+    r->end = kv_now_ns();
+    r->cmd->result = result;
+    if (r->state.exchange(REQ_DONE) == REQ_WAITING) {
+        futex_wake(&r->state);
+    }
+}
+
+void KVMultiQueueBackend::complete_slot(void *ctx, int status, __u32 result) {
+    slot *s = (slot *)ctx;
+    request *r = s->r;
+    // only what the command returned: the rest of the bounce buffer is stale
+    if (s->copy_out && status == 0) {
+        memcpy((void *)(uintptr_t)r->cmd->addr, s->bounce, kv_returned_bytes(r->cmd, result));
+    }
+    s->r = NULL;
+    s->free_list->push_back(s);
+    complete(r, status, result);
+}
+
+int KVMultiQueueBackend::submit(struct nvme_passthru_cmd *cmd, __u32 *result) {
+    request r;
+    r.cmd = cmd;
+    r.status = 0;
+    r.err = 0;
+    r.result = 0;
+    r.state.store(REQ_PENDING, std::memory_order_relaxed);
+    enqueue(&r);
+    wait(&r);
+    if (result) {
+        *result = r.result;
+    }
+    if (r.status < 0) {
+        errno = r.err;
+    }
+    return r.status;
+}
+
+void KVMultiQueueBackend::submit_batch(struct nvme_passthru_cmd *cmds, size_t n, int *status) {
+    std::vector<request> requests(n);
+    __u64 start = kv_now_ns();
+    for (size_t i = 0; i < n; i++) {
+        request &r = requests[i];
+        r.cmd = &cmds[i];
+        r.status = 0;
+        r.err = 0;
+        r.result = 0;
+        r.state.store(REQ_PENDING, std::memory_order_relaxed);
+        enqueue(&r);
+    }
+    for (size_t i = 0; i < n; i++) {
+        wait(&requests[i]);
+        status[i] = requests[i].status < 0 ? -requests[i].err : requests[i].status;
+        // the session times a batch as a whole only through this backend
+        kv_latency_record(cmds[i].opcode, status[i], requests[i].end - start);
+    }
+}
+
+// Own ring first, then the others'
+KVMultiQueueBackend::request *KVMultiQueueBackend::take(int q) {
+    request *r;
+    if (queue_list[q]->ring.pop(&r)) {
+        return r;
+    }
+    int n = queue_list.size();
+    for (int i = 1; i < n; i++) {
+        if (queue_list[(q + i) % n]->ring.pop(&r)) {
+            queue_list[q]->steals.fetch_add(1, std::memory_order_relaxed);
+            return r;
+        }
+    }
+    return NULL;
+}
+
+void KVMultiQueueBackend::worker(int q) {
+    queue &self = *queue_list[q];
+    if (config.pin) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(self.cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    std::unique_ptr<KVUringEngine> engine;
+    if (inner->device_fd() >= 0) {
+        engine = KVUringEngine::create(inner->device_fd(), config.queue_depth);
+    }
+    // bounce buffers, touched here first so the pages come from this
+    // core's node, and registered with the ring as fixed buffers
+    std::shared_ptr<KVBufferPool> pool;
+    std::vector<slot> slots;
+    std::vector<slot *> free_slots;
+    if (engine) {
+        engine->record_latency(false);
+        KVBufferPoolConfig pool_config;
+        pool_config.buffers = config.queue_depth;
+        pool = KVBufferPool::create(pool_config);
+        if (pool) {
+            engine->register_buffers(pool);
+        }
+        slots.resize(config.queue_depth);
+        for (unsigned i = 0; i < config.queue_depth; i++) {
+            if (pool) {
+                slots[i].buffer = pool->lease();
+                memset(slots[i].buffer.data(), 0, slots[i].buffer.size());
+            }
+            slots[i].r = NULL;
+            slots[i].bounce = (__u8 *)slots[i].buffer.data();
+            slots[i].free_list = &free_slots;
+            free_slots.push_back(&slots[i]);
+        }
+    }
+
+    // the ring is unusable. What the kernel took may still write to the
+    // bounce buffers, so it goes no further before that is done; what it
+    // never took, and what comes after, runs through the inner backend.
+    auto give_up = [&] {
+        while (engine->in_kernel() > 0 && engine->reap(engine->in_kernel()) >= 0) {
+        }
+        bool drained = engine->in_kernel() == 0;
+        for (slot &s : slots) {
+            request *r = s.r;
+            if (!r) {
+                continue;
+            }
+            s.r = NULL;
+            int status = -EIO;
+            __u32 result = 0;
+            if (drained) {
+                int ret = inner->submit(r->cmd, &result);
+                status = ret < 0 ? -errno : ret;
+            }
+            complete(r, status, result);
+        }
+        engine.reset();
+    };
+
+    int idle = 0;
+    for (;;) {
+        bool progress = false;
+        while (!engine || !free_slots.empty()) {
+            request *r = take(q);
+            if (!r) {
+                break;
+            }
+            progress = true;
+            self.done.fetch_add(1, std::memory_order_relaxed);
+            if (!engine) {
+                __u32 result = 0;
+                int ret = inner->submit(r->cmd, &result);
+                complete(r, ret < 0 ? -errno : ret, result);
+                continue;
+            }
+            slot *s = free_slots.back();
+            free_slots.pop_back();
+            struct nvme_passthru_cmd cmd = *r->cmd;
+            bool bounce = s->bounce && cmd.addr && cmd.data_len <= BUFFER_SIZE;
+            if (bounce) {
+                if (cmd.opcode == KV_OPC_STORE) {
+                    memcpy(s->bounce, (const void *)(uintptr_t)cmd.addr, cmd.data_len);
+                }
+                cmd.addr = (__u64)(uintptr_t)s->bounce;
+            }
+            s->r = r;
+            s->copy_out = bounce && cmd.opcode != KV_OPC_STORE;
+            if (engine->queue(&cmd, complete_slot, s) < 0) {
+                free_slots.push_back(s);
+                __u32 result = 0;
+                int ret = inner->submit(r->cmd, &result);
+                complete(r, ret < 0 ? -errno : ret, result);
+            }
+        }
+        if (engine) {
+            int ret = engine->submit();
+            if (ret >= 0 && engine->inflight() > 0) {
+                ret = engine->reap(0);
+                progress |= ret > 0;
+            }
+            if (ret < 0) {
+                give_up();
+                progress = true;
+            }
+        }
+        if (progress) {
+            idle = 0;
+            continue;
+        }
+        if (engine && engine->inflight() > 0) {
+            if (++idle > spin && engine->reap(1) < 0) {
+                give_up();
+            }
+            continue;
+        }
+        if (stopping.load()) {
+            break;
+        }
+        if (++idle < spin) {
+            cpu_relax();
+            continue;
+        }
+        // nothing anywhere: sleep until a producer rings
+        int bell = self.doorbell.load();
+        self.sleeping.store(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool empty = true;
+        for (auto &other : queue_list) {
+            empty &= other->ring.size_approx() == 0;
+        }
+        if (empty && !stopping.load()) {
+            futex_wait(&self.doorbell, bell);
+        }
+        self.sleeping.store(0);
+        idle = 0;
+    }
+}
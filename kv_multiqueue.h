@@ -0,0 +1,140 @@
+#ifndef KV_MULTIQUEUE_H
+#define KV_MULTIQUEUE_H
+
+#include "kv_backend.h"
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Bounded lock-free multi-producer multi-consumer ring (Vyukov): every cell
+// carries a sequence number telling producers and consumers whose turn it is
+template <typename T>
+class KVBoundedQueue {
+public:
+    explicit KVBoundedQueue(size_t size) : enqueue_pos(0), dequeue_pos(0) {
+        size_t n = 2;
+        while (n < size) {
+            n <<= 1;
+        }
+        cells = std::vector<cell>(n);
+        mask = n - 1;
+        for (size_t i = 0; i < n; i++) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(const T &value) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell &c = cells[pos & mask];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.value = value;
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;               //full
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(T *value) {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell &c = cells[pos & mask];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    *value = c.value;
+                    c.seq.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;               //empty
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Only a hint while other threads push and pop
+    size_t size_approx() const {
+        size_t head = dequeue_pos.load(std::memory_order_relaxed);
+        size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+private:
+    struct cell {
+        std::atomic<size_t> seq;
+        T value;
+
+        cell() : seq(0), value() {}
+        cell(const cell &) : seq(0), value() {}
+    };
+
+    std::vector<cell> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueue_pos;
+    alignas(64) std::atomic<size_t> dequeue_pos;
+};
+
+struct KVMultiQueueConfig {
+    int queues = 0;                 //0: one per CPU the process may run on
+    bool pin = true;                //pin queue i's worker to the i-th CPU
+    unsigned queue_depth = 64;      //commands in flight per queue
+    size_t ring_size = 1024;        //requests waiting per queue
+};
+
+// Multi-queue submission. Each queue has a worker thread pinned to one
+// core, with its own io_uring on the device and its own pool of bounce
+// buffers, first touched by that worker so they sit on its NUMA node and
+// registered with the ring as fixed buffers. A command goes to the queue
+// of the core the caller runs on through a lock-free ring; workers with
+// nothing to do steal from the other rings.
+// Without a device fd the workers call the inner backend directly.
+class KVMultiQueueBackend : public KVBackend {
+public:
+    KVMultiQueueBackend(std::shared_ptr<KVBackend> inner, const KVMultiQueueConfig &config = KVMultiQueueConfig());
+    ~KVMultiQueueBackend();
+
+    int submit(struct nvme_passthru_cmd *cmd, __u32 *result) override;
+    void submit_batch(struct nvme_passthru_cmd *cmds, size_t n, int *status) override;
+    int device_fd() const override { return inner->device_fd(); }
+
+    int queues() const { return queue_list.size(); }
+    __u64 executed(int queue) const;
+    __u64 stolen(int queue) const;
+
+private:
+    struct request;
+    struct queue;
+    struct slot;
+    struct queue_free {
+        void operator()(queue *q) const;
+    };
+
+    void enqueue(request *r);
+    void ring(queue *q);
+    void wait(request *r);
+    static void complete(request *r, int status, __u32 result);
+    static void complete_slot(void *ctx, int status, __u32 result);
+    request *take(int q);
+    void worker(int q);
+
+    std::shared_ptr<KVBackend> inner;
+    KVMultiQueueConfig config;
+    std::vector<std::unique_ptr<queue, queue_free> > queue_list;
+    std::vector<int> queue_of_cpu;
+    int spin;
+    std::atomic<bool> stopping;
+};
+
+#endif
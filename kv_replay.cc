@@ -0,0 +1,203 @@
+#include "kv_client.h"
+#include "kv_histogram.h"
+#include "kv_trace.h"
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Re-issues a trace recorded through a "trace:<file>,<spec>" backend
+// against a device or emulator, then compares the latency distributions of
+// the recording and of the replay, per opcode. Commands are paced evenly at
+// the recorded average rate times -s, or with the recorded gaps between
+// them under -p; "-s max" sends them as fast as the workers can.
+
+struct replay_config {
+    const char *device = KV_DEFAULT_DEVICE;
+    const char *trace = NULL;
+    double speed = 1;               //0: as fast as possible
+    bool original_gaps = false;
+    int threads = 4;
+    long nsid = -1;                 //-1: the recorded one
+};
+
+const __u64 LATE_NS = 1000000;      //issued this much after its slot counts as late
+
+struct worker_stats {
+    KVHistogram latency[KV_LAT_OPS];
+    __u64 mismatches = 0;
+    __u64 late = 0;
+};
+
+static void sleep_until(__u64 ns) {
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000ull;
+    ts.tv_nsec = ns % 1000000000ull;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static void replay(const KVTraceReader &trace, const std::vector<__u32> &order, const std::vector<__u64> &due,
+                   KVBackend *backend, const replay_config &config, size_t buffer_size,
+                   std::atomic<size_t> *next, worker_stats *stats) {
+    std::vector<__u8> buf(buffer_size, 0x5a);
+    for (;;) {
+        size_t i = next->fetch_add(1);
+        if (i >= order.size()) {
+            return;
+        }
+        const KVTraceRecord &r = trace[order[i]];
+        if (!due.empty()) {
+            __u64 now = kv_now_ns();
+            if (now < due[i]) {
+                sleep_until(due[i]);
+            } else if (now - due[i] > LATE_NS) {
+                stats->late++;
+            }
+        }
+        struct nvme_passthru_cmd cmd;
+        kv_trace_command(r, &cmd, buf.data());
+        if (config.nsid >= 0) {
+            cmd.nsid = config.nsid;
+        }
+        __u32 result = 0;
+        __u64 start = kv_now_ns();
+        int ret = backend->submit(&cmd, &result);
+        stats->latency[kv_latency_op_index(r.opcode)].record(kv_now_ns() - start);
+        int status = ret < 0 ? -errno : ret;
+        stats->mismatches += status != r.status;
+    }
+}
+
+static const char *op_name(int op) {
+    static const char *const names[KV_LAT_OPS] = {"store", "retrieve", "list", "delete", "exists", "other"};
+    return names[op];
+}
+
+static double us(__u64 ns) {
+    return ns / 1e3;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-d device|emu] [-s speed|max] [-p] [-t threads] [-n nsid] trace\n"
+            "  -s  N times the recorded rate (default 1), max: no pacing\n"
+            "  -p  keep the recorded gaps between commands instead of even pacing\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    replay_config config;
+    const char *env = getenv("KV_DEVICE");
+    if (env && *env) {
+        config.device = env;
+    }
+    int opt;
+    while ((opt = getopt(argc, argv, "d:s:pt:n:h")) != -1) {
+        switch (opt) {
+        case 'd': config.device = optarg; break;
+        case 's': config.speed = strcmp(optarg, "max") == 0 ? 0 : atof(optarg); break;
+        case 'p': config.original_gaps = true; break;
+        case 't': config.threads = atoi(optarg); break;
+        case 'n': config.nsid = strtol(optarg, NULL, 0); break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1 || config.speed < 0 || config.threads < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+    config.trace = argv[optind];
+
+    std::unique_ptr<KVTraceReader> trace = KVTraceReader::open(config.trace);
+    if (!trace) {
+        return 2;
+    }
+    if (trace->size() == 0) {
+        fprintf(stderr, "The trace is empty\n");
+        return 2;
+    }
+    std::shared_ptr<KVBackend> backend = kv_open_backend(config.device);
+    if (!backend) {
+        fprintf(stderr, "Could NOT open the KV device %s\n", config.device);
+        return 2;
+    }
+
+    // records are written as commands complete: replay them in issue order
+    const KVTraceReader &t = *trace;
+    std::vector<__u32> order(t.size());
+    size_t buffer_size = 1;
+    KVHistogram recorded[KV_LAT_OPS];
+    for (size_t i = 0; i < t.size(); i++) {
+        order[i] = i;
+        buffer_size = std::max<size_t>(buffer_size, t[i].data_len);
+        recorded[kv_latency_op_index(t[i].opcode)].record(t[i].latency_ns);
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&t](__u32 a, __u32 b) { return t[a].issued_ns < t[b].issued_ns; });
+
+    __u64 first = t[order.front()].issued_ns;
+    __u64 span = t[order.back()].issued_ns - first;
+    __u64 start = kv_now_ns() + (config.speed > 0 ? 1000000 : 0);      //time to start the workers
+    std::vector<__u64> due;
+    if (config.speed > 0) {
+        due.resize(order.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            double offset = config.original_gaps ? t[order[i]].issued_ns - first
+                                                 : order.size() > 1 ? (double)span * i / (order.size() - 1) : 0;
+            due[i] = start + (__u64)(offset / config.speed);
+        }
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<worker_stats> stats(config.threads);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < config.threads; i++) {
+        workers.emplace_back(replay, std::cref(t), std::cref(order), std::cref(due), backend.get(),
+                             std::cref(config), buffer_size, &next, &stats[i]);
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+    __u64 end = kv_now_ns();
+    double elapsed = end > start ? (end - start) / 1e9 : 0;
+
+    KVHistogram replayed[KV_LAT_OPS];
+    __u64 mismatches = 0;
+    __u64 late = 0;
+    for (worker_stats &s : stats) {
+        for (int op = 0; op < KV_LAT_OPS; op++) {
+            replayed[op].merge(s.latency[op]);
+        }
+        mismatches += s.mismatches;
+        late += s.late;
+    }
+
+    printf("%zu commands over %.3f s recorded, replayed in %.3f s (%.0f ops/s)\n", t.size(), span / 1e9,
+           elapsed, elapsed > 0 ? t.size() / elapsed : 0);
+    printf("%-9s %9s %21s %21s %21s %21s\n", "", "", "p50_us", "p99_us", "p999_us", "max_us");
+    printf("%-9s %9s %10s %10s %10s %10s %10s %10s %10s %10s\n", "op", "count", "recorded", "replayed",
+           "recorded", "replayed", "recorded", "replayed", "recorded", "replayed");
+    for (int op = 0; op < KV_LAT_OPS; op++) {
+        const KVHistogram &a = recorded[op];
+        const KVHistogram &b = replayed[op];
+        if (a.count() == 0) {
+            continue;
+        }
+        printf("%-9s %9llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", op_name(op),
+               (unsigned long long)a.count(), us(a.percentile(0.5)), us(b.percentile(0.5)),
+               us(a.percentile(0.99)), us(b.percentile(0.99)), us(a.percentile(0.999)),
+               us(b.percentile(0.999)), us(a.max()), us(b.max()));
+    }
+    printf("status differs from the recording: %llu, issued late: %llu\n", (unsigned long long)mismatches,
+           (unsigned long long)late);
+    return 0;
+}
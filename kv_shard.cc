@@ -0,0 +1,460 @@
+#include "kv_shard.h"
+#include "kv_cursor.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <future>
+
+static __u64 mix64(__u64 h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+static __u64 hash_bytes(const void *data, size_t size) {
+    const __u8 *p = (const __u8 *)data;
+    __u64 h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    }
+    return mix64(h);
+}
+
+static __u64 key_hash(const KVKey &key) {
+    return hash_bytes(key.bytes, key.size);
+}
+
+static std::string key_string(const KVKey &key) {
+    return std::string((const char *)key.bytes, key.size);
+}
+
+const KVShard *KVShardBackend::layout::owner(__u64 hash) const {
+    auto it = std::lower_bound(ring.begin(), ring.end(), hash,
+                               [](const point &p, __u64 h) { return p.hash < h; });
+    return it == ring.end() ? ring.front().shard : it->shard;
+}
+
+KVShardBackend::KVShardBackend(const std::vector<KVShard> &shards, int vnodes)
+    : vnodes(vnodes > 0 ? vnodes : 1), moved_keys(0) {
+    std::vector<std::shared_ptr<KVShard> > list;
+    for (const KVShard &s : shards) {
+        list.push_back(std::make_shared<KVShard>(s));
+    }
+    current = build(list);
+}
+
+std::shared_ptr<KVShardBackend::layout> KVShardBackend::build(const std::vector<std::shared_ptr<KVShard> > &shards) const {
+    std::shared_ptr<layout> l = std::make_shared<layout>();
+    l->shards = shards;
+    for (auto &s : shards) {
+        for (int v = 0; v < vnodes; v++) {
+            std::string point_name = s->name + "#" + std::to_string(v);
+            l->ring.push_back(point{hash_bytes(point_name.data(), point_name.size()), s.get()});
+        }
+    }
+    std::sort(l->ring.begin(), l->ring.end(), [](const point &a, const point &b) { return a.hash < b.hash; });
+    return l;
+}
+
+// Current shards plus, mid-rebalance, the ones on their way out
+std::vector<const KVShard *> KVShardBackend::all_shards() const {
+    std::vector<const KVShard *> all;
+    for (auto &s : current->shards) {
+        all.push_back(s.get());
+    }
+    if (previous) {
+        for (auto &s : previous->shards) {
+            if (std::find(all.begin(), all.end(), s.get()) == all.end()) {
+                all.push_back(s.get());
+            }
+        }
+    }
+    return all;
+}
+
+int KVShardBackend::forward(const KVShard *shard, struct nvme_passthru_cmd *cmd, __u32 *result) {
+    __u32 nsid = cmd->nsid;
+    cmd->nsid = shard->nsid;
+    int ret = shard->backend->submit(cmd, result);
+    cmd->nsid = nsid;
+    return ret;
+}
+
+int KVShardBackend::key_command(const KVShard *shard, __u8 opcode, const KVKey &key) {
+    struct nvme_passthru_cmd cmd = {0,};
+    __u32 result;
+    cmd.opcode = opcode;
+    cmd.nsid = NSID;
+    kv_pack_key(&cmd, key);
+    cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+    return forward(shard, &cmd, &result);
+}
+
+int KVShardBackend::submit(struct nvme_passthru_cmd *cmd, __u32 *result) {
+    std::shared_lock<std::shared_timed_mutex> guard(layout_lock);
+    __u32 key_size = cmd->cdw11 & 0xff;
+    const KVShard *first = current->ring.front().shard;
+    if (cmd->nsid != NSID || key_size == 0 || key_size > KV_MAX_KEY_SIZE) {
+        // any shard gives the same error
+        return first->backend->submit(cmd, result);
+    }
+    if (cmd->opcode == KV_OPC_LIST) {
+        return list(cmd, result);
+    }
+    if (cmd->opcode != KV_OPC_STORE && cmd->opcode != KV_OPC_RETRIEVE &&
+        cmd->opcode != KV_OPC_EXISTS && cmd->opcode != KV_OPC_DELETE) {
+        return forward(first, cmd, result);
+    }
+    KVKey key = kv_unpack_key(cmd);
+    __u64 hash = key_hash(key);
+    const KVShard *to = current->owner(hash);
+    const KVShard *from = previous ? previous->owner(hash) : to;
+    if (to == from) {
+        return forward(to, cmd, result);
+    }
+    std::lock_guard<std::mutex> stripe(stripes[hash % STRIPES]);
+    return migrating(to, from, cmd, result);
+}
+
+// A key whose owner is changing: it is on one of the two shards, never both
+// once the stripe lock is released
+int KVShardBackend::migrating(const KVShard *to, const KVShard *from, struct nvme_passthru_cmd *cmd, __u32 *result) {
+    KVKey key = kv_unpack_key(cmd);
+    switch (cmd->opcode) {
+    case KV_OPC_RETRIEVE:
+    case KV_OPC_EXISTS: {
+        int ret = forward(to, cmd, result);
+        return ret == KV_ERR_KEY_NOT_EXIST ? forward(from, cmd, result) : ret;
+    }
+    case KV_OPC_DELETE: {
+        int ret = forward(to, cmd, result);
+        int old = key_command(from, KV_OPC_DELETE, key);
+        return ret == KV_ERR_KEY_NOT_EXIST && old == 0 ? 0 : ret;
+    }
+    }
+
+    // Store: the options look at both copies
+    __u32 options = cmd->cdw11 & (KV_STORE_MUST_EXIST | KV_STORE_MUST_NOT_EXIST);
+    int ret;
+    if (options && key_command(from, KV_OPC_EXISTS, key) == 0) {
+        if (options & KV_STORE_MUST_NOT_EXIST) {
+            return KV_ERR_INVALID_REQUEST;
+        }
+        __u32 cdw11 = cmd->cdw11;
+        cmd->cdw11 &= ~options;
+        ret = forward(to, cmd, result);
+        cmd->cdw11 = cdw11;
+    } else {
+        ret = forward(to, cmd, result);
+    }
+    if (ret == 0) {
+        key_command(from, KV_OPC_DELETE, key);
+    }
+    return ret;
+}
+
+int KVShardBackend::list(struct nvme_passthru_cmd *cmd, __u32 *result) {
+    if (cmd->cdw10 == 0) {
+        return forward(current->ring.front().shard, cmd, result);
+    }
+    std::vector<const KVShard *> shards = all_shards();
+    size_t size = cmd->cdw10;
+    std::vector<std::vector<__u8> > pages(shards.size(), std::vector<__u8>(size));
+    std::vector<int> status(shards.size());
+
+    auto fetch = [this, cmd, size, &shards, &pages, &status](size_t i) {
+        struct nvme_passthru_cmd c = *cmd;
+        __u32 dw0;
+        c.addr = (__u64)(uintptr_t)pages[i].data();
+        c.data_len = size;
+        status[i] = forward(shards[i], &c, &dw0);
+    };
+    std::vector<std::future<void> > pending;
+    for (size_t i = 1; i < shards.size(); i++) {
+        pending.push_back(std::async(std::launch::async, fetch, i));
+    }
+    fetch(0);
+    for (auto &f : pending) {
+        f.get();
+    }
+
+    // A full page may stop short of keys that sort before another shard's
+    // last key, so the merge only goes up to the smallest such last key
+    const size_t MAX_ENTRY = (2 + KV_MAX_KEY_SIZE + 3) & ~(size_t)3;
+    std::vector<std::string> merged;
+    bool bounded = false;
+    std::string bound;
+    for (size_t i = 0; i < shards.size(); i++) {
+        if (status[i] != 0) {
+            return status[i];
+        }
+        std::vector<KVKey> keys;
+        if (kv_list_parse(pages[i].data(), size, &keys) < 0) {
+            return -1;
+        }
+        size_t used = 4;
+        for (const KVKey &k : keys) {
+            used += (2 + k.size + 3) & ~(size_t)3;
+            merged.push_back(key_string(k));
+        }
+        if (size < used + MAX_ENTRY) {
+            std::string last = keys.empty() ? std::string() : key_string(keys.back());
+            if (!bounded || last < bound) {
+                bound = last;
+                bounded = true;
+            }
+        }
+    }
+    std::sort(merged.begin(), merged.end());
+    merged.erase(std::unique(merged.begin(), merged.end()), merged.end());
+    std::vector<KVKey> out;
+    for (const std::string &k : merged) {
+        if (bounded && k > bound) {
+            break;
+        }
+        out.push_back(kv_key(k.data(), k.size()));
+    }
+    std::vector<__u8> page(size);
+    __u32 count = kv_list_encode(out, page.data(), size);
+    if (cmd->addr) {
+        memcpy((void *)(uintptr_t)cmd->addr, page.data(), std::min<size_t>(size, cmd->data_len));
+    }
+    cmd->result = count;
+    if (result) {
+        *result = count;
+    }
+    return KV_SUCCESS;
+}
+
+void KVShardBackend::submit_batch(struct nvme_passthru_cmd *cmds, size_t n, int *status) {
+    std::vector<size_t> direct;
+    {
+        std::shared_lock<std::shared_timed_mutex> guard(layout_lock);
+        const layout &l = *current;
+        std::vector<std::vector<size_t> > groups(l.shards.size());
+        for (size_t i = 0; i < n; i++) {
+            __u32 key_size = cmds[i].cdw11 & 0xff;
+            bool routable = !previous && cmds[i].nsid == NSID && key_size > 0 &&
+                            key_size <= KV_MAX_KEY_SIZE && cmds[i].opcode != KV_OPC_LIST;
+            if (!routable) {
+                direct.push_back(i);
+                continue;
+            }
+            const KVShard *owner = l.owner(key_hash(kv_unpack_key(&cmds[i])));
+            for (size_t s = 0; s < l.shards.size(); s++) {
+                if (l.shards[s].get() == owner) {
+                    groups[s].push_back(i);
+                }
+            }
+        }
+
+        auto run = [cmds, status, &l, &groups](size_t s) {
+            std::vector<size_t> &idx = groups[s];
+            std::vector<struct nvme_passthru_cmd> batch(idx.size());
+            std::vector<int> st(idx.size());
+            for (size_t j = 0; j < idx.size(); j++) {
+                batch[j] = cmds[idx[j]];
+                batch[j].nsid = l.shards[s]->nsid;
+            }
+            l.shards[s]->backend->submit_batch(batch.data(), batch.size(), st.data());
+            for (size_t j = 0; j < idx.size(); j++) {
+                cmds[idx[j]].result = batch[j].result;
+                status[idx[j]] = st[j];
+            }
+        };
+        // the layout must not change until every group is done
+        std::vector<std::future<void> > pending;
+        for (size_t s = 1; s < groups.size(); s++) {
+            if (!groups[s].empty()) {
+                pending.push_back(std::async(std::launch::async, run, s));
+            }
+        }
+        if (!groups.empty() && !groups[0].empty()) {
+            run(0);
+        }
+        for (auto &f : pending) {
+            f.get();
+        }
+    }
+    // LIST, errors and commands caught in a rebalance take the usual path
+    for (size_t i : direct) {
+        status[i] = submit(&cmds[i], &cmds[i].result);
+    }
+}
+
+int KVShardBackend::move_key(const KVKey &key, const KVShard *from, const KVShard *to) {
+    std::lock_guard<std::mutex> stripe(stripes[key_hash(key) % STRIPES]);
+    std::vector<__u8> value(BUFFER_SIZE);
+    struct nvme_passthru_cmd cmd = {0,};
+    __u32 size = 0;
+    cmd.opcode = KV_OPC_RETRIEVE;
+    cmd.nsid = NSID;
+    kv_pack_key(&cmd, key);
+    cmd.cdw10 = value.size();               //buffer size
+    cmd.addr = (__u64)(uintptr_t)value.data();
+    cmd.data_len = value.size();
+    cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+    int ret = forward(from, &cmd, &size);
+    if (ret == KV_ERR_KEY_NOT_EXIST) {
+        return 0;                           //deleted meanwhile
+    }
+    if (ret != 0) {
+        return ret;
+    }
+    // a newer write may already sit on the new owner: it wins
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = KV_OPC_STORE;
+    cmd.nsid = NSID;
+    cmd.cdw11 = KV_STORE_MUST_NOT_EXIST;
+    kv_pack_key(&cmd, key);
+    cmd.cdw10 = size;                       //value size
+    cmd.addr = (__u64)(uintptr_t)value.data();
+    cmd.data_len = size;
+    cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+    __u32 dw0;
+    ret = forward(to, &cmd, &dw0);
+    if (ret != 0 && ret != KV_ERR_INVALID_REQUEST) {
+        return ret;
+    }
+    if (ret == 0) {
+        moved_keys.fetch_add(1, std::memory_order_relaxed);
+    }
+    ret = key_command(from, KV_OPC_DELETE, key);
+    return ret == KV_ERR_KEY_NOT_EXIST ? 0 : ret;
+}
+
+int KVShardBackend::rebalance() {
+    std::shared_ptr<layout> next;
+    std::shared_ptr<layout> prev;
+    {
+        std::shared_lock<std::shared_timed_mutex> guard(layout_lock);
+        next = current;
+        prev = previous;
+    }
+    if (!prev) {
+        return 0;
+    }
+    for (auto &s : prev->shards) {
+        KVListCursor cursor(std::make_shared<KVSession>(s->backend, s->nsid));
+        KVKey key;
+        while (cursor.next(&key)) {
+            const KVShard *to = next->owner(key_hash(key));
+            if (to == s.get()) {
+                continue;
+            }
+            int ret = move_key(key, s.get(), to);
+            if (ret != 0) {
+                return ret;
+            }
+        }
+        if (cursor.status() != 0) {
+            return cursor.status();
+        }
+    }
+    std::lock_guard<std::shared_timed_mutex> guard(layout_lock);
+    previous.reset();
+    return 0;
+}
+
+int KVShardBackend::add_shard(const KVShard &shard) {
+    std::lock_guard<std::mutex> one(rebalance_lock);
+    int ret = rebalance();
+    if (ret != 0) {
+        return ret;
+    }
+    {
+        std::lock_guard<std::shared_timed_mutex> guard(layout_lock);
+        std::vector<std::shared_ptr<KVShard> > shards = current->shards;
+        shards.push_back(std::make_shared<KVShard>(shard));
+        previous = current;
+        current = build(shards);
+    }
+    return rebalance();
+}
+
+int KVShardBackend::remove_shard(const std::string &name) {
+    std::lock_guard<std::mutex> one(rebalance_lock);
+    int ret = rebalance();
+    if (ret != 0) {
+        return ret;
+    }
+    {
+        std::lock_guard<std::shared_timed_mutex> guard(layout_lock);
+        std::vector<std::shared_ptr<KVShard> > shards;
+        for (auto &s : current->shards) {
+            if (s->name != name) {
+                shards.push_back(s);
+            }
+        }
+        if (shards.size() == current->shards.size() || shards.empty()) {
+            return -1;                      //unknown, or the last shard
+        }
+        previous = current;
+        current = build(shards);
+    }
+    return rebalance();
+}
+
+size_t KVShardBackend::shard_count() {
+    std::shared_lock<std::shared_timed_mutex> guard(layout_lock);
+    return current->shards.size();
+}
+
+std::string KVShardBackend::owner(const KVKey &key) {
+    std::shared_lock<std::shared_timed_mutex> guard(layout_lock);
+    return current->owner(key_hash(key))->name;
+}
+
+bool kv_is_shard_spec(const char *spec) {
+    return strncmp(spec, "shard:", 6) == 0;
+}
+
+std::shared_ptr<KVShardBackend> kv_open_shards(const char *spec) {
+    if (!kv_is_shard_spec(spec)) {
+        return NULL;
+    }
+    std::vector<KVShard> shards;
+    std::string rest(spec + 6);
+    size_t pos = 0;
+    while (pos <= rest.size()) {
+        size_t end = rest.find(';', pos);
+        if (end == std::string::npos) {
+            end = rest.size();
+        }
+        std::string part = rest.substr(pos, end - pos);
+        pos = end + 1;
+        if (part.empty()) {
+            continue;
+        }
+        KVShard shard;
+        shard.name = part;
+        shard.nsid = 1;
+        size_t at = part.rfind('@');
+        if (at != std::string::npos) {
+            shard.nsid = strtoul(part.c_str() + at + 1, NULL, 0);
+            part.resize(at);
+        }
+        shard.backend = kv_open_backend(part.c_str());
+        if (!shard.backend) {
+            return NULL;
+        }
+        for (const KVShard &other : shards) {
+            // the same emulator twice would be one store seen through two shards
+            if (other.backend == shard.backend && other.nsid == shard.nsid) {
+                fprintf(stderr, "Shard listed twice: %s\n", shard.name.c_str());
+                return NULL;
+            }
+        }
+        shards.push_back(shard);
+    }
+    if (shards.empty()) {
+        fprintf(stderr, "Invalid shard spec: %s\n", spec);
+        return NULL;
+    }
+    return std::make_shared<KVShardBackend>(shards);
+}
@@ -0,0 +1,84 @@
+#ifndef KV_SHARD_H
+#define KV_SHARD_H
+
+#include "kv_backend.h"
+#include "kv_client.h"
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+// One device and namespace of a sharded keyspace. The name places it on
+// the hash ring, so it must stay the same from one run to the next.
+struct KVShard {
+    std::string name;
+    std::shared_ptr<KVBackend> backend;
+    __u32 nsid;
+};
+
+// Spreads keys over several devices or namespaces with consistent hashing:
+// each shard owns vnodes points of a 64 bit ring and a key belongs to the
+// first point at or after its hash. Commands use namespace 1 and are sent
+// on with the shard's own nsid. LIST asks every shard and merges the pages
+// in key order.
+//
+// add_shard() and remove_shard() rebalance online: only keys whose owner
+// changed are moved, one at a time under a per-key stripe lock. While they
+// move, reads look at the new owner and then the old one, writes go to the
+// new owner and drop the old copy, and LIST merges both rings.
+class KVShardBackend : public KVBackend {
+public:
+    explicit KVShardBackend(const std::vector<KVShard> &shards, int vnodes = 64);
+
+    int submit(struct nvme_passthru_cmd *cmd, __u32 *result) override;
+    // Commands of a batch are grouped per shard and the groups run at once
+    void submit_batch(struct nvme_passthru_cmd *cmds, size_t n, int *status) override;
+
+    int add_shard(const KVShard &shard);
+    int remove_shard(const std::string &name);
+    // Finishes a rebalance that stopped on an error
+    int rebalance();
+
+    size_t shard_count();
+    std::string owner(const KVKey &key);
+    __u64 moved() const { return moved_keys.load(std::memory_order_relaxed); }
+
+private:
+    static const int STRIPES = 64;
+    static const __u32 NSID = 1;
+
+    struct point {
+        __u64 hash;
+        const KVShard *shard;
+    };
+
+    struct layout {
+        std::vector<std::shared_ptr<KVShard> > shards;
+        std::vector<point> ring;
+
+        const KVShard *owner(__u64 hash) const;
+    };
+
+    std::shared_ptr<layout> build(const std::vector<std::shared_ptr<KVShard> > &shards) const;
+    std::vector<const KVShard *> all_shards() const;
+    int forward(const KVShard *shard, struct nvme_passthru_cmd *cmd, __u32 *result);
+    int key_command(const KVShard *shard, __u8 opcode, const KVKey &key);
+    int migrating(const KVShard *to, const KVShard *from, struct nvme_passthru_cmd *cmd, __u32 *result);
+    int list(struct nvme_passthru_cmd *cmd, __u32 *result);
+    int move_key(const KVKey &key, const KVShard *from, const KVShard *to);
+
+    int vnodes;
+    std::shared_timed_mutex layout_lock;
+    std::shared_ptr<layout> current;
+    std::shared_ptr<layout> previous;       //set while keys are moving
+    std::mutex rebalance_lock;
+    std::mutex stripes[STRIPES];
+    std::atomic<__u64> moved_keys;
+};
+
+// "shard:<spec>[@nsid];<spec>[@nsid]..." over kv_open_backend() specs
+std::shared_ptr<KVShardBackend> kv_open_shards(const char *spec);
+bool kv_is_shard_spec(const char *spec);
+
+#endif
@@ -0,0 +1,814 @@
+#include "kv_shm.h"
+#include "kv_client.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+
+namespace {
+
+const __u32 SHM_MAGIC = 0x4d51564b;        //"KVQM"
+const __u32 SHM_VERSION = 1;
+const size_t PAGE = 4096;
+const unsigned MAX_DEPTH = 4096;
+const size_t MAX_SLOT_SIZE = 16ul << 20;
+const size_t MAX_SEGMENT = 1ul << 30;
+const int SPIN = 2000;                     //polls before sleeping, with more than one CPU
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "ring indexes are shared between processes");
+
+// A command as it sits in the submission ring. data is an offset into the
+// segment, 0 for none.
+struct shm_sqe {
+    __u16 slot;
+    __u8 opcode;
+    __u8 flags;
+    __u32 nsid;
+    __u32 cdw2;
+    __u32 cdw3;
+    __u32 cdw10;
+    __u32 cdw11;
+    __u32 cdw12;
+    __u32 cdw13;
+    __u32 cdw14;
+    __u32 cdw15;
+    __u32 data_len;
+    __u32 timeout_ms;
+    __u64 data;
+};
+
+struct shm_cqe {
+    __u16 slot;
+    __u16 reserved;
+    __s32 status;
+    __u32 result;
+    __s32 err;                      //errno when status is -1
+};
+
+// Start of the segment. The indexes run freely and wrap at depth; every
+// line has one writer, but for the need_wakeup flags, which whoever rings
+// the doorbell clears: one ring per sleep.
+struct shm_header {
+    __u32 magic;
+    __u32 version;
+    __u32 depth;
+    __u32 slot_size;
+    __u64 size;
+    __u64 sq_offset;
+    __u64 cq_offset;
+    __u64 slots_offset;             //a buffer of slot_size per submission slot
+    __u64 buffers_offset;           //then the leasable ones
+    __u64 buffers;
+
+    alignas(64) std::atomic<__u32> sq_tail;        //client
+    std::atomic<__u32> cq_head;
+    std::atomic<__u32> cq_need_wakeup;
+    alignas(64) std::atomic<__u32> sq_head;        //server
+    std::atomic<__u32> cq_tail;
+    std::atomic<__u32> sq_need_wakeup;
+};
+
+// What goes over the socket, once each way; the reply carries the memfd
+// and the submission and completion doorbells
+struct shm_setup {
+    __u32 magic;
+    __u32 version;
+    __u32 depth;
+    __u32 slot_size;
+    __u64 buffers;
+};
+
+struct shm_reply {
+    __s32 err;
+    __u32 reserved;
+    __u64 size;
+};
+
+size_t page_align(size_t n) {
+    return (n + PAGE - 1) & ~(PAGE - 1);
+}
+
+// The segment layout for a setup request, false when it is out of bounds
+bool layout(const shm_setup &s, shm_header *h) {
+    if (s.depth == 0 || s.depth > MAX_DEPTH || s.slot_size == 0 || s.slot_size > MAX_SLOT_SIZE ||
+        s.buffers > MAX_SEGMENT / PAGE) {
+        return false;
+    }
+    memset((void *)h, 0, sizeof(*h));
+    h->magic = SHM_MAGIC;
+    h->version = SHM_VERSION;
+    h->depth = s.depth;
+    h->slot_size = page_align(s.slot_size);
+    h->sq_offset = page_align(sizeof(shm_header));
+    h->cq_offset = h->sq_offset + page_align(sizeof(shm_sqe) * s.depth);
+    h->slots_offset = h->cq_offset + page_align(sizeof(shm_cqe) * s.depth);
+    h->buffers_offset = h->slots_offset + (__u64)h->slot_size * s.depth;
+    h->buffers = s.buffers;
+    h->size = h->buffers_offset + (__u64)h->slot_size * s.buffers;
+    return h->size <= MAX_SEGMENT;
+}
+
+shm_sqe *sq_ring(__u8 *base) {
+    return (shm_sqe *)(base + ((shm_header *)base)->sq_offset);
+}
+
+shm_cqe *cq_ring(__u8 *base) {
+    return (shm_cqe *)(base + ((shm_header *)base)->cq_offset);
+}
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+void ring(int fd) {
+    __u64 one = 1;
+    ssize_t r = write(fd, &one, sizeof(one));
+    (void)r;                        //only fails when the count is about to overflow: it is rung already
+}
+
+void drain(int fd) {
+    __u64 n;
+    ssize_t r = read(fd, &n, sizeof(n));
+    (void)r;
+}
+
+int unix_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+}
+
+struct KVShmServer::connection {
+    int sock = -1;
+    int memfd = -1;
+    int sq_fd = -1;
+    int cq_fd = -1;
+    __u8 *base = NULL;
+    size_t size = 0;
+    // the layout as setup() made it: the client can rewrite the header
+    __u32 depth = 0;
+    shm_sqe *sq = NULL;
+    shm_cqe *cq = NULL;
+    __u64 data_start = 0;
+    std::atomic<bool> finished;
+    std::thread thread;
+
+    connection() : finished(false) {}
+    ~connection() {
+        if (thread.joinable()) {
+            thread.join();
+        }
+        if (base) {
+            munmap(base, size);
+        }
+        for (int fd : {sock, memfd, sq_fd, cq_fd}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+};
+
+std::unique_ptr<KVShmServer> KVShmServer::start(const char *socket_path, std::shared_ptr<KVBackend> backend) {
+    struct sockaddr_un addr;
+    if (!backend || unix_address(socket_path, &addr) < 0) {
+        fprintf(stderr, "Invalid socket path: %s\n", socket_path);
+        return NULL;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Error creating the server socket");
+        return NULL;
+    }
+    // a socket nobody answers on is left over from a server that died
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "A server is running on %s already\n", socket_path);
+        close(fd);
+        return NULL;
+    }
+    if (errno == ECONNREFUSED) {
+        unlink(socket_path);
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+        perror("Error listening on the server socket");
+        close(fd);
+        return NULL;
+    }
+    int stop = eventfd(0, EFD_CLOEXEC);
+    if (stop < 0) {
+        perror("Error creating an eventfd");
+        close(fd);
+        unlink(socket_path);
+        return NULL;
+    }
+    return std::unique_ptr<KVShmServer>(new KVShmServer(socket_path, backend, fd, stop));
+}
+
+KVShmServer::KVShmServer(const char *socket_path, std::shared_ptr<KVBackend> backend, int listen_fd, int stop_fd)
+    : path(socket_path), inner(backend), listen_fd(listen_fd), stop_fd(stop_fd),
+      spin(std::thread::hardware_concurrency() > 1 ? SPIN : 0), stopping(false), done(0) {
+    acceptor = std::thread(&KVShmServer::accept_loop, this);
+}
+
+KVShmServer::~KVShmServer() {
+    stopping.store(true);
+    ring(stop_fd);
+    acceptor.join();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        conns.clear();
+    }
+    close(listen_fd);
+    close(stop_fd);
+    unlink(path.c_str());
+}
+
+size_t KVShmServer::clients() {
+    reap_finished();
+    std::lock_guard<std::mutex> guard(lock);
+    return conns.size();
+}
+
+void KVShmServer::reap_finished() {
+    std::list<std::unique_ptr<connection> > gone;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto it = conns.begin(); it != conns.end();) {
+            auto next = std::next(it);
+            if ((*it)->finished.load()) {
+                gone.splice(gone.end(), conns, it);
+            }
+            it = next;
+        }
+    }
+    // joined and closed outside the lock
+}
+
+void KVShmServer::accept_loop() {
+    while (!stopping.load()) {
+        struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error polling the server socket");
+            return;
+        }
+        if (fds[1].revents) {
+            return;
+        }
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        reap_finished();
+        std::unique_ptr<connection> c(new connection());
+        c->sock = fd;
+        connection *p = c.get();
+        std::lock_guard<std::mutex> guard(lock);
+        conns.push_back(std::move(c));
+        p->thread = std::thread(&KVShmServer::serve, this, p);
+    }
+}
+
+// Maps the segment the client asked for and sends it the descriptors;
+// 0, or -1 when the connection is to be dropped
+int KVShmServer::setup(connection *c) {
+    shm_setup request;
+    struct pollfd fds[2] = {{c->sock, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+    if (poll(fds, 2, 1000) <= 0 || fds[1].revents) {
+        return -1;
+    }
+    ssize_t n = recv(c->sock, &request, sizeof(request), 0);
+    shm_header h;
+    shm_reply reply = {0, 0, 0};
+    if (n != sizeof(request) || request.magic != SHM_MAGIC || request.version != SHM_VERSION || !layout(request, &h)) {
+        reply.err = EINVAL;
+        send(c->sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+        return -1;
+    }
+    c->memfd = memfd_create("kv_shm", MFD_CLOEXEC);
+    c->sq_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    c->cq_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (c->memfd < 0 || c->sq_fd < 0 || c->cq_fd < 0 || ftruncate(c->memfd, h.size) < 0) {
+        reply.err = errno;
+        send(c->sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+        return -1;
+    }
+    void *p = mmap(NULL, h.size, PROT_READ | PROT_WRITE, MAP_SHARED, c->memfd, 0);
+    if (p == MAP_FAILED) {
+        reply.err = errno;
+        send(c->sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+        return -1;
+    }
+    c->base = (__u8 *)p;
+    c->size = h.size;
+    c->depth = h.depth;
+    c->sq = (shm_sqe *)(c->base + h.sq_offset);
+    c->cq = (shm_cqe *)(c->base + h.cq_offset);
+    c->data_start = h.slots_offset;
+    memcpy(c->base, &h, sizeof(h));
+
+    reply.size = h.size;
+    struct iovec iov = {&reply, sizeof(reply)};
+    int fds_out[3] = {c->memfd, c->sq_fd, c->cq_fd};
+    char control[CMSG_SPACE(sizeof(fds_out))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds_out));
+    memcpy(CMSG_DATA(cmsg), fds_out, sizeof(fds_out));
+    return sendmsg(c->sock, &msg, MSG_NOSIGNAL) == sizeof(reply) ? 0 : -1;
+}
+
+// Polls for a while, then sleeps on the doorbell; false once the client
+// has gone or the server stops
+bool KVShmServer::wait_for_commands(connection *c, __u32 head) {
+    shm_header *h = (shm_header *)c->base;
+    for (int i = 0; i < spin; i++) {
+        if (h->sq_tail.load(std::memory_order_acquire) != head) {
+            return true;
+        }
+        cpu_relax();
+    }
+    // seq_cst: a client that moves the tail after this store sees the flag
+    h->sq_need_wakeup.store(1);
+    if (h->sq_tail.load() == head) {
+        struct pollfd fds[3] = {{c->sq_fd, POLLIN, 0}, {c->sock, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+        while (poll(fds, 3, -1) < 0 && errno == EINTR) {
+        }
+        if (fds[1].revents || fds[2].revents) {
+            return false;
+        }
+        drain(c->sq_fd);
+    }
+    h->sq_need_wakeup.store(0, std::memory_order_relaxed);
+    return true;
+}
+
+void KVShmServer::serve(connection *c) {
+    if (setup(c) < 0) {
+        c->finished.store(true);
+        return;
+    }
+    shm_header *h = (shm_header *)c->base;
+    shm_sqe *sq = c->sq;
+    shm_cqe *cq = c->cq;
+    const __u32 depth = c->depth;
+    const __u64 data_start = c->data_start;
+    __u32 head = 0;
+    __u32 cq_tail = 0;
+    std::vector<struct nvme_passthru_cmd> cmds;
+    std::vector<shm_cqe> cqes;
+    std::vector<int> status;
+    cmds.reserve(depth);
+    cqes.reserve(depth);
+
+    while (!stopping.load(std::memory_order_relaxed)) {
+        __u32 tail = h->sq_tail.load(std::memory_order_acquire);
+        if (tail == head) {
+            if (!wait_for_commands(c, head)) {
+                break;
+            }
+            continue;
+        }
+        // more than depth behind means a client that lost count
+        if (tail - head > depth) {
+            break;
+        }
+        // the whole drained batch goes to the backend together, so one that
+        // pipelines or models parallel dies gets to overlap it
+        cmds.clear();
+        cqes.clear();
+        for (; head != tail; head++) {
+            // copied first: the client may scribble over its ring meanwhile
+            shm_sqe e = sq[head % depth];
+            h->sq_head.store(head + 1, std::memory_order_release);
+
+            struct nvme_passthru_cmd cmd;
+            memset(&cmd, 0, sizeof(cmd));
+            cmd.opcode = e.opcode;
+            cmd.flags = e.flags;
+            cmd.nsid = e.nsid;
+            cmd.cdw2 = e.cdw2;
+            cmd.cdw3 = e.cdw3;
+            cmd.cdw10 = e.cdw10;
+            cmd.cdw11 = e.cdw11;
+            cmd.cdw12 = e.cdw12;
+            cmd.cdw13 = e.cdw13;
+            cmd.cdw14 = e.cdw14;
+            cmd.cdw15 = e.cdw15;
+            cmd.data_len = e.data_len;
+            cmd.timeout_ms = e.timeout_ms;
+
+            shm_cqe r;
+            r.slot = e.slot;
+            r.reserved = 0;
+            r.result = 0;
+            r.err = 0;
+            r.status = 0;
+            if (e.data && (e.data < data_start || e.data > c->size || e.data_len > c->size - e.data)) {
+                r.status = -1;
+                r.err = EFAULT;
+            } else {
+                cmd.addr = e.data ? (__u64)(uintptr_t)(c->base + e.data) : 0;
+                cmds.push_back(cmd);
+            }
+            cqes.push_back(r);
+        }
+        status.assign(cmds.size(), -1);
+        errno = 0;
+        inner->submit_batch(cmds.data(), cmds.size(), status.data());
+        int err = errno ? errno : EIO;
+        done.fetch_add(cmds.size(), std::memory_order_relaxed);
+
+        size_t k = 0;
+        for (shm_cqe &r : cqes) {
+            if (r.err == 0) {
+                r.status = status[k];
+                r.result = cmds[k].result;
+                r.err = r.status < 0 ? (r.status < -1 ? -r.status : err) : 0;
+                k++;
+            }
+            // at most depth completions are unreaped: each holds a slot
+            cq[cq_tail % depth] = r;
+            h->cq_tail.store(++cq_tail);
+        }
+        if (h->cq_need_wakeup.load() && h->cq_need_wakeup.exchange(0)) {
+            ring(c->cq_fd);
+        }
+    }
+    // the client sees the socket close and fails what is still queued
+    shutdown(c->sock, SHUT_RDWR);
+    c->finished.store(true);
+}
+
+std::shared_ptr<KVShmBackend> KVShmBackend::connect(const char *socket_path, const KVShmConfig &config) {
+    struct sockaddr_un addr;
+    if (unix_address(socket_path, &addr) < 0) {
+        fprintf(stderr, "Invalid socket path: %s\n", socket_path);
+        return NULL;
+    }
+    std::shared_ptr<KVShmBackend> b(new KVShmBackend());
+    b->dead.store(false);
+    b->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (b->sock < 0 || ::connect(b->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Error connecting to the KV server");
+        return NULL;
+    }
+    shm_setup request;
+    request.magic = SHM_MAGIC;
+    request.version = SHM_VERSION;
+    request.depth = config.depth;
+    request.slot_size = std::min(config.slot_size, MAX_SLOT_SIZE + 1);
+    request.buffers = config.buffers;
+    if (send(b->sock, &request, sizeof(request), MSG_NOSIGNAL) != sizeof(request)) {
+        perror("Error setting up the KV server connection");
+        return NULL;
+    }
+
+    shm_reply reply;
+    struct iovec iov = {&reply, sizeof(reply)};
+    int fds[3] = {-1, -1, -1};
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(b->sock, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = n == sizeof(reply) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+    b->sq_fd = fds[1];
+    b->cq_fd = fds[2];
+    if (n != sizeof(reply) || reply.err != 0 || fds[0] < 0) {
+        if (fds[0] >= 0) {
+            close(fds[0]);
+        }
+        fprintf(stderr, "The KV server refused the connection: %s\n",
+                n == sizeof(reply) && reply.err ? strerror(reply.err) : "no segment");
+        return NULL;
+    }
+    size_t size = reply.size;
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (p == MAP_FAILED) {
+        perror("Error mapping the KV server segment");
+        return NULL;
+    }
+    b->mapping = std::shared_ptr<void>(p, [size](void *q) { munmap(q, size); });
+    b->base = (__u8 *)p;
+    b->size = size;
+
+    const shm_header *h = (const shm_header *)p;
+    if (h->magic != SHM_MAGIC || h->version != SHM_VERSION || h->depth != config.depth || h->size != size) {
+        fprintf(stderr, "The KV server segment does not match the request\n");
+        return NULL;
+    }
+    b->queue_depth = h->depth;
+    b->slot_size = h->slot_size;
+    b->spin = std::thread::hardware_concurrency() > 1 ? SPIN : 0;
+    b->state.resize(h->depth);
+    for (unsigned i = h->depth; i > 0; i--) {
+        b->free_slots.push_back(i - 1);
+    }
+    if (h->buffers > 0) {
+        b->pool = KVBufferPool::wrap(b->base + h->buffers_offset, h->slot_size, h->buffers, b->mapping);
+    }
+    return b;
+}
+
+KVShmBackend::~KVShmBackend() {
+    for (int fd : {sock, sq_fd, cq_fd}) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+int KVShmBackend::submit(struct nvme_passthru_cmd *cmd, __u32 *result) {
+    int status;
+    int err;
+    run(cmd, 1, &status, &err);
+    if (status < 0) {
+        errno = err;
+        return -1;
+    }
+    if (result) {
+        *result = cmd->result;
+    }
+    return status;
+}
+
+void KVShmBackend::submit_batch(struct nvme_passthru_cmd *cmds, size_t n, int *status) {
+    std::vector<int> errs(n);
+    run(cmds, n, status, errs.data());
+    for (size_t i = 0; i < n; i++) {
+        if (status[i] < 0) {
+            status[i] = -errs[i];
+        }
+    }
+}
+
+// Moves whatever completed into the slot states; under lock
+size_t KVShmBackend::reap() {
+    shm_header *h = (shm_header *)base;
+    shm_cqe *cq = cq_ring(base);
+    __u32 head = h->cq_head.load(std::memory_order_relaxed);
+    __u32 tail = h->cq_tail.load(std::memory_order_acquire);
+    size_t n = 0;
+    for (; head != tail; head++) {
+        const shm_cqe &r = cq[head % queue_depth];
+        if (r.slot >= queue_depth || !state[r.slot].busy || state[r.slot].done) {
+            continue;
+        }
+        slot_state &s = state[r.slot];
+        s.done = true;
+        s.status = r.status;
+        s.result = r.result;
+        s.err = r.err;
+        outstanding--;
+        n++;
+    }
+    h->cq_head.store(head, std::memory_order_release);
+    return n;
+}
+
+// Polls for a while, then sleeps on the doorbell; false once the server
+// has gone. One thread at a time, without lock.
+bool KVShmBackend::wait_for_completions() {
+    shm_header *h = (shm_header *)base;
+    __u32 head = h->cq_head.load(std::memory_order_relaxed);
+    for (int i = 0; i < spin; i++) {
+        if (h->cq_tail.load(std::memory_order_acquire) != head) {
+            return true;
+        }
+        cpu_relax();
+    }
+    // seq_cst: the server stores the tail, then looks at the flag
+    h->cq_need_wakeup.store(1);
+    bool alive = true;
+    if (h->cq_tail.load() == head) {
+        struct pollfd fds[2] = {{cq_fd, POLLIN, 0}, {sock, POLLIN, 0}};
+        while (poll(fds, 2, -1) < 0 && errno == EINTR) {
+        }
+        // the server never writes to the socket after setup
+        alive = fds[1].revents == 0;
+        if (fds[0].revents) {
+            drain(cq_fd);
+        }
+    }
+    h->cq_need_wakeup.store(0, std::memory_order_relaxed);
+    return alive;
+}
+
+void KVShmBackend::fail_outstanding() {
+    for (slot_state &s : state) {
+        if (s.busy && !s.done) {
+            s.done = true;
+            s.status = -1;
+            s.err = EIO;
+        }
+    }
+    outstanding = 0;
+}
+
+// Waits for pred under lock; meanwhile one waiter at a time reaps for
+// everyone, sleeping on the doorbell only while a command is outstanding
+template <class Pred>
+void KVShmBackend::wait_until(std::unique_lock<std::mutex> &guard, Pred pred) {
+    while (!pred()) {
+        if (reaping || outstanding == 0) {
+            changed.wait(guard);
+            continue;
+        }
+        if (reap() > 0) {
+            changed.notify_all();
+            continue;
+        }
+        reaping = true;
+        guard.unlock();
+        bool alive = wait_for_completions();
+        guard.lock();
+        reaping = false;
+        if (!alive) {
+            dead.store(true);
+            reap();
+            fail_outstanding();
+        }
+        changed.notify_all();
+    }
+}
+
+void KVShmBackend::run(struct nvme_passthru_cmd *cmds, size_t n, int *status, int *errs) {
+    shm_header *h = (shm_header *)base;
+    shm_sqe *sq = sq_ring(base);
+    std::vector<__u16> ids;
+    std::vector<size_t> which;
+    size_t next = 0;
+    while (next < n) {
+        ids.clear();
+        which.clear();
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wait_until(guard, [this] { return !free_slots.empty() || dead.load(); });
+            if (dead.load()) {
+                for (; next < n; next++) {
+                    status[next] = -1;
+                    errs[next] = EIO;
+                }
+                return;
+            }
+            while (next < n && !free_slots.empty()) {
+                ids.push_back(free_slots.back());
+                free_slots.pop_back();
+                status[next] = -1;                      //until it completes
+                errs[next] = EIO;
+                which.push_back(next++);
+            }
+        }
+
+        // payloads go in outside the lock: the slots are ours
+        std::vector<shm_sqe> entries(ids.size());
+        std::vector<bool> bounced(ids.size(), false);
+        size_t sent = 0;
+        for (size_t i = 0; i < ids.size(); i++) {
+            struct nvme_passthru_cmd &c = cmds[which[i]];
+            __u8 *addr = (__u8 *)(uintptr_t)c.addr;
+            __u64 data = 0;
+            if (addr && c.data_len > 0) {
+                if (addr >= base && addr < base + size && c.data_len <= (size_t)(base + size - addr)) {
+                    data = addr - base;
+                } else if (c.data_len > slot_size) {
+                    status[which[i]] = -1;
+                    errs[which[i]] = E2BIG;
+                    continue;
+                } else {
+                    data = h->slots_offset + (__u64)ids[i] * slot_size;
+                    bounced[i] = true;
+                    if (c.opcode & 1) {                 //host to controller
+                        memcpy(base + data, addr, c.data_len);
+                    }
+                }
+            }
+            shm_sqe &e = entries[sent];
+            e.slot = ids[i];
+            e.opcode = c.opcode;
+            e.flags = c.flags;
+            e.nsid = c.nsid;
+            e.cdw2 = c.cdw2;
+            e.cdw3 = c.cdw3;
+            e.cdw10 = c.cdw10;
+            e.cdw11 = c.cdw11;
+            e.cdw12 = c.cdw12;
+            e.cdw13 = c.cdw13;
+            e.cdw14 = c.cdw14;
+            e.cdw15 = c.cdw15;
+            e.data_len = c.data_len;
+            e.timeout_ms = c.timeout_ms;
+            e.data = data;
+            sent++;
+        }
+
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if (dead.load()) {
+                sent = 0;
+            }
+            __u32 tail = h->sq_tail.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < sent; i++) {
+                slot_state &s = state[entries[i].slot];
+                s.busy = true;
+                s.done = false;
+                sq[tail++ % queue_depth] = entries[i];
+            }
+            if (sent > 0) {
+                outstanding += sent;
+                // seq_cst: the server sets the flag, then looks at the tail
+                h->sq_tail.store(tail);
+                if (h->sq_need_wakeup.load() && h->sq_need_wakeup.exchange(0)) {
+                    ring(sq_fd);
+                }
+            }
+
+            wait_until(guard, [this, &entries, sent] {
+                for (size_t i = 0; i < sent; i++) {
+                    if (!state[entries[i].slot].done) {
+                        return false;
+                    }
+                }
+                return true;
+            });
+            for (size_t i = 0; i < ids.size(); i++) {
+                slot_state &s = state[ids[i]];
+                if (s.busy) {
+                    size_t k = which[i];
+                    status[k] = s.status;
+                    errs[k] = s.err;
+                    cmds[k].result = s.result;
+                    // only what the command returned: the rest of the slot is stale
+                    if (s.status == 0 && bounced[i]) {
+                        memcpy((void *)(uintptr_t)cmds[k].addr, base + h->slots_offset + (__u64)ids[i] * slot_size,
+                               kv_returned_bytes(&cmds[k], s.result));
+                    }
+                    s.busy = false;
+                }
+                free_slots.push_back(ids[i]);
+            }
+            changed.notify_all();
+        }
+    }
+}
+
+bool kv_is_shm_spec(const char *spec) {
+    return strncmp(spec, "shm:", 4) == 0;
+}
+
+std::shared_ptr<KVShmBackend> kv_open_shm(const char *spec) {
+    static std::mutex lock;
+    static std::map<std::string, std::shared_ptr<KVShmBackend> > conns;
+
+    if (!kv_is_shm_spec(spec) || !spec[4]) {
+        fprintf(stderr, "Invalid shm spec: %s\n", spec ? spec : "");
+        return NULL;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    std::shared_ptr<KVShmBackend> &conn = conns[spec];
+    if (!conn || !conn->connected()) {
+        conn = KVShmBackend::connect(spec + 4);
+        if (!conn) {
+            conns.erase(spec);
+            return NULL;
+        }
+    }
+    return conn;
+}
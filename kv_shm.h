@@ -0,0 +1,128 @@
+#ifndef KV_SHM_H
+#define KV_SHM_H
+
+#include "kv_backend.h"
+#include "kv_buffer.h"
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+const char *const KV_SHM_DEFAULT_SOCKET = "/tmp/kv_emud.sock";
+
+struct KVShmConfig {
+    unsigned depth = 128;               //commands in flight per connection
+    size_t slot_size = 64 * 1024;       //largest payload, rounded up to whole pages
+    size_t buffers = 128;               //leasable zero-copy buffers of slot_size
+};
+
+// Serves a backend to other processes, the way kv_emud does. A client
+// connects to a Unix socket, says how deep its queues are, and gets back a
+// memfd and two eventfds: the memfd holds a submission and a completion
+// ring plus the payload buffers, the eventfds are the doorbells. From then
+// on the socket only tells either side that the other one went away.
+// Every connection is served by a thread of its own, which polls its
+// submission ring for a while before it sleeps on the doorbell and hands
+// whatever it took off the ring to the backend's submit_batch() at once;
+// each side rings the other only when that one said it is going to sleep.
+class KVShmServer {
+public:
+    static std::unique_ptr<KVShmServer> start(const char *socket_path, std::shared_ptr<KVBackend> backend);
+    // Finishes the commands taken off the rings, drops every client and
+    // removes the socket
+    ~KVShmServer();
+
+    KVShmServer(const KVShmServer &) = delete;
+    KVShmServer &operator=(const KVShmServer &) = delete;
+
+    size_t clients();
+    __u64 executed() const { return done.load(std::memory_order_relaxed); }
+
+private:
+    struct connection;
+
+    KVShmServer(const char *socket_path, std::shared_ptr<KVBackend> backend, int listen_fd, int stop_fd);
+    void accept_loop();
+    void serve(connection *c);
+    int setup(connection *c);
+    bool wait_for_commands(connection *c, __u32 head);
+    void reap_finished();
+
+    std::string path;
+    std::shared_ptr<KVBackend> inner;
+    int listen_fd;
+    int stop_fd;                        //eventfd, readable once the server stops
+    int spin;
+    std::atomic<bool> stopping;
+    std::atomic<__u64> done;
+    std::mutex lock;
+    std::list<std::unique_ptr<connection> > conns;
+    std::thread acceptor;
+};
+
+// Client of a KVShmServer. Payloads are copied through a buffer of the
+// shared segment that belongs to the command, unless they already sit in
+// one of the segment's buffers, see buffers(). Threads share the rings:
+// whoever waits for a completion drains the completion ring for everyone,
+// one of them at a time. Commands fail with EIO once the server is gone,
+// and with E2BIG when a payload is bigger than a buffer.
+class KVShmBackend : public KVBackend {
+public:
+    static std::shared_ptr<KVShmBackend> connect(const char *socket_path, const KVShmConfig &config = KVShmConfig());
+    ~KVShmBackend();
+
+    int submit(struct nvme_passthru_cmd *cmd, __u32 *result) override;
+    // Fills as many submission slots as there are free, with one doorbell
+    void submit_batch(struct nvme_passthru_cmd *cmds, size_t n, int *status) override;
+
+    // Buffers in the shared segment: commands on leased ones go zero-copy
+    std::shared_ptr<KVBufferPool> buffers() const override { return pool; }
+    unsigned depth() const { return queue_depth; }
+    bool connected() const { return !dead.load(); }
+
+private:
+    struct slot_state {
+        bool busy;                      //submitted, not reaped yet
+        bool done;
+        int status;
+        __u32 result;
+        int err;
+    };
+
+    KVShmBackend() {}
+    void run(struct nvme_passthru_cmd *cmds, size_t n, int *status, int *errs);
+    template <class Pred>
+    void wait_until(std::unique_lock<std::mutex> &guard, Pred pred);
+    size_t reap();
+    bool wait_for_completions();
+    void fail_outstanding();
+
+    int sock = -1;
+    int sq_fd = -1;
+    int cq_fd = -1;
+    int spin = 0;
+    std::shared_ptr<void> mapping;
+    __u8 *base = NULL;
+    size_t size = 0;
+    unsigned queue_depth = 0;
+    size_t slot_size = 0;
+    std::shared_ptr<KVBufferPool> pool;
+
+    std::atomic<bool> dead;
+    std::mutex lock;                    //everything below, and the submission ring
+    std::condition_variable changed;
+    std::vector<slot_state> state;
+    std::vector<__u16> free_slots;
+    size_t outstanding = 0;
+    bool reaping = false;
+};
+
+// "shm:<socket>" connects to a server there, once per process and socket
+bool kv_is_shm_spec(const char *spec);
+std::shared_ptr<KVShmBackend> kv_open_shm(const char *spec);
+
+#endif
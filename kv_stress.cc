@@ -0,0 +1,341 @@
+#include "kv_client.h"
+#include "kv_histogram.h"
+#include "kv_multiqueue.h"
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+// Concurrent Store/Retrieve/Exists/Delete load. Every worker owns a private
+// key range, where it knows exactly what the device must answer, and shares
+// a second range with the other workers, where only well-formed values and
+// legal statuses are checked. The run is repeated for 1, 2, 4 ... threads to
+// show how throughput scales per added core. Exits 1 on any inconsistency.
+
+struct stress_config {
+    const char *device = KV_DEFAULT_DEVICE;
+    int max_threads = 4;
+    double seconds = 2;
+    int keys = 1024;                //per private range, and the shared one
+    int shared_percent = 25;        //ops that go to the shared range
+    int value_size = 256;
+    int queues = -1;                //-1: plain session, 0: one queue per CPU
+    int mix[4] = {30, 50, 10, 10};  //store, retrieve, exists, delete
+};
+
+enum { OP_STORE, OP_RETRIEVE, OP_EXISTS, OP_DELETE };
+
+// value layout: key, writer thread, version, then a pattern and a crc
+struct value_header {
+    __u8 key[8];
+    __u32 thread;
+    __u32 version;
+};
+
+const int MAX_REPORTED = 10;
+
+static std::atomic<__u64> inconsistencies(0);
+static std::mutex report_lock;
+
+static void report(int thread, const char *what, const KVKey &key, int status, int expected) {
+    __u64 n = inconsistencies.fetch_add(1) + 1;
+    if (n > MAX_REPORTED) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(report_lock);
+    fprintf(stderr, "thread %d: %s on key", thread, what);
+    for (int i = 0; i < key.size; i++) {
+        fprintf(stderr, " %02x", key.bytes[i]);
+    }
+    fprintf(stderr, ": status %d, expected %d\n", status, expected);
+}
+
+static KVKey private_key(int thread, int i) {
+    __u8 bytes[6] = {0x5d, (__u8)thread};
+    memcpy(bytes + 2, &i, 4);
+    return kv_key(bytes, sizeof(bytes));
+}
+
+static KVKey shared_key(int i) {
+    __u8 bytes[5] = {0x5e};
+    memcpy(bytes + 1, &i, 4);
+    return kv_key(bytes, sizeof(bytes));
+}
+
+static void fill_value(std::vector<__u8> &value, const KVKey &key, __u32 thread, __u32 version) {
+    value_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.key, key.bytes, std::min<size_t>(key.size, sizeof(h.key)));
+    h.thread = thread;
+    h.version = version;
+    memcpy(value.data(), &h, sizeof(h));
+    size_t body = value.size() - 4;
+    for (size_t i = sizeof(h); i < body; i++) {
+        value[i] = (__u8)(i * 131 + version);
+    }
+    __u32 crc = kv_crc32(value.data(), body);
+    memcpy(value.data() + body, &crc, 4);
+}
+
+// A value written by fill_value() for this key, not a torn or foreign one
+static bool valid_value(const __u8 *value, size_t size, const KVKey &key, value_header *h) {
+    if (size < sizeof(value_header) + 4) {
+        return false;
+    }
+    __u32 crc;
+    memcpy(&crc, value + size - 4, 4);
+    memcpy(h, value, sizeof(*h));
+    return crc == kv_crc32(value, size - 4) &&
+           memcmp(h->key, key.bytes, std::min<size_t>(key.size, sizeof(h->key))) == 0;
+}
+
+struct worker_stats {
+    __u64 ops = 0;
+};
+
+// One load thread with its own commands, buffers and private key model
+class stress_worker {
+public:
+    stress_worker(std::shared_ptr<KVSession> session, const stress_config &config, int id)
+        : session(session), config(config), id(id), rng(id * 7919 + 1),
+          versions(config.keys, 0), value(config.value_size), buf(config.value_size) {}
+
+    void run(const std::atomic<bool> &stop, worker_stats *stats) {
+        int total = config.mix[0] + config.mix[1] + config.mix[2] + config.mix[3];
+        while (!stop.load(std::memory_order_relaxed)) {
+            int pick = rng() % total;
+            int op = OP_STORE;
+            while (pick >= config.mix[op]) {
+                pick -= config.mix[op++];
+            }
+            int i = rng() % config.keys;
+            if ((int)(rng() % 100) < config.shared_percent) {
+                shared_op(op, i);
+            } else {
+                private_op(op, i);
+            }
+            stats->ops++;
+        }
+    }
+
+    // Deletes whatever this worker left in its private range
+    void cleanup() {
+        for (int i = 0; i < config.keys; i++) {
+            if (versions[i]) {
+                session->remove(private_key(id, i));
+            }
+        }
+    }
+
+private:
+    void private_op(int op, int i) {
+        KVKey key = private_key(id, i);
+        __u32 &version = versions[i];
+        int ret;
+        switch (op) {
+        case OP_STORE:
+            fill_value(value, key, id, next_version);
+            ret = session->store(key, value.data(), value.size());
+            if (ret != 0) {
+                report(id, "Store", key, ret, 0);
+            } else {
+                version = next_version++;
+            }
+            break;
+        case OP_RETRIEVE: {
+            __u32 size = 0;
+            ret = session->retrieve(key, buf.data(), buf.size(), &size);
+            if (ret != (version ? 0 : 135)) {
+                report(id, "Retrieve", key, ret, version ? 0 : 135);
+                break;
+            }
+            value_header h;
+            if (ret == 0 && (size != buf.size() || !valid_value(buf.data(), size, key, &h) ||
+                             h.thread != (__u32)id || h.version != version)) {
+                report(id, "Retrieve (stale or torn value)", key, ret, 0);
+            }
+            break;
+        }
+        case OP_EXISTS:
+            ret = session->exists(key);
+            if (ret != (version ? 0 : 135)) {
+                report(id, "Exists", key, ret, version ? 0 : 135);
+            }
+            break;
+        case OP_DELETE:
+            ret = session->remove(key);
+            if (ret != (version ? 0 : 135)) {
+                report(id, "Delete", key, ret, version ? 0 : 135);
+            }
+            version = 0;
+            break;
+        }
+    }
+
+    void shared_op(int op, int i) {
+        KVKey key = shared_key(i);
+        int ret;
+        switch (op) {
+        case OP_STORE:
+            fill_value(value, key, id, next_version++);
+            ret = session->store(key, value.data(), value.size());
+            if (ret != 0) {
+                report(id, "shared Store", key, ret, 0);
+            }
+            break;
+        case OP_RETRIEVE: {
+            __u32 size = 0;
+            ret = session->retrieve(key, buf.data(), buf.size(), &size);
+            value_header h;
+            if (ret != 0 && ret != 135) {
+                report(id, "shared Retrieve", key, ret, 0);
+            } else if (ret == 0 && (size != buf.size() || !valid_value(buf.data(), size, key, &h))) {
+                report(id, "shared Retrieve (torn value)", key, ret, 0);
+            }
+            break;
+        }
+        case OP_EXISTS:
+            ret = session->exists(key);
+            if (ret != 0 && ret != 135) {
+                report(id, "shared Exists", key, ret, 0);
+            }
+            break;
+        case OP_DELETE:
+            ret = session->remove(key);
+            if (ret != 0 && ret != 135) {
+                report(id, "shared Delete", key, ret, 0);
+            }
+            break;
+        }
+    }
+
+    std::shared_ptr<KVSession> session;
+    const stress_config &config;
+    int id;
+    std::mt19937 rng;
+    std::vector<__u32> versions;        //version stored under each private key, 0 for none
+    __u32 next_version = 1;
+    std::vector<__u8> value;
+    std::vector<__u8> buf;
+};
+
+static double run(std::shared_ptr<KVSession> session, const stress_config &config, int threads) {
+    std::vector<std::unique_ptr<stress_worker> > workers;
+    std::vector<worker_stats> stats(threads);
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back(new stress_worker(session, config, t));
+    }
+    kv_latency_reset();
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> pool;
+    __u64 start = kv_now_ns();
+    for (int t = 0; t < threads; t++) {
+        pool.emplace_back(&stress_worker::run, workers[t].get(), std::cref(stop), &stats[t]);
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(config.seconds));
+    stop.store(true);
+    for (std::thread &t : pool) {
+        t.join();
+    }
+    double elapsed = (kv_now_ns() - start) / 1e9;
+    for (auto &w : workers) {
+        w->cleanup();
+    }
+    for (int i = 0; i < config.keys; i++) {
+        session->remove(shared_key(i));
+    }
+
+    __u64 ops = 0;
+    for (worker_stats &s : stats) {
+        ops += s.ops;
+    }
+    return ops / elapsed;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-d device|emu] [-t max_threads] [-s seconds] [-k keys]\n"
+            "          [-o shared_percent] [-v value_size] [-m store:retrieve:exists:delete]\n"
+            "          [-q queues (0: one per CPU)]\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    stress_config config;
+    const char *env = getenv("KV_DEVICE");
+    if (env && *env) {
+        config.device = env;
+    }
+    int opt;
+    while ((opt = getopt(argc, argv, "d:t:s:k:o:v:m:q:h")) != -1) {
+        switch (opt) {
+        case 'd': config.device = optarg; break;
+        case 't': config.max_threads = atoi(optarg); break;
+        case 's': config.seconds = atof(optarg); break;
+        case 'k': config.keys = atoi(optarg); break;
+        case 'o': config.shared_percent = atoi(optarg); break;
+        case 'v': config.value_size = atoi(optarg); break;
+        case 'q': config.queues = atoi(optarg); break;
+        case 'm':
+            if (sscanf(optarg, "%d:%d:%d:%d", &config.mix[0], &config.mix[1],
+                       &config.mix[2], &config.mix[3]) != 4) {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    int mix_total = config.mix[0] + config.mix[1] + config.mix[2] + config.mix[3];
+    if (config.max_threads < 1 || config.max_threads > 255 || config.keys < 1 || mix_total <= 0 ||
+        config.value_size < (int)sizeof(value_header) + 4 || config.value_size > (int)KV_MAX_VALUE_SIZE) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    std::shared_ptr<KVSession> session = KVSession::open(config.device);
+    if (!session) {
+        fprintf(stderr, "Could NOT open the KV device %s\n", config.device);
+        return 2;
+    }
+    if (config.queues >= 0) {
+        KVMultiQueueConfig mq;
+        mq.queues = config.queues;
+        session = std::make_shared<KVSession>(std::make_shared<KVMultiQueueBackend>(session->backend(), mq),
+                                              session->nsid());
+    }
+
+    printf("%8s %14s %9s %11s %10s %10s\n", "threads", "ops/s", "speedup", "per-core", "p99_us", "errors");
+    double base = 0;
+    for (int threads = 1;; threads = std::min(threads * 2, config.max_threads)) {
+        __u64 before = inconsistencies.load();
+        double rate = run(session, config, threads);
+        if (threads == 1) {
+            base = rate;
+        }
+        double speedup = base > 0 ? rate / base : 0;
+        KVHistogram all = kv_latency_snapshot();
+        printf("%8d %14.0f %8.2fx %10.0f%% %10.1f %10llu\n", threads, rate, speedup,
+               100 * speedup / threads, all.percentile(0.99) / 1e3,
+               (unsigned long long)(inconsistencies.load() - before));
+        fflush(stdout);
+        if (threads == config.max_threads) {
+            break;
+        }
+    }
+    if (inconsistencies.load()) {
+        fprintf(stderr, "%llu status or value inconsistencies\n", (unsigned long long)inconsistencies.load());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef KV_TEST_H
+#define KV_TEST_H
+
+#include <gtest/gtest.h>
+#include "kv_client.h"
+#include "kv_cursor.h"
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+#include <vector>
+
+// KV_DEVICE picks what the suites run against: a device path (default
+// /dev/ng0n1) or an emulator spec such as "emu"
+inline const char *kv_test_device() {
+    const char *device = getenv("KV_DEVICE");
+    return device && *device ? device : KV_DEFAULT_DEVICE;
+}
+
+const __u8 KV_TEST_PREFIX_SIZE = 8;
+const __u8 KV_TEST_KEY_SIZE = KV_TEST_PREFIX_SIZE + 4;
+const __u8 KV_TEST_PREFIX_MARK = 0x7e;     //first byte of every test keyspace
+
+// Every test gets a keyspace of its own: a random 8 byte prefix in front of
+// the 4 byte keys the tests name. SetUp() stores the keys the suites expect
+// ("kitty" under 0xcccccccc and 0xcccccc89) and TearDown() deletes whatever
+// is left under the prefix, so tests can run in any order, be rerun, and
+// share one device from parallel processes (ctest -j, GTEST_SHARD_INDEX).
+class KVTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        session = KVSession::open(kv_test_device());
+        ASSERT_TRUE(session != NULL) << "Could NOT open the NVMe device";
+        std::random_device rd;
+        prefix[0] = KV_TEST_PREFIX_MARK;
+        for (int i = 1; i < KV_TEST_PREFIX_SIZE; i++) {
+            prefix[i] = rd() & 0xff;
+        }
+        char kitty[] = "kitty";
+        ASSERT_EQ(session->store(test_key(0xcccccccc), kitty, strlen(kitty)), 0);
+        ASSERT_EQ(session->store(test_key(0xcccccc89), kitty, strlen(kitty)), 0);
+    }
+
+    void TearDown() override {
+        if (!session) {
+            return;
+        }
+        std::vector<KVKey> mine = keyspace();
+        for (const KVKey &k : mine) {
+            session->remove(k);
+        }
+    }
+
+    // value as a key of this test: the prefix, then value little endian
+    KVKey test_key(__u32 value) const {
+        KVKey k = kv_key(prefix, KV_TEST_PREFIX_SIZE);
+        for (int i = 0; i < 4; i++) {
+            k.bytes[KV_TEST_PREFIX_SIZE + i] = (value >> (8 * i)) & 0xff;
+        }
+        k.size = KV_TEST_KEY_SIZE;
+        return k;
+    }
+
+    // For raw commands: packs test_key(value), keeping the option bits of cdw11
+    void pack_key(struct nvme_passthru_cmd *cmd, __u32 value) const {
+        kv_pack_key(cmd, test_key(value));
+    }
+
+    bool in_keyspace(const KVKey &k) const {
+        return k.size >= KV_TEST_PREFIX_SIZE && memcmp(k.bytes, prefix, KV_TEST_PREFIX_SIZE) == 0;
+    }
+
+    // Every key stored under the prefix, in LIST order
+    std::vector<KVKey> keyspace() {
+        std::vector<KVKey> keys;
+        KVListCursor cursor(session, kv_key(prefix, KV_TEST_PREFIX_SIZE), BUFFER_SIZE, false);
+        KVKey k;
+        while (cursor.next(&k) && in_keyspace(k)) {
+            keys.push_back(k);
+        }
+        return keys;
+    }
+
+    int submit(struct nvme_passthru_cmd *cmd) {
+        return session->submit(cmd, &result);
+    }
+
+    std::shared_ptr<KVSession> session;
+    __u8 prefix[KV_TEST_PREFIX_SIZE];
+    __u32 result;
+};
+
+#endif
@@ -0,0 +1,254 @@
+#include "kv_timing.h"
+#include "kv_client.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+
+const __u64 SPIN_NS = 100000;              //timers wake up this late, give or take
+
+static const char *const OP_NAMES[KV_LAT_OPS] = {"store", "retrieve", "list", "delete", "exists", "other"};
+
+// Quantiles the distribution of a trace is cut into
+static const double TRACE_FRACTIONS[] = {0, 0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.95, 0.99, 0.999, 0.9999, 1};
+
+// Fractions rising from 0 to at most 1, times that do not fall
+static bool valid_quantiles(const std::vector<KVServiceQuantile> &q) {
+    for (size_t i = 0; i < q.size(); i++) {
+        if (q[i].fraction < 0 || q[i].fraction > 1) {
+            return false;
+        }
+        if (i > 0 && (q[i].fraction <= q[i - 1].fraction || q[i].ns < q[i - 1].ns)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void kv_timing_from_trace(const KVTraceReader &trace, KVTimingProfile *profile) {
+    KVHistogram latency[KV_LAT_OPS];
+    for (size_t i = 0; i < trace.size(); i++) {
+        if (trace[i].status >= 0) {
+            latency[kv_latency_op_index(trace[i].opcode)].record(trace[i].latency_ns);
+        }
+    }
+    for (int op = 0; op < KV_LAT_OPS; op++) {
+        profile->service[op].clear();
+        if (latency[op].count() == 0) {
+            continue;
+        }
+        for (double f : TRACE_FRACTIONS) {
+            KVServiceQuantile q;
+            q.fraction = f;
+            q.ns = f < 1 ? latency[op].percentile(f) : latency[op].max();
+            if (!profile->service[op].empty()) {
+                // bucket bounds can pass the largest value recorded
+                q.ns = std::max(q.ns, profile->service[op].back().ns);
+            }
+            profile->service[op].push_back(q);
+        }
+    }
+}
+
+static bool is_trace(const char *path) {
+    FILE *f = fopen(path, "rb");
+    __u32 magic = 0;
+    bool trace = f && fread(&magic, sizeof(magic), 1, f) == 1 && magic == KV_TRACE_MAGIC;
+    if (f) {
+        fclose(f);
+    }
+    return trace;
+}
+
+static int load_trace(const char *path, KVTimingProfile *profile) {
+    std::unique_ptr<KVTraceReader> trace = KVTraceReader::open(path);
+    if (!trace) {
+        return -1;
+    }
+    kv_timing_from_trace(*trace, profile);
+    return 0;
+}
+
+// "<fraction>:<us> ..." into q
+static bool parse_quantiles(char *rest, std::vector<KVServiceQuantile> *q) {
+    q->clear();
+    char *save;
+    for (char *tok = strtok_r(rest, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save)) {
+        char *colon = strchr(tok, ':');
+        char *end;
+        if (!colon) {
+            return false;
+        }
+        KVServiceQuantile p;
+        p.fraction = strtod(tok, &end);
+        if (end != colon) {
+            return false;
+        }
+        double us = strtod(colon + 1, &end);
+        if (*end != '\0' || us < 0) {
+            return false;
+        }
+        p.ns = (__u64)(us * 1000);
+        q->push_back(p);
+    }
+    return !q->empty() && valid_quantiles(*q);
+}
+
+int kv_load_timing_profile(const char *path, KVTimingProfile *profile) {
+    if (is_trace(path)) {
+        return load_trace(path, profile);
+    }
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("Error opening the timing profile");
+        return -1;
+    }
+    char line[4096];
+    int number = 0;
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), f)) {
+        number++;
+        char *hash = strchr(line, '#');
+        if (hash) {
+            *hash = '\0';
+        }
+        char *save;
+        char *name = strtok_r(line, " \t\r\n", &save);
+        if (!name) {
+            continue;
+        }
+        char *rest = strtok_r(NULL, "\r\n", &save);
+        std::string value = rest ? rest : "";
+        value.erase(0, value.find_first_not_of(" \t"));
+        value.erase(value.find_last_not_of(" \t") + 1);
+
+        int op = -1;
+        for (int i = 0; i < KV_LAT_OPS; i++) {
+            if (strcmp(name, OP_NAMES[i]) == 0) {
+                op = i;
+            }
+        }
+        char *end;
+        double n = strtod(value.c_str(), &end);
+        bool number_ok = !value.empty() && *end == '\0' && n >= 0;
+        if (op >= 0) {
+            std::string tokens = value;
+            if (!parse_quantiles(&tokens[0], &profile->service[op])) {
+                ret = -1;
+            }
+        } else if (strcmp(name, "from_trace") == 0) {
+            if (value.empty() || load_trace(value.c_str(), profile) < 0) {
+                ret = -1;
+            }
+        } else if (strcmp(name, "channels") == 0 && number_ok && n >= 1) {
+            profile->channels = n;
+        } else if (strcmp(name, "dies_per_channel") == 0 && number_ok && n >= 1) {
+            profile->dies_per_channel = n;
+        } else if (strcmp(name, "bandwidth_mbps") == 0 && number_ok) {
+            profile->bandwidth_mbps = n;
+        } else if (strcmp(name, "write_amplification") == 0 && number_ok && n >= 1) {
+            profile->write_amplification = n;
+        } else if (strcmp(name, "gc_every_mb") == 0 && number_ok) {
+            profile->gc_every_bytes = (__u64)(n * (1 << 20));
+        } else if (strcmp(name, "gc_pause_us") == 0 && number_ok) {
+            profile->gc_pause_ns = (__u64)(n * 1000);
+        } else if (strcmp(name, "seed") == 0 && number_ok) {
+            profile->seed = (__u64)n;
+        } else {
+            ret = -1;
+        }
+        if (ret < 0) {
+            fprintf(stderr, "Invalid timing profile line %s:%d: %s %s\n", path, number, name, value.c_str());
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+KVTimingModel::KVTimingModel(const KVTimingProfile &profile)
+    : prof(profile), link_free(0), programmed(0), pauses(0) {
+    prof.channels = std::max(prof.channels, 1u);
+    prof.dies_per_channel = std::max(prof.dies_per_channel, 1u);
+    link_ns_per_byte = prof.bandwidth_mbps > 0 ? 1000.0 / prof.bandwidth_mbps : 0;
+    die_free.assign(prof.channels * prof.dies_per_channel, 0);
+    rng.seed(prof.seed ? prof.seed : kv_now_ns());
+}
+
+unsigned KVTimingModel::die_of(const void *key, size_t key_size) const {
+    return kv_crc32(key, key_size) % die_free.size();
+}
+
+__u64 KVTimingModel::gc_pauses() {
+    std::lock_guard<std::mutex> guard(lock);
+    return pauses;
+}
+
+// Inverse of the piecewise linear distribution; under lock
+__u64 KVTimingModel::sample(int op) {
+    const std::vector<KVServiceQuantile> &q = prof.service[op];
+    if (q.empty()) {
+        return 0;
+    }
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    if (u <= q[0].fraction) {
+        return q[0].ns;
+    }
+    for (size_t i = 1; i < q.size(); i++) {
+        if (u <= q[i].fraction) {
+            double t = (u - q[i - 1].fraction) / (q[i].fraction - q[i - 1].fraction);
+            return q[i - 1].ns + (__u64)(t * (q[i].ns - q[i - 1].ns));
+        }
+    }
+    return q.back().ns;
+}
+
+__u64 KVTimingModel::schedule(__u8 opcode, const void *key, size_t key_size, size_t bytes, __u64 arrival_ns) {
+    unsigned die = die_of(key, key_size);
+    __u64 transfer = (__u64)(bytes * link_ns_per_byte);
+    std::lock_guard<std::mutex> guard(lock);
+    __u64 service = sample(kv_latency_op_index(opcode));
+    __u64 done;
+    if (opcode == KV_OPC_STORE) {
+        // the value comes over the link before the die can program it
+        __u64 sent = std::max(arrival_ns, link_free) + transfer;
+        link_free = sent;
+        done = std::max(sent, die_free[die]) + service;
+        // pages moved to make room keep the die busy after the ack
+        die_free[die] = done + (__u64)((prof.write_amplification - 1) * service);
+        programmed += (__u64)(bytes * prof.write_amplification);
+        if (prof.gc_every_bytes > 0 && programmed >= prof.gc_every_bytes) {
+            programmed -= prof.gc_every_bytes;
+            pauses++;
+            unsigned first = die - die % prof.dies_per_channel;
+            for (unsigned d = first; d < first + prof.dies_per_channel; d++) {
+                die_free[d] = std::max(die_free[d], done) + prof.gc_pause_ns;
+            }
+        }
+    } else {
+        __u64 read = std::max(arrival_ns, die_free[die]) + service;
+        die_free[die] = read;
+        done = transfer > 0 ? std::max(read, link_free) + transfer : read;
+        link_free = transfer > 0 ? done : link_free;
+    }
+    return done;
+}
+
+void KVTimingModel::wait_until(__u64 ns) {
+    __u64 now = kv_now_ns();
+    if (now + SPIN_NS < ns) {
+        struct timespec ts;
+        ts.tv_sec = (ns - SPIN_NS) / 1000000000ull;
+        ts.tv_nsec = (ns - SPIN_NS) % 1000000000ull;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        }
+    }
+    while (kv_now_ns() < ns) {
+        std::this_thread::yield();
+    }
+}
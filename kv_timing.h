@@ -0,0 +1,91 @@
+#ifndef KV_TIMING_H
+#define KV_TIMING_H
+
+#include "kv_histogram.h"
+#include "kv_trace.h"
+#include <linux/types.h>
+#include <stddef.h>
+#include <mutex>
+#include <random>
+#include <vector>
+
+// One point of a service-time distribution: fraction of commands done
+// within ns
+struct KVServiceQuantile {
+    double fraction;
+    __u64 ns;
+};
+
+// What a device looks like from the host. Service times are per opcode
+// (KV_LAT_OP_*), as quantiles that are interpolated between; an opcode
+// without any takes no time on a die.
+struct KVTimingProfile {
+    unsigned channels = 8;
+    unsigned dies_per_channel = 4;
+    double bandwidth_mbps = 0;              //host link, MB/s; 0 leaves it uncapped
+    double write_amplification = 1;         //NAND bytes programmed per byte stored
+    __u64 gc_every_bytes = 0;               //NAND bytes between GC pauses, 0 for none
+    __u64 gc_pause_ns = 0;
+    __u64 seed = 0;                         //0 seeds from the clock
+    std::vector<KVServiceQuantile> service[KV_LAT_OPS];
+};
+
+// Loads a profile file, one setting per line and # for comments:
+//
+//   channels 8
+//   dies_per_channel 4
+//   bandwidth_mbps 3200
+//   write_amplification 2.5
+//   gc_every_mb 512
+//   gc_pause_us 4000
+//   seed 1
+//   store 0:9 0.5:14 0.99:60 0.999:300 1:2000      <fraction>:<us> ...
+//   retrieve 0:70 0.5:90 0.99:180 1:900
+//   from_trace /var/tmp/prod.trace                  service times of every opcode
+//
+// A trace file (see KVTraceWriter) is a profile too: the defaults, with the
+// service times it recorded. Record it at queue depth 1, or the queueing
+// of the recording is counted twice. Returns 0 or -1.
+int kv_load_timing_profile(const char *path, KVTimingProfile *profile);
+// The latency distribution of every opcode in the trace, over the commands
+// that completed on the device
+void kv_timing_from_trace(const KVTraceReader &trace, KVTimingProfile *profile);
+
+// Timeline of a device that follows a profile. Every die, and the host
+// link, is free again at some time; a command goes to the die its key
+// hashes to, waits there for the commands ahead of it and then for its
+// transfer, which is when it completes. A store keeps its die busy a while
+// longer for the pages that write amplification adds, and every
+// gc_every_bytes of them stop the channel for a GC pause.
+class KVTimingModel {
+public:
+    explicit KVTimingModel(const KVTimingProfile &profile);
+
+    KVTimingModel(const KVTimingModel &) = delete;
+    KVTimingModel &operator=(const KVTimingModel &) = delete;
+
+    // Books a command that arrived at arrival_ns (kv_now_ns() time) and
+    // moved bytes over the link; returns when it completes
+    __u64 schedule(__u8 opcode, const void *key, size_t key_size, size_t bytes, __u64 arrival_ns);
+    // Sleeps, then spins the last stretch, which a timer would overshoot
+    static void wait_until(__u64 ns);
+
+    unsigned die_of(const void *key, size_t key_size) const;
+    unsigned dies() const { return die_free.size(); }
+    __u64 gc_pauses();
+    const KVTimingProfile &profile() const { return prof; }
+
+private:
+    __u64 sample(int op);
+
+    KVTimingProfile prof;
+    double link_ns_per_byte;
+    std::mutex lock;                        //everything below
+    std::mt19937_64 rng;
+    std::vector<__u64> die_free;
+    __u64 link_free;
+    __u64 programmed;                       //NAND bytes since the last GC pause
+    __u64 pauses;
+};
+
+#endif
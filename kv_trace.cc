@@ -0,0 +1,246 @@
+#include "kv_trace.h"
+#include "kv_client.h"
+#include "kv_histogram.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+
+static int write_all(int fd, const void *data, size_t size) {
+    const char *p = (const char *)data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+std::shared_ptr<KVTraceWriter> KVTraceWriter::create(const char *path) {
+    int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Error creating the trace");
+        return NULL;
+    }
+    std::shared_ptr<KVTraceWriter> writer(new KVTraceWriter(fd));
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    KVTraceHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = KV_TRACE_MAGIC;
+    header.version = KV_TRACE_VERSION;
+    header.record_size = sizeof(KVTraceRecord);
+    header.wall_ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    int ret = write_all(fd, &header, sizeof(header));
+    if (ret < 0) {
+        errno = -ret;
+        perror("Error writing the trace header");
+        return NULL;
+    }
+    return writer;
+}
+
+KVTraceWriter::KVTraceWriter(int fd)
+    : fd(fd), base(kv_now_ns()), written(0), error(0), writing(false), stopping(false) {
+    pending.reserve(BLOCK);
+    spare.reserve(BLOCK);
+    thread = std::thread(&KVTraceWriter::worker, this);
+}
+
+KVTraceWriter::~KVTraceWriter() {
+    flush();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    cond.notify_all();
+    thread.join();
+    close(fd);
+}
+
+void KVTraceWriter::append(const struct nvme_passthru_cmd *cmd, int status, __u64 start, __u64 end) {
+    KVTraceRecord r;
+    memset(&r, 0, sizeof(r));
+    r.issued_ns = start > base ? start - base : 0;
+    __u64 latency = end > start ? end - start : 0;
+    r.latency_ns = latency > UINT32_MAX ? UINT32_MAX : latency;
+    r.status = status;
+    r.nsid = cmd->nsid;
+    r.cdw10 = cmd->cdw10;
+    r.cdw11 = cmd->cdw11;
+    r.data_len = cmd->data_len;
+    r.opcode = cmd->opcode;
+    KVKey key = kv_unpack_key(cmd);
+    memcpy(r.key, key.bytes, sizeof(r.key));
+
+    std::unique_lock<std::mutex> guard(lock);
+    pending.push_back(r);
+    if (pending.size() < BLOCK) {
+        return;
+    }
+    cond.wait(guard, [this] { return !writing; });
+    // another append may have handed the block over while this one waited
+    if (pending.size() >= BLOCK) {
+        pending.swap(spare);
+        writing = true;
+        cond.notify_all();
+    }
+}
+
+void KVTraceWriter::worker() {
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+        cond.wait(guard, [this] { return writing || stopping; });
+        if (!writing) {
+            return;
+        }
+        guard.unlock();
+        int ret = write_all(fd, spare.data(), spare.size() * sizeof(KVTraceRecord));
+        guard.lock();
+        if (ret == 0) {
+            written += spare.size();
+        } else if (!error) {
+            error = ret;
+        }
+        spare.clear();
+        writing = false;
+        cond.notify_all();
+    }
+}
+
+int KVTraceWriter::write_pending() {
+    if (pending.empty()) {
+        return 0;
+    }
+    int ret = write_all(fd, pending.data(), pending.size() * sizeof(KVTraceRecord));
+    if (ret == 0) {
+        written += pending.size();
+    } else if (!error) {
+        error = ret;
+    }
+    pending.clear();
+    return ret;
+}
+
+int KVTraceWriter::flush() {
+    std::unique_lock<std::mutex> guard(lock);
+    // the block in flight goes first, the file is written in order
+    cond.wait(guard, [this] { return !writing; });
+    write_pending();
+    return error;
+}
+
+__u64 KVTraceWriter::records() {
+    std::lock_guard<std::mutex> guard(lock);
+    return written + pending.size() + spare.size();
+}
+
+std::unique_ptr<KVTraceReader> KVTraceReader::open(const char *path) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("Error opening the trace");
+        return NULL;
+    }
+    struct stat st;
+    std::unique_ptr<KVTraceReader> reader(new KVTraceReader());
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(KVTraceHeader)) {
+        fprintf(stderr, "Not a KV trace: %s\n", path);
+        close(fd);
+        return NULL;
+    }
+    reader->map_size = st.st_size;
+    reader->map = mmap(NULL, reader->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (reader->map == MAP_FAILED) {
+        reader->map = NULL;
+        perror("Error mapping the trace");
+        return NULL;
+    }
+    const KVTraceHeader &h = reader->header();
+    if (h.magic != KV_TRACE_MAGIC || h.version != KV_TRACE_VERSION || h.record_size != sizeof(KVTraceRecord)) {
+        fprintf(stderr, "Not a KV trace, or another version: %s\n", path);
+        return NULL;
+    }
+    madvise(reader->map, reader->map_size, MADV_SEQUENTIAL);
+    reader->records = (const KVTraceRecord *)((const char *)reader->map + sizeof(KVTraceHeader));
+    reader->count = (reader->map_size - sizeof(KVTraceHeader)) / sizeof(KVTraceRecord);
+    return reader;
+}
+
+KVTraceReader::~KVTraceReader() {
+    if (map) {
+        munmap(map, map_size);
+    }
+}
+
+void kv_trace_command(const KVTraceRecord &record, struct nvme_passthru_cmd *cmd, void *buf) {
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->opcode = record.opcode;
+    cmd->nsid = record.nsid;
+    kv_pack_key(cmd, kv_key(record.key, KV_MAX_KEY_SIZE));
+    cmd->cdw10 = record.cdw10;
+    cmd->cdw11 = record.cdw11;
+    cmd->addr = (__u64)(uintptr_t)buf;
+    cmd->data_len = record.data_len;
+    cmd->timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+}
+
+int KVTraceBackend::submit(struct nvme_passthru_cmd *cmd, __u32 *result) {
+    __u64 start = kv_now_ns();
+    int ret = inner->submit(cmd, result);
+    int saved = errno;
+    writer->append(cmd, ret < 0 ? -saved : ret, start, kv_now_ns());
+    errno = saved;
+    return ret;
+}
+
+void KVTraceBackend::submit_batch(struct nvme_passthru_cmd *cmds, size_t n, int *status) {
+    __u64 start = kv_now_ns();
+    inner->submit_batch(cmds, n, status);
+    __u64 end = kv_now_ns();
+    for (size_t i = 0; i < n; i++) {
+        writer->append(&cmds[i], status[i], start, end);
+    }
+}
+
+bool kv_is_trace_spec(const char *spec) {
+    return strncmp(spec, "trace:", 6) == 0;
+}
+
+std::shared_ptr<KVTraceBackend> kv_open_trace(const char *spec) {
+    static std::mutex lock;
+    static std::map<std::string, std::shared_ptr<KVTraceBackend> > traces;
+
+    const char *comma = kv_is_trace_spec(spec) ? strchr(spec + 6, ',') : NULL;
+    if (!comma || comma == spec + 6 || !comma[1]) {
+        fprintf(stderr, "Invalid trace spec: %s\n", spec ? spec : "");
+        return NULL;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    // a second recorder on the same file would truncate the first one
+    std::shared_ptr<KVTraceBackend> &trace = traces[spec];
+    if (!trace) {
+        std::string path(spec + 6, comma);
+        std::shared_ptr<KVBackend> inner = kv_open_backend(comma + 1);
+        std::shared_ptr<KVTraceWriter> writer = inner ? KVTraceWriter::create(path.c_str()) : NULL;
+        if (!writer) {
+            traces.erase(spec);
+            return NULL;
+        }
+        trace = std::make_shared<KVTraceBackend>(inner, writer);
+    }
+    return trace;
+}
@@ -0,0 +1,128 @@
+#ifndef KV_TRACE_H
+#define KV_TRACE_H
+
+#include "kv_backend.h"
+#include <linux/types.h>
+#include <linux/nvme_ioctl.h>
+#include <stddef.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+const __u32 KV_TRACE_MAGIC = 0x5254564b;   //"KVTR"
+const __u32 KV_TRACE_VERSION = 1;
+
+struct KVTraceHeader {
+    __u32 magic;
+    __u32 version;
+    __u32 record_size;
+    __u32 reserved;
+    __u64 wall_ns;          //CLOCK_REALTIME when recording started
+};
+
+// One command. Records have a fixed size so a mapped trace is an array.
+struct KVTraceRecord {
+    __u64 issued_ns;        //since recording started
+    __u32 latency_ns;       //saturates at about 4.3 s
+    __s32 status;           //NVMe status, or -errno
+    __u32 nsid;
+    __u32 cdw10;            //value or buffer size
+    __u32 cdw11;            //key size and options
+    __u32 data_len;
+    __u8 opcode;
+    __u8 reserved[7];
+    __u8 key[16];           //cdw2, cdw3, cdw14, cdw15 as sent
+};
+
+static_assert(sizeof(KVTraceRecord) == 56, "trace records are 56 bytes on disk");
+
+// Appends records to a new trace file. Records are buffered and written
+// in blocks, in completion order, so issued_ns is only roughly sorted.
+// Full blocks go to a writer thread, so append() only waits for the disk
+// when it falls a whole block behind.
+class KVTraceWriter {
+public:
+    static std::shared_ptr<KVTraceWriter> create(const char *path);
+    ~KVTraceWriter();
+
+    KVTraceWriter(const KVTraceWriter &) = delete;
+    KVTraceWriter &operator=(const KVTraceWriter &) = delete;
+
+    // start and end are kv_now_ns() readings
+    void append(const struct nvme_passthru_cmd *cmd, int status, __u64 start, __u64 end);
+    // Writes out what is buffered. Returns 0, or the first write error
+    // (-errno) since the trace was created; the records it hit are lost.
+    int flush();
+    __u64 records();
+
+private:
+    static const size_t BLOCK = 1024;       //records per write
+
+    explicit KVTraceWriter(int fd);
+    int write_pending();
+    void worker();
+
+    int fd;
+    __u64 base;
+    __u64 written;
+    int error;              //first failed write, -errno
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<KVTraceRecord> pending;
+    std::vector<KVTraceRecord> spare;       //the block being written
+    bool writing;
+    bool stopping;
+    std::thread thread;
+};
+
+// Read-only view of a trace file mapped into memory. A record cut short by
+// a crash at the end of the file is ignored.
+class KVTraceReader {
+public:
+    static std::unique_ptr<KVTraceReader> open(const char *path);
+    ~KVTraceReader();
+
+    KVTraceReader(const KVTraceReader &) = delete;
+    KVTraceReader &operator=(const KVTraceReader &) = delete;
+
+    const KVTraceHeader &header() const { return *(const KVTraceHeader *)map; }
+    size_t size() const { return count; }
+    const KVTraceRecord &operator[](size_t i) const { return records[i]; }
+
+private:
+    KVTraceReader() : map(NULL), map_size(0), records(NULL), count(0) {}
+
+    void *map;
+    size_t map_size;
+    const KVTraceRecord *records;
+    size_t count;
+};
+
+// Rebuilds the recorded command around a data buffer of data_len bytes
+void kv_trace_command(const KVTraceRecord &record, struct nvme_passthru_cmd *cmd, void *buf);
+
+// Records every command that goes through it, then hands it to the inner
+// backend. Commands of a batch share the batch's issue time and latency.
+// It reports no device fd, so nothing stacked on top can go around it.
+class KVTraceBackend : public KVBackend {
+public:
+    KVTraceBackend(std::shared_ptr<KVBackend> inner, std::shared_ptr<KVTraceWriter> writer)
+        : inner(std::move(inner)), writer(std::move(writer)) {}
+
+    int submit(struct nvme_passthru_cmd *cmd, __u32 *result) override;
+    void submit_batch(struct nvme_passthru_cmd *cmds, size_t n, int *status) override;
+
+    const std::shared_ptr<KVTraceWriter> &trace() const { return writer; }
+
+private:
+    std::shared_ptr<KVBackend> inner;
+    std::shared_ptr<KVTraceWriter> writer;
+};
+
+// "trace:<file>,<spec>" records the commands sent to <spec> into <file>
+std::shared_ptr<KVTraceBackend> kv_open_trace(const char *spec);
+bool kv_is_trace_spec(const char *spec);
+
+#endif
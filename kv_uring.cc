@@ -0,0 +1,296 @@
+#include "kv_uring.h"
+#include "kv_buffer.h"
+#include "kv_histogram.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+// SQE128 / CQE32 rings are required for NVMe passthrough
+const size_t SQE_SIZE = 128;
+const size_t CQE_SIZE = 32;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+std::unique_ptr<KVUringEngine> KVUringEngine::create(int fd, unsigned queue_depth) {
+    std::unique_ptr<KVUringEngine> engine(new KVUringEngine(fd, queue_depth));
+    if (engine->setup() < 0) {
+        perror("Error setting up the io_uring");
+        return NULL;
+    }
+    return engine;
+}
+
+KVUringEngine::KVUringEngine(int fd, unsigned queue_depth)
+    : dev_fd(fd), ring_fd(-1), depth(queue_depth ? queue_depth : 1), busy(0), pending(0), recording(true),
+      sq_ptr(MAP_FAILED), sq_size(0), cq_ptr(MAP_FAILED), cq_size(0),
+      sqes(MAP_FAILED), sqes_size(0) {
+}
+
+KVUringEngine::~KVUringEngine() {
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqes_size);
+    }
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+        munmap(cq_ptr, cq_size);
+    }
+    if (sq_ptr != MAP_FAILED) {
+        munmap(sq_ptr, sq_size);
+    }
+    if (ring_fd >= 0) {
+        close(ring_fd);
+    }
+}
+
+int KVUringEngine::setup() {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SQE128 | IORING_SETUP_CQE32;
+    ring_fd = io_uring_setup(depth, &p);
+    if (ring_fd < 0) {
+        return -1;
+    }
+    // the kernel rounds up to a power of two; never keep more in flight
+    // than the completion ring can hold
+    if (depth > p.sq_entries) {
+        depth = p.sq_entries;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * CQE_SIZE;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            return -1;
+        }
+    }
+    sqes_size = p.sq_entries * SQE_SIZE;
+    sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return -1;
+    }
+
+    char *sq = (char *)sq_ptr;
+    char *cq = (char *)cq_ptr;
+    sq_head = (unsigned *)(sq + p.sq_off.head);
+    sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + p.sq_off.array);
+    cq_head = (unsigned *)(cq + p.cq_off.head);
+    cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    cqes = cq + p.cq_off.cqes;
+
+    slots.resize(depth);
+    for (unsigned i = depth; i > 0; i--) {
+        free_slots.push_back(i - 1);
+    }
+    return 0;
+}
+
+int KVUringEngine::register_buffers(const std::shared_ptr<KVBufferPool> &pool) {
+#ifdef IORING_URING_CMD_FIXED
+    if (fixed) {
+        io_uring_register(ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        fixed = NULL;
+    }
+    std::vector<struct iovec> regions = pool->regions();
+    if (io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, regions.data(), regions.size()) < 0) {
+        return -errno;
+    }
+    fixed = pool;
+    return 0;
+#else
+    (void)pool;
+    return -EOPNOTSUPP;
+#endif
+}
+
+int KVUringEngine::queue(const struct nvme_passthru_cmd *cmd, kv_completion_fn fn, void *ctx) {
+    if (free_slots.empty()) {
+        return -EBUSY;
+    }
+    unsigned id = free_slots.back();
+    free_slots.pop_back();
+    slots[id].fn = fn;
+    slots[id].ctx = ctx;
+    slots[id].start = kv_now_ns();
+    slots[id].opcode = cmd->opcode;
+
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)((char *)sqes + index * SQE_SIZE);
+    memset(sqe, 0, SQE_SIZE);
+    sqe->opcode = IORING_OP_URING_CMD;
+    sqe->fd = dev_fd;
+    sqe->cmd_op = NVME_URING_CMD_IO;
+    sqe->user_data = id;
+#ifdef IORING_URING_CMD_FIXED
+    int region = fixed ? fixed->region_of((const void *)(uintptr_t)cmd->addr, cmd->data_len) : -1;
+    if (region >= 0 && cmd->data_len > 0) {
+        sqe->uring_cmd_flags = IORING_URING_CMD_FIXED;
+        sqe->buf_index = region;
+    }
+#endif
+
+    struct nvme_uring_cmd *ucmd = (struct nvme_uring_cmd *)sqe->cmd;
+    ucmd->opcode = cmd->opcode;
+    ucmd->flags = cmd->flags;
+    ucmd->nsid = cmd->nsid;
+    ucmd->cdw2 = cmd->cdw2;
+    ucmd->cdw3 = cmd->cdw3;
+    ucmd->metadata = cmd->metadata;
+    ucmd->addr = cmd->addr;
+    ucmd->metadata_len = cmd->metadata_len;
+    ucmd->data_len = cmd->data_len;
+    ucmd->cdw10 = cmd->cdw10;
+    ucmd->cdw11 = cmd->cdw11;
+    ucmd->cdw12 = cmd->cdw12;
+    ucmd->cdw13 = cmd->cdw13;
+    ucmd->cdw14 = cmd->cdw14;
+    ucmd->cdw15 = cmd->cdw15;
+    ucmd->timeout_ms = cmd->timeout_ms;
+
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    busy++;
+    pending++;
+    return 0;
+}
+
+int KVUringEngine::submit() {
+    int submitted = 0;
+    bool retried = false;
+    while (pending > 0) {
+        int ret = io_uring_enter(ring_fd, pending, 0, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            // the kernel took nothing; once more, then let the caller decide
+            if (retried) {
+                return -EAGAIN;
+            }
+            retried = true;
+            continue;
+        }
+        pending -= ret;
+        submitted += ret;
+    }
+    return submitted;
+}
+
+int KVUringEngine::reap(unsigned min_complete) {
+    int reaped = 0;
+    if (min_complete > busy) {
+        min_complete = busy;
+    }
+    for (;;) {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = (struct io_uring_cqe *)(cqes + (head & *cq_mask) * CQE_SIZE);
+            unsigned id = (unsigned)cqe->user_data;
+            int status = cqe->res;
+            __u32 result = (__u32)cqe->big_cqe[0];
+            head++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+            slot s = slots[id];
+            if (recording) {
+                kv_latency_record(s.opcode, status, kv_now_ns() - s.start);
+            }
+            free_slots.push_back(id);
+            busy--;
+            reaped++;
+            if (s.fn) {
+                s.fn(s.ctx, status, result);
+            }
+        }
+        if ((unsigned)reaped >= min_complete) {
+            return reaped;
+        }
+        int ret = io_uring_enter(ring_fd, pending, min_complete - reaped, IORING_ENTER_GETEVENTS);
+        if (ret < 0 && errno != EINTR) {
+            return -errno;
+        }
+        if (ret > 0) {
+            pending -= ret < (int)pending ? ret : pending;
+        }
+    }
+}
+
+struct sync_completion {
+    bool done;
+    int status;
+    __u32 result;
+};
+
+static void complete_sync(void *ctx, int status, __u32 result) {
+    sync_completion *c = (sync_completion *)ctx;
+    c->done = true;
+    c->status = status;
+    c->result = result;
+}
+
+int KVUringEngine::execute(struct nvme_passthru_cmd *cmd, __u32 *result) {
+    sync_completion c = {false, 0, 0};
+    int ret = queue(cmd, complete_sync, &c);
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    ret = submit();
+    while (!c.done && ret >= 0) {
+        ret = reap(1);
+    }
+    if (!c.done) {
+        // c goes away with this frame: a late completion is dropped
+        for (slot &s : slots) {
+            if (s.ctx == &c) {
+                s.fn = NULL;
+                s.ctx = NULL;
+            }
+        }
+        errno = -ret;
+        return -1;
+    }
+    if (c.status < 0) {
+        errno = -c.status;
+        return -1;
+    }
+    cmd->result = c.result;
+    if (result) {
+        *result = c.result;
+    }
+    return c.status;
+}
@@ -0,0 +1,97 @@
+#ifndef KV_URING_H
+#define KV_URING_H
+
+#include <linux/types.h>
+#include <linux/nvme_ioctl.h>
+#include <memory>
+#include <vector>
+
+class KVBufferPool;
+
+// status is the NVMe status (0, 129, 134, ...) exactly as the ioctl path
+// returns it, or a negative errno when the command never reached the device
+typedef void (*kv_completion_fn)(void *ctx, int status, __u32 result);
+
+const unsigned KV_URING_DEFAULT_DEPTH = 128;
+
+// Asynchronous KV submission over IORING_OP_URING_CMD on an NVMe generic
+// char device (/dev/ngXnY). Commands are queued, handed to the kernel in
+// one io_uring_enter() per submit() and completed from reap().
+// One engine per thread: nothing in here is locked.
+class KVUringEngine {
+public:
+    static std::unique_ptr<KVUringEngine> create(int fd, unsigned queue_depth = KV_URING_DEFAULT_DEPTH);
+    virtual ~KVUringEngine();
+
+    KVUringEngine(const KVUringEngine &) = delete;
+    KVUringEngine &operator=(const KVUringEngine &) = delete;
+
+    unsigned queue_depth() const { return depth; }
+    virtual unsigned inflight() const { return busy; }
+    // Of those, the ones the kernel has taken: queued ones are not yet
+    virtual unsigned in_kernel() const { return busy - pending; }
+    // Off when the caller already times the commands, e.g. under a KVSession
+    void record_latency(bool on) { recording = on; }
+    // Registers the pool's arena as io_uring fixed buffers. Commands whose
+    // data lies in it are then sent with IORING_URING_CMD_FIXED, so the
+    // kernel skips pinning and mapping the pages on every command.
+    // Returns 0 or -errno; the engine keeps the pool alive.
+    int register_buffers(const std::shared_ptr<KVBufferPool> &pool);
+    bool fixed_buffers() const { return fixed != NULL; }
+
+    // Returns 0, or -EBUSY when queue_depth commands are already in flight.
+    // The command is copied; its data buffer must live until completion.
+    virtual int queue(const struct nvme_passthru_cmd *cmd, kv_completion_fn fn, void *ctx);
+    // Hands every queued command to the kernel, returns how many or -errno.
+    // -EAGAIN when the kernel twice takes none; in_kernel() tells what went in.
+    virtual int submit();
+    // Runs completion callbacks, waiting until at least min_complete are
+    // available. Returns the number reaped or -errno.
+    virtual int reap(unsigned min_complete = 0);
+
+    // Synchronous helper with the same contract as nvme_submit_io_passthru
+    int execute(struct nvme_passthru_cmd *cmd, __u32 *result);
+
+protected:
+    // Without setup(): for engines that stand in for a ring, such as in tests
+    KVUringEngine(int fd, unsigned queue_depth);
+
+private:
+    int setup();
+
+    struct slot {
+        kv_completion_fn fn;
+        void *ctx;
+        __u64 start;
+        __u8 opcode;
+    };
+
+    int dev_fd;
+    int ring_fd;
+    unsigned depth;
+    unsigned busy;
+    unsigned pending;
+    bool recording;
+
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    void *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    char *cqes;
+
+    std::shared_ptr<KVBufferPool> fixed;
+    std::vector<slot> slots;
+    std::vector<unsigned> free_slots;
+};
+
+#endif
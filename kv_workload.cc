@@ -0,0 +1,152 @@
+#include "kv_workload.h"
+#include <ctype.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+int kv_ycsb_workload(char letter, KVWorkloadSpec *spec) {
+    static const double mixes[6][KV_YCSB_OPS] = {
+        //read  update insert scan   rmw
+        {0.50,  0.50,  0,     0,     0},        //A: update heavy
+        {0.95,  0.05,  0,     0,     0},        //B: read mostly
+        {1.00,  0,     0,     0,     0},        //C: read only
+        {0.95,  0,     0.05,  0,     0},        //D: read latest
+        {0,     0,     0.05,  0.95,  0},        //E: short ranges
+        {0.50,  0,     0,     0,     0.50},     //F: read-modify-write
+    };
+    int w = toupper((unsigned char)letter) - 'A';
+    if (w < 0 || w >= 6) {
+        return -1;
+    }
+    memcpy(spec->mix, mixes[w], sizeof(spec->mix));
+    spec->distribution = w == 3 ? KV_DIST_LATEST : KV_DIST_ZIPFIAN;
+    spec->max_scan = 100;
+    return 0;
+}
+
+const char *kv_ycsb_op_name(int op) {
+    static const char *const names[KV_YCSB_OPS] = {"read", "update", "insert", "scan", "rmw"};
+    return op >= 0 && op < KV_YCSB_OPS ? names[op] : "?";
+}
+
+KVZipfian::KVZipfian(double theta)
+    : theta(theta), alpha(1 / (1 - theta)), zeta2(1 + pow(0.5, theta)), zetan(0), count(0) {
+}
+
+void KVZipfian::extend(__u64 n) {
+    for (__u64 i = count + 1; i <= n; i++) {
+        zetan += 1 / pow((double)i, theta);
+    }
+    count = n;
+}
+
+__u64 KVZipfian::next(std::mt19937_64 &rng, __u64 n) {
+    if (n <= 1) {
+        return 0;
+    }
+    if (n > count) {
+        extend(n);
+    }
+    double eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    double uz = u * zetan;
+    if (uz < 1) {
+        return 0;
+    }
+    if (uz < 1 + pow(0.5, theta)) {
+        return 1;
+    }
+    __u64 rank = (__u64)(n * pow(eta * u - eta + 1, alpha));
+    return std::min(rank, n - 1);
+}
+
+// FNV-1a over the 8 bytes of a number
+static __u64 fnv64(__u64 v) {
+    __u64 h = 0xcbf29ce484222325ull;
+    for (int i = 0; i < 8; i++) {
+        h ^= (v >> (8 * i)) & 0xff;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+KVKey kv_ycsb_key(__u64 record) {
+    // a bijection of the record number: distinct records, distinct keys
+    __u64 v = record;
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdull;
+    v ^= v >> 33;
+    v *= 0xc4ceb9fe1a85ec53ull;
+    v ^= v >> 33;
+    __u8 bytes[8];
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = (v >> (56 - 8 * i)) & 0xff;
+    }
+    return kv_key(bytes, sizeof(bytes));
+}
+
+KVWorkloadGenerator::KVWorkloadGenerator(const KVWorkloadSpec &spec, std::atomic<__u64> *records, __u64 seed)
+    : spec(spec), records(records), rng(seed), mix_total(0) {
+    for (int op = 0; op < KV_YCSB_OPS; op++) {
+        mix_total += spec.mix[op];
+    }
+}
+
+kv_ycsb_op_e KVWorkloadGenerator::next_op() {
+    double pick = std::uniform_real_distribution<double>(0, mix_total)(rng);
+    for (int op = 0; op < KV_YCSB_OPS; op++) {
+        if (pick < spec.mix[op]) {
+            return (kv_ycsb_op_e)op;
+        }
+        pick -= spec.mix[op];
+    }
+    return KV_YCSB_READ;
+}
+
+__u64 KVWorkloadGenerator::next_record() {
+    __u64 n = records->load(std::memory_order_relaxed);
+    if (n == 0) {
+        return 0;
+    }
+    switch (spec.distribution) {
+    case KV_DIST_ZIPFIAN:
+        // scattered, so the hot records are not all neighbours
+        return fnv64(zipf.next(rng, n)) % n;
+    case KV_DIST_LATEST:
+        return n - 1 - zipf.next(rng, n);
+    default:
+        return std::uniform_int_distribution<__u64>(0, n - 1)(rng);
+    }
+}
+
+int KVWorkloadGenerator::next_scan_length() {
+    return std::uniform_int_distribution<int>(1, std::max(spec.max_scan, 1))(rng);
+}
+
+int kv_ycsb_execute(KVSession *session, kv_ycsb_op_e op, __u64 record, int scan_length,
+                    void *buf, __u32 value_size) {
+    KVKey key = kv_ycsb_key(record);
+    switch (op) {
+    case KV_YCSB_READ:
+        return session->retrieve(key, buf, BUFFER_SIZE);
+    case KV_YCSB_UPDATE:
+        return session->update_if_present(key, buf, value_size);
+    case KV_YCSB_INSERT:
+        return session->insert_if_absent(key, buf, value_size);
+    case KV_YCSB_SCAN: {
+        // 4 byte count, then 2 byte size + 8 key bytes + 2 padding per key
+        size_t size = std::min<size_t>(4 + 12 * (size_t)std::max(scan_length, 1), BUFFER_SIZE);
+        return session->list(key, buf, size);
+    }
+    case KV_YCSB_RMW: {
+        int ret = session->retrieve(key, buf, BUFFER_SIZE);
+        if (ret != 0) {
+            return ret;
+        }
+        ((__u8 *)buf)[0]++;
+        return session->update_if_present(key, buf, value_size);
+    }
+    default:
+        return KV_ERR_INVALID_REQUEST;
+    }
+}
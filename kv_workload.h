@@ -0,0 +1,83 @@
+#ifndef KV_WORKLOAD_H
+#define KV_WORKLOAD_H
+
+#include "kv_client.h"
+#include <atomic>
+#include <random>
+
+// YCSB operations and how they map onto KV commands
+typedef enum {
+    KV_YCSB_READ,           //RETRIEVE
+    KV_YCSB_UPDATE,         //STORE, must exist
+    KV_YCSB_INSERT,         //STORE, must not exist
+    KV_YCSB_SCAN,           //LIST from the key
+    KV_YCSB_RMW,            //RETRIEVE, then STORE must exist
+    KV_YCSB_OPS
+} kv_ycsb_op_e;
+
+typedef enum {
+    KV_DIST_UNIFORM,
+    KV_DIST_ZIPFIAN,        //a few records everywhere in the keyspace are hot
+    KV_DIST_LATEST,         //the most recent inserts are hot
+} kv_key_distribution_e;
+
+struct KVWorkloadSpec {
+    double mix[KV_YCSB_OPS];
+    kv_key_distribution_e distribution;
+    int max_scan;           //scan lengths are uniform in 1..max_scan
+};
+
+// Core workloads A to F, case insensitive. Returns -1 for any other letter.
+int kv_ycsb_workload(char letter, KVWorkloadSpec *spec);
+const char *kv_ycsb_op_name(int op);
+
+// Zipfian ranks in [0, n), rank 0 the most popular, after Gray et al.
+// "Quickly generating billion-record synthetic databases". n may grow
+// between calls; the zeta sum is extended rather than recomputed.
+class KVZipfian {
+public:
+    explicit KVZipfian(double theta = 0.99);
+    __u64 next(std::mt19937_64 &rng, __u64 n);
+
+private:
+    void extend(__u64 n);
+
+    double theta;
+    double alpha;
+    double zeta2;
+    double zetan;
+    __u64 count;
+};
+
+// 8-byte key of a record. Record numbers are hashed so that consecutive
+// inserts land all over the keyspace, as with YCSB's hashed insert order.
+KVKey kv_ycsb_key(__u64 record);
+
+// Picks operations, records and scan lengths for one client thread. The
+// record count is shared by every generator of a run: inserts claim the
+// next number, reads pick among the numbers claimed so far.
+class KVWorkloadGenerator {
+public:
+    KVWorkloadGenerator(const KVWorkloadSpec &spec, std::atomic<__u64> *records, __u64 seed);
+
+    kv_ycsb_op_e next_op();
+    __u64 next_record();
+    __u64 next_insert() { return records->fetch_add(1); }
+    int next_scan_length();
+    std::mt19937_64 &random() { return rng; }
+
+private:
+    KVWorkloadSpec spec;
+    std::atomic<__u64> *records;
+    std::mt19937_64 rng;
+    KVZipfian zipf;
+    double mix_total;
+};
+
+// Runs one operation on record through session. buf must hold BUFFER_SIZE
+// bytes and value_size is what stores write. Returns the status of the
+// last command sent, or -1 with errno set.
+int kv_ycsb_execute(KVSession *session, kv_ycsb_op_e op, __u64 record, int scan_length,
+                    void *buf, __u32 value_size);
+
+#endif
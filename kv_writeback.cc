@@ -0,0 +1,291 @@
+#include "kv_writeback.h"
+#include "kv_histogram.h"
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+const size_t ENTRY_OVERHEAD = 64;
+
+KVWriteBackBackend::KVWriteBackBackend(std::shared_ptr<KVBackend> inner, __u32 nsid,
+                                       const KVWriteBackConfig &config)
+    : inner(std::move(inner)), ns(nsid), config(config), buffer_bytes(0), next_seq(0),
+      durable_seq(0), flush_seq(0), first_error(0), stopping(false), flushed_count(0), error_count(0) {
+    if (this->config.batch == 0) {
+        this->config.batch = 1;
+    }
+    thread = std::thread(&KVWriteBackBackend::flusher, this);
+}
+
+KVWriteBackBackend::~KVWriteBackBackend() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    // the flusher drains everything before it leaves
+    thread.join();
+}
+
+int KVWriteBackBackend::submit(struct nvme_passthru_cmd *cmd, __u32 *result) {
+    __u32 key_size = cmd->cdw11 & 0xff;
+    if (cmd->nsid != ns || key_size == 0 || key_size > KV_MAX_KEY_SIZE) {
+        if (cmd->opcode == KV_OPC_LIST) {
+            barrier();
+        }
+        return inner->submit(cmd, result);
+    }
+    KVKey k = kv_unpack_key(cmd);
+    std::string key((const char *)k.bytes, k.size);
+
+    switch (cmd->opcode) {
+    case KV_OPC_STORE:
+        return store(cmd, result, key);
+    case KV_OPC_DELETE:
+        return remove(cmd, result, key);
+    case KV_OPC_RETRIEVE:
+        return retrieve(cmd, result, key);
+    case KV_OPC_EXISTS: {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = buffer.find(key);
+        if (it != buffer.end()) {
+            cmd->result = 0;
+            if (result) {
+                *result = 0;
+            }
+            return it->second.deleted ? KV_ERR_KEY_NOT_EXIST : KV_SUCCESS;
+        }
+        break;
+    }
+    case KV_OPC_LIST:
+        // the device lists what it holds: give it everything first
+        barrier();
+        break;
+    }
+    return inner->submit(cmd, result);
+}
+
+int KVWriteBackBackend::store(struct nvme_passthru_cmd *cmd, __u32 *result, const std::string &key) {
+    __u32 size = cmd->cdw10;
+    bool options = (cmd->cdw11 & ~0xffu) != 0;
+    if (options || size == 0 || size > config.max_value || !cmd->addr || cmd->data_len < size) {
+        // conditions are checked by the device against what it holds, and
+        // a buffered write must not land on top of this one later
+        bool buffered;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            buffered = buffer.count(key) > 0;
+        }
+        if (buffered) {
+            barrier();
+        }
+        return inner->submit(cmd, result);
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    accept(guard, key, (const char *)(uintptr_t)cmd->addr, size, false);
+    cmd->result = 0;
+    if (result) {
+        *result = 0;
+    }
+    return KV_SUCCESS;
+}
+
+int KVWriteBackBackend::remove(struct nvme_passthru_cmd *cmd, __u32 *result, const std::string &key) {
+    std::unique_lock<std::mutex> guard(lock);
+    auto it = buffer.find(key);
+    if (it == buffer.end()) {
+        guard.unlock();
+        return inner->submit(cmd, result);
+    }
+    cmd->result = 0;
+    if (result) {
+        *result = 0;
+    }
+    if (it->second.deleted) {
+        return KV_ERR_KEY_NOT_EXIST;
+    }
+    accept(guard, key, NULL, 0, true);
+    return KV_SUCCESS;
+}
+
+int KVWriteBackBackend::retrieve(struct nvme_passthru_cmd *cmd, __u32 *result, const std::string &key) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = buffer.find(key);
+        if (it != buffer.end()) {
+            if (it->second.deleted) {
+                return KV_ERR_KEY_NOT_EXIST;
+            }
+            // same partial-read semantics as the device
+            if (cmd->cdw10 == 0) {
+                return KV_ERR_INVALID_REQUEST;
+            }
+            const std::string &value = it->second.value;
+            if (cmd->addr) {
+                size_t n = std::min<size_t>(std::min(cmd->cdw10, cmd->data_len), value.size());
+                memcpy((void *)(uintptr_t)cmd->addr, value.data(), n);
+            }
+            cmd->result = value.size();
+            if (result) {
+                *result = value.size();
+            }
+            return KV_SUCCESS;
+        }
+    }
+    return inner->submit(cmd, result);
+}
+
+void KVWriteBackBackend::accept(std::unique_lock<std::mutex> &guard, const std::string &key, const char *value,
+                                size_t size, bool deleted) {
+    for (;;) {
+        // a write a pending flush() waits for is not overwritten until it landed
+        auto it = buffer.find(key);
+        bool held = it != buffer.end() && it->second.seq <= flush_seq && durable_seq < flush_seq;
+        if (stopping || (!held && buffer_bytes < config.capacity_bytes)) {
+            break;
+        }
+        wake.notify_one();
+        done.wait(guard);
+    }
+    pending &p = buffer[key];
+    if (p.seq) {
+        buffer_bytes -= key.size() + p.value.size() + ENTRY_OVERHEAD;
+    }
+    p.value.assign(size ? value : "", size);
+    p.seq = ++next_seq;
+    p.deleted = deleted;
+    buffer_bytes += key.size() + size + ENTRY_OVERHEAD;
+
+    queued q;
+    q.key = key;
+    q.seq = p.seq;
+    q.accepted_ns = kv_now_ns();
+    order.push_back(std::move(q));
+    // the first write sets the flusher's deadline, a full batch goes at once
+    if (order.size() == 1 || order.size() >= config.batch) {
+        wake.notify_one();
+    }
+}
+
+bool KVWriteBackBackend::due(__u64 now) const {
+    if (order.empty()) {
+        return false;
+    }
+    return stopping || flush_seq > durable_seq || order.size() >= config.batch ||
+           buffer_bytes >= config.capacity_bytes ||
+           now - order.front().accepted_ns >= config.max_staleness_us * 1000;
+}
+
+void KVWriteBackBackend::flusher() {
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+        if (order.empty()) {
+            if (stopping) {
+                return;
+            }
+            wake.wait(guard);
+            continue;
+        }
+        __u64 now = kv_now_ns();
+        if (due(now)) {
+            drain(guard);
+            continue;
+        }
+        __u64 deadline = order.front().accepted_ns + config.max_staleness_us * 1000;
+        wake.wait_for(guard, std::chrono::nanoseconds(deadline - now));
+    }
+}
+
+// Sends the next batch of writes, oldest first, and drops them from the
+// buffer once the device has them (unless they were written again since)
+void KVWriteBackBackend::drain(std::unique_lock<std::mutex> &guard) {
+    std::vector<queued> batch;
+    std::vector<std::string> values;
+    std::vector<bool> deletes;
+    __u64 last = 0;
+    while (!order.empty() && batch.size() < config.batch) {
+        queued q = std::move(order.front());
+        order.pop_front();
+        last = q.seq;
+        auto it = buffer.find(q.key);
+        if (it == buffer.end() || it->second.seq != q.seq) {
+            continue;                       //written again, a later entry has it
+        }
+        values.push_back(it->second.value);
+        deletes.push_back(it->second.deleted);
+        batch.push_back(std::move(q));
+    }
+    guard.unlock();
+
+    size_t n = batch.size();
+    std::vector<struct nvme_passthru_cmd> cmds(n);
+    std::vector<int> status(n);
+    for (size_t i = 0; i < n; i++) {
+        struct nvme_passthru_cmd &cmd = cmds[i];
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.nsid = ns;
+        cmd.timeout_ms = KV_DEFAULT_TIMEOUT_MS;
+        kv_pack_key(&cmd, kv_key(batch[i].key.data(), batch[i].key.size()));
+        if (deletes[i]) {
+            cmd.opcode = KV_OPC_DELETE;
+        } else {
+            cmd.opcode = KV_OPC_STORE;
+            cmd.addr = (__u64)(uintptr_t)values[i].data();
+            cmd.cdw10 = values[i].size();
+            cmd.data_len = values[i].size();
+        }
+    }
+    if (n > 0) {
+        inner->submit_batch(cmds.data(), n, status.data());
+    }
+
+    guard.lock();
+    for (size_t i = 0; i < n; i++) {
+        // deleting a key whose store never left the buffer finds nothing
+        bool ok = status[i] == 0 || (deletes[i] && status[i] == KV_ERR_KEY_NOT_EXIST);
+        if (!ok) {
+            error_count.fetch_add(1, std::memory_order_relaxed);
+            if (first_error == 0) {
+                first_error = status[i] > 0 ? status[i] : -1;
+            }
+        }
+        auto it = buffer.find(batch[i].key);
+        if (it != buffer.end() && it->second.seq == batch[i].seq) {
+            buffer_bytes -= it->first.size() + it->second.value.size() + ENTRY_OVERHEAD;
+            buffer.erase(it);
+        }
+    }
+    flushed_count.fetch_add(n, std::memory_order_relaxed);
+    durable_seq = std::max(durable_seq, last);
+    done.notify_all();
+}
+
+void KVWriteBackBackend::barrier() {
+    std::unique_lock<std::mutex> guard(lock);
+    __u64 target = next_seq;
+    if (durable_seq >= target) {
+        return;
+    }
+    flush_seq = std::max(flush_seq, target);
+    wake.notify_one();
+    done.wait(guard, [this, target] { return durable_seq >= target; });
+}
+
+int KVWriteBackBackend::flush() {
+    barrier();
+    std::lock_guard<std::mutex> guard(lock);
+    int ret = first_error;
+    first_error = 0;
+    return ret;
+}
+
+size_t KVWriteBackBackend::buffered() {
+    std::lock_guard<std::mutex> guard(lock);
+    return buffer.size();
+}
+
+size_t KVWriteBackBackend::bytes() {
+    std::lock_guard<std::mutex> guard(lock);
+    return buffer_bytes;
+}
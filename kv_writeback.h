@@ -0,0 +1,96 @@
+#ifndef KV_WRITEBACK_H
+#define KV_WRITEBACK_H
+
+#include "kv_backend.h"
+#include "kv_client.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+struct KVWriteBackConfig {
+    size_t capacity_bytes = 16ul << 20;     //stores block once this much is buffered
+    __u32 max_value = 512;                  //bigger values are stored synchronously
+    size_t batch = 256;                     //commands per submit_batch() of the flusher
+    __u64 max_staleness_us = 1000;          //oldest buffered write reaches the device by then
+};
+
+// Write-back buffer for small Stores. An unconditional STORE of up to
+// max_value bytes is copied to host memory and acknowledged at once; a
+// DELETE of a buffered key is buffered too. Retrieve and Exists see the
+// buffered writes, LIST flushes first. A flusher thread drains the buffer
+// in order, batch commands at a time through the inner backend's
+// submit_batch(), as soon as a batch is full or the oldest write has waited
+// max_staleness_us.
+//
+// A buffered store that the device then rejects (129 when it is full) was
+// already acknowledged: flush() reports it, like fsync() does.
+class KVWriteBackBackend : public KVBackend {
+public:
+    KVWriteBackBackend(std::shared_ptr<KVBackend> inner, __u32 nsid = 1,
+                       const KVWriteBackConfig &config = KVWriteBackConfig());
+    ~KVWriteBackBackend();
+
+    int submit(struct nvme_passthru_cmd *cmd, __u32 *result) override;
+    // the char device would skip the buffer
+    int device_fd() const override { return -1; }
+
+    // Barrier: returns once every write acknowledged before the call is on
+    // the device. 0, or the first status the device gave a buffered write
+    // since the last flush().
+    int flush();
+
+    size_t buffered();
+    size_t bytes();
+    __u64 flushed() const { return flushed_count.load(std::memory_order_relaxed); }
+    __u64 errors() const { return error_count.load(std::memory_order_relaxed); }
+
+private:
+    struct pending {
+        std::string value;
+        __u64 seq;
+        bool deleted;                       //a buffered DELETE
+    };
+
+    // write order, oldest first; entries overwritten since are skipped
+    struct queued {
+        std::string key;
+        __u64 seq;
+        __u64 accepted_ns;
+    };
+
+    int store(struct nvme_passthru_cmd *cmd, __u32 *result, const std::string &key);
+    int remove(struct nvme_passthru_cmd *cmd, __u32 *result, const std::string &key);
+    int retrieve(struct nvme_passthru_cmd *cmd, __u32 *result, const std::string &key);
+    void accept(std::unique_lock<std::mutex> &guard, const std::string &key, const char *value,
+                size_t size, bool deleted);
+    bool due(__u64 now) const;
+    // waits until every write accepted so far is on the device
+    void barrier();
+    void flusher();
+    void drain(std::unique_lock<std::mutex> &guard);
+
+    std::shared_ptr<KVBackend> inner;
+    __u32 ns;
+    KVWriteBackConfig config;
+
+    std::mutex lock;
+    std::condition_variable wake;           //the flusher: there is work
+    std::condition_variable done;           //writers and flush(): a batch landed
+    std::unordered_map<std::string, pending> buffer;
+    std::deque<queued> order;
+    size_t buffer_bytes;
+    __u64 next_seq;
+    __u64 durable_seq;                      //every write up to here is on the device
+    __u64 flush_seq;                        //flush() waits for this one
+    int first_error;
+    bool stopping;
+    std::atomic<__u64> flushed_count;
+    std::atomic<__u64> error_count;
+    std::thread thread;
+};
+
+#endif
@@ -0,0 +1,238 @@
+#include "kv_client.h"
+#include "kv_histogram.h"
+#include "kv_workload.h"
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+
+// YCSB core workloads A to F over the KV opcodes. A load phase inserts the
+// records, then the run phase drives the workload's mix for -s seconds or
+// -o operations. Closed loop by default: every thread issues its next
+// operation when the last one completes. With -r the run is open loop at
+// that many ops/s with Poisson arrivals, and latency is measured from when
+// an operation was due, so a stalled device is not hidden by fewer
+// requests.
+
+struct ycsb_config {
+    const char *device = KV_DEFAULT_DEVICE;
+    char workload = 'A';
+    int distribution = -1;          //-1: the workload's own
+    __u64 records = 100000;
+    __u64 operations = 0;           //0: run for seconds instead
+    double seconds = 10;
+    int threads = 4;
+    double rate = 0;                //ops/s, 0: closed loop
+    int value_size = 1000;
+    int max_scan = 100;
+    bool load = true;
+};
+
+struct phase_stats {
+    KVHistogram latency[KV_YCSB_OPS];
+    __u64 errors[KV_YCSB_OPS] = {0,};
+    __u64 not_found[KV_YCSB_OPS] = {0,};
+};
+
+static __u64 deadline(const ycsb_config &config) {
+    return config.operations ? 0 : kv_now_ns() + (__u64)(config.seconds * 1e9);
+}
+
+static void sleep_until(__u64 ns) {
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000ull;
+    ts.tv_nsec = ns % 1000000000ull;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static void count(phase_stats *stats, int op, int status, __u64 ns) {
+    stats->latency[op].record(ns);
+    // reads may pick a record whose insert has not completed yet
+    if (status == KV_ERR_KEY_NOT_EXIST && op != KV_YCSB_INSERT) {
+        stats->not_found[op]++;
+    } else if (status != 0) {
+        stats->errors[op]++;
+    }
+}
+
+static void load(KVSession *session, KVWorkloadGenerator gen, const ycsb_config &config, phase_stats *stats) {
+    std::vector<__u8> buf(BUFFER_SIZE, 0x5a);
+    for (;;) {
+        __u64 record = gen.next_insert();
+        if (record >= config.records) {
+            return;
+        }
+        __u64 start = kv_now_ns();
+        int ret = kv_ycsb_execute(session, KV_YCSB_INSERT, record, 0, buf.data(), config.value_size);
+        count(stats, KV_YCSB_INSERT, ret < 0 ? -errno : ret, kv_now_ns() - start);
+    }
+}
+
+static void run(KVSession *session, KVWorkloadGenerator gen, const ycsb_config &config, __u64 end,
+                std::atomic<__u64> *issued, phase_stats *stats) {
+    std::vector<__u8> buf(BUFFER_SIZE, 0x5a);
+    std::exponential_distribution<double> gap(config.rate > 0 ? config.rate / config.threads : 1);
+    __u64 due = kv_now_ns();
+    for (;;) {
+        if (config.operations ? issued->fetch_add(1) >= config.operations : kv_now_ns() >= end) {
+            return;
+        }
+        if (config.rate > 0) {
+            due += (__u64)(gap(gen.random()) * 1e9);
+            if (end && due >= end) {
+                return;
+            }
+            sleep_until(due);
+        }
+        kv_ycsb_op_e op = gen.next_op();
+        __u64 record = op == KV_YCSB_INSERT ? gen.next_insert() : gen.next_record();
+        int scan = op == KV_YCSB_SCAN ? gen.next_scan_length() : 0;
+        __u64 start = config.rate > 0 ? due : kv_now_ns();
+        int ret = kv_ycsb_execute(session, op, record, scan, buf.data(), config.value_size);
+        count(stats, op, ret < 0 ? -errno : ret, kv_now_ns() - start);
+    }
+}
+
+static void report(const char *phase, const std::vector<phase_stats> &stats, double elapsed) {
+    phase_stats all;
+    __u64 ops = 0;
+    for (const phase_stats &s : stats) {
+        for (int op = 0; op < KV_YCSB_OPS; op++) {
+            all.latency[op].merge(s.latency[op]);
+            all.errors[op] += s.errors[op];
+            all.not_found[op] += s.not_found[op];
+        }
+    }
+    for (int op = 0; op < KV_YCSB_OPS; op++) {
+        ops += all.latency[op].count();
+    }
+    printf("[%s] %llu ops in %.3f s, %.0f ops/s\n", phase, (unsigned long long)ops, elapsed,
+           elapsed > 0 ? ops / elapsed : 0);
+    printf("%-8s %10s %8s %9s %10s %10s %10s %10s %10s\n", "op", "count", "errors", "notfound", "mean_us",
+           "p50_us", "p99_us", "p999_us", "max_us");
+    for (int op = 0; op < KV_YCSB_OPS; op++) {
+        const KVHistogram &h = all.latency[op];
+        if (h.count() == 0) {
+            continue;
+        }
+        printf("%-8s %10llu %8llu %9llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", kv_ycsb_op_name(op),
+               (unsigned long long)h.count(), (unsigned long long)all.errors[op],
+               (unsigned long long)all.not_found[op], h.mean() / 1e3, h.percentile(0.5) / 1e3,
+               h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3, h.max() / 1e3);
+    }
+    fflush(stdout);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-d device|emu] [-w A-F] [-D uniform|zipfian|latest] [-n records]\n"
+            "          [-s seconds | -o operations] [-t threads] [-r ops_per_second]\n"
+            "          [-v value_size] [-m max_scan] [-x (skip the load phase)]\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    ycsb_config config;
+    const char *env = getenv("KV_DEVICE");
+    if (env && *env) {
+        config.device = env;
+    }
+    int opt;
+    while ((opt = getopt(argc, argv, "d:w:D:n:s:o:t:r:v:m:xh")) != -1) {
+        switch (opt) {
+        case 'd': config.device = optarg; break;
+        case 'w': config.workload = optarg[0]; break;
+        case 'n': config.records = strtoull(optarg, NULL, 0); break;
+        case 's': config.seconds = atof(optarg); break;
+        case 'o': config.operations = strtoull(optarg, NULL, 0); break;
+        case 't': config.threads = atoi(optarg); break;
+        case 'r': config.rate = atof(optarg); break;
+        case 'v': config.value_size = atoi(optarg); break;
+        case 'm': config.max_scan = atoi(optarg); break;
+        case 'x': config.load = false; break;
+        case 'D':
+            if (strcmp(optarg, "uniform") == 0) {
+                config.distribution = KV_DIST_UNIFORM;
+            } else if (strcmp(optarg, "zipfian") == 0) {
+                config.distribution = KV_DIST_ZIPFIAN;
+            } else if (strcmp(optarg, "latest") == 0) {
+                config.distribution = KV_DIST_LATEST;
+            } else {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    KVWorkloadSpec spec;
+    if (kv_ycsb_workload(config.workload, &spec) < 0 || config.threads < 1 || config.records < 1 ||
+        config.rate < 0 || config.value_size < 1 || config.value_size > (int)KV_MAX_VALUE_SIZE ||
+        config.max_scan < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (config.distribution >= 0) {
+        spec.distribution = (kv_key_distribution_e)config.distribution;
+    }
+    spec.max_scan = config.max_scan;
+
+    std::shared_ptr<KVSession> session = KVSession::open(config.device);
+    if (!session) {
+        fprintf(stderr, "Could NOT open the KV device %s\n", config.device);
+        return 2;
+    }
+
+    std::atomic<__u64> records(0);
+    KVWorkloadGenerator proto(spec, &records, 0);
+    std::vector<KVWorkloadGenerator> gens;
+    for (int i = 0; i < config.threads; i++) {
+        gens.push_back(proto);
+        gens.back().random().seed(i + 1);
+    }
+
+    if (config.load) {
+        std::vector<phase_stats> stats(config.threads);
+        std::vector<std::thread> workers;
+        __u64 start = kv_now_ns();
+        for (int i = 0; i < config.threads; i++) {
+            workers.emplace_back(load, session.get(), gens[i], std::cref(config), &stats[i]);
+        }
+        for (auto &w : workers) {
+            w.join();
+        }
+        report("load", stats, (kv_now_ns() - start) / 1e9);
+    }
+    records.store(config.records);
+    // the zeta sum over every record is worked out once, not per thread
+    proto.next_record();
+    for (int i = 0; i < config.threads; i++) {
+        gens[i] = proto;
+        gens[i].random().seed(config.threads + i + 1);
+    }
+
+    std::vector<phase_stats> stats(config.threads);
+    std::vector<std::thread> workers;
+    std::atomic<__u64> issued(0);
+    __u64 start = kv_now_ns();
+    __u64 end = deadline(config);
+    for (int i = 0; i < config.threads; i++) {
+        workers.emplace_back(run, session.get(), gens[i], std::cref(config), end, &issued, &stats[i]);
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+    char phase[32];
+    snprintf(phase, sizeof(phase), "run %c", config.workload);
+    report(phase, stats, (kv_now_ns() - start) / 1e9);
+    return 0;
+}
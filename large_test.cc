@@ -0,0 +1,184 @@
+#include "kv_test.h"
+#include "kv_large.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <atomic>
+#include <functional>
+#include <set>
+#include <string>
+#include <vector>
+
+// Lets a fixed number of stores through, then fails them like a full device
+class FailingStores : public KVBackend {
+public:
+    FailingStores(std::shared_ptr<KVBackend> inner, int allowed) : inner(inner), allowed(allowed) {}
+
+    int submit(struct nvme_passthru_cmd *cmd, __u32 *result) override {
+        if (cmd->opcode == KV_OPC_STORE && allowed.fetch_sub(1) <= 0) {
+            return KV_ERR_CAPACITY_EXCEEDED;
+        }
+        return inner->submit(cmd, result);
+    }
+
+private:
+    std::shared_ptr<KVBackend> inner;
+    std::atomic<int> allowed;
+};
+
+// Runs race() just before the first chunk store goes down, and keeps the
+// chunk keys alive on the device
+class RacingPut : public KVBackend {
+public:
+    explicit RacingPut(std::shared_ptr<KVBackend> inner) : inner(inner) {}
+
+    int submit(struct nvme_passthru_cmd *cmd, __u32 *result) override {
+        KVKey key = kv_unpack_key(cmd);
+        bool chunk = key.size == KV_MAX_KEY_SIZE && key.bytes[KV_MAX_KEY_SIZE - 1] == 0xfe;
+        if (race && chunk && cmd->opcode == KV_OPC_STORE) {
+            std::function<void()> now;
+            now.swap(race);
+            now();
+        }
+        int ret = inner->submit(cmd, result);
+        std::string name((const char *)key.bytes, key.size);
+        if (ret == 0 && chunk && cmd->opcode == KV_OPC_STORE) {
+            live.insert(name);
+        } else if (ret == 0 && chunk && cmd->opcode == KV_OPC_DELETE) {
+            live.erase(name);
+        }
+        return ret;
+    }
+
+    std::function<void()> race;
+    std::set<std::string> live;
+
+private:
+    std::shared_ptr<KVBackend> inner;
+};
+
+class LargeTest : public KVTest {
+protected:
+    void SetUp() override {
+        KVTest::SetUp();
+        objects.reset(new KVObjectStore(session));
+    }
+
+    static std::vector<char> pattern(size_t size, int seed) {
+        std::vector<char> v(size);
+        for (size_t i = 0; i < size; i++) {
+            v[i] = (char)(i * 31 + seed);
+        }
+        return v;
+    }
+
+    std::unique_ptr<KVObjectStore> objects;
+};
+
+TEST_F(LargeTest, StoreAndRetrieveOneMegabyte) {
+    KVKey key = test_key(0x1a000001);
+    std::vector<char> value = pattern(1 << 20, 1);
+    ASSERT_EQ(objects->put(key, value.data(), value.size()), 0);
+    std::vector<char> buf(value.size());
+    size_t size = 0;
+    EXPECT_EQ(objects->get(key, buf.data(), buf.size(), &size), 0);
+    EXPECT_EQ(size, value.size());
+    EXPECT_TRUE(buf == value);
+    EXPECT_EQ(objects->remove(key), 0);
+}
+
+TEST_F(LargeTest, BufferSmallerThanObject) {
+    KVKey key = test_key(0x1a000002);
+    std::vector<char> value = pattern(3 * KV_MAX_VALUE_SIZE + 100, 2);
+    ASSERT_EQ(objects->put(key, value.data(), value.size()), 0);
+    std::vector<char> buf(KV_MAX_VALUE_SIZE + 10, 'x');
+    size_t size = 0;
+    EXPECT_EQ(objects->get(key, buf.data(), KV_MAX_VALUE_SIZE + 5, &size), 0);
+    EXPECT_EQ(size, value.size());
+    EXPECT_EQ(memcmp(buf.data(), value.data(), KV_MAX_VALUE_SIZE + 5), 0);
+    EXPECT_EQ(memcmp(buf.data() + KV_MAX_VALUE_SIZE + 5, "xxxxx", 5), 0);
+    EXPECT_EQ(objects->remove(key), 0);
+}
+
+TEST_F(LargeTest, EmptyObject) {
+    KVKey key = test_key(0x1a000003);
+    ASSERT_EQ(objects->put(key, NULL, 0), 0);
+    size_t size = 1;
+    EXPECT_EQ(objects->stat(key, &size), 0);
+    EXPECT_EQ(size, 0u);
+    EXPECT_EQ(objects->remove(key), 0);
+}
+
+TEST_F(LargeTest, OverwriteReplacesObject) {
+    KVKey key = test_key(0x1a000004);
+    std::vector<char> first = pattern(100000, 3);
+    std::vector<char> second = pattern(5000, 4);
+    ASSERT_EQ(objects->put(key, first.data(), first.size()), 0);
+    ASSERT_EQ(objects->put(key, second.data(), second.size()), 0);
+    std::vector<char> buf(first.size());
+    size_t size = 0;
+    EXPECT_EQ(objects->get(key, buf.data(), buf.size(), &size), 0);
+    EXPECT_EQ(size, second.size());
+    EXPECT_EQ(memcmp(buf.data(), second.data(), second.size()), 0);
+    EXPECT_EQ(objects->remove(key), 0);
+}
+
+TEST_F(LargeTest, RemovedObjectIsGone) {
+    KVKey key = test_key(0x1a000005);
+    std::vector<char> value = pattern(20000, 5);
+    ASSERT_EQ(objects->put(key, value.data(), value.size()), 0);
+    ASSERT_EQ(objects->remove(key), 0);
+    char buf[16];
+    EXPECT_EQ(objects->get(key, buf, sizeof(buf)), 135);
+    EXPECT_EQ(objects->remove(key), 135);
+}
+
+TEST_F(LargeTest, PlainValueIsNotAnObject) {
+    char buf[16];
+    EXPECT_EQ(objects->get(test_key(0xcccccccc), buf, sizeof(buf)), 137);
+}
+
+TEST_F(LargeTest, FailedPutKeepsOldObject) {
+    KVKey key = test_key(0x1a000006);
+    std::vector<char> old_value = pattern(10000, 6);
+    ASSERT_EQ(objects->put(key, old_value.data(), old_value.size()), 0);
+
+    // half of the new chunks make it, then the device is full
+    std::shared_ptr<KVSession> failing = std::make_shared<KVSession>(
+        std::make_shared<FailingStores>(session->backend(), 10), session->nsid());
+    KVObjectStore broken(failing);
+    std::vector<char> new_value = pattern(20 * KV_MAX_VALUE_SIZE, 7);
+    EXPECT_EQ(broken.put(key, new_value.data(), new_value.size()), 129);
+
+    std::vector<char> buf(new_value.size());
+    size_t size = 0;
+    EXPECT_EQ(objects->get(key, buf.data(), buf.size(), &size), 0);
+    EXPECT_EQ(size, old_value.size());
+    EXPECT_EQ(memcmp(buf.data(), old_value.data(), old_value.size()), 0);
+    EXPECT_EQ(objects->remove(key), 0);
+}
+
+TEST_F(LargeTest, RacingPutsLeaveOneObject) {
+    std::shared_ptr<RacingPut> racing = std::make_shared<RacingPut>(session->backend());
+    KVObjectStore store(std::make_shared<KVSession>(racing, session->nsid()), 1024);
+    KVKey key = test_key(0x1a000008);
+    std::vector<char> first = pattern(4 * 1024, 8);
+    std::vector<char> second = pattern(4 * 1024, 9);
+    // the second put is over before the first one's chunks go down
+    racing->race = [&] { EXPECT_EQ(store.put(key, second.data(), second.size()), 0); };
+    ASSERT_EQ(store.put(key, first.data(), first.size()), 0);
+    EXPECT_FALSE(racing->race);
+
+    std::vector<char> buf(first.size());
+    EXPECT_EQ(store.get(key, buf.data(), buf.size()), 0);
+    EXPECT_TRUE(buf == first);
+    // the second put's chunks went with its manifest
+    EXPECT_EQ(racing->live.size(), 4u);
+    EXPECT_EQ(store.remove(key), 0);
+    EXPECT_EQ(racing->live.size(), 0u);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
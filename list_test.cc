@@ -1,24 +1,12 @@
-#include <gtest/gtest.h>
-#include "libnvme.h"
-#include <sys/ioctl.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <linux/nvme_ioctl.h>
+#include "kv_test.h"
+#include "kv_buffer.h"
+#include "kv_cursor.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-
-typedef enum {
-    KV_OPC_STORE = 0x01,
-    KV_OPC_RETRIEVE = 0x02,
-    KV_OPC_LIST = 0x06,
-    KV_OPC_DELETE = 0x10,
-    KV_OPC_EXISTS = 0x14,
-} kv_opcode_e;
-
-const size_t BUFFER_SIZE = 4096;
-int ret = 0;
-__u32 result;
+#include <set>
+#include <string>
+#include <vector>
 
 void DumpHex(const void* data, size_t size) {
 	char ascii[17];
@@ -49,79 +37,44 @@ void DumpHex(const void* data, size_t size) {
 	}
 }
 
-
-int open_nvme_device() {
-    int fd = open("/dev/ng0n1", O_RDWR);
-    if (fd < 0) {
-        perror("Error opening the NVMe device");
-    }
-    return fd;
-}
-
-void close_nvme_device(int fd) {
-    if (fd >= 0) {
-        close(fd);
-    }
-}
-
-class NVMeTest : public ::testing::Test {
-protected:
-    
-    void TearDown() override {
-        // Limpieza después de cada prueba
-        close_nvme_device(fd);
-    }
-
-    int fd;
+class ListTest : public KVTest {
 };
 
-TEST(ListTest, ExistingKey) {
-    void *list_buffer = malloc(BUFFER_SIZE);
-    if (!list_buffer) {
-        TearDown();
-    }
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(ListTest, ExistingKey) {
+    KVBuffer lease = session->lease();
+    ASSERT_TRUE(lease.valid());
+    void *list_buffer = lease.data();
     struct nvme_passthru_cmd my_cmd = {0,};
     memset(list_buffer, 0, BUFFER_SIZE);
     my_cmd.addr = (__u64)list_buffer;
     my_cmd.nsid = 1;
     my_cmd.opcode = KV_OPC_LIST;
-    my_cmd.cdw11 = 4;                           //key size
-    my_cmd.cdw2 = 0xcccccccc;                 //key value
+    pack_key(&my_cmd, 0xcccccccc);            //key value
     my_cmd.cdw10 = BUFFER_SIZE;
     my_cmd.data_len = BUFFER_SIZE;
-    ret = nvme_submit_io_passthru(fd, &my_cmd, &result);
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 0);
     DumpHex(list_buffer, BUFFER_SIZE);
-    free(list_buffer);
 }
 
-TEST(ListTest, NotExistingKey) {
-    void *list_buffer = malloc(BUFFER_SIZE);
-    if (!list_buffer) {
-        TearDown();
-    }
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(ListTest, NotExistingKey) {
+    KVBuffer lease = session->lease();
+    ASSERT_TRUE(lease.valid());
+    void *list_buffer = lease.data();
     struct nvme_passthru_cmd my_cmd = {0,};
     memset(list_buffer, 0, BUFFER_SIZE);
     my_cmd.addr = (__u64)list_buffer;
     my_cmd.nsid = 1;
     my_cmd.opcode = KV_OPC_LIST;
-    my_cmd.cdw11 = 4;                           //key size
-    my_cmd.cdw2 = 0xccccccc2;                 //key value
+    pack_key(&my_cmd, 0xccccccc2);            //key value
     my_cmd.cdw10 = BUFFER_SIZE;
     my_cmd.data_len = BUFFER_SIZE;
-    ret = nvme_submit_io_passthru(fd, &my_cmd, &result);
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 0);
     DumpHex(list_buffer, BUFFER_SIZE);
-    free(list_buffer);
 }
 
-TEST(ListTest, BufferCanNotFitAnyKey) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(ListTest, BufferCanNotFitAnyKey) {
     struct nvme_passthru_cmd my_cmd = {0,};
     void *list_buffer = malloc(4);
     if (!list_buffer) {
@@ -130,38 +83,41 @@ TEST(ListTest, BufferCanNotFitAnyKey) {
 
     my_cmd.nsid = 1;
     my_cmd.opcode = KV_OPC_LIST;
-    my_cmd.cdw11 = 4;                           //key size
-    my_cmd.cdw2 = 0xcccccc89;                 //key value
+    pack_key(&my_cmd, 0xcccccc89);            //key value
     my_cmd.cdw10 = 4;
-    ret = nvme_submit_io_passthru(fd, &my_cmd, &result);
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 0);
     DumpHex(list_buffer, 4);
     free(list_buffer);
 }
 
-TEST(ListTest, BufferCanFit1Key) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(ListTest, BufferCanFit1Key) {
+    // the key count and one entry: a 2 byte size and a 12 byte key, padded
+    ASSERT_EQ(KV_TEST_KEY_SIZE, 12);
     struct nvme_passthru_cmd my_cmd = {0,};
-    void *list_buffer = malloc(12);
+    void *list_buffer = malloc(20);
     if (!list_buffer) {
         TearDown();
     }
+    memset(list_buffer, 0, 20);
 
+    my_cmd.addr = (__u64)list_buffer;
     my_cmd.nsid = 1;
     my_cmd.opcode = KV_OPC_LIST;
-    my_cmd.cdw11 = 4;                           //key size
-    my_cmd.cdw2 = 0xcccccc89;                 //key value
-    my_cmd.cdw10 = 12;
-    ret = nvme_submit_io_passthru(fd, &my_cmd, &result);
+    pack_key(&my_cmd, 0xcccccc89);            //key value
+    my_cmd.cdw10 = 20;
+    my_cmd.data_len = 20;
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 0);
-    DumpHex(list_buffer, 12);
+    DumpHex(list_buffer, 20);
+    std::vector<KVKey> keys;
+    EXPECT_EQ(kv_list_parse(list_buffer, 20, &keys), 1);
+    ASSERT_EQ(keys.size(), 1u);
+    EXPECT_TRUE(in_keyspace(keys[0]));
     free(list_buffer);
 }
 
-TEST(ListTest, BufferSizeTooSmall) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(ListTest, BufferSizeTooSmall) {
     struct nvme_passthru_cmd my_cmd = {0,};
     void *list_buffer = malloc(0);
     if (!list_buffer) {
@@ -170,18 +126,15 @@ TEST(ListTest, BufferSizeTooSmall) {
 
     my_cmd.nsid = 1;
     my_cmd.opcode = KV_OPC_LIST;
-    my_cmd.cdw11 = 4;                           //key size
-    my_cmd.cdw2 = 0xcccccc89;                 //key value
+    pack_key(&my_cmd, 0xcccccc89);            //key value
     my_cmd.cdw10 = 0;
-    ret = nvme_submit_io_passthru(fd, &my_cmd, &result);
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 137);
     DumpHex(list_buffer, 0);
     free(list_buffer);
 }
 
-TEST(ListTest, KeyLengthTooSmall) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(ListTest, KeyLengthTooSmall) {
     struct nvme_passthru_cmd my_cmd = {0,};
     void *list_buffer = malloc(8);
     if (!list_buffer) {
@@ -193,15 +146,13 @@ TEST(ListTest, KeyLengthTooSmall) {
     my_cmd.cdw11 = 0;                           //key size
     my_cmd.cdw2 = 0xcccccc89;                 //key value
     my_cmd.cdw10 = 8;
-    ret = nvme_submit_io_passthru(fd, &my_cmd, &result);
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 134);
     DumpHex(list_buffer, 8);
     free(list_buffer);
 }
 
-TEST(ListTest, KeyLengthTooBig) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(ListTest, KeyLengthTooBig) {
     struct nvme_passthru_cmd my_cmd = {0,};
     void *list_buffer = malloc(8);
     if (!list_buffer) {
@@ -213,12 +164,60 @@ TEST(ListTest, KeyLengthTooBig) {
     my_cmd.cdw11 = 19;                           //key size
     my_cmd.cdw2 = 0xcccccc89;                 //key value
     my_cmd.cdw10 = 8;
-    ret = nvme_submit_io_passthru(fd, &my_cmd, &result);
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 134);
     DumpHex(list_buffer, 8);
     free(list_buffer);
 }
 
+static std::string key_string(const KVKey &key) {
+    return std::string((const char *)key.bytes, key.size);
+}
+
+TEST_F(ListTest, CursorWalksWholeKeyspace) {
+    char value[] = "v";
+    for (__u32 i = 0; i < 2000; i++) {
+        ASSERT_EQ(session->store(test_key(0x5c000000 + i), value, 1), 0);
+    }
+    for (bool prefetch : {true, false}) {
+        KVListCursor cursor(session, 256, prefetch);
+        std::set<std::string> seen;
+        std::string last;
+        KVKey key;
+        while (cursor.next(&key)) {
+            std::string k = key_string(key);
+            EXPECT_LT(last, k);                 //strictly increasing, no repeats
+            last = k;
+            seen.insert(k);
+        }
+        EXPECT_EQ(cursor.status(), 0);
+        EXPECT_GT(cursor.pages(), 1u);
+        for (__u32 i = 0; i < 2000; i++) {
+            EXPECT_EQ(seen.count(key_string(test_key(0x5c000000 + i))), 1u);
+        }
+        EXPECT_EQ(seen.count(key_string(test_key(0xcccccccc))), 1u);
+    }
+    for (__u32 i = 0; i < 2000; i++) {
+        session->remove(test_key(0x5c000000 + i));
+    }
+}
+
+TEST_F(ListTest, CursorStartsAtKey) {
+    KVListCursor cursor(session, test_key(0xcccccc89));
+    KVKey key;
+    ASSERT_TRUE(cursor.next(&key));
+    EXPECT_TRUE(kv_key_equal(key, test_key(0xcccccc89)));
+}
+
+TEST_F(ListTest, CursorKeyLengthTooBig) {
+    KVKey start = test_key(0xcccccc89);
+    start.size = 19;                            //key size
+    KVListCursor cursor(session, start);
+    KVKey key;
+    EXPECT_FALSE(cursor.next(&key));
+    EXPECT_EQ(cursor.status(), 134);
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -0,0 +1,174 @@
+#include "kv_test.h"
+#include "kv_multiqueue.h"
+#include "kv_histogram.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Takes its time over every command, like a busy device
+class SlowBackend : public KVBackend {
+public:
+    explicit SlowBackend(std::shared_ptr<KVBackend> inner) : inner(inner) {}
+
+    int submit(struct nvme_passthru_cmd *cmd, __u32 *result) override {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+        return inner->submit(cmd, result);
+    }
+
+private:
+    std::shared_ptr<KVBackend> inner;
+};
+
+class MultiQueueTest : public KVTest {
+protected:
+    void SetUp() override {
+        KVTest::SetUp();
+        KVMultiQueueConfig config;
+        config.queues = 4;
+        multi = std::make_shared<KVMultiQueueBackend>(session->backend(), config);
+        kv = std::make_shared<KVSession>(multi, session->nsid());
+    }
+
+    __u64 executed() {
+        __u64 total = 0;
+        for (int q = 0; q < multi->queues(); q++) {
+            total += multi->executed(q);
+        }
+        return total;
+    }
+
+    std::shared_ptr<KVMultiQueueBackend> multi;
+    std::shared_ptr<KVSession> kv;
+};
+
+TEST_F(MultiQueueTest, StatusCodes) {
+    char kitty[] = "kitty";
+    KVKey key = test_key(0x3c000001);
+    EXPECT_EQ(kv->exists(key), 135);
+    EXPECT_EQ(kv->store(key, kitty, strlen(kitty)), 0);
+    EXPECT_EQ(kv->store(key, kitty, strlen(kitty), KV_STORE_MUST_NOT_EXIST), 137);
+    char buf[8] = {0,};
+    __u32 size = 0;
+    EXPECT_EQ(kv->retrieve(key, buf, sizeof(buf), &size), 0);
+    EXPECT_EQ(size, 5u);
+    EXPECT_STREQ(buf, "kitty");
+    EXPECT_EQ(kv->retrieve(key, buf, 0), 137);
+    EXPECT_EQ(kv->remove(key), 0);
+    EXPECT_EQ(kv->remove(key), 135);
+
+    struct nvme_passthru_cmd my_cmd = {0,};
+    my_cmd.nsid = 1;
+    my_cmd.opcode = KV_OPC_EXISTS;
+    my_cmd.cdw11 = 17;                           //key size
+    my_cmd.cdw2 = 0x0b;                 //key value
+    EXPECT_EQ(kv->submit(&my_cmd, &result), 134);
+}
+
+TEST_F(MultiQueueTest, ConcurrentClients) {
+    const int THREADS = 8;
+    const int OPS = 300;
+    std::atomic<int> errors(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; t++) {
+        threads.emplace_back([this, t, &errors] {
+            char value[16];
+            char buf[16];
+            for (int i = 0; i < OPS; i++) {
+                KVKey key = test_key(0x3d000000 + t * OPS + i);
+                snprintf(value, sizeof(value), "%d-%d", t, i);
+                errors += kv->store(key, value, sizeof(value)) != 0;
+                errors += kv->retrieve(key, buf, sizeof(buf)) != 0;
+                errors += memcmp(buf, value, sizeof(value)) != 0;
+                errors += kv->remove(key) != 0;
+                errors += kv->exists(key) != 135;
+            }
+        });
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    EXPECT_EQ(errors.load(), 0);
+    EXPECT_EQ(executed(), (__u64)THREADS * OPS * 4);
+}
+
+TEST_F(MultiQueueTest, IdleQueuesSteal) {
+    KVMultiQueueConfig config;
+    config.queues = 4;
+    config.pin = false;
+    KVMultiQueueBackend slow(std::make_shared<SlowBackend>(session->backend()), config);
+
+    const size_t N = 64;
+    std::vector<struct nvme_passthru_cmd> cmds(N);
+    std::vector<int> status(N);
+    for (size_t i = 0; i < N; i++) {
+        memset(&cmds[i], 0, sizeof(cmds[i]));
+        cmds[i].nsid = 1;
+        cmds[i].opcode = KV_OPC_EXISTS;
+        kv_pack_key(&cmds[i], test_key(i % 2 ? 0xcccccccc : 0x3e000000));
+    }
+    // one caller, one home queue: the others only get work by stealing it
+    slow.submit_batch(cmds.data(), N, status.data());
+    __u64 stolen = 0;
+    __u64 done = 0;
+    for (int q = 0; q < slow.queues(); q++) {
+        stolen += slow.stolen(q);
+        done += slow.executed(q);
+    }
+    for (size_t i = 0; i < N; i++) {
+        EXPECT_EQ(status[i], i % 2 ? 0 : 135);
+    }
+    EXPECT_EQ(done, N);
+    EXPECT_GT(stolen, 0u);
+}
+
+TEST_F(MultiQueueTest, ReturnsOnlyWhatTheCommandWrote) {
+    // one worker: on a device its bounce buffers go round and round
+    KVMultiQueueConfig config;
+    config.queues = 1;
+    config.pin = false;
+    KVSession one(std::make_shared<KVMultiQueueBackend>(session->backend(), config), session->nsid());
+    std::vector<char> big(64, 'S');
+    char kitty[] = "kitty";
+    ASSERT_EQ(one.store(test_key(0x3c000300), big.data(), big.size()), 0);
+    ASSERT_EQ(one.store(test_key(0x3c000301), kitty, strlen(kitty)), 0);
+    std::vector<char> buf(64);
+    ASSERT_EQ(one.retrieve(test_key(0x3c000300), buf.data(), buf.size()), 0);
+
+    std::fill(buf.begin(), buf.end(), 'x');
+    __u32 size = 0;
+    ASSERT_EQ(one.retrieve(test_key(0x3c000301), buf.data(), buf.size(), &size), 0);
+    EXPECT_EQ(size, 5u);
+    EXPECT_EQ(std::string(buf.data(), buf.size()), "kitty" + std::string(59, 'x'));
+
+    std::fill(buf.begin(), buf.end(), 'x');
+    EXPECT_EQ(one.retrieve(test_key(0x3c000302), buf.data(), buf.size()), 135);
+    EXPECT_EQ(std::string(buf.data(), buf.size()), std::string(64, 'x'));
+}
+
+TEST_F(MultiQueueTest, BatchesAreTimed) {
+    const int N = 16;
+    struct nvme_passthru_cmd cmds[N] = {{0,}};
+    int status[N];
+    for (int i = 0; i < N; i++) {
+        cmds[i].nsid = session->nsid();
+        cmds[i].opcode = KV_OPC_EXISTS;
+        kv_pack_key(&cmds[i], test_key(0x3c000000 + i));
+    }
+    kv_latency_reset();
+    kv->submit_batch(cmds, N, status);
+    for (int i = 0; i < N; i++) {
+        EXPECT_EQ(status[i], 135) << i;
+    }
+    EXPECT_EQ(kv_latency_snapshot(KV_LAT_OP_EXISTS, KV_LAT_ST_135).count(), (__u64)N);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,219 @@
+#include <gtest/gtest.h>
+#include "kv_shard.h"
+#include "kv_cursor.h"
+#include "kv_emulator.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <atomic>
+#include <set>
+#include <string>
+#include <thread>
+
+// Sharding needs several devices: every test gets its own emulators
+class ShardTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        std::vector<KVShard> shards;
+        for (int i = 0; i < 3; i++) {
+            shards.push_back(make_shard(i));
+        }
+        sharded = std::make_shared<KVShardBackend>(shards);
+        kv = std::make_shared<KVSession>(sharded, 1);
+    }
+
+    KVShard make_shard(int i) {
+        emulators.push_back(std::make_shared<KVEmulator>());
+        KVShard shard;
+        shard.name = "emu" + std::to_string(i);
+        shard.backend = emulators.back();
+        shard.nsid = 1;
+        return shard;
+    }
+
+    void store_keys(int n) {
+        for (int i = 0; i < n; i++) {
+            __u32 value = i;
+            ASSERT_EQ(kv->store(kv_key(0x5a000000 + i), &value, sizeof(value)), 0);
+        }
+    }
+
+    void check_keys(int n) {
+        for (int i = 0; i < n; i++) {
+            __u32 value = 0;
+            ASSERT_EQ(kv->retrieve(kv_key(0x5a000000 + i), &value, sizeof(value)), 0);
+            ASSERT_EQ(value, (__u32)i);
+        }
+    }
+
+    size_t total_keys() {
+        size_t total = 0;
+        for (auto &e : emulators) {
+            total += e->key_count();
+        }
+        return total;
+    }
+
+    std::vector<std::shared_ptr<KVEmulator> > emulators;
+    std::shared_ptr<KVShardBackend> sharded;
+    std::shared_ptr<KVSession> kv;
+    __u32 result;
+};
+
+TEST_F(ShardTest, KeysSpreadOverShards) {
+    store_keys(3000);
+    for (auto &e : emulators) {
+        EXPECT_GT(e->key_count(), 600u);
+        EXPECT_LT(e->key_count(), 1400u);
+    }
+    EXPECT_EQ(total_keys(), 3000u);
+    check_keys(3000);
+}
+
+TEST_F(ShardTest, StatusCodes) {
+    char kitty[] = "kitty";
+    KVKey key = kv_key(0xcccccccc);
+    EXPECT_EQ(kv->exists(key), 135);
+    EXPECT_EQ(kv->store(key, kitty, strlen(kitty), KV_STORE_MUST_EXIST), 135);
+    EXPECT_EQ(kv->store(key, kitty, strlen(kitty)), 0);
+    EXPECT_EQ(kv->store(key, kitty, strlen(kitty), KV_STORE_MUST_NOT_EXIST), 137);
+    EXPECT_EQ(kv->retrieve(key, kitty, 0), 137);
+    EXPECT_EQ(kv->remove(key), 0);
+    EXPECT_EQ(kv->remove(key), 135);
+
+    struct nvme_passthru_cmd my_cmd = {0,};
+    my_cmd.nsid = 1;
+    my_cmd.opcode = KV_OPC_EXISTS;
+    my_cmd.cdw11 = 0;                           //key size
+    my_cmd.cdw2 = 0xcccccccc;                 //key value
+    EXPECT_EQ(kv->submit(&my_cmd, &result), 134);
+}
+
+TEST_F(ShardTest, ListMergesShardsInOrder) {
+    store_keys(2000);
+    KVListCursor cursor(kv, 512);
+    std::string last;
+    size_t count = 0;
+    KVKey key;
+    while (cursor.next(&key)) {
+        std::string k((const char *)key.bytes, key.size);
+        EXPECT_LT(last, k);
+        last = k;
+        count++;
+    }
+    EXPECT_EQ(cursor.status(), 0);
+    EXPECT_EQ(count, 2000u);
+}
+
+TEST_F(ShardTest, AddShardMovesOnlyItsKeys) {
+    store_keys(3000);
+    std::vector<std::string> before;
+    for (int i = 0; i < 3000; i++) {
+        before.push_back(sharded->owner(kv_key(0x5a000000 + i)));
+    }
+    ASSERT_EQ(sharded->add_shard(make_shard(3)), 0);
+    EXPECT_EQ(sharded->shard_count(), 4u);
+
+    size_t changed = 0;
+    for (int i = 0; i < 3000; i++) {
+        std::string now = sharded->owner(kv_key(0x5a000000 + i));
+        if (now != before[i]) {
+            EXPECT_EQ(now, "emu3");                 //keys only move to the new shard
+            changed++;
+        }
+    }
+    EXPECT_EQ(sharded->moved(), changed);
+    EXPECT_EQ(emulators[3]->key_count(), changed);
+    EXPECT_GT(changed, 400u);
+    EXPECT_LT(changed, 1200u);
+    EXPECT_EQ(total_keys(), 3000u);
+    check_keys(3000);
+}
+
+TEST_F(ShardTest, RemoveShardDrainsIt) {
+    store_keys(3000);
+    ASSERT_EQ(sharded->remove_shard("emu1"), 0);
+    EXPECT_EQ(sharded->shard_count(), 2u);
+    EXPECT_EQ(emulators[1]->key_count(), 0u);
+    EXPECT_EQ(total_keys(), 3000u);
+    check_keys(3000);
+    EXPECT_EQ(sharded->remove_shard("emu1"), -1);
+}
+
+TEST_F(ShardTest, RebalanceUnderLoad) {
+    store_keys(2000);
+    std::atomic<bool> stop(false);
+    std::atomic<int> errors(0);
+    // rewrites and deletes keys 2000..2999 while the shards change
+    std::thread writer([this, &stop, &errors] {
+        for (int round = 1; !stop.load(); round++) {
+            for (int i = 2000; i < 3000; i++) {
+                __u32 value = round;
+                KVKey key = kv_key(0x5a000000 + i);
+                errors += kv->store(key, &value, sizeof(value)) != 0;
+                __u32 back = 0;
+                errors += kv->retrieve(key, &back, sizeof(back)) != 0 || back != value;
+                if (i % 3 == 0) {
+                    errors += kv->remove(key) != 0;
+                    errors += kv->exists(key) != 135;
+                }
+            }
+        }
+    });
+    ASSERT_EQ(sharded->add_shard(make_shard(3)), 0);
+    ASSERT_EQ(sharded->remove_shard("emu0"), 0);
+    stop.store(true);
+    writer.join();
+    EXPECT_EQ(errors.load(), 0);
+    check_keys(2000);
+    EXPECT_EQ(emulators[0]->key_count(), 0u);
+    // no key is left on a shard that does not own it
+    for (int i = 0; i < 3000; i++) {
+        KVKey key = kv_key(0x5a000000 + i);
+        int copies = 0;
+        for (auto &e : emulators) {
+            struct nvme_passthru_cmd cmd = {0,};
+            cmd.nsid = 1;
+            cmd.opcode = KV_OPC_EXISTS;
+            kv_pack_key(&cmd, key);
+            copies += e->submit(&cmd, &result) == 0;
+        }
+        EXPECT_LE(copies, 1);
+    }
+}
+
+TEST_F(ShardTest, BatchSpansShards) {
+    const size_t N = 300;
+    std::vector<__u32> values(N);
+    std::vector<struct nvme_passthru_cmd> cmds(N);
+    std::vector<int> status(N);
+    for (size_t i = 0; i < N; i++) {
+        values[i] = i;
+        memset(&cmds[i], 0, sizeof(cmds[i]));
+        cmds[i].nsid = 1;
+        cmds[i].opcode = KV_OPC_STORE;
+        kv_pack_key(&cmds[i], kv_key(0x5a000000 + i));
+        cmds[i].cdw10 = sizeof(__u32);
+        cmds[i].addr = (__u64)&values[i];
+        cmds[i].data_len = sizeof(__u32);
+    }
+    kv->submit_batch(cmds.data(), N, status.data());
+    for (size_t i = 0; i < N; i++) {
+        EXPECT_EQ(status[i], 0);
+    }
+    check_keys(N);
+}
+
+TEST_F(ShardTest, OpenFromSpec) {
+    std::shared_ptr<KVSession> session = KVSession::open("shard:emu,capacity=1000000;emu,capacity=2000000");
+    ASSERT_TRUE(session != NULL);
+    char kitty[] = "kitty";
+    EXPECT_EQ(session->store(kv_key(0x5a000001), kitty, strlen(kitty)), 0);
+    EXPECT_EQ(session->exists(kv_key(0x5a000001)), 0);
+    EXPECT_TRUE(kv_open_shards("shard:emu,capacity=1000000;emu,capacity=1000000") == NULL);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
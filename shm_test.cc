@@ -0,0 +1,233 @@
+#include "kv_test.h"
+#include "kv_shm.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The suites' device served over a socket of the test's own, and a client
+// connected to it
+class ShmTest : public KVTest {
+protected:
+    void SetUp() override {
+        KVTest::SetUp();
+        if (HasFatalFailure()) {
+            return;
+        }
+        socket_path = "/tmp/kv_shm_test_" + std::to_string(getpid()) + ".sock";
+        server = KVShmServer::start(socket_path.c_str(), session->backend());
+        ASSERT_TRUE(server != NULL);
+        connect(KVShmConfig());
+    }
+
+    void TearDown() override {
+        kv.reset();
+        client.reset();
+        server.reset();
+        KVTest::TearDown();
+    }
+
+    void connect(const KVShmConfig &config) {
+        kv.reset();
+        client = KVShmBackend::connect(socket_path.c_str(), config);
+        ASSERT_TRUE(client != NULL);
+        kv = std::make_shared<KVSession>(client, session->nsid());
+    }
+
+    std::string socket_path;
+    std::unique_ptr<KVShmServer> server;
+    std::shared_ptr<KVShmBackend> client;
+    std::shared_ptr<KVSession> kv;
+};
+
+TEST_F(ShmTest, StatusCodes) {
+    char kitty[] = "kitty";
+    KVKey key = test_key(0x3e000001);
+    EXPECT_EQ(kv->exists(key), 135);
+    EXPECT_EQ(kv->store(key, kitty, strlen(kitty)), 0);
+    EXPECT_EQ(kv->store(key, kitty, strlen(kitty), KV_STORE_MUST_NOT_EXIST), 137);
+    char buf[8] = {0,};
+    __u32 size = 0;
+    EXPECT_EQ(kv->retrieve(key, buf, sizeof(buf), &size), 0);
+    EXPECT_EQ(size, 5u);
+    EXPECT_STREQ(buf, "kitty");
+    EXPECT_EQ(kv->remove(key), 0);
+    EXPECT_EQ(kv->remove(key), 135);
+    // what SetUp() stored directly is there through the server too
+    EXPECT_EQ(kv->exists(test_key(0xcccccccc)), 0);
+
+    struct nvme_passthru_cmd my_cmd = {0,};
+    my_cmd.nsid = 1;
+    my_cmd.opcode = KV_OPC_EXISTS;
+    my_cmd.cdw11 = 17;                           //key size
+    my_cmd.cdw2 = 0x0b;                 //key value
+    EXPECT_EQ(kv->submit(&my_cmd, &result), 134);
+}
+
+TEST_F(ShmTest, BatchDeeperThanQueue) {
+    KVShmConfig config;
+    config.depth = 8;
+    connect(config);
+    const int N = 50;
+    std::vector<__u32> values(N);
+    std::vector<struct nvme_passthru_cmd> cmds(N);
+    std::vector<int> status(N, -1);
+    for (int i = 0; i < N; i++) {
+        values[i] = 0x5000 + i;
+        struct nvme_passthru_cmd &c = cmds[i];
+        memset(&c, 0, sizeof(c));
+        c.opcode = KV_OPC_STORE;
+        c.nsid = session->nsid();
+        c.addr = (__u64)(uintptr_t)&values[i];
+        c.data_len = sizeof(__u32);
+        c.cdw10 = sizeof(__u32);
+        pack_key(&c, 0x3e000100 + i);
+    }
+    kv->submit_batch(cmds.data(), N, status.data());
+    for (int i = 0; i < N; i++) {
+        EXPECT_EQ(status[i], 0) << i;
+    }
+    for (int i = 0; i < N; i++) {
+        __u32 v = 0;
+        EXPECT_EQ(session->retrieve(test_key(0x3e000100 + i), &v, sizeof(v)), 0);
+        EXPECT_EQ(v, 0x5000u + i);
+    }
+}
+
+TEST_F(ShmTest, ReturnsOnlyWhatTheCommandWrote) {
+    // one slot, so every command reuses the buffer of the one before
+    KVShmConfig config;
+    config.depth = 1;
+    connect(config);
+    std::vector<char> big(64, 'S');
+    char kitty[] = "kitty";
+    ASSERT_EQ(kv->store(test_key(0x3e000300), big.data(), big.size()), 0);
+    ASSERT_EQ(kv->store(test_key(0x3e000301), kitty, strlen(kitty)), 0);
+    std::vector<char> buf(64);
+    ASSERT_EQ(kv->retrieve(test_key(0x3e000300), buf.data(), buf.size()), 0);
+
+    std::fill(buf.begin(), buf.end(), 'x');
+    __u32 size = 0;
+    ASSERT_EQ(kv->retrieve(test_key(0x3e000301), buf.data(), buf.size(), &size), 0);
+    EXPECT_EQ(size, 5u);
+    EXPECT_EQ(std::string(buf.data(), buf.size()), "kitty" + std::string(59, 'x'));
+
+    std::fill(buf.begin(), buf.end(), 'x');
+    EXPECT_EQ(kv->retrieve(test_key(0x3e000302), buf.data(), buf.size()), 135);
+    EXPECT_EQ(std::string(buf.data(), buf.size()), std::string(64, 'x'));
+}
+
+TEST_F(ShmTest, LeasedBuffersGoZeroCopy) {
+    KVShmConfig config;
+    config.slot_size = 4096;
+    config.buffers = 4;
+    connect(config);
+    ASSERT_TRUE(client->buffers() != NULL);
+    // the session leases from the segment
+    KVBuffer in = kv->lease();
+    KVBuffer out = kv->lease();
+    ASSERT_TRUE(in.valid() && out.valid());
+    EXPECT_EQ(client->buffers()->available(), 2u);
+    memset(in.data(), 0x6b, 1000);
+    KVKey key = test_key(0x3e000200);
+    EXPECT_EQ(kv->store(key, in.data(), 1000), 0);
+    __u32 size = 0;
+    EXPECT_EQ(kv->retrieve(key, out.data(), out.size(), &size), 0);
+    EXPECT_EQ(size, 1000u);
+    EXPECT_EQ(memcmp(in.data(), out.data(), 1000), 0);
+    EXPECT_GT(kv->list(test_key(0), out.data(), out.size()), -1);
+    std::vector<KVKey> keys;
+    EXPECT_GE(kv_list_parse(out.data(), out.size(), &keys), 1);
+
+    // anything else is copied through the command's buffer, which has a size
+    std::vector<char> big(2 * config.slot_size);
+    errno = 0;
+    EXPECT_EQ(kv->list(test_key(0), big.data(), big.size()), -1);
+    EXPECT_EQ(errno, E2BIG);
+}
+
+TEST_F(ShmTest, ConcurrentClients) {
+    const int THREADS = 8;
+    const int OPS = 300;
+    std::atomic<int> errors(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; t++) {
+        threads.emplace_back([this, t, &errors] {
+            char value[16];
+            char buf[16];
+            for (int i = 0; i < OPS; i++) {
+                KVKey key = test_key(0x3e010000 + t * OPS + i);
+                snprintf(value, sizeof(value), "v%d-%d", t, i);
+                __u32 size = 0;
+                memset(buf, 0, sizeof(buf));
+                if (kv->store(key, value, strlen(value)) != 0 ||
+                    kv->retrieve(key, buf, sizeof(buf), &size) != 0 || size != strlen(value) ||
+                    memcmp(buf, value, size) != 0 || kv->remove(key) != 0) {
+                    errors++;
+                }
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    EXPECT_EQ(errors.load(), 0);
+    EXPECT_GE(server->executed(), (__u64)THREADS * OPS * 3);
+}
+
+TEST_F(ShmTest, OtherProcessesShareTheDevice) {
+    const int CHILDREN = 3;
+    const int KEYS = 100;
+    std::vector<pid_t> children;
+    for (int p = 0; p < CHILDREN; p++) {
+        pid_t pid = fork();
+        ASSERT_GE(pid, 0);
+        if (pid == 0) {
+            std::shared_ptr<KVShmBackend> mine = KVShmBackend::connect(socket_path.c_str());
+            if (!mine) {
+                _exit(3);
+            }
+            KVSession s(mine, session->nsid());
+            for (__u32 i = 0; i < KEYS; i++) {
+                __u32 v = p * KEYS + i;
+                if (s.store(test_key(0x3e020000 + v), &v, sizeof(v)) != 0) {
+                    _exit(1);
+                }
+            }
+            _exit(0);
+        }
+        children.push_back(pid);
+    }
+    for (pid_t pid : children) {
+        int wstatus = 0;
+        ASSERT_EQ(waitpid(pid, &wstatus, 0), pid);
+        EXPECT_TRUE(WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0) << wstatus;
+    }
+    for (__u32 v = 0; v < CHILDREN * KEYS; v++) {
+        __u32 got = ~0u;
+        EXPECT_EQ(kv->retrieve(test_key(0x3e020000 + v), &got, sizeof(got)), 0);
+        EXPECT_EQ(got, v);
+    }
+}
+
+TEST_F(ShmTest, ServerGoneFailsWithEIO) {
+    EXPECT_EQ(kv->exists(test_key(0xcccccccc)), 0);
+    server.reset();
+    errno = 0;
+    EXPECT_EQ(kv->exists(test_key(0xcccccccc)), -1);
+    EXPECT_EQ(errno, EIO);
+    EXPECT_FALSE(client->connected());
+    EXPECT_TRUE(KVShmBackend::connect(socket_path.c_str()) == NULL);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -1,325 +1,368 @@
-#include <gtest/gtest.h>
-#include "libnvme.h"
-#include <sys/ioctl.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <linux/nvme_ioctl.h>
+#include "kv_test.h"
+#include "kv_buffer.h"
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <atomic>
+#include <thread>
+#include <vector>
 
-typedef enum {
-    KV_OPC_STORE = 0x01,
-    KV_OPC_RETRIEVE = 0x02,
-    KV_OPC_LIST = 0x06,
-    KV_OPC_DELETE = 0x10,
-    KV_OPC_EXISTS = 0x14,
-} kv_opcode_e;
+class StoreTest : public KVTest {
+};
 
-const size_t BUFFER_SIZE = 4096;
-int ret = 0;
-__u8 opcode = 0x14; 
-__u8 flags = 0;
-__u16 rsvd = 0;
-__u32 nsid = 1;
-__u32 cdw2 = 0;
-__u32 cdw3 = 0;
-__u32 cdw10 = 0;
-__u32 cdw11 = 0;
-__u32 cdw12 = 0;
-__u32 cdw13 = 0;
-__u32 cdw14 = 0;
-__u32 cdw15 = 0;
-__u32 data_len = 0;
-void *data = NULL;
-__u32 metadata_len = 0;
-void *metadata = NULL;
-__u32 timeout_ms = 1000;
-__u32 result;
+// Turns the first rejects STOREs down with 137 and drops them, the way a
+// device rejects a bad request, or as if another client's create had
+// been deleted again right away
+class RejectingStore : public KVBackend {
+public:
+    RejectingStore(std::shared_ptr<KVBackend> inner, int rejects) : stores(0), rejects(rejects), inner(inner) {}
 
-int open_nvme_device() {
-    int fd = open("/dev/ng0n1", O_RDWR);
-    if (fd < 0) {
-        perror("Error opening the NVMe device");
+    int submit(struct nvme_passthru_cmd *cmd, __u32 *result) override {
+        if (cmd->opcode == KV_OPC_STORE && stores++ < rejects) {
+            return KV_ERR_INVALID_REQUEST;
+        }
+        return inner->submit(cmd, result);
     }
-    return fd;
-}
 
-void close_nvme_device(int fd) {
-    if (fd >= 0) {
-        close(fd);
-    }
-}
+    int stores;
+    int rejects;
 
-class NVMeTest : public ::testing::Test {
-protected:
-    
-    void TearDown() override {
-        // Limpieza después de cada prueba
-        close_nvme_device(fd);
-    }
-
-    int fd;
+private:
+    std::shared_ptr<KVBackend> inner;
 };
 
-TEST(StoreTest, ExistingKey) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(StoreTest, ExistingKey) {
+    struct nvme_passthru_cmd my_cmd = {0,};
     char kitty[] = "kitty";
-    nsid = 1;
-    data = kitty;
-    opcode = KV_OPC_STORE;
-    data_len = strlen(kitty);
-    cdw11 = 4;                           //key size
-    cdw10 = strlen(kitty); 
-    cdw2 = 0xcccccccc;                 //key value
-    ret = nvme_io_passthru(fd, opcode, flags, rsvd, nsid, cdw2, cdw3,
-                             cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len,
-                             data, metadata_len, metadata, timeout_ms, &result);
+    my_cmd.nsid = 1;
+    my_cmd.addr = (__u64)kitty;
+    my_cmd.opcode = KV_OPC_STORE;
+    my_cmd.data_len = strlen(kitty);
+    my_cmd.cdw10 = strlen(kitty); 
+    pack_key(&my_cmd, 0xcccccccc);            //key value
+    my_cmd.timeout_ms = 1000;
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 0);
 }
 
-TEST(StoreTest, NotExistingKey) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(StoreTest, NotExistingKey) {
+    struct nvme_passthru_cmd my_cmd = {0,};
     char kitty[] = "kitty";
-    nsid = 1;
-    data = kitty;
-    opcode = KV_OPC_STORE;
-    data_len = strlen(kitty);
-    cdw11 = 4;                           //key size
-    cdw10 = strlen(kitty); 
-    cdw2 = 0xcccccc89;                 //key value
-    ret = nvme_io_passthru(fd, opcode, flags, rsvd, nsid, cdw2, cdw3,
-                             cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len,
-                             data, metadata_len, metadata, timeout_ms, &result);
+    my_cmd.nsid = 1;
+    my_cmd.addr = (__u64)kitty;
+    my_cmd.opcode = KV_OPC_STORE;
+    my_cmd.data_len = strlen(kitty);
+    my_cmd.cdw10 = strlen(kitty); 
+    pack_key(&my_cmd, 0xcccccc89);            //key value
+    my_cmd.timeout_ms = 1000;
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 0);
 }
 
-TEST(StoreTest, KeyLengthTooShort) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(StoreTest, KeyLengthTooShort) {
+    struct nvme_passthru_cmd my_cmd = {0,};
     char kitty[] = "kitty";
-    nsid = 1;
-    data = kitty;
-    opcode = KV_OPC_STORE;
-    data_len = strlen(kitty);
-    cdw11 = 0;                           //key size
-    cdw10 = strlen(kitty); 
-    cdw2 = 0xcccccc89;                 //key value
-    ret = nvme_io_passthru(fd, opcode, flags, rsvd, nsid, cdw2, cdw3,
-                             cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len,
-                             data, metadata_len, metadata, timeout_ms, &result);
+    my_cmd.nsid = 1;
+    my_cmd.addr = (__u64)kitty;
+    my_cmd.opcode = KV_OPC_STORE;
+    my_cmd.data_len = strlen(kitty);
+    my_cmd.cdw11 = 0;                           //key size
+    my_cmd.cdw10 = strlen(kitty); 
+    my_cmd.cdw2 = 0xcccccc89;                 //key value
+    my_cmd.timeout_ms = 1000;
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret,134);
 }
 
-TEST(StoreTest, KeyLengthTooLong) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(StoreTest, KeyLengthTooLong) {
+    struct nvme_passthru_cmd my_cmd = {0,};
     char kitty[] = "kitty";
-    nsid = 1;
-    data = kitty;
-    opcode = KV_OPC_STORE;
-    data_len = strlen(kitty);
-    cdw11 = 18;                           //key size
-    cdw10 = strlen(kitty); 
-    cdw2 = 0xcccccc89;                 //key value
-    ret = nvme_io_passthru(fd, opcode, flags, rsvd, nsid, cdw2, cdw3,
-                             cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len,
-                             data, metadata_len, metadata, timeout_ms, &result);
+    my_cmd.nsid = 1;
+    my_cmd.addr = (__u64)kitty;
+    my_cmd.opcode = KV_OPC_STORE;
+    my_cmd.data_len = strlen(kitty);
+    my_cmd.cdw11 = 18;                           //key size
+    my_cmd.cdw10 = strlen(kitty); 
+    my_cmd.cdw2 = 0xcccccc89;                 //key value
+    my_cmd.timeout_ms = 1000;
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 134);
 }
 
-TEST(StoreTest, ValueSizeZero) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(StoreTest, ValueSizeZero) {
+    struct nvme_passthru_cmd my_cmd = {0,};
     char kitty[] = "kitty";
-    nsid = 1;
-    data = kitty;
-    opcode = KV_OPC_STORE;
-    data_len = 0;
-    cdw11 = 4;                           //key size
-    cdw10 = 0; 
-    cdw2 = 0xccccc789;                 //key value
-    ret = nvme_io_passthru(fd, opcode, flags, rsvd, nsid, cdw2, cdw3,
-                             cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len,
-                             data, metadata_len, metadata, timeout_ms, &result);
+    my_cmd.nsid = 1;
+    my_cmd.addr = (__u64)kitty;
+    my_cmd.opcode = KV_OPC_STORE;
+    my_cmd.data_len = 0;
+    my_cmd.cdw10 = 0; 
+    pack_key(&my_cmd, 0xccccc789);            //key value
+    my_cmd.timeout_ms = 1000;
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 0);
 }
 
-TEST(StoreTest, DataEqualsNull) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(StoreTest, DataEqualsNull) {
+    struct nvme_passthru_cmd my_cmd = {0,};
     char kitty[] = "kitty";
-    nsid = 1;
-    data = NULL;
-    opcode = KV_OPC_STORE;
-    data_len = strlen(kitty);
-    cdw11 = 4;                           //key size
-    cdw10 = 0; 
-    cdw2 = 0xcccccc89;                 //key value
-    ret = nvme_io_passthru(fd, opcode, flags, rsvd, nsid, cdw2, cdw3,
-                             cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len,
-                             data, metadata_len, metadata, timeout_ms, &result);
+    my_cmd.nsid = 1;
+    my_cmd.addr = (__u64)NULL;
+    my_cmd.opcode = KV_OPC_STORE;
+    my_cmd.data_len = strlen(kitty);
+    my_cmd.cdw10 = 0; 
+    pack_key(&my_cmd, 0xcccccc89);            //key value
+    my_cmd.timeout_ms = 1000;
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 0);
 }
 
-TEST(StoreTest, ValueSizeBiggerThanValue) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(StoreTest, ValueSizeBiggerThanValue) {
+    struct nvme_passthru_cmd my_cmd = {0,};
     char kitty[] = "kitty";
-    nsid = 1;
-    data = kitty;
-    opcode = KV_OPC_STORE;
-    data_len = strlen(kitty);
-    cdw11 = 4;                           //key size
-    cdw10 = strlen(kitty) + 6; 
-    cdw2 = 0xcccccc89;                 //key value
-    ret = nvme_io_passthru(fd, opcode, flags, rsvd, nsid, cdw2, cdw3,
-                             cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len,
-                             data, metadata_len, metadata, timeout_ms, &result);
+    my_cmd.nsid = 1;
+    my_cmd.addr = (__u64)kitty;
+    my_cmd.opcode = KV_OPC_STORE;
+    my_cmd.data_len = strlen(kitty);
+    my_cmd.cdw10 = strlen(kitty) + 6; 
+    pack_key(&my_cmd, 0xcccccc89);            //key value
+    my_cmd.timeout_ms = 1000;
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 0);
 }
 
-TEST(StoreTest, ValueSizeSmallerThanValue) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(StoreTest, ValueSizeSmallerThanValue) {
+    struct nvme_passthru_cmd my_cmd = {0,};
     char kitty[] = "kitty";
-    nsid = 1;
-    data = kitty;
-    opcode = KV_OPC_STORE;
-    data_len = strlen(kitty);
-    cdw11 = 4;                           //key size
-    cdw10 = strlen(kitty) - 3; 
-    cdw2 = 0xcccccc89;                 //key value
-    ret = nvme_io_passthru(fd, opcode, flags, rsvd, nsid, cdw2, cdw3,
-                             cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len,
-                             data, metadata_len, metadata, timeout_ms, &result);
+    my_cmd.nsid = 1;
+    my_cmd.addr = (__u64)kitty;
+    my_cmd.opcode = KV_OPC_STORE;
+    my_cmd.data_len = strlen(kitty);
+    my_cmd.cdw10 = strlen(kitty) - 3; 
+    pack_key(&my_cmd, 0xcccccc89);            //key value
+    my_cmd.timeout_ms = 1000;
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 0);
 }
 
-TEST(StoreTest, Bit8SetTo1KeyNotExists) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(StoreTest, Bit8SetTo1KeyNotExists) {
+    struct nvme_passthru_cmd my_cmd = {0,};
     char kitty[] = "kitty";
-    nsid = 1;
-    data = kitty;
-    opcode = KV_OPC_STORE;
-    data_len = strlen(kitty);
-    cdw11 = 260;                           //key size
-    cdw10 = strlen(kitty); 
-    cdw2 = 0xcc87cccc;                 //key value
-    ret = nvme_io_passthru(fd, opcode, flags, rsvd, nsid, cdw2, cdw3,
-                             cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len,
-                             data, metadata_len, metadata, timeout_ms, &result);
+    my_cmd.nsid = 1;
+    my_cmd.addr = (__u64)kitty;
+    my_cmd.opcode = KV_OPC_STORE;
+    my_cmd.data_len = strlen(kitty);
+    my_cmd.cdw11 = 256;                         //bit 8: must exist
+    my_cmd.cdw10 = strlen(kitty); 
+    pack_key(&my_cmd, 0xcc87cccc);            //key value
+    my_cmd.timeout_ms = 1000;
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 135);
 }
 
-TEST(StoreTest, Bit8SetTo1KeyExists) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(StoreTest, Bit8SetTo1KeyExists) {
+    struct nvme_passthru_cmd my_cmd = {0,};
     char kitty[] = "kitty";
-    nsid = 1;
-    data = kitty;
-    opcode = KV_OPC_STORE;
-    data_len = strlen(kitty);
-    cdw11 = 260;                           //key size
-    cdw10 = strlen(kitty); 
-    cdw2 = 0xcccccccc;                 //key value
-    ret = nvme_io_passthru(fd, opcode, flags, rsvd, nsid, cdw2, cdw3,
-                             cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len,
-                             data, metadata_len, metadata, timeout_ms, &result);
+    my_cmd.nsid = 1;
+    my_cmd.addr = (__u64)kitty;
+    my_cmd.opcode = KV_OPC_STORE;
+    my_cmd.data_len = strlen(kitty);
+    my_cmd.cdw11 = 256;                         //bit 8: must exist
+    my_cmd.cdw10 = strlen(kitty); 
+    pack_key(&my_cmd, 0xcccccccc);            //key value
+    my_cmd.timeout_ms = 1000;
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 0);
 }
 
-TEST(StoreTest, Bit9SetTo1KeyExists) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(StoreTest, Bit9SetTo1KeyExists) {
+    struct nvme_passthru_cmd my_cmd = {0,};
     char kitty[] = "kitty";
-    nsid = 1;
-    data = kitty;
-    opcode = KV_OPC_STORE;
-    data_len = strlen(kitty);
-    cdw11 = 516;                           //key size
-    cdw10 = strlen(kitty); 
-    cdw2 = 0xcccccc89;                 //key value
-    ret = nvme_io_passthru(fd, opcode, flags, rsvd, nsid, cdw2, cdw3,
-                             cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len,
-                             data, metadata_len, metadata, timeout_ms, &result);
+    my_cmd.nsid = 1;
+    my_cmd.addr = (__u64)kitty;
+    my_cmd.opcode = KV_OPC_STORE;
+    my_cmd.data_len = strlen(kitty);
+    my_cmd.cdw11 = 512;                         //bit 9: must not exist
+    my_cmd.cdw10 = strlen(kitty); 
+    pack_key(&my_cmd, 0xcccccc89);            //key value
+    my_cmd.timeout_ms = 1000;
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 137);
 }
 
-//I comment it bc otherwise it will only pass the first time because the others the file will be already created
-/*
-TEST(StoreTest, Bit9SetTo1KeyNotExists) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(StoreTest, Bit9SetTo1KeyNotExists) {
+    struct nvme_passthru_cmd my_cmd = {0,};
     char kitty[] = "kitty";
-    nsid = 1;
-    data = kitty;
-    opcode = KV_OPC_STORE;
-    data_len = strlen(kitty);
-    cdw11 = 516;                           //key size
-    cdw10 = strlen(kitty); 
-    cdw2 = 0xcc2c7889;                 //key value
-    ret = nvme_io_passthru(fd, opcode, flags, rsvd, nsid, cdw2, cdw3,
-                             cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len,
-                             data, metadata_len, metadata, timeout_ms, &result);
+    my_cmd.nsid = 1;
+    my_cmd.addr = (__u64)kitty;
+    my_cmd.opcode = KV_OPC_STORE;
+    my_cmd.data_len = strlen(kitty);
+    my_cmd.cdw11 = 512;                         //bit 9: must not exist
+    my_cmd.cdw10 = strlen(kitty); 
+    pack_key(&my_cmd, 0xcc2c7889);            //key value
+    my_cmd.timeout_ms = 1000;
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 0);
 }
-*/
 
-TEST(StoreTest, Bit9AndBit8SetTo1KeyExists) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(StoreTest, Bit9AndBit8SetTo1KeyExists) {
+    struct nvme_passthru_cmd my_cmd = {0,};
     char kitty[] = "kitty";
-    nsid = 1;
-    data = kitty;
-    opcode = KV_OPC_STORE;
-    data_len = strlen(kitty);
-    cdw11 = 772;                           //key size
-    cdw10 = strlen(kitty); 
-    cdw2 = 0xcccccccc;                 //key value
-    ret = nvme_io_passthru(fd, opcode, flags, rsvd, nsid, cdw2, cdw3,
-                             cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len,
-                             data, metadata_len, metadata, timeout_ms, &result);
+    my_cmd.nsid = 1;
+    my_cmd.addr = (__u64)kitty;
+    my_cmd.opcode = KV_OPC_STORE;
+    my_cmd.data_len = strlen(kitty);
+    my_cmd.cdw11 = 768;                         //bits 8 and 9
+    my_cmd.cdw10 = strlen(kitty); 
+    pack_key(&my_cmd, 0xcccccccc);            //key value
+    my_cmd.timeout_ms = 1000;
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 137);
 }
 
-TEST(StoreTest, Bit9AndBit8SetTo1KeyNotExists) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(StoreTest, Bit9AndBit8SetTo1KeyNotExists) {
+    struct nvme_passthru_cmd my_cmd = {0,};
     char kitty[] = "kitty";
-    nsid = 1;
-    data = kitty;
-    opcode = KV_OPC_STORE;
-    data_len = strlen(kitty);
-    cdw11 = 772;                           //key size
-    cdw10 = strlen(kitty); 
-    cdw2 = 0xccc47889;                 //key value
-    ret = nvme_io_passthru(fd, opcode, flags, rsvd, nsid, cdw2, cdw3,
-                             cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len,
-                             data, metadata_len, metadata, timeout_ms, &result);
+    my_cmd.nsid = 1;
+    my_cmd.addr = (__u64)kitty;
+    my_cmd.opcode = KV_OPC_STORE;
+    my_cmd.data_len = strlen(kitty);
+    my_cmd.cdw11 = 768;                         //bits 8 and 9
+    my_cmd.cdw10 = strlen(kitty); 
+    pack_key(&my_cmd, 0xccc47889);            //key value
+    my_cmd.timeout_ms = 1000;
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 135);
 }
 
-TEST(StoreTest, CapacityExceeded) {
-    int fd = open_nvme_device();
-    ASSERT_GE(fd, 0) << "Could NOT open the NVMe device";
+TEST_F(StoreTest, CapacityExceeded) {
+    struct nvme_passthru_cmd my_cmd = {0,};
     char kitty[] = "kitty";
-    nsid = 1;
-    data = kitty;
-    opcode = KV_OPC_STORE;
-    data_len = 4096;
-    cdw11 = 4;                           //key size
-    cdw10 = 4096; 
-    cdw2 = 0xcccccccc;                 //key value
-    ret = nvme_io_passthru(fd, opcode, flags, rsvd, nsid, cdw2, cdw3,
-                             cdw10, cdw11, cdw12, cdw13, cdw14, cdw15, data_len,
-                             data, metadata_len, metadata, timeout_ms, &result);
+    my_cmd.nsid = 1;
+    my_cmd.addr = (__u64)kitty;
+    my_cmd.opcode = KV_OPC_STORE;
+    my_cmd.data_len = 4096;
+    my_cmd.cdw10 = 4096; 
+    pack_key(&my_cmd, 0xcccccccc);            //key value
+    my_cmd.timeout_ms = 1000;
+    int ret = submit(&my_cmd);
     EXPECT_EQ(ret, 129);
 }
 
+TEST_F(StoreTest, InsertIfAbsent) {
+    char kitty[] = "kitty";
+    char puppy[] = "puppy";
+    char buf[8] = {0,};
+    KVKey key = test_key(0x5c000001);
+    EXPECT_EQ(session->insert_if_absent(key, kitty, strlen(kitty)), 0);
+    EXPECT_EQ(session->insert_if_absent(key, puppy, strlen(puppy)), 137);
+    EXPECT_EQ(session->retrieve(key, buf, sizeof(buf)), 0);
+    EXPECT_STREQ(buf, "kitty");
+    EXPECT_EQ(session->remove(key), 0);
+}
+
+TEST_F(StoreTest, UpdateIfPresent) {
+    char kitty[] = "kitty";
+    char puppy[] = "puppy";
+    char buf[8] = {0,};
+    KVKey key = test_key(0x5c000002);
+    EXPECT_EQ(session->update_if_present(key, kitty, strlen(kitty)), 135);
+    EXPECT_EQ(session->exists(key), 135);
+    EXPECT_EQ(session->store(key, kitty, strlen(kitty)), 0);
+    EXPECT_EQ(session->update_if_present(key, puppy, strlen(puppy)), 0);
+    EXPECT_EQ(session->retrieve(key, buf, sizeof(buf)), 0);
+    EXPECT_STREQ(buf, "puppy");
+    EXPECT_EQ(session->remove(key), 0);
+}
+
+TEST_F(StoreTest, LeasedBuffers) {
+    KVBuffer in = session->lease();
+    KVBuffer out = session->lease();
+    ASSERT_TRUE(in.valid() && out.valid());
+    memcpy(in.data(), "kitty", 5);
+    KVKey key = test_key(0x5c000007);
+    EXPECT_EQ(session->store(key, in.data(), 5), 0);
+    __u32 size = 0;
+    EXPECT_EQ(session->retrieve(key, out.data(), out.size(), &size), 0);
+    EXPECT_EQ(size, 5u);
+    EXPECT_EQ(memcmp(out.data(), "kitty", 5), 0);
+    EXPECT_EQ(session->remove(key), 0);
+}
+
+TEST_F(StoreTest, GetOrCreate) {
+    char kitty[] = "kitty";
+    char puppy[] = "puppy";
+    char buf[8] = {0,};
+    __u32 size = 0;
+    bool created = false;
+    KVKey key = test_key(0x5c000003);
+    EXPECT_EQ(session->get_or_create(key, kitty, strlen(kitty), buf, sizeof(buf), &size, &created), 0);
+    EXPECT_TRUE(created);
+    EXPECT_EQ(size, 5u);
+    EXPECT_STREQ(buf, "kitty");
+    memset(buf, 0, sizeof(buf));
+    EXPECT_EQ(session->get_or_create(key, puppy, strlen(puppy), buf, sizeof(buf), &size, &created), 0);
+    EXPECT_FALSE(created);
+    EXPECT_STREQ(buf, "kitty");
+    EXPECT_EQ(session->remove(key), 0);
+}
+
+TEST_F(StoreTest, GetOrCreateRace) {
+    const int THREADS = 4;
+    KVKey key = test_key(0x5c000004);
+    std::atomic<int> creators(0);
+    std::atomic<int> disagree(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; t++) {
+        threads.emplace_back([&, t] {
+            __u32 mine = 0x1000 + t;
+            __u32 got = 0;
+            bool created = false;
+            if (session->get_or_create(key, &mine, sizeof(mine), &got, sizeof(got), NULL, &created) != 0) {
+                disagree++;
+                return;
+            }
+            creators += created;
+            __u32 stored = 0;
+            session->retrieve(key, &stored, sizeof(stored));
+            disagree += got != stored;
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    EXPECT_EQ(creators.load(), 1);              //exactly one client created it
+    EXPECT_EQ(disagree.load(), 0);
+    EXPECT_EQ(session->remove(key), 0);
+}
+
+TEST_F(StoreTest, GetOrCreateRejected) {
+    std::shared_ptr<RejectingStore> rejecting = std::make_shared<RejectingStore>(session->backend(), INT_MAX);
+    KVSession rejected(rejecting, session->nsid());
+    char kitty[] = "kitty";
+    char buf[8] = {0,};
+    bool created = true;
+    KVKey key = test_key(0x5c000005);
+    EXPECT_EQ(rejected.get_or_create(key, kitty, strlen(kitty), buf, sizeof(buf), NULL, &created), 137);
+    EXPECT_EQ(rejecting->stores, KV_CONDITIONAL_RETRIES);
+    EXPECT_EQ(session->exists(key), 135);
+}
+
+TEST_F(StoreTest, GetOrCreateAfterDeletedWinner) {
+    std::shared_ptr<RejectingStore> rejecting = std::make_shared<RejectingStore>(session->backend(), 1);
+    KVSession racing(rejecting, session->nsid());
+    char kitty[] = "kitty";
+    char buf[8] = {0,};
+    bool created = false;
+    KVKey key = test_key(0x5c000006);
+    EXPECT_EQ(racing.get_or_create(key, kitty, strlen(kitty), buf, sizeof(buf), NULL, &created), 0);
+    EXPECT_TRUE(created);
+    EXPECT_EQ(rejecting->stores, 2);
+    EXPECT_STREQ(buf, "kitty");
+    EXPECT_EQ(session->remove(key), 0);
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -0,0 +1,300 @@
+#include <gtest/gtest.h>
+#include "kv_timing.h"
+#include "kv_client.h"
+#include "kv_emulator.h"
+#include "kv_shm.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+const __u64 T0 = 1000000000;               //arrival of the first command, ns
+
+// Every test writes its profiles next to the others
+class TimingTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        path = std::string("/tmp/kv_timing_test.") + std::to_string(getpid()) + "." +
+               ::testing::UnitTest::GetInstance()->current_test_info()->name();
+    }
+
+    void TearDown() override {
+        unlink(path.c_str());
+        unlink((path + ".trace").c_str());
+    }
+
+    void write_profile(const char *text) {
+        FILE *f = fopen(path.c_str(), "w");
+        ASSERT_TRUE(f != NULL);
+        fputs(text, f);
+        fclose(f);
+    }
+
+    // The same service time, every time
+    static void fixed(KVTimingProfile *p, int op, __u64 ns) {
+        p->service[op].clear();
+        p->service[op].push_back({0, ns});
+        p->service[op].push_back({1, ns});
+    }
+
+    // A key of each of the first n dies
+    static std::vector<KVKey> one_key_per_die(const KVTimingModel &m, unsigned n) {
+        std::vector<KVKey> keys(n);
+        std::vector<bool> found(n, false);
+        unsigned left = n;
+        for (__u32 v = 0; left > 0; v++) {
+            KVKey k = kv_key(v);
+            unsigned d = m.die_of(k.bytes, k.size);
+            if (d < n && !found[d]) {
+                found[d] = true;
+                keys[d] = k;
+                left--;
+            }
+        }
+        return keys;
+    }
+
+    std::string path;
+};
+
+TEST_F(TimingTest, LoadsProfile) {
+    write_profile("# a small drive\n"
+                  "channels 2\n"
+                  "dies_per_channel 3   # per channel\n"
+                  "bandwidth_mbps 1500\n"
+                  "write_amplification 2.5\n"
+                  "gc_every_mb 64\n"
+                  "gc_pause_us 3000\n"
+                  "store 0:10 0.5:12.5 1:400\n"
+                  "retrieve 0:80 1:90\n");
+    KVTimingProfile p;
+    ASSERT_EQ(kv_load_timing_profile(path.c_str(), &p), 0);
+    EXPECT_EQ(p.channels, 2u);
+    EXPECT_EQ(p.dies_per_channel, 3u);
+    EXPECT_EQ(p.bandwidth_mbps, 1500);
+    EXPECT_EQ(p.write_amplification, 2.5);
+    EXPECT_EQ(p.gc_every_bytes, 64ull << 20);
+    EXPECT_EQ(p.gc_pause_ns, 3000000u);
+    ASSERT_EQ(p.service[KV_LAT_OP_STORE].size(), 3u);
+    EXPECT_EQ(p.service[KV_LAT_OP_STORE][1].fraction, 0.5);
+    EXPECT_EQ(p.service[KV_LAT_OP_STORE][1].ns, 12500u);
+    EXPECT_EQ(p.service[KV_LAT_OP_RETRIEVE].size(), 2u);
+    EXPECT_TRUE(p.service[KV_LAT_OP_LIST].empty());
+
+    write_profile("store 0.5:10 0.2:20\n");
+    EXPECT_EQ(kv_load_timing_profile(path.c_str(), &p), -1);
+    write_profile("channels zero\n");
+    EXPECT_EQ(kv_load_timing_profile(path.c_str(), &p), -1);
+    write_profile("flux_capacitor 1\n");
+    EXPECT_EQ(kv_load_timing_profile(path.c_str(), &p), -1);
+}
+
+TEST_F(TimingTest, SamplesTheDistribution) {
+    KVTimingProfile p;
+    p.channels = 1;
+    p.dies_per_channel = 1;
+    p.seed = 1;
+    // 90% within 10 us, the rest up to 1 ms
+    p.service[KV_LAT_OP_RETRIEVE] = {{0, 0}, {0.9, 10000}, {1, 1000000}};
+    KVTimingModel m(p);
+    KVKey k = kv_key(1);
+    const int N = 20000;
+    int slow = 0;
+    __u64 at = T0;
+    for (int i = 0; i < N; i++) {
+        __u64 done = m.schedule(KV_OPC_RETRIEVE, k.bytes, k.size, 0, at);
+        ASSERT_LE(done - at, 1000000u);
+        slow += done - at > 10000;
+        at = done;
+    }
+    EXPECT_NEAR(slow, N / 10, N / 50);
+}
+
+TEST_F(TimingTest, DiesWorkInParallel) {
+    KVTimingProfile p;
+    p.channels = 2;
+    p.dies_per_channel = 2;
+    fixed(&p, KV_LAT_OP_RETRIEVE, 100000);
+    KVTimingModel m(p);
+    ASSERT_EQ(m.dies(), 4u);
+    std::vector<KVKey> keys = one_key_per_die(m, 4);
+    // one command per die: all done together
+    for (const KVKey &k : keys) {
+        EXPECT_EQ(m.schedule(KV_OPC_RETRIEVE, k.bytes, k.size, 0, T0), T0 + 100000);
+    }
+    // a second one on a die queues behind the first
+    EXPECT_EQ(m.schedule(KV_OPC_RETRIEVE, keys[2].bytes, keys[2].size, 0, T0), T0 + 200000);
+    // and a die that is idle again starts at once
+    EXPECT_EQ(m.schedule(KV_OPC_RETRIEVE, keys[0].bytes, keys[0].size, 0, T0 + 500000), T0 + 600000);
+}
+
+TEST_F(TimingTest, BandwidthIsShared) {
+    KVTimingProfile p;
+    p.channels = 4;
+    p.dies_per_channel = 1;
+    p.bandwidth_mbps = 1000;                   //1 byte per ns
+    KVTimingModel m(p);
+    std::vector<KVKey> keys = one_key_per_die(m, 2);
+    // dies of their own, but one link to come in over
+    EXPECT_EQ(m.schedule(KV_OPC_STORE, keys[0].bytes, keys[0].size, 4000, T0), T0 + 4000);
+    EXPECT_EQ(m.schedule(KV_OPC_STORE, keys[1].bytes, keys[1].size, 4000, T0), T0 + 8000);
+    EXPECT_EQ(m.schedule(KV_OPC_RETRIEVE, keys[1].bytes, keys[1].size, 2000, T0), T0 + 10000);
+}
+
+TEST_F(TimingTest, WriteAmplificationAndGC) {
+    KVTimingProfile p;
+    p.channels = 2;
+    p.dies_per_channel = 1;
+    p.write_amplification = 3;
+    p.gc_every_bytes = 3 * 3000;
+    p.gc_pause_ns = 1000000;
+    fixed(&p, KV_LAT_OP_STORE, 10000);
+    fixed(&p, KV_LAT_OP_RETRIEVE, 1000);
+    KVTimingModel m(p);
+    std::vector<KVKey> keys = one_key_per_die(m, 2);
+    const KVKey &a = keys[0];
+    const KVKey &b = keys[1];
+
+    // acked after its own service time, but the die programs twice as long again
+    EXPECT_EQ(m.schedule(KV_OPC_STORE, a.bytes, a.size, 1000, T0), T0 + 10000);
+    EXPECT_EQ(m.schedule(KV_OPC_RETRIEVE, a.bytes, a.size, 0, T0 + 10000), T0 + 31000);
+    EXPECT_EQ(m.gc_pauses(), 0u);
+
+    // the third 1000 byte store fills 9000 NAND bytes: its channel stops
+    EXPECT_EQ(m.schedule(KV_OPC_STORE, b.bytes, b.size, 1000, T0), T0 + 10000);
+    EXPECT_EQ(m.schedule(KV_OPC_STORE, b.bytes, b.size, 1000, T0), T0 + 40000);
+    EXPECT_EQ(m.gc_pauses(), 1u);
+    EXPECT_EQ(m.schedule(KV_OPC_RETRIEVE, b.bytes, b.size, 0, T0 + 50000), T0 + 40000 + 20000 + 1000000 + 1000);
+    // the other channel goes on
+    EXPECT_EQ(m.schedule(KV_OPC_RETRIEVE, a.bytes, a.size, 0, T0 + 50000), T0 + 51000);
+}
+
+TEST_F(TimingTest, ProfileFromTrace) {
+    std::string trace = path + ".trace";
+    {
+        std::shared_ptr<KVTraceWriter> w = KVTraceWriter::create(trace.c_str());
+        ASSERT_TRUE(w != NULL);
+        struct nvme_passthru_cmd cmd;
+        memset(&cmd, 0, sizeof(cmd));
+        kv_pack_key(&cmd, kv_key(7));
+        for (int i = 1; i <= 1000; i++) {
+            cmd.opcode = KV_OPC_RETRIEVE;
+            w->append(&cmd, 0, T0, T0 + i * 1000);          //1 us to 1 ms, evenly
+            cmd.opcode = KV_OPC_EXISTS;
+            w->append(&cmd, 135, T0, T0 + 5000);
+            w->append(&cmd, -5, T0, T0 + 900000000);       //never reached the device
+        }
+        ASSERT_EQ(w->flush(), 0);
+    }
+    KVTimingProfile p;
+    ASSERT_EQ(kv_load_timing_profile(trace.c_str(), &p), 0);
+    const std::vector<KVServiceQuantile> &r = p.service[KV_LAT_OP_RETRIEVE];
+    ASSERT_FALSE(r.empty());
+    for (const KVServiceQuantile &q : r) {
+        if (q.fraction > 0 && q.fraction < 1) {
+            EXPECT_NEAR((double)q.ns, q.fraction * 1000000, 0.04 * q.fraction * 1000000 + 1000) << q.fraction;
+        }
+    }
+    EXPECT_EQ(r.back().ns, 1000000u);
+    EXPECT_LE(p.service[KV_LAT_OP_EXISTS].back().ns, 5200u);
+    EXPECT_TRUE(p.service[KV_LAT_OP_STORE].empty());
+
+    // settings from the file, service times from the trace
+    write_profile(("channels 1\nfrom_trace " + trace + "\n").c_str());
+    KVTimingProfile q;
+    ASSERT_EQ(kv_load_timing_profile(path.c_str(), &q), 0);
+    EXPECT_EQ(q.channels, 1u);
+    EXPECT_EQ(q.service[KV_LAT_OP_RETRIEVE].size(), r.size());
+}
+
+TEST_F(TimingTest, EmulatorTakesItsTime) {
+    write_profile("channels 1\n"
+                  "dies_per_channel 1\n"
+                  "store 0:2000 1:2000\n"
+                  "exists 0:500 1:500\n");
+    KVEmulatorConfig config;
+    ASSERT_EQ(kv_parse_emulator_spec(("emu,timing=" + path).c_str(), &config), 0);
+    EXPECT_EQ(config.timing, path);
+    KVEmulator emu(config);
+    ASSERT_TRUE(emu.ok());
+    KVSession kv(std::shared_ptr<KVBackend>(&emu, [](KVBackend *) {}), 1);
+
+    char kitty[] = "kitty";
+    __u64 start = kv_now_ns();
+    EXPECT_EQ(kv.store(kv_key(0xcccccccc), kitty, strlen(kitty)), 0);
+    EXPECT_GE(kv_now_ns() - start, 2000000u);
+    // one die: four threads take four times as long as one
+    start = kv_now_ns();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&kv] { EXPECT_EQ(kv.exists(kv_key(0xcccccccc)), 0); });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    EXPECT_GE(kv_now_ns() - start, 4 * 500000u);
+
+    config.timing = path + ".missing";
+    KVEmulator broken(config);
+    EXPECT_FALSE(broken.ok());
+}
+
+TEST_F(TimingTest, BatchesOverlapOnTheDies) {
+    write_profile("channels 4\n"
+                  "dies_per_channel 1\n"
+                  "exists 0:2000 1:2000\n");
+    KVEmulatorConfig config;
+    config.timing = path;
+    std::shared_ptr<KVEmulator> emu = std::make_shared<KVEmulator>(config);
+    ASSERT_TRUE(emu->ok());
+    KVTimingProfile p;
+    ASSERT_EQ(kv_load_timing_profile(path.c_str(), &p), 0);
+    std::vector<KVKey> keys = one_key_per_die(KVTimingModel(p), 4);
+    std::vector<struct nvme_passthru_cmd> cmds(keys.size());
+    std::vector<int> status(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        memset(&cmds[i], 0, sizeof(cmds[i]));
+        cmds[i].nsid = 1;
+        cmds[i].opcode = KV_OPC_EXISTS;
+        kv_pack_key(&cmds[i], keys[i]);
+    }
+
+    // one command per die: the batch takes as long as one of them
+    __u64 start = kv_now_ns();
+    emu->submit_batch(cmds.data(), cmds.size(), status.data());
+    __u64 took = kv_now_ns() - start;
+    EXPECT_GE(took, 2000000u);
+    EXPECT_LT(took, 3 * 2000000u);
+    for (int s : status) {
+        EXPECT_EQ(s, 135);
+    }
+    // one at a time, they add up
+    start = kv_now_ns();
+    for (auto &cmd : cmds) {
+        EXPECT_EQ(emu->submit(&cmd, NULL), 135);
+    }
+    EXPECT_GE(kv_now_ns() - start, 4 * 2000000u);
+
+    // and so does a batch a kv_emud client rings in
+    std::string socket = path + ".sock";
+    std::unique_ptr<KVShmServer> server = KVShmServer::start(socket.c_str(), emu);
+    ASSERT_TRUE(server != NULL);
+    std::shared_ptr<KVShmBackend> client = KVShmBackend::connect(socket.c_str());
+    ASSERT_TRUE(client != NULL);
+    start = kv_now_ns();
+    client->submit_batch(cmds.data(), cmds.size(), status.data());
+    took = kv_now_ns() - start;
+    EXPECT_GE(took, 2000000u);
+    EXPECT_LT(took, 3 * 2000000u);
+    for (int s : status) {
+        EXPECT_EQ(s, 135);
+    }
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,197 @@
+#include <gtest/gtest.h>
+#include "kv_trace.h"
+#include "kv_client.h"
+#include "kv_emulator.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <string>
+
+// Every test records into its own file next to the others
+class TraceTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        path = std::string("/tmp/kv_trace_test.") + std::to_string(getpid()) + "." +
+               ::testing::UnitTest::GetInstance()->current_test_info()->name();
+        emulator = std::make_shared<KVEmulator>();
+        writer = KVTraceWriter::create(path.c_str());
+        ASSERT_TRUE(writer != NULL);
+        traced = std::make_shared<KVTraceBackend>(emulator, writer);
+        kv = std::make_shared<KVSession>(traced, 1);
+    }
+
+    void TearDown() override {
+        unlink(path.c_str());
+    }
+
+    std::unique_ptr<KVTraceReader> read_back() {
+        EXPECT_EQ(writer->flush(), 0);
+        return KVTraceReader::open(path.c_str());
+    }
+
+    std::string path;
+    std::shared_ptr<KVEmulator> emulator;
+    std::shared_ptr<KVTraceWriter> writer;
+    std::shared_ptr<KVTraceBackend> traced;
+    std::shared_ptr<KVSession> kv;
+    __u32 result;
+};
+
+TEST_F(TraceTest, RecordsEveryCommand) {
+    char kitty[] = "kitty";
+    EXPECT_EQ(kv->store(kv_key(0xcccccccc), kitty, strlen(kitty), KV_STORE_MUST_NOT_EXIST), 0);
+    EXPECT_EQ(kv->retrieve(kv_key(0xccccccc2), kitty, sizeof(kitty)), 135);
+    EXPECT_EQ(kv->exists(kv_key(0x05060708, 8)), 135);
+
+    struct nvme_passthru_cmd my_cmd = {0,};
+    my_cmd.nsid = 1;
+    my_cmd.opcode = KV_OPC_EXISTS;
+    my_cmd.cdw11 = 17;                          //key size
+    my_cmd.cdw2 = 0xcccccccc;                 //key value
+    EXPECT_EQ(kv->submit(&my_cmd, &result), 134);
+    EXPECT_EQ(writer->records(), 4u);
+
+    std::unique_ptr<KVTraceReader> trace = read_back();
+    ASSERT_TRUE(trace != NULL);
+    ASSERT_EQ(trace->size(), 4u);
+    const KVTraceRecord &store = (*trace)[0];
+    EXPECT_EQ(store.opcode, KV_OPC_STORE);
+    EXPECT_EQ(store.nsid, 1u);
+    EXPECT_EQ(store.status, 0);
+    EXPECT_EQ(store.cdw10, 5u);                 //value size
+    EXPECT_EQ(store.data_len, 5u);
+    EXPECT_EQ(store.cdw11, 4u | KV_STORE_MUST_NOT_EXIST);
+    EXPECT_EQ(memcmp(store.key, "\xcc\xcc\xcc\xcc", 4), 0);
+    EXPECT_EQ((*trace)[1].opcode, KV_OPC_RETRIEVE);
+    EXPECT_EQ((*trace)[1].status, 135);
+    EXPECT_EQ((*trace)[2].cdw11, 8u);
+    EXPECT_EQ((*trace)[3].status, 134);
+    EXPECT_EQ((*trace)[3].cdw11, 17u);
+    for (size_t i = 1; i < trace->size(); i++) {
+        EXPECT_GE((*trace)[i].issued_ns, (*trace)[i - 1].issued_ns);
+    }
+}
+
+TEST_F(TraceTest, ReplayGivesSameStatuses) {
+    char kitty[] = "kitty";
+    for (int i = 0; i < 50; i++) {
+        kv->store(kv_key(0x5a000000 + i % 20), kitty, strlen(kitty), i % 3 ? 0 : KV_STORE_MUST_NOT_EXIST);
+        kv->retrieve(kv_key(0x5a000000 + i), kitty, sizeof(kitty));
+        if (i % 7 == 0) {
+            kv->remove(kv_key(0x5a000000 + i % 20));
+        }
+    }
+    std::unique_ptr<KVTraceReader> trace = read_back();
+    ASSERT_TRUE(trace != NULL);
+
+    KVEmulator fresh;
+    char buf[16];
+    for (size_t i = 0; i < trace->size(); i++) {
+        const KVTraceRecord &r = (*trace)[i];
+        struct nvme_passthru_cmd cmd;
+        kv_trace_command(r, &cmd, buf);
+        EXPECT_EQ(cmd.cdw10, r.cdw10);
+        EXPECT_EQ(cmd.cdw11, r.cdw11);
+        EXPECT_EQ(fresh.submit(&cmd, &result), r.status) << "record " << i;
+    }
+    EXPECT_EQ(fresh.key_count(), emulator->key_count());
+}
+
+TEST_F(TraceTest, BatchIsRecorded) {
+    __u32 values[3] = {1, 2, 3};
+    struct nvme_passthru_cmd cmds[3] = {{0,}};
+    int status[3];
+    for (int i = 0; i < 3; i++) {
+        cmds[i].nsid = 1;
+        cmds[i].opcode = KV_OPC_STORE;
+        kv_pack_key(&cmds[i], kv_key(0x5a000000 + i));
+        cmds[i].cdw10 = sizeof(__u32);
+        cmds[i].addr = (__u64)&values[i];
+        cmds[i].data_len = sizeof(__u32);
+    }
+    cmds[2].cdw11 = 0;                          //key size
+    kv->submit_batch(cmds, 3, status);
+    std::unique_ptr<KVTraceReader> trace = read_back();
+    ASSERT_TRUE(trace != NULL);
+    ASSERT_EQ(trace->size(), 3u);
+    EXPECT_EQ((*trace)[0].status, 0);
+    EXPECT_EQ((*trace)[1].status, 0);
+    EXPECT_EQ((*trace)[2].status, 134);
+}
+
+TEST_F(TraceTest, CutRecordIsIgnored) {
+    for (int i = 0; i < 10; i++) {
+        kv->exists(kv_key(0x5a000000 + i));
+    }
+    ASSERT_EQ(writer->flush(), 0);
+    // what a crash in the middle of a write leaves behind
+    int fd = open(path.c_str(), O_WRONLY | O_APPEND);
+    ASSERT_GE(fd, 0);
+    char partial[20] = {0,};
+    ASSERT_EQ(write(fd, partial, sizeof(partial)), (ssize_t)sizeof(partial));
+    close(fd);
+    std::unique_ptr<KVTraceReader> trace = KVTraceReader::open(path.c_str());
+    ASSERT_TRUE(trace != NULL);
+    EXPECT_EQ(trace->size(), 10u);
+}
+
+TEST_F(TraceTest, RejectsOtherFiles) {
+    int fd = open(path.c_str(), O_WRONLY | O_TRUNC);
+    ASSERT_GE(fd, 0);
+    char junk[64];
+    memset(junk, 0x5a, sizeof(junk));
+    ASSERT_EQ(write(fd, junk, sizeof(junk)), (ssize_t)sizeof(junk));
+    close(fd);
+    EXPECT_TRUE(KVTraceReader::open(path.c_str()) == NULL);
+    EXPECT_TRUE(KVTraceReader::open("/nonexistent/trace") == NULL);
+}
+
+TEST_F(TraceTest, OpenFromSpec) {
+    std::string spec = "trace:" + path + ".spec,emu,capacity=1000000";
+    std::shared_ptr<KVSession> session = KVSession::open(spec.c_str());
+    ASSERT_TRUE(session != NULL);
+    char kitty[] = "kitty";
+    EXPECT_EQ(session->store(kv_key(0x5a000001), kitty, strlen(kitty)), 0);
+    EXPECT_EQ(session->exists(kv_key(0x5a000001)), 0);
+    EXPECT_EQ(session->device_fd(), -1);
+
+    std::shared_ptr<KVTraceBackend> trace = kv_open_trace(spec.c_str());
+    ASSERT_TRUE(trace != NULL);
+    EXPECT_EQ(trace, session->backend());
+    EXPECT_EQ(trace->trace()->records(), 2u);
+    unlink((path + ".spec").c_str());
+
+    EXPECT_TRUE(kv_open_trace("trace:,emu") == NULL);
+    EXPECT_TRUE(kv_open_trace("trace:/tmp/x") == NULL);
+}
+
+TEST_F(TraceTest, WriteErrorIsReported) {
+    // a file size limit makes the first full block fail with EFBIG
+    struct rlimit saved;
+    ASSERT_EQ(getrlimit(RLIMIT_FSIZE, &saved), 0);
+    struct rlimit limit = saved;
+    limit.rlim_cur = 4096;
+    sighandler_t old = signal(SIGXFSZ, SIG_IGN);
+    ASSERT_EQ(setrlimit(RLIMIT_FSIZE, &limit), 0);
+    for (int i = 0; i < 1024; i++) {                    //one block
+        kv->exists(kv_key(0x5a000000 + i));
+    }
+    int ret = writer->flush();
+    setrlimit(RLIMIT_FSIZE, &saved);
+    signal(SIGXFSZ, old);
+    EXPECT_EQ(ret, -EFBIG);
+    // the error sticks after later writes go through
+    kv->exists(kv_key(0x5a000000));
+    EXPECT_EQ(writer->flush(), -EFBIG);
+    EXPECT_EQ(writer->records(), 1u);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,97 @@
+#include "kv_test.h"
+#include "kv_uring.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+const unsigned QUEUE_DEPTH = 32;
+
+struct completion {
+    int calls;
+    int status;
+    __u32 result;
+};
+
+static void on_complete(void *ctx, int status, __u32 result) {
+    completion *c = (completion *)ctx;
+    c->calls++;
+    c->status = status;
+    c->result = result;
+}
+
+class UringTest : public KVTest {
+protected:
+    void SetUp() override {
+        KVTest::SetUp();
+        if (session->device_fd() < 0) {
+            GTEST_SKIP() << "io_uring passthrough needs an NVMe char device";
+        }
+        engine = KVUringEngine::create(session->device_fd(), QUEUE_DEPTH);
+        ASSERT_TRUE(engine != NULL) << "Could NOT set up the io_uring";
+    }
+
+    std::unique_ptr<KVUringEngine> engine;
+};
+
+TEST_F(UringTest, ExistsStatusCodes) {
+    struct nvme_passthru_cmd cmds[3] = {{0,}};
+    completion done[3] = {{0,}};
+    for (int i = 0; i < 3; i++) {
+        cmds[i].nsid = 1;
+        cmds[i].opcode = KV_OPC_EXISTS;
+    }
+    pack_key(&cmds[0], 0xcccccccc);           //key value
+    pack_key(&cmds[1], 0xeeeeeeee);
+    cmds[2].cdw11 = 0;                          //key size
+    for (int i = 0; i < 3; i++) {
+        ASSERT_EQ(engine->queue(&cmds[i], on_complete, &done[i]), 0);
+    }
+    EXPECT_EQ(engine->submit(), 3);
+    EXPECT_EQ(engine->reap(3), 3);
+    EXPECT_EQ(done[0].status, 0);
+    EXPECT_EQ(done[1].status, 135);
+    EXPECT_EQ(done[2].status, 134);
+}
+
+TEST_F(UringTest, FullQueueDepth) {
+    struct nvme_passthru_cmd cmds[QUEUE_DEPTH];
+    completion done[QUEUE_DEPTH];
+    char values[QUEUE_DEPTH][8];
+    memset(cmds, 0, sizeof(cmds));
+    memset(done, 0, sizeof(done));
+    for (unsigned i = 0; i < QUEUE_DEPTH; i++) {
+        cmds[i].nsid = 1;
+        cmds[i].opcode = KV_OPC_RETRIEVE;
+        pack_key(&cmds[i], 0xcccccccc);       //key value
+        cmds[i].cdw10 = sizeof(values[i]);
+        cmds[i].addr = (__u64)values[i];
+        cmds[i].data_len = sizeof(values[i]);
+        ASSERT_EQ(engine->queue(&cmds[i], on_complete, &done[i]), 0);
+    }
+    EXPECT_EQ(engine->queue(&cmds[0], on_complete, &done[0]), -EBUSY);
+    EXPECT_EQ(engine->submit(), (int)QUEUE_DEPTH);
+    EXPECT_EQ(engine->reap(QUEUE_DEPTH), (int)QUEUE_DEPTH);
+    for (unsigned i = 0; i < QUEUE_DEPTH; i++) {
+        EXPECT_EQ(done[i].calls, 1);
+        EXPECT_EQ(done[i].status, 0);
+    }
+    EXPECT_EQ(engine->inflight(), 0u);
+}
+
+TEST_F(UringTest, ExecuteMatchesIoctl) {
+    struct nvme_passthru_cmd my_cmd = {0,};
+    my_cmd.nsid = 1;
+    my_cmd.opcode = KV_OPC_RETRIEVE;
+    my_cmd.cdw10 = 7;
+    pack_key(&my_cmd, 0xc9cccccc);            //key value
+    int ret = engine->execute(&my_cmd, &result);
+    EXPECT_EQ(ret, 135);
+    ret = submit(&my_cmd);
+    EXPECT_EQ(ret, 135);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,137 @@
+#include "kv_test.h"
+#include "kv_workload.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
+class WorkloadTest : public KVTest {
+};
+
+TEST_F(WorkloadTest, CoreWorkloads) {
+    KVWorkloadSpec spec;
+    for (char w = 'A'; w <= 'F'; w++) {
+        ASSERT_EQ(kv_ycsb_workload(w, &spec), 0);
+        double total = 0;
+        for (int op = 0; op < KV_YCSB_OPS; op++) {
+            total += spec.mix[op];
+        }
+        EXPECT_DOUBLE_EQ(total, 1.0) << w;
+    }
+    ASSERT_EQ(kv_ycsb_workload('d', &spec), 0);
+    EXPECT_EQ(spec.distribution, KV_DIST_LATEST);
+    EXPECT_EQ(kv_ycsb_workload('G', &spec), -1);
+}
+
+TEST_F(WorkloadTest, MixIsFollowed) {
+    KVWorkloadSpec spec;
+    ASSERT_EQ(kv_ycsb_workload('B', &spec), 0);
+    std::atomic<__u64> records(1000);
+    KVWorkloadGenerator gen(spec, &records, 1);
+    int counts[KV_YCSB_OPS] = {0,};
+    for (int i = 0; i < 100000; i++) {
+        counts[gen.next_op()]++;
+    }
+    EXPECT_NEAR(counts[KV_YCSB_READ], 95000, 1000);
+    EXPECT_NEAR(counts[KV_YCSB_UPDATE], 5000, 1000);
+    EXPECT_EQ(counts[KV_YCSB_INSERT] + counts[KV_YCSB_SCAN] + counts[KV_YCSB_RMW], 0);
+}
+
+TEST_F(WorkloadTest, ZipfianIsSkewed) {
+    KVZipfian zipf;
+    std::mt19937_64 rng(7);
+    const __u64 N = 1000000;
+    std::vector<int> hits(100, 0);
+    int top = 0;
+    for (int i = 0; i < 100000; i++) {
+        __u64 rank = zipf.next(rng, N);
+        ASSERT_LT(rank, N);
+        top += rank < N / 100;
+        if (rank < hits.size()) {
+            hits[rank]++;
+        }
+    }
+    EXPECT_GT(hits[0], hits[1]);
+    EXPECT_GT(hits[1], hits[10]);
+    EXPECT_GT(top, 50000);                      //the top 1% takes most of the load
+    // the count may grow between calls
+    for (int i = 0; i < 1000; i++) {
+        ASSERT_LT(zipf.next(rng, N + i), N + i);
+    }
+}
+
+TEST_F(WorkloadTest, Distributions) {
+    KVWorkloadSpec spec;
+    ASSERT_EQ(kv_ycsb_workload('C', &spec), 0);
+    std::atomic<__u64> records(10000);
+
+    spec.distribution = KV_DIST_UNIFORM;
+    KVWorkloadGenerator uniform(spec, &records, 1);
+    std::set<__u64> seen;
+    for (int i = 0; i < 100000; i++) {
+        __u64 r = uniform.next_record();
+        ASSERT_LT(r, 10000u);
+        seen.insert(r);
+    }
+    EXPECT_GT(seen.size(), 9900u);
+
+    spec.distribution = KV_DIST_LATEST;
+    KVWorkloadGenerator latest(spec, &records, 1);
+    int recent = 0;
+    for (int i = 0; i < 10000; i++) {
+        recent += latest.next_record() >= 9900;
+    }
+    EXPECT_GT(recent, 5000);
+
+    spec.distribution = KV_DIST_ZIPFIAN;
+    KVWorkloadGenerator zipfian(spec, &records, 1);
+    std::vector<int> hits(10000, 0);
+    for (int i = 0; i < 100000; i++) {
+        hits[zipfian.next_record()]++;
+    }
+    std::sort(hits.rbegin(), hits.rend());
+    EXPECT_GT(hits[0], 100000 / 100);           //a hot record, wherever it is
+}
+
+TEST_F(WorkloadTest, KeysAreDistinct) {
+    std::set<std::string> keys;
+    for (__u64 r = 0; r < 100000; r++) {
+        KVKey key = kv_ycsb_key(r);
+        ASSERT_EQ(key.size, 8);
+        keys.insert(std::string((const char *)key.bytes, key.size));
+    }
+    EXPECT_EQ(keys.size(), 100000u);
+}
+
+TEST_F(WorkloadTest, OperationsMapToCommands) {
+    const __u64 BASE = 0x5a5a000000000000ull;
+    std::vector<__u8> buf(BUFFER_SIZE, 0);
+    EXPECT_EQ(kv_ycsb_execute(session.get(), KV_YCSB_UPDATE, BASE, 0, buf.data(), 100), 135);
+    for (int i = 0; i < 3; i++) {
+        EXPECT_EQ(kv_ycsb_execute(session.get(), KV_YCSB_INSERT, BASE + i, 0, buf.data(), 100), 0);
+    }
+    EXPECT_EQ(kv_ycsb_execute(session.get(), KV_YCSB_INSERT, BASE, 0, buf.data(), 100), 137);
+    EXPECT_EQ(kv_ycsb_execute(session.get(), KV_YCSB_UPDATE, BASE, 0, buf.data(), 100), 0);
+    EXPECT_EQ(kv_ycsb_execute(session.get(), KV_YCSB_RMW, BASE, 0, buf.data(), 100), 0);
+    EXPECT_EQ(kv_ycsb_execute(session.get(), KV_YCSB_READ, BASE, 0, buf.data(), 100), 0);
+    EXPECT_EQ(buf[0], 1);                       //the rmw increment
+
+    EXPECT_EQ(kv_ycsb_execute(session.get(), KV_YCSB_SCAN, BASE + 1, 2, buf.data(), 100), 0);
+    std::vector<KVKey> listed;
+    ASSERT_EQ(kv_list_parse(buf.data(), 4 + 12 * 2, &listed), (int)buf[0]);
+    EXPECT_LE(listed.size(), 2u);
+    ASSERT_GE(listed.size(), 1u);
+    EXPECT_TRUE(kv_key_equal(listed[0], kv_ycsb_key(BASE + 1)));
+
+    for (int i = 0; i < 3; i++) {
+        EXPECT_EQ(session->remove(kv_ycsb_key(BASE + i)), 0);
+    }
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,199 @@
+#include "kv_test.h"
+#include "kv_writeback.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+class WriteBackTest : public KVTest {
+protected:
+    void SetUp() override {
+        KVTest::SetUp();
+        // nothing leaves the buffer unless a test asks for it
+        config.max_staleness_us = 60ull * 1000 * 1000;
+        config.batch = 1024;
+    }
+
+    void TearDown() override {
+        kv.reset();
+        wb.reset();
+        KVTest::TearDown();
+    }
+
+    void start() {
+        wb = std::make_shared<KVWriteBackBackend>(session->backend(), session->nsid(), config);
+        kv = std::make_shared<KVSession>(wb, session->nsid());
+    }
+
+    // polls for what the flusher does on its own
+    bool eventually(__u64 flushed) {
+        for (int i = 0; i < 1000 && wb->flushed() < flushed; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return wb->flushed() >= flushed;
+    }
+
+    KVWriteBackConfig config;
+    std::shared_ptr<KVWriteBackBackend> wb;
+    std::shared_ptr<KVSession> kv;
+};
+
+TEST_F(WriteBackTest, ReadYourWrites) {
+    start();
+    char kitty[] = "kitty";
+    KVKey key = test_key(0x19000001);
+    EXPECT_EQ(kv->store(key, kitty, strlen(kitty)), 0);
+    EXPECT_EQ(wb->buffered(), 1u);
+    EXPECT_EQ(kv->exists(key), 0);
+    char buf[8] = {0,};
+    __u32 size = 0;
+    EXPECT_EQ(kv->retrieve(key, buf, 2, &size), 0);
+    EXPECT_EQ(size, 5u);
+    EXPECT_EQ(memcmp(buf, "ki\0", 3), 0);
+    EXPECT_EQ(kv->retrieve(key, buf, 0), 137);
+    EXPECT_EQ(session->exists(key), 135);       //still only in the buffer
+
+    EXPECT_EQ(wb->flush(), 0);
+    EXPECT_EQ(wb->buffered(), 0u);
+    EXPECT_EQ(session->retrieve(key, buf, sizeof(buf), &size), 0);
+    EXPECT_EQ(size, 5u);
+    EXPECT_STREQ(buf, "kitty");
+}
+
+TEST_F(WriteBackTest, BufferedDelete) {
+    start();
+    char kitty[] = "kitty";
+    KVKey key = test_key(0x19000002);
+    EXPECT_EQ(kv->store(key, kitty, strlen(kitty)), 0);
+    EXPECT_EQ(kv->remove(key), 0);
+    EXPECT_EQ(kv->exists(key), 135);
+    char buf[8];
+    EXPECT_EQ(kv->retrieve(key, buf, sizeof(buf)), 135);
+    EXPECT_EQ(kv->remove(key), 135);
+    EXPECT_EQ(wb->flush(), 0);                  //the delete finds nothing, that is fine
+    EXPECT_EQ(session->exists(key), 135);
+
+    // a key the buffer does not have is deleted on the device
+    EXPECT_EQ(kv->remove(test_key(0xcccccccc)), 0);
+    EXPECT_EQ(session->exists(test_key(0xcccccccc)), 135);
+}
+
+TEST_F(WriteBackTest, LastWriteWins) {
+    start();
+    KVKey key = test_key(0x19000003);
+    char value[8];
+    for (int i = 0; i < 100; i++) {
+        snprintf(value, sizeof(value), "v%d", i);
+        ASSERT_EQ(kv->store(key, value, strlen(value) + 1), 0);
+    }
+    EXPECT_EQ(wb->flush(), 0);
+    EXPECT_EQ(wb->flushed(), 1u);               //99 of them never left the host
+    char buf[8] = {0,};
+    EXPECT_EQ(session->retrieve(key, buf, sizeof(buf)), 0);
+    EXPECT_STREQ(buf, "v99");
+}
+
+TEST_F(WriteBackTest, StalenessBound) {
+    config.max_staleness_us = 2000;
+    start();
+    char kitty[] = "kitty";
+    KVKey key = test_key(0x19000004);
+    EXPECT_EQ(kv->store(key, kitty, strlen(kitty)), 0);
+    ASSERT_TRUE(eventually(1));                 //no flush(): the deadline sent it
+    EXPECT_EQ(session->exists(key), 0);
+    EXPECT_EQ(wb->buffered(), 0u);
+}
+
+TEST_F(WriteBackTest, FullBatchGoesAtOnce) {
+    config.batch = 8;
+    start();
+    char kitty[] = "kitty";
+    for (__u32 i = 0; i < 8; i++) {
+        EXPECT_EQ(kv->store(test_key(0x19000100 + i), kitty, strlen(kitty)), 0);
+    }
+    ASSERT_TRUE(eventually(8));
+    for (__u32 i = 0; i < 8; i++) {
+        EXPECT_EQ(session->exists(test_key(0x19000100 + i)), 0);
+    }
+}
+
+TEST_F(WriteBackTest, ConditionalStoresSeeTheBuffer) {
+    start();
+    char kitty[] = "kitty";
+    char puppy[] = "puppy";
+    KVKey key = test_key(0x19000005);
+    EXPECT_EQ(kv->store(key, kitty, strlen(kitty)), 0);
+    // checked by the device, after the buffered store reached it
+    EXPECT_EQ(kv->insert_if_absent(key, puppy, strlen(puppy)), 137);
+    EXPECT_EQ(kv->update_if_present(key, puppy, strlen(puppy)), 0);
+    EXPECT_EQ(kv->update_if_present(test_key(0x19000006), puppy, strlen(puppy)), 135);
+    char buf[8] = {0,};
+    EXPECT_EQ(kv->retrieve(key, buf, sizeof(buf)), 0);
+    EXPECT_STREQ(buf, "puppy");
+}
+
+TEST_F(WriteBackTest, ListFlushesFirst) {
+    start();
+    char kitty[] = "kitty";
+    KVKey key = test_key(0x19000007);
+    EXPECT_EQ(kv->store(key, kitty, strlen(kitty)), 0);
+    char list_buffer[BUFFER_SIZE];
+    EXPECT_EQ(kv->list(key, list_buffer, sizeof(list_buffer)), 0);
+    std::vector<KVKey> keys;
+    EXPECT_GE(kv_list_parse(list_buffer, sizeof(list_buffer), &keys), 1);
+    ASSERT_FALSE(keys.empty());
+    EXPECT_TRUE(kv_key_equal(keys[0], key));
+    EXPECT_EQ(wb->buffered(), 0u);
+}
+
+TEST_F(WriteBackTest, FlushReportsRejectedWrites) {
+    config.max_value = BUFFER_SIZE;
+    start();
+    std::vector<char> value(BUFFER_SIZE, 'v');
+    KVKey key = test_key(0x19000008);
+    // acknowledged, then refused by the device with 129
+    EXPECT_EQ(kv->store(key, value.data(), value.size()), 0);
+    EXPECT_EQ(wb->flush(), 129);
+    EXPECT_EQ(wb->errors(), 1u);
+    EXPECT_EQ(wb->flush(), 0);
+    EXPECT_EQ(kv->exists(key), 135);
+}
+
+TEST_F(WriteBackTest, ConcurrentWriters) {
+    config.max_staleness_us = 200;
+    config.batch = 32;
+    config.capacity_bytes = 4096;               //writers have to wait for the flusher
+    start();
+    const int THREADS = 4;
+    const int OPS = 500;
+    std::atomic<int> errors(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; t++) {
+        threads.emplace_back([this, t, &errors] {
+            char value[16];
+            char buf[16];
+            for (int i = 0; i < OPS; i++) {
+                KVKey key = test_key(0x19010000 + t * OPS + i);
+                snprintf(value, sizeof(value), "%d-%d", t, i);
+                errors += kv->store(key, value, sizeof(value)) != 0;
+                errors += kv->retrieve(key, buf, sizeof(buf)) != 0;
+                errors += memcmp(buf, value, sizeof(value)) != 0;
+            }
+        });
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    EXPECT_EQ(errors.load(), 0);
+    EXPECT_EQ(wb->flush(), 0);
+    EXPECT_EQ(wb->flushed(), (__u64)THREADS * OPS);
+    EXPECT_EQ(session->exists(test_key(0x19010000 + THREADS * OPS - 1)), 0);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}